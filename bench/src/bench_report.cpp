@@ -0,0 +1,99 @@
+#include "bench_report.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures::Bench {
+
+double Measurement::median_ms() const {
+  if (times_ms.empty()) {
+    return 0.0;
+  }
+  auto sorted = times_ms;
+  std::sort(sorted.begin(), sorted.end());
+  const auto mid = sorted.size() / 2;
+  return (sorted.size() % 2 == 1) ? sorted[mid]
+                                  : (sorted[mid - 1] + sorted[mid]) / 2.0;
+}
+
+double Measurement::min_ms() const {
+  if (times_ms.empty()) {
+    return 0.0;
+  }
+  return *std::min_element(times_ms.begin(), times_ms.end());
+}
+
+void write_json(const std::filesystem::path &path,
+                const std::vector<Measurement> &measurements) {
+  cv::FileStorage fs(path.string(),
+                     cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+  if (!fs.isOpened()) {
+    throw std::runtime_error("Could not write benchmark results to '" +
+                             path.string() + "'.");
+  }
+  fs << "format_version" << 1;
+  fs << "opencv_version" << CV_VERSION;
+  fs << "results"
+     << "[";
+  for (const auto &m : measurements) {
+    fs << "{";
+    fs << "name" << m.name;
+    fs << "kernel" << m.kernel;
+    fs << "width" << m.width;
+    fs << "height" << m.height;
+    fs << "depth" << m.depth;
+    fs << "frames" << m.frames;
+    fs << "align" << static_cast<int>(m.align);
+    fs << "threads" << m.threads;
+    fs << "repeats" << static_cast<int>(m.times_ms.size());
+    fs << "median_ms" << m.median_ms();
+    fs << "min_ms" << m.min_ms();
+    fs << "metrics"
+       << "{";
+    for (const auto &[key, value] : m.metrics) {
+      fs << key << value;
+    }
+    fs << "}";
+    fs << "}";
+  }
+  fs << "]";
+}
+
+std::map<std::string, double>
+read_baseline(const std::filesystem::path &path) {
+  cv::FileStorage fs(path.string(),
+                     cv::FileStorage::READ | cv::FileStorage::FORMAT_JSON);
+  if (!fs.isOpened()) {
+    throw std::runtime_error("Could not read benchmark baseline '" +
+                             path.string() + "'.");
+  }
+  std::map<std::string, double> result;
+  const auto results = fs["results"];
+  for (auto iter = results.begin(); iter != results.end(); ++iter) {
+    const auto entry = *iter;
+    result[static_cast<std::string>(entry["name"])] =
+        static_cast<double>(entry["median_ms"]);
+  }
+  return result;
+}
+
+std::vector<Regression>
+regressions(const std::vector<Measurement> &measurements,
+            const std::map<std::string, double> &baseline, double threshold) {
+  std::vector<Regression> result;
+  for (const auto &m : measurements) {
+    const auto found = baseline.find(m.name);
+    if (found == baseline.end()) {
+      continue;
+    }
+    const auto current = m.median_ms();
+    if (current > found->second * (1.0 + threshold)) {
+      result.push_back({m.name, found->second, current});
+    }
+  }
+  return result;
+}
+
+} // namespace StackExposures::Bench
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace StackExposures::Bench {
+
+/**
+ * @brief      Timing for one kernel, run with one set of parameters.
+ */
+struct Measurement {
+  std::string name; // Unique; identifies the kernel and its parameters
+  std::string kernel;
+  int width{0};
+  int height{0};
+  int depth{0}; // Bits per channel
+  int frames{0};
+  bool align{false};
+  int threads{0};
+  std::vector<double> times_ms;
+  std::map<std::string, double> metrics; // e.g., frames/sec, warp error
+
+  [[nodiscard]] double median_ms() const;
+  [[nodiscard]] double min_ms() const;
+};
+
+/**
+ * @brief      A kernel whose median time exceeds its baseline by more than
+ * the allowed threshold.
+ */
+struct Regression {
+  std::string name;
+  double baseline_ms{0.0};
+  double current_ms{0.0};
+};
+
+/**
+ * @brief      Save measurements as JSON.
+ *
+ * @param[in]  path          Where to save
+ * @param[in]  measurements  What to save
+ */
+void write_json(const std::filesystem::path &path,
+                const std::vector<Measurement> &measurements);
+
+/**
+ * @brief      Read the median times, by measurement name, from a JSON file
+ * written by write_json.
+ *
+ * @param[in]  path  The file to read
+ *
+ * @return     Median times in milliseconds, keyed by measurement name
+ */
+std::map<std::string, double>
+read_baseline(const std::filesystem::path &path);
+
+/**
+ * @brief      Find measurements that are slower than their baselines.
+ *
+ * @param[in]  measurements  Current measurements
+ * @param[in]  baseline      Baseline median times, by measurement name
+ * @param[in]  threshold     Allowed slowdown, as a fraction; e.g., 0.2 allows
+ * measurements to be up to 20% slower than baseline
+ *
+ * @return     The regressions, if any
+ */
+std::vector<Regression>
+regressions(const std::vector<Measurement> &measurements,
+            const std::map<std::string, double> &baseline, double threshold);
+
+} // namespace StackExposures::Bench
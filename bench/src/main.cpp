@@ -0,0 +1,676 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "arg_parse.hpp"
+#include "async_image_loader.hpp"
+#include "bench_report.hpp"
+#include "image_aligner.hpp"
+#include "image_loader.hpp"
+#include "image_stacker.hpp"
+#include "raw_stacker.hpp"
+#include "resource_usage.hpp"
+#include "star_field.hpp"
+#include "str_util.hpp"
+#include "tiff_writer.hpp"
+
+using namespace StackExposures;
+using namespace StackExposures::Bench;
+
+namespace {
+
+struct FrameParams {
+  cv::Size size;
+  int depth{8};
+  int frames{2};
+};
+
+std::vector<int> parse_ints(std::string_view spec, std::string_view what) {
+  std::vector<int> result;
+  for (const auto &field : StrUtil::split(spec, ',')) {
+    try {
+      size_t num_parsed = 0;
+      result.push_back(std::stoi(field, &num_parsed));
+      if (num_parsed != field.size()) {
+        throw std::invalid_argument(field);
+      }
+    } catch (std::logic_error &) {
+      throw std::runtime_error("Invalid " + std::string(what) + " '" +
+                               field + "'.");
+    }
+  }
+  return result;
+}
+
+std::vector<cv::Size> parse_sizes(std::string_view spec) {
+  std::vector<cv::Size> result;
+  for (const auto &field : StrUtil::split(spec, ',')) {
+    const auto dims = StrUtil::split(field, 'x');
+    const auto values = (dims.size() == 2)
+                            ? parse_ints(dims[0] + "," + dims[1], "size")
+                            : std::vector<int>{};
+    if ((values.size() != 2) || (values[0] <= 0) || (values[1] <= 0)) {
+      throw std::runtime_error("Invalid size '" + field +
+                               "'; expected 'WIDTHxHEIGHT'.");
+    }
+    result.emplace_back(values[0], values[1]);
+  }
+  return result;
+}
+
+std::vector<bool> parse_align(std::string_view spec) {
+  std::vector<bool> result;
+  for (const auto &field : StrUtil::split(spec, ',')) {
+    if ((field != "on") && (field != "off")) {
+      throw std::runtime_error("Invalid alignment setting '" + field +
+                               "'; expected 'on' or 'off'.");
+    }
+    result.push_back(field == "on");
+  }
+  return result;
+}
+
+// Stars offset by a different amount in each frame, so that alignment has
+// work to do.
+std::vector<cv::Mat> synthetic_frames(const FrameParams &params) {
+  StarField::Params field_params;
+  field_params.size = params.size;
+  field_params.depth = params.depth;
+  const StarField field(field_params);
+
+  std::vector<cv::Mat> result;
+  for (int frame = 0; frame < params.frames; ++frame) {
+    const FrameWarp warp{1.5 * frame, -1.0 * frame, 0.0};
+    result.push_back(field.render(warp, frame));
+  }
+  return result;
+}
+
+ImageInfoFutureContainer ready_futures(const std::vector<cv::Mat> &frames) {
+  ImageInfoFutureContainer result;
+  for (const auto &frame : frames) {
+    std::promise<ImageInfo::SharedPtr> promise;
+    promise.set_value(ImageInfo::from_file({}, frame));
+    result.push_back(promise.get_future().share());
+  }
+  return result;
+}
+
+double time_ms(const std::function<void()> &fn) {
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+class CmdOption {
+  ArgParse::ArgumentParser::Ptr m_parser;
+  ArgParse::Option<std::string>::Ptr m_kernels;
+  ArgParse::Option<std::string>::Ptr m_sizes;
+  ArgParse::Option<std::string>::Ptr m_megapixels;
+  ArgParse::Option<std::string>::Ptr m_depths;
+  ArgParse::Option<std::string>::Ptr m_frames;
+  ArgParse::Option<std::string>::Ptr m_align;
+  ArgParse::Option<std::string>::Ptr m_threads;
+  ArgParse::Option<int>::Ptr m_repeats;
+  ArgParse::Option<std::string>::Ptr m_raw_images;
+  ArgParse::Option<std::filesystem::path>::Ptr m_output_path;
+  ArgParse::Option<std::filesystem::path>::Ptr m_baseline;
+  ArgParse::Option<double>::Ptr m_threshold;
+
+public:
+  CmdOption(int argc, char **argv) {
+    m_parser = ArgParse::ArgumentParser::create(
+        "Benchmark stack_exposures' core kernels.");
+
+    m_kernels = ArgParse::option<std::string>(
+        m_parser, "-k", "--kernels",
+        "Comma-separated kernels to run:  align, warp, stack, stack_f16, "
+        "load, write, raw_load, raw_stack, e2e, accuracy.  The raw kernels "
+        "need --raw-images.",
+        std::string("align,warp,stack,stack_f16,load,write,raw_load,"
+                    "raw_stack,e2e,accuracy"));
+
+    m_sizes = ArgParse::option<std::string>(
+        m_parser, "--sizes", "--sizes",
+        "Comma-separated frame sizes, as 'WIDTHxHEIGHT'.",
+        std::string("640x480,1920x1080"));
+
+    m_megapixels = ArgParse::option<std::string>(
+        m_parser, "--megapixels", "--megapixels",
+        "Comma-separated frame sizes for the e2e and accuracy kernels, in "
+        "megapixels (3:2 aspect ratio).",
+        std::string("1,12"));
+
+    m_depths = ArgParse::option<std::string>(
+        m_parser, "--depths", "--depths",
+        "Comma-separated bits per channel of synthetic frames:  8, 16.",
+        std::string("8,16"));
+
+    m_frames = ArgParse::option<std::string>(
+        m_parser, "--frames", "--frames",
+        "Comma-separated numbers of frames to stack.", std::string("4,8"));
+
+    m_align = ArgParse::option<std::string>(
+        m_parser, "--align", "--align",
+        "Comma-separated alignment settings for stacking:  on, off.",
+        std::string("on,off"));
+
+    m_threads = ArgParse::option<std::string>(
+        m_parser, "--threads", "--threads",
+        "Comma-separated OpenCV thread counts; 0 for OpenCV's default.",
+        std::string("1,0"));
+
+    m_repeats = ArgParse::option<int>(
+        m_parser, "-r", "--repeats",
+        "How many times to time each kernel.  The median is reported.", 5);
+
+    m_raw_images = ArgParse::option<std::string>(
+        m_parser, "--raw-images", "--raw-images",
+        "Comma-separated raw images, for the raw kernels.");
+
+    m_output_path = ArgParse::option<std::filesystem::path>(
+        m_parser, "-o", "--output-path", "Where to save results as JSON.");
+
+    m_baseline = ArgParse::option<std::filesystem::path>(
+        m_parser, "-b", "--baseline",
+        "Results from an earlier run.  Exit with an error if any kernel is "
+        "slower than its baseline by more than the threshold.");
+
+    m_threshold = ArgParse::option<double>(
+        m_parser, "-t", "--threshold",
+        "Allowed slowdown relative to baseline, as a fraction; default 0.25.",
+        0.25);
+
+    m_parser->parse_args(argc, argv);
+
+    if (!should_exit() && (m_repeats->value() < 1)) {
+      m_parser->show_error("--repeats must be at least 1.", 1);
+    }
+  }
+
+  [[nodiscard]] bool should_exit() const { return m_parser->should_exit(); }
+  [[nodiscard]] int exit_code() const { return m_parser->exit_code(); }
+
+  [[nodiscard]] bool runs(std::string_view kernel) const {
+    const auto kernels = StrUtil::split(m_kernels->value(), ',');
+    return std::find(kernels.begin(), kernels.end(), kernel) != kernels.end();
+  }
+
+  [[nodiscard]] std::vector<cv::Size> sizes() const {
+    return parse_sizes(m_sizes->value());
+  }
+
+  [[nodiscard]] std::vector<cv::Size> megapixel_sizes() const {
+    std::vector<cv::Size> result;
+    for (const auto mp : parse_ints(m_megapixels->value(), "megapixels")) {
+      if (mp < 1) {
+        throw std::runtime_error("Megapixels must be at least 1.");
+      }
+      result.push_back(StarField::size_for_megapixels(mp));
+    }
+    return result;
+  }
+
+  [[nodiscard]] std::vector<int> depths() const {
+    auto result = parse_ints(m_depths->value(), "depth");
+    for (const auto depth : result) {
+      if ((depth != 8) && (depth != 16)) {
+        throw std::runtime_error("Depth must be 8 or 16.");
+      }
+    }
+    return result;
+  }
+
+  [[nodiscard]] std::vector<int> frames() const {
+    auto result = parse_ints(m_frames->value(), "frame count");
+    for (const auto count : result) {
+      if (count < 2) {
+        throw std::runtime_error("Frame counts must be at least 2.");
+      }
+    }
+    return result;
+  }
+
+  [[nodiscard]] std::vector<bool> align() const {
+    return parse_align(m_align->value());
+  }
+
+  [[nodiscard]] std::vector<int> threads() const {
+    return parse_ints(m_threads->value(), "thread count");
+  }
+
+  [[nodiscard]] int repeats() const { return m_repeats->value(); }
+
+  [[nodiscard]] std::vector<std::filesystem::path> raw_images() const {
+    std::vector<std::filesystem::path> result;
+    if (!m_raw_images->value().empty()) {
+      for (const auto &path : StrUtil::split(m_raw_images->value(), ',')) {
+        result.emplace_back(path);
+      }
+    }
+    return result;
+  }
+
+  [[nodiscard]] std::filesystem::path output_path() const {
+    return m_output_path->value();
+  }
+
+  [[nodiscard]] std::filesystem::path baseline() const {
+    return m_baseline->value();
+  }
+
+  [[nodiscard]] double threshold() const { return m_threshold->value(); }
+};
+
+class Runner {
+public:
+  Runner(int repeats, std::filesystem::path scratch_dir)
+      : m_repeats(repeats), m_scratch_dir(std::move(scratch_dir)) {}
+
+  [[nodiscard]] const std::vector<Measurement> &measurements() const {
+    return m_measurements;
+  }
+
+  void align(const FrameParams &params, int threads) {
+    const auto frames = synthetic_frames(params);
+    // Time one alignment, of the last (most offset) frame to the first.
+    cv::Mat ref;
+    cv::Mat to_align;
+    frames.front().convertTo(ref, CV_32FC3);
+    frames.back().convertTo(to_align, CV_32FC3);
+    run(measurement("align", params, false, threads), [&]() {
+      ImageAligner aligner;
+      cv::Mat aligned;
+      aligner.align(ref, to_align, aligned);
+    });
+  }
+
+  void warp(const FrameParams &params, int threads) {
+    // Add one frame to an accumulator, warped by a whole-pixel shift, and by
+    // a sub-pixel shift with each interpolation kernel.
+    cv::Mat image;
+    synthetic_frames(params).front().convertTo(image, CV_32FC3);
+    cv::Mat sum = cv::Mat::zeros(image.size(), CV_32FC3);
+
+    const cv::Mat shift = (cv::Mat_<float>(2, 3) << 1, 0, 3, 0, 1, -2);
+    run(measurement("warp_shift", params, false, threads),
+        [&]() { ImageAligner().add_warped(image, shift, sum); });
+
+    const cv::Mat subpixel =
+        (cv::Mat_<float>(2, 3) << 1, 0, 2.5F, 0, 1, -1.25F);
+    for (const auto &[interpolation, name] :
+         {std::pair{ImageAligner::Interpolation::nearest, "nearest"},
+          std::pair{ImageAligner::Interpolation::bilinear, "bilinear"},
+          std::pair{ImageAligner::Interpolation::lanczos, "lanczos"}}) {
+      const ImageAligner aligner(ImageAligner::Motion::euclidean, nullptr,
+                                 interpolation);
+      run(measurement(std::string("warp_") + name, params, false, threads),
+          [&]() { aligner.add_warped(image, subpixel, sum); });
+    }
+  }
+
+  void stack(const FrameParams &params, bool align, int threads) {
+    const auto frames = synthetic_frames(params);
+    run(measurement("stack", params, align, threads), [&]() {
+      const auto stacked = ImageStacker::create()->stacked_result(
+          ready_futures(frames), nullptr, align);
+      if (stacked.empty()) {
+        throw std::runtime_error("Stacking failed.");
+      }
+    });
+  }
+
+  void stack_f16(const FrameParams &params, bool align, int threads) {
+    // Stack frames held as calibrated images are:  as 32-bit floats, and as
+    // 16-bit floats (--half-float).
+    const auto frames = synthetic_frames(params);
+    for (const auto type : {CV_32FC3, CV_16FC3}) {
+      std::vector<cv::Mat> converted;
+      double megabytes = 0.0;
+      for (const auto &frame : frames) {
+        // Loaded images have values in 0...255, which CV_16F can hold.
+        const double scale = (frame.depth() == CV_16U) ? 1.0 / 257.0 : 1.0;
+        converted.emplace_back();
+        frame.convertTo(converted.back(), type, scale);
+        megabytes += static_cast<double>(converted.back().total()) *
+                     converted.back().elemSize() / (1024.0 * 1024.0);
+      }
+      const auto kernel = (type == CV_16FC3) ? "stack_f16" : "stack_f32";
+      run(measurement(kernel, params, align, threads), [&]() {
+        const auto stacked = ImageStacker::create()->stacked_result(
+            ready_futures(converted), nullptr, align);
+        if (stacked.empty()) {
+          throw std::runtime_error("Stacking failed.");
+        }
+      });
+      m_measurements.back().metrics["input_mb"] = megabytes;
+    }
+  }
+
+  void load(const FrameParams &params, int threads) {
+    const auto frames = synthetic_frames(params);
+    std::vector<std::filesystem::path> paths;
+    for (size_t i = 0; i < frames.size(); ++i) {
+      paths.push_back(m_scratch_dir / ("frame_" + std::to_string(i) + ".tif"));
+      cv::imwrite(paths.back().string(), frames[i]);
+    }
+    run(measurement("load", params, false, threads), [&]() {
+      const auto loader = load_images_async(paths, {});
+      for (const auto &future : loader->futures()) {
+        if (future.get() == nullptr) {
+          throw std::runtime_error("Could not load synthetic frame.");
+        }
+      }
+    });
+  }
+
+  void write(const FrameParams &params, int threads) {
+    // A stacked result, written as a 32-bit float TIFF with each codec.
+    cv::Mat stacked;
+    synthetic_frames({params.size, params.depth, 1})
+        .front()
+        .convertTo(stacked, CV_32FC3);
+    const auto path = m_scratch_dir / "stacked.tiff";
+    const double megabytes = static_cast<double>(stacked.total()) *
+                             stacked.elemSize() / (1024.0 * 1024.0);
+    for (const auto *const codec : {"none", "lzw", "deflate", "zstd"}) {
+      TiffOptions options;
+      options.float32 = true;
+      options.compression = *TiffCompression::parse(codec);
+      if (!TiffCompression::available(options.compression.codec)) {
+        continue;
+      }
+      run(measurement(std::string("write_") + codec, params, false, threads),
+          [&]() { write_tiff(stacked, path, options); });
+      auto &recorded = m_measurements.back();
+      recorded.metrics["mb_per_sec"] =
+          1000.0 * megabytes / recorded.median_ms();
+      recorded.metrics["file_mb"] =
+          static_cast<double>(std::filesystem::file_size(path)) /
+          (1024.0 * 1024.0);
+    }
+  }
+
+  void e2e(const FrameParams &params, bool align, int threads) {
+    // A session like a real one:  dithered, slightly rotated frames with hot
+    // pixels and a dark signal, loaded from TIFF files and stacked.
+    StarField::Params field_params;
+    field_params.size = params.size;
+    field_params.depth = params.depth;
+    field_params.num_hot_pixels = params.size.area() / 100000;
+    field_params.dark_level = 0.02;
+    const StarField field(field_params);
+    const auto warps = FrameWarp::random(params.frames, 20.0, 0.5, 1);
+    const auto dir = m_scratch_dir / "e2e";
+    const auto paths = field.write_tiffs(dir, warps);
+
+    reset_peak_rss();
+    run(measurement("e2e", params, align, threads), [&]() {
+      const auto loader = load_images_async(
+          paths, {}, nullptr, ImageStacker::consumption_order(paths.size()));
+      const auto stacked = ImageStacker::create()->stacked_result(
+          loader->take_futures(), nullptr, align);
+      if (stacked.empty()) {
+        throw std::runtime_error("Stacking failed.");
+      }
+    });
+    auto &recorded = m_measurements.back();
+    recorded.metrics["frames_per_sec"] =
+        1000.0 * params.frames / recorded.median_ms();
+    recorded.metrics["peak_rss_mb"] =
+        static_cast<double>(peak_rss_bytes()) / (1024.0 * 1024.0);
+    std::filesystem::remove_all(dir);
+  }
+
+  void accuracy(const FrameParams &params, ImageAligner::Motion motion,
+                int threads) {
+    // A translation-only model can't recover rotation, so don't ask it to.
+    const auto max_rotation =
+        (motion == ImageAligner::Motion::translation) ? 0.0 : 0.5;
+    StarField::Params field_params;
+    field_params.size = params.size;
+    field_params.depth = params.depth;
+    const StarField field(field_params);
+    const auto warps = FrameWarp::random(params.frames, 20.0, max_rotation, 2);
+
+    std::vector<cv::Mat> frames;
+    for (size_t i = 0; i < warps.size(); ++i) {
+      cv::Mat frame;
+      field.render(warps[i], i).convertTo(frame, CV_32FC3);
+      frames.push_back(frame);
+    }
+
+    std::vector<double> errors;
+    const ImageAligner aligner(motion);
+    const auto kernel = std::string("accuracy_") + motion_name(motion);
+    run(measurement(kernel, params, true, threads), [&]() {
+      errors.clear();
+      for (size_t i = 1; i < frames.size(); ++i) {
+        const auto estimate = aligner.estimate(frames.front(), frames[i]);
+        if (estimate.empty()) {
+          throw std::runtime_error("Alignment failed.");
+        }
+        errors.push_back(warp_error(estimate, warps[i], params.size));
+      }
+    });
+    auto &recorded = m_measurements.back();
+    recorded.metrics["max_warp_error_px"] =
+        *std::max_element(errors.begin(), errors.end());
+    recorded.metrics["mean_warp_error_px"] =
+        std::accumulate(errors.begin(), errors.end(), 0.0) /
+        static_cast<double>(errors.size());
+    std::cout << "    warp error:  max " << std::setprecision(3)
+              << recorded.metrics["max_warp_error_px"] << " px, mean "
+              << recorded.metrics["mean_warp_error_px"] << " px" << std::endl;
+  }
+
+  void raw_load(const std::vector<std::filesystem::path> &paths,
+                int threads) {
+    run(raw_measurement("raw_load", paths, false, threads), [&]() {
+      const auto loader = load_images_async(paths, {});
+      for (const auto &future : loader->futures()) {
+        if (future.get() == nullptr) {
+          throw std::runtime_error("Could not load raw image.");
+        }
+      }
+    });
+  }
+
+  void raw_stack(const std::vector<std::filesystem::path> &paths, bool align,
+                 int threads) {
+    run(raw_measurement("raw_stack", paths, align, threads), [&]() {
+      const auto loader = load_cfa_async(paths, {});
+      RawStacker stacker({});
+      if (stacker.stacked_result(loader->take_futures(), align) == nullptr) {
+        throw std::runtime_error("Raw stacking failed.");
+      }
+    });
+  }
+
+private:
+  const int m_repeats;
+  const std::filesystem::path m_scratch_dir;
+  std::vector<Measurement> m_measurements;
+
+  static const char *motion_name(ImageAligner::Motion motion) {
+    switch (motion) {
+    case ImageAligner::Motion::translation:
+      return "translation";
+    case ImageAligner::Motion::affine:
+      return "affine";
+    default:
+      return "euclidean";
+    }
+  }
+
+  static Measurement measurement(std::string kernel, const FrameParams &params,
+                                 bool align, int threads) {
+    Measurement result;
+    result.kernel = std::move(kernel);
+    result.width = params.size.width;
+    result.height = params.size.height;
+    result.depth = params.depth;
+    result.frames = params.frames;
+    result.align = align;
+    result.threads = threads;
+
+    std::ostringstream name;
+    name << result.kernel << "/" << result.width << "x" << result.height << "/"
+         << result.depth << "bit/" << result.frames << "frames/"
+         << (align ? "align" : "noalign") << "/" << threads << "threads";
+    result.name = name.str();
+    return result;
+  }
+
+  static Measurement
+  raw_measurement(std::string kernel,
+                  const std::vector<std::filesystem::path> &paths, bool align,
+                  int threads) {
+    auto result = measurement(std::move(kernel),
+                              {{0, 0}, 0, static_cast<int>(paths.size())},
+                              align, threads);
+    // Raw images have their own size and depth; name by the files instead.
+    std::ostringstream name;
+    name << result.kernel << "/" << paths.front().filename().string() << "/"
+         << result.frames << "frames/" << (align ? "align" : "noalign") << "/"
+         << threads << "threads";
+    result.name = name.str();
+    return result;
+  }
+
+  void run(Measurement m, const std::function<void()> &fn) {
+    cv::setNumThreads(m.threads);
+    // Warm up caches and OpenCV's thread pool.
+    fn();
+    for (int i = 0; i < m_repeats; ++i) {
+      m.times_ms.push_back(time_ms(fn));
+    }
+    std::cout << std::left << std::setw(60) << m.name << std::right
+              << std::fixed << std::setprecision(2) << std::setw(10)
+              << m.median_ms() << " ms" << std::endl;
+    m_measurements.push_back(std::move(m));
+  }
+};
+
+std::vector<Measurement> run_benchmarks(const CmdOption &opt) {
+  const auto stamp =
+      std::chrono::steady_clock::now().time_since_epoch().count();
+  const auto scratch_dir = std::filesystem::temp_directory_path() /
+                           ("stack_exposures_bench_" + std::to_string(stamp));
+  std::filesystem::create_directories(scratch_dir);
+
+  Runner runner(opt.repeats(), scratch_dir);
+  const auto raw_images = opt.raw_images();
+  for (const auto threads : opt.threads()) {
+    for (const auto &size : opt.sizes()) {
+      for (const auto depth : opt.depths()) {
+        for (const auto frames : opt.frames()) {
+          const FrameParams params{size, depth, frames};
+          if (opt.runs("stack")) {
+            for (const auto align : opt.align()) {
+              runner.stack(params, align, threads);
+            }
+          }
+          if (opt.runs("stack_f16")) {
+            for (const auto align : opt.align()) {
+              runner.stack_f16(params, align, threads);
+            }
+          }
+          if (opt.runs("load")) {
+            runner.load(params, threads);
+          }
+        }
+        if (opt.runs("align")) {
+          runner.align({size, depth, 2}, threads);
+        }
+        if (opt.runs("warp")) {
+          runner.warp({size, depth, 1}, threads);
+        }
+        if (opt.runs("write")) {
+          runner.write({size, depth, 1}, threads);
+        }
+      }
+    }
+    for (const auto &size : opt.megapixel_sizes()) {
+      for (const auto depth : opt.depths()) {
+        for (const auto frames : opt.frames()) {
+          const FrameParams params{size, depth, frames};
+          if (opt.runs("e2e")) {
+            for (const auto align : opt.align()) {
+              runner.e2e(params, align, threads);
+            }
+          }
+          if (opt.runs("accuracy")) {
+            for (const auto motion : {ImageAligner::Motion::translation,
+                                      ImageAligner::Motion::euclidean,
+                                      ImageAligner::Motion::affine}) {
+              runner.accuracy(params, motion, threads);
+            }
+          }
+        }
+      }
+    }
+    if (!raw_images.empty()) {
+      if (opt.runs("raw_load")) {
+        runner.raw_load(raw_images, threads);
+      }
+      if (opt.runs("raw_stack")) {
+        for (const auto align : opt.align()) {
+          runner.raw_stack(raw_images, align, threads);
+        }
+      }
+    }
+  }
+
+  std::filesystem::remove_all(scratch_dir);
+  return runner.measurements();
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  CmdOption opt(argc, argv);
+  if (opt.should_exit()) {
+    return opt.exit_code();
+  }
+
+  try {
+    const auto measurements = run_benchmarks(opt);
+    if (!opt.output_path().empty()) {
+      write_json(opt.output_path(), measurements);
+    }
+
+    if (!opt.baseline().empty()) {
+      const auto found =
+          regressions(measurements, read_baseline(opt.baseline()),
+                      opt.threshold());
+      for (const auto &r : found) {
+        std::cerr << "Regression: " << r.name << " took " << std::fixed
+                  << std::setprecision(2) << r.current_ms << " ms; baseline "
+                  << r.baseline_ms << " ms." << std::endl;
+      }
+      if (!found.empty()) {
+        return 3;
+      }
+    }
+  } catch (std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "image_aligner.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      Warps found by ImageAligner, saved in a sidecar file so that
+ * later runs over the same frames can skip estimating them.
+ *
+ * Each warp is keyed by the identity of the reference it was aligned to, the
+ * identity of the aligned image, and the motion model.  Identities are
+ * derived from file contents (see file_id), so changing calibration frames
+ * or output settings does not invalidate saved warps.  Thread-safe.
+ */
+class AlignmentCache {
+public:
+  using SharedPtr = std::shared_ptr<AlignmentCache>;
+
+  struct Entry {
+    std::string reference;
+    std::string frame;
+    ImageAligner::Motion motion{ImageAligner::Motion::euclidean};
+    double correlation{0.0};
+    cv::Mat warp; // 2x3 CV_32F, as from ImageAligner::estimate
+  };
+
+  /**
+   * @brief      Open a sidecar.  A missing or unreadable sidecar yields an
+   * empty cache.
+   *
+   * @param[in]  path        The sidecar file
+   * @param[in]  invalidate  Ignore any warps already saved in the sidecar
+   *
+   * @return     A shared pointer to the new instance
+   */
+  static SharedPtr open(std::filesystem::path path, bool invalidate = false);
+
+  /**
+   * @brief      Get an identity for an image file, from its contents.
+   *
+   * @param[in]  path  The image file
+   *
+   * @return     16 hex digits; empty if the file could not be read
+   */
+  [[nodiscard]] static std::string file_id(const std::filesystem::path &path);
+
+  /**
+   * @brief      Get an identity for two images stacked together.
+   *
+   * @return     The combined identity; empty if either identity is empty
+   */
+  [[nodiscard]] static std::string combined_id(const std::string &a,
+                                               const std::string &b);
+
+  [[nodiscard]] std::optional<Entry> find(const std::string &reference,
+                                          const std::string &frame,
+                                          ImageAligner::Motion motion) const;
+
+  void store(Entry entry);
+
+  /**
+   * @brief      Drop the warps read from the sidecar, keeping those stored
+   * since it was opened, and rewrite the sidecar on the next save.  Use this
+   * when a job asks to refresh alignments in a cache that is already open.
+   */
+  void forget_saved();
+
+  /**
+   * @brief      Write the sidecar, if any warps have been added since it was
+   * opened.  The sidecar is replaced whole, so that readers never see it
+   * partly written.
+   *
+   * @return     true on success
+   */
+  bool save() const;
+
+  [[nodiscard]] size_t hits() const;
+  [[nodiscard]] size_t misses() const;
+
+private:
+  const std::filesystem::path m_path;
+  mutable std::mutex m_mutex;
+  std::map<std::string, Entry> m_entries;
+  std::set<std::string> m_saved_keys; // Entries read from the sidecar
+  mutable bool m_dirty{false};
+  mutable size_t m_hits{0};
+  mutable size_t m_misses{0};
+
+  explicit AlignmentCache(std::filesystem::path path);
+
+  void load();
+};
+
+} // namespace StackExposures
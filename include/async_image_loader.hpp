@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "image_loader.hpp"
+#include "memory_budget.hpp"
+#include "thread_budget.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      Get how many bytes a loaded image holds.
+ */
+inline size_t resident_bytes(const ImageInfo &image) {
+  return image.image().total() * image.image().elemSize();
+}
+
+inline size_t resident_bytes(const CfaImage &image) {
+  const auto &sizes = image.processor->imgdata.sizes;
+  return static_cast<size_t>(sizes.raw_pitch) * sizes.raw_height;
+}
+
+/**
+ * @brief      Loads images in the background.
+ *
+ * Loads are started in a given order.  With a MemoryBudget, each load first
+ * reserves enough memory to decode an image; once decoded, the image holds on
+ * to a reservation for its own size until the last reference to it is
+ * dropped.  So a consumer that releases images as it goes, and that consumes
+ * them in load order, keeps the whole pipeline within the budget.
+ *
+ * How many loads run at once, and how many threads each may use, follow
+ * ThreadBudget::current()'s decode plan.
+ *
+ * @tparam     T     What is loaded for each image, e.g., ImageInfo
+ */
+template <typename T> class AsyncImageLoader {
+public:
+  using Result = std::shared_ptr<T>;
+  using LoadFn = std::function<Result(ImageLoader &loader,
+                                      const std::filesystem::path &path)>;
+
+  /**
+   * @brief      Start loading images.
+   *
+   * @param[in]  image_paths  The images to load
+   * @param[in]  options      How to load them
+   * @param[in]  load         Loads one image
+   * @param[in]  budget       Optional memory budget
+   * @param[in]  load_order   Indices into image_paths, in the order in which
+   * the images will be consumed; empty for first to last
+   * @param[in]  image_bytes  Expected size of a loaded image, e.g., from
+   * ImageHeader; 0 if unknown.  Until the first image has been loaded, a
+   * budget can only plan loads with this estimate.
+   */
+  AsyncImageLoader(std::vector<std::filesystem::path> image_paths,
+                   LoadOptions options, LoadFn load,
+                   MemoryBudget::SharedPtr budget = nullptr,
+                   std::vector<size_t> load_order = {},
+                   size_t image_bytes = 0)
+      : m_paths(std::move(image_paths)), m_options(std::move(options)),
+        m_load(std::move(load)), m_budget(std::move(budget)),
+        m_promises(m_paths.size()),
+        m_decode_bytes(decode_overhead * image_bytes) {
+    for (auto &promise : m_promises) {
+      m_futures.emplace_back(promise.get_future().share());
+    }
+    if (load_order.empty()) {
+      load_order.resize(m_paths.size());
+      std::iota(load_order.begin(), load_order.end(), 0);
+    }
+    m_dispatcher = std::thread(
+        [this, order = std::move(load_order)]() { dispatch(order); });
+  }
+
+  ~AsyncImageLoader() {
+    m_cancelled = true;
+    m_dispatcher.join();
+  }
+
+  AsyncImageLoader(const AsyncImageLoader &src) = delete;
+  AsyncImageLoader(AsyncImageLoader &&src) = delete;
+  AsyncImageLoader &operator=(const AsyncImageLoader &src) = delete;
+  AsyncImageLoader &operator=(AsyncImageLoader &&src) = delete;
+
+  /**
+   * @brief      Get futures for the loaded images, in the order of
+   * image_paths.  This instance keeps its own copies, so the images stay in
+   * memory for the life of this instance.
+   */
+  auto futures() const { return m_futures; }
+
+  /**
+   * @brief      Hand over the futures for the loaded images.  Images are
+   * released as soon as the caller is done with them.
+   */
+  auto take_futures() { return std::move(m_futures); }
+
+  // Without a memory limit or a chosen thread count, keep the historical
+  // limit on concurrent decodes.  One decode per core could exhaust the
+  // memory of a many-core machine.
+  constexpr static size_t max_concurrent_loads = 4;
+
+private:
+  // Only demosaicing (LibRaw's dcraw_process) runs OpenMP teams; unpacking
+  // raw sensor data is single-threaded.
+  constexpr static bool multithreaded_decode = !std::is_same_v<T, CfaImage>;
+
+  // Decoding takes several image-sized buffers, e.g., LibRaw's working image
+  // and its output, in addition to the result.
+  constexpr static size_t decode_overhead = 4;
+
+  const std::vector<std::filesystem::path> m_paths;
+  const LoadOptions m_options;
+  const LoadFn m_load;
+  const MemoryBudget::SharedPtr m_budget;
+
+  std::vector<std::promise<Result>> m_promises;
+  std::vector<std::shared_future<Result>> m_futures;
+
+  std::atomic_bool m_cancelled{false};
+  std::atomic<size_t> m_decode_bytes; // 0 until known or estimated
+  std::atomic_bool m_measured{false}; // Whether an image has been loaded
+
+  // How many loaded images are still referenced.  Shared with the images'
+  // deleters, since images may outlive this loader.
+  std::shared_ptr<std::atomic<size_t>> m_num_resident{
+      std::make_shared<std::atomic<size_t>>(0)};
+
+  std::mutex m_mutex;
+  std::condition_variable m_load_finished;
+  size_t m_num_active{0};
+
+  std::thread m_dispatcher;
+
+  [[nodiscard]] size_t max_active(const ThreadBudget &thread_budget,
+                                  const ThreadBudget::DecodePlan &plan) const {
+    // A budget of unlimited capacity only keeps account.
+    if ((m_budget == nullptr) || (m_budget->capacity() == 0)) {
+      return thread_budget.per_core()
+                 ? std::min(max_concurrent_loads, plan.concurrent_decodes)
+                 : plan.concurrent_decodes;
+    }
+    return m_budget->concurrency(m_decode_bytes, plan.concurrent_decodes);
+  }
+
+  void dispatch(const std::vector<size_t> &order) {
+    std::vector<std::future<void>> tasks;
+    for (const auto index : order) {
+      MemoryBudget::ReservationPtr reservation;
+      if (m_budget != nullptr) {
+        reservation = reserve_decode();
+      }
+      const auto threads = m_cancelled ? 0 : wait_for_slot();
+      if (threads == 0) {
+        break;
+      }
+      tasks.emplace_back(
+          std::async(std::launch::async, [this, index, reservation, threads]() {
+            load_one(index, reservation, threads);
+          }));
+
+      // Until an image has been loaded or its size estimated, decode memory
+      // needs are unknown.
+      if ((m_budget != nullptr) && (m_decode_bytes == 0)) {
+        tasks.back().wait();
+      }
+    }
+    for (auto &task : tasks) {
+      task.wait();
+    }
+  }
+
+  MemoryBudget::ReservationPtr reserve_decode() {
+    std::unique_lock lock(m_mutex);
+    while (!m_cancelled) {
+      auto result = m_budget->try_reserve(m_decode_bytes);
+      // A consumer may hold on to one image while it waits for the next,
+      // e.g., RawStacker's reference frame.  If the budget is too small for
+      // even that, load anyway rather than wait forever.
+      if ((result == nullptr) && (m_num_active == 0) &&
+          (*m_num_resident <= 1)) {
+        result = m_budget->claim(m_decode_bytes);
+      }
+      if (result != nullptr) {
+        return result;
+      }
+      m_load_finished.wait_for(lock, std::chrono::milliseconds(50));
+    }
+    return nullptr;
+  }
+
+  // Wait until another load may start, and claim its threads from the
+  // thread budget.  Returns how many threads the load may use; 0 if
+  // cancelled.
+  size_t wait_for_slot() {
+    auto &thread_budget = ThreadBudget::current();
+    std::unique_lock lock(m_mutex);
+    for (;;) {
+      const auto plan =
+          thread_budget.decode_plan(multithreaded_decode ? m_decode_bytes : 0);
+      if ((m_num_active < max_active(thread_budget, plan)) &&
+          thread_budget.try_claim_decode(plan.threads_per_decode)) {
+        ++m_num_active;
+        return plan.threads_per_decode;
+      }
+      if (m_cancelled) {
+        return 0;
+      }
+      m_load_finished.wait_for(lock, std::chrono::milliseconds(50));
+    }
+  }
+
+  void load_one(size_t index, MemoryBudget::ReservationPtr reservation,
+                size_t threads) {
+    try {
+      ThreadBudget::limit_openmp_threads(threads);
+      ImageLoader loader(m_options);
+      Result loaded = m_load(loader, m_paths[index]);
+      if ((m_budget != nullptr) && (loaded != nullptr)) {
+        const auto bytes = resident_bytes(*loaded);
+        // The first image loaded replaces any estimate.
+        if (!m_measured.exchange(true)) {
+          m_decode_bytes = decode_overhead * bytes;
+        }
+
+        // Shrink the reservation to the image's size, and hold it for as
+        // long as the image is referenced.
+        reservation->resize(bytes);
+        ++*m_num_resident;
+        loaded = Result(loaded.get(),
+                        [loaded, reservation, resident = m_num_resident](T *) {
+                          --*resident;
+                        });
+      }
+      m_promises[index].set_value(loaded);
+    } catch (...) {
+      m_promises[index].set_exception(std::current_exception());
+    }
+    ThreadBudget::current().release_decode(threads);
+    {
+      std::lock_guard lock(m_mutex);
+      --m_num_active;
+    }
+    m_load_finished.notify_all();
+  }
+};
+
+/**
+ * @brief      Load processed images in the background.
+ */
+inline auto load_images_async(std::vector<std::filesystem::path> image_paths,
+                              const LoadOptions &options,
+                              MemoryBudget::SharedPtr budget = nullptr,
+                              std::vector<size_t> load_order = {},
+                              size_t image_bytes = 0) {
+  return std::make_unique<AsyncImageLoader<ImageInfo>>(
+      std::move(image_paths), options,
+      [](auto &image_loader, const auto &path) {
+        return image_loader.load_image(path);
+      },
+      std::move(budget), std::move(load_order), image_bytes);
+}
+
+/**
+ * @brief      Load raw sensor data in the background.
+ */
+inline auto load_cfa_async(std::vector<std::filesystem::path> image_paths,
+                           const LoadOptions &options,
+                           MemoryBudget::SharedPtr budget = nullptr,
+                           size_t image_bytes = 0) {
+  return std::make_unique<AsyncImageLoader<CfaImage>>(
+      std::move(image_paths), options,
+      [](auto &image_loader, const auto &path) {
+        return image_loader.load_cfa(path);
+      },
+      std::move(budget), std::vector<size_t>{}, image_bytes);
+}
+
+} // namespace StackExposures
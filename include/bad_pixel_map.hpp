@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      A sparse list of defective (e.g., hot) pixels, which can be
+ * repaired by interpolating from their neighbors.
+ *
+ * Repair cost is proportional to the number of bad pixels, not to the size of
+ * the image.
+ */
+class BadPixelMap {
+public:
+  using ConstPtr = std::shared_ptr<const BadPixelMap>;
+
+  /**
+   * @brief      Finds pixels that stay much brighter than their same-color
+   * neighbors in every exposure of a session, while the sky moves across the
+   * sensor.  A star's core can pass detect()'s test, but once exposures are
+   * dithered, or drift, it does not pass in the same place in all of them.
+   * Without such motion, bad pixels cannot be told from stars.
+   */
+  class SessionDetector {
+  public:
+    // How far, in pixels, the sky must move for a star's core to leave its
+    // place on the sensor.
+    static constexpr double min_motion = 2.0;
+
+    /**
+     * @brief      Constructs a new instance.
+     *
+     * @param[in]  cfa     true iff exposures are Bayer sensor data
+     * @param[in]  sigmas  Detection threshold; see detect
+     */
+    SessionDetector(bool cfa, double sigmas);
+
+    /**
+     * @brief      Examine one more exposure, unaligned.  Exposures whose size
+     * differs from the first are ignored.
+     */
+    void add(const cv::Mat &exposure);
+
+    /**
+     * @brief      Get the pixels that were bad in every exposure.
+     *
+     * @return     The map; nullptr unless at least two exposures were added,
+     * and the sky moved at least min_motion pixels between them
+     */
+    [[nodiscard]] ConstPtr result() const;
+
+  private:
+    bool m_cfa;
+    double m_sigmas;
+    cv::Mat m_weakest;   // Least excess seen, as a fraction of the threshold
+    cv::Mat m_reference; // Binned intensity of the first exposure
+    cv::Mat m_window;
+    size_t m_count{0};
+    double m_motion{0.0}; // Largest shift from the first exposure, pixels
+  };
+
+  /**
+   * @brief      Create from a list of pixel indices.
+   *
+   * @param[in]  size     Dimensions of the images to which the map applies
+   * @param[in]  indices  Index (row * width + column) of each bad pixel
+   * @param[in]  cfa      true iff the map applies to Bayer sensor data, whose
+   * same-color neighbors are two pixels away
+   *
+   * @return     A shared pointer to the new instance
+   */
+  static ConstPtr create(cv::Size size, std::vector<uint32_t> indices,
+                         bool cfa);
+
+  /**
+   * @brief      Find pixels that are much brighter than their same-color
+   * neighbors, e.g., in a master dark.  In an exposure, star cores may pass
+   * this test too; use SessionDetector instead.
+   *
+   * @param[in]  image   The image to examine
+   * @param[in]  cfa     true iff image is Bayer sensor data
+   * @param[in]  sigmas  How many (robust) standard deviations above its
+   * neighborhood median a pixel must be, to be considered bad
+   *
+   * @return     The bad pixels of image
+   */
+  static ConstPtr detect(const cv::Mat &image, bool cfa, double sigmas);
+
+  /**
+   * @brief      Load a map saved with save().
+   *
+   * @param[in]  path  Where the map was saved
+   *
+   * @return     The map, or nullptr if it could not be read
+   */
+  static ConstPtr load(const std::filesystem::path &path);
+
+  /**
+   * @brief      Save this map.
+   *
+   * @param[in]  path  Where to save the map
+   *
+   * @return     true iff the map was saved
+   */
+  bool save(const std::filesystem::path &path) const;
+
+  [[nodiscard]] cv::Size size() const { return m_size; }
+  [[nodiscard]] bool cfa() const { return m_cfa; }
+  [[nodiscard]] const std::vector<uint32_t> &indices() const {
+    return m_indices;
+  }
+
+  /**
+   * @brief      Replace each bad pixel with the mean of its good same-color
+   * neighbors, in place.
+   *
+   * @param      image  An image with the map's dimensions:  CV_8U, CV_16U
+   * or CV_32F, with up to 4 channels.  Throws std::runtime_error otherwise.
+   */
+  void repair(cv::Mat &image) const;
+
+private:
+  BadPixelMap(cv::Size size, std::vector<uint32_t> indices, bool cfa);
+
+  [[nodiscard]] bool is_bad(int row, int col) const;
+
+  template <typename T> void repair_pixels(cv::Mat &image) const;
+
+  const cv::Size m_size;
+  const std::vector<uint32_t> m_indices; // sorted
+  const bool m_cfa;
+};
+
+} // namespace StackExposures
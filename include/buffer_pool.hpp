@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      A cv::MatAllocator that keeps freed image buffers for reuse.
+ *
+ * A stacking session allocates and frees many buffers of the same few sizes:
+ * decoded frames, their floating point conversions, warped copies and
+ * partial sums.  Left to malloc, each of these large buffers is mapped from
+ * and returned to the kernel, page faults and all.  This pool keeps freed
+ * buffers, by size, and hands them out again, so that once a session has
+ * warmed up, it seldom asks the kernel for memory.  Where the platform
+ * supports it (Linux), pooled buffers are backed by transparent huge pages.
+ *
+ * When the pool is full, the buffers returned longest ago are freed first.
+ * Only buffers of at least min_pooled_bytes are pooled.  An installed pool
+ * also counts every allocation for Trace::print_stats, even with no room
+ * for idle buffers.  Thread-safe.
+ */
+class BufferPool : public cv::MatAllocator {
+public:
+  struct Stats {
+    uint64_t hits{0};      // Allocations served from the pool
+    uint64_t misses{0};    // Pooled sizes that had to be allocated anew
+    uint64_t discarded{0}; // Freed buffers not kept, for lack of room
+    size_t idle_bytes{0};  // Held by the pool, waiting for reuse
+  };
+
+  static constexpr size_t min_pooled_bytes = size_t{256} << 10;
+
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  max_idle_bytes  How many bytes of freed buffers to keep
+   */
+  explicit BufferPool(size_t max_idle_bytes);
+
+  /**
+   * @brief      Free the idle buffers.  Every cv::Mat allocated by this pool
+   * must have been released first.
+   */
+  ~BufferPool() override;
+
+  BufferPool(const BufferPool &src) = delete;
+  BufferPool(BufferPool &&src) = delete;
+  BufferPool &operator=(const BufferPool &src) = delete;
+  BufferPool &operator=(BufferPool &&src) = delete;
+
+  /**
+   * @brief      Make a pool the default allocator for every cv::Mat created
+   * from now on, and count its allocations for Trace.  The pool lives until
+   * the process exits.  Calling this again changes the pool's capacity.
+   *
+   * @param[in]  max_idle_bytes  How many bytes of freed buffers to keep
+   *
+   * @return     The pool
+   */
+  static BufferPool &install(size_t max_idle_bytes);
+
+  [[nodiscard]] cv::UMatData *
+  allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+           cv::AccessFlag flags,
+           cv::UMatUsageFlags usage_flags) const override;
+
+  bool allocate(cv::UMatData *data, cv::AccessFlag access_flags,
+                cv::UMatUsageFlags usage_flags) const override;
+
+  void deallocate(cv::UMatData *data) const override;
+
+  [[nodiscard]] Stats stats() const;
+
+  /**
+   * @brief      Change how many bytes of freed buffers to keep, freeing idle
+   * buffers as needed.
+   *
+   * @param[in]  max_idle_bytes  The new limit
+   */
+  void set_max_idle_bytes(size_t max_idle_bytes);
+
+  /**
+   * @brief      Free every idle buffer.
+   */
+  void trim();
+
+private:
+  struct Idle {
+    void *buffer;
+    uint64_t returned; // When the buffer was given back, in returns
+  };
+
+  mutable std::mutex m_mutex;
+  size_t m_max_idle_bytes;
+  // By bucket size, least recently returned first
+  mutable std::map<size_t, std::deque<Idle>> m_idle;
+  mutable uint64_t m_returns{0};
+  mutable Stats m_stats;
+  std::atomic_bool m_counts_allocations{false};
+
+  [[nodiscard]] void *take(size_t bytes) const;
+  void give_back(void *buffer, size_t bytes) const;
+  void free_idle_down_to(size_t max_idle_bytes, size_t kept_bucket = 0) const;
+};
+
+} // namespace StackExposures
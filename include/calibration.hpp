@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      Master calibration data, applied to each image as it is loaded.
+ *
+ * Calibration subtracts a per-pixel offset (the master dark, or failing that
+ * the master bias) and then multiplies by a per-pixel flat-field gain, in one
+ * pass over the image.
+ */
+class Calibration {
+public:
+  using ConstPtr = std::shared_ptr<const Calibration>;
+
+  /**
+   * @brief      Create a calibration.
+   *
+   * @param[in]  offset         Per-pixel offset, CV_32F; may be empty
+   * @param[in]  gain           Per-pixel gain, CV_32F; may be empty
+   * @param[in]  sensor_domain  true iff offset and gain describe undemosaiced
+   * sensor data, rather than processed images
+   *
+   * @return     A shared pointer to the new instance
+   */
+  static ConstPtr create(const cv::Mat &offset, const cv::Mat &gain,
+                         bool sensor_domain);
+
+  /**
+   * @brief      Compute flat-field gain from a master flat whose offset has
+   * already been removed.  Gain is normalized so that it averages to 1 for
+   * each color, whether the flat is a processed image or a Bayer mosaic.
+   *
+   * @param[in]  flat_signal  Master flat minus its offset
+   *
+   * @return     The per-pixel gain, CV_32F
+   */
+  [[nodiscard]] static cv::Mat flat_gain(const cv::Mat &flat_signal);
+
+  /**
+   * @brief      Find out whether this instance applies to sensor data.
+   *
+   * @return     true iff this instance should be applied to raw sensor data
+   */
+  [[nodiscard]] bool sensor_domain() const;
+
+  /**
+   * @brief      Get the dimensions of images to which this calibration can be
+   * applied.
+   *
+   * @return     The size of the master frames
+   */
+  [[nodiscard]] cv::Size size() const;
+
+  /**
+   * @brief      Calibrate a processed image.
+   *
+   * @param[in]  image  An 8-bit, 16-bit or floating point image
+   *
+   * @return     The calibrated image, CV_32F, with the same number of channels
+   * as image.
+   */
+  [[nodiscard]] cv::Mat applied(const cv::Mat &image) const;
+
+  /**
+   * @brief      Calibrate undemosaiced sensor data, in place.
+   *
+   * @param      sensor        CV_16UC1 sensor data
+   * @param[in]  black_levels  CV_32FC1 black level of each sensor pixel.
+   * Calibrated values retain this black level, so that LibRaw can subtract
+   * it as usual.
+   */
+  void apply_to_sensor(cv::Mat &sensor, const cv::Mat &black_levels) const;
+
+private:
+  Calibration(cv::Mat offset, cv::Mat gain, bool sensor_domain);
+
+  void check_size(const cv::Mat &image) const;
+
+  const cv::Mat m_offset;
+  const cv::Mat m_gain;
+  const bool m_sensor_domain;
+};
+
+} // namespace StackExposures
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+#include "bad_pixel_map.hpp"
+#include "calibration.hpp"
+#include "image_loader.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      The images from which to build master calibration frames.
+ */
+struct CalibrationFrames {
+  std::vector<std::filesystem::path> darks;
+  std::vector<std::filesystem::path> biases;
+  std::vector<std::filesystem::path> flats;
+
+  [[nodiscard]] bool empty() const {
+    return darks.empty() && biases.empty() && flats.empty();
+  }
+};
+
+/**
+ * @brief      Builds master dark, bias and flat frames by stacking
+ * calibration images, optionally caching the masters on disk.
+ */
+class CalibrationBuilder {
+public:
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  options        How to load calibration images.  Masters have
+   * the same scaling and ROI as images loaded with these options.
+   * @param[in]  sensor_domain  Build masters from undemosaiced sensor data
+   * @param[in]  cache_dir      Where to cache masters; empty to disable
+   * caching
+   */
+  CalibrationBuilder(LoadOptions options, bool sensor_domain,
+                     std::filesystem::path cache_dir = {});
+
+  /**
+   * @brief      Build a calibration from master frames.  The masters are
+   * built concurrently.
+   *
+   * @param[in]  frames  The calibration images
+   *
+   * @return     The calibration, or nullptr if frames is empty
+   */
+  [[nodiscard]] Calibration::ConstPtr
+  build(const CalibrationFrames &frames) const;
+
+  /**
+   * @brief      Build a map of bad pixels, from the cache if possible.  Bad
+   * pixels are detected in the master dark if there is one.  Otherwise they
+   * are pixels that stand out in the same place in each of a sample of
+   * exposures, while the sky moves; see BadPixelMap::SessionDetector.
+   *
+   * @param[in]  frames     The calibration images
+   * @param[in]  exposures  The images to be stacked
+   * @param[in]  sigmas     Detection threshold; see BadPixelMap::detect
+   *
+   * @return     The map, or nullptr if there are no images to examine, or if
+   * the exposures are not dithered
+   */
+  [[nodiscard]] BadPixelMap::ConstPtr
+  bad_pixels(const CalibrationFrames &frames,
+             const std::vector<std::filesystem::path> &exposures,
+             double sigmas) const;
+
+  /**
+   * @brief      Get the mean of some images, from the cache if possible.
+   *
+   * @param[in]  kind   What kind of master this is, e.g., "dark"
+   * @param[in]  paths  The images to average
+   *
+   * @return     The mean image, CV_32F; empty if paths is empty
+   */
+  [[nodiscard]] cv::Mat
+  master(std::string_view kind,
+         const std::vector<std::filesystem::path> &paths) const;
+
+private:
+  LoadOptions m_options;
+  bool m_sensor_domain;
+  std::filesystem::path m_cache_dir;
+
+  [[nodiscard]] cv::Mat
+  mean_of(const std::vector<std::filesystem::path> &paths) const;
+
+  [[nodiscard]] BadPixelMap::ConstPtr
+  session_bad_pixels(const std::vector<std::filesystem::path> &paths,
+                     double sigmas) const;
+
+  [[nodiscard]] std::filesystem::path
+  cache_path(std::string_view kind,
+             const std::vector<std::filesystem::path> &paths,
+             std::string_view extension) const;
+};
+
+} // namespace StackExposures
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace StackExposures {
+
+/**
+ * @brief      Incremental 64-bit FNV-1a hash, for cache keys.
+ */
+class ContentHash {
+public:
+  ContentHash &add(const void *data, size_t size);
+  ContentHash &add(std::string_view s);
+  ContentHash &add(uint64_t value);
+
+  /**
+   * @brief      Add a file's identity without reading it:  its absolute
+   * path, size and modification time.  A file that is replaced, or that
+   * does not exist, hashes differently.
+   *
+   * @param[in]  path  The file
+   */
+  ContentHash &add_file_stamp(const std::filesystem::path &path);
+
+  [[nodiscard]] uint64_t value() const { return m_value; }
+
+  /**
+   * @brief      Get the hash value as a fixed-width hexadecimal string.
+   *
+   * @return     16 lowercase hex digits
+   */
+  [[nodiscard]] std::string hex() const;
+
+private:
+  uint64_t m_value{14695981039346656037ULL};
+};
+
+} // namespace StackExposures
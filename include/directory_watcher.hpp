@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace StackExposures {
+
+/**
+ * @brief      Reports files as they finish being written into a directory.
+ *
+ * On Linux this uses inotify, and a file is reported once the writer closes
+ * it (or once it is moved into the directory).  Elsewhere, the directory is
+ * polled, and a file is reported once its size stops changing.  Hidden files
+ * and files with temporary-download suffixes (.tmp, .part, ...) are ignored.
+ *
+ * Files already in the directory count as existing only if their size is
+ * steady when watching begins; files still growing are reported once
+ * complete.  With inotify, an existing file that is closed after growing is
+ * reported again.
+ */
+class DirectoryWatcher {
+public:
+  /**
+   * @brief      Start watching.  If the directory holds files, this waits
+   * briefly to see whether they are still being written.  Throws
+   * std::runtime_error if dir is not a directory.
+   *
+   * @param[in]  dir   The directory to watch
+   */
+  explicit DirectoryWatcher(std::filesystem::path dir);
+
+  ~DirectoryWatcher();
+
+  DirectoryWatcher(const DirectoryWatcher &src) = delete;
+  DirectoryWatcher(DirectoryWatcher &&src) = delete;
+  DirectoryWatcher &operator=(const DirectoryWatcher &src) = delete;
+  DirectoryWatcher &operator=(DirectoryWatcher &&src) = delete;
+
+  /**
+   * @brief      Get the files that were in the directory when watching began.
+   *
+   * @return     The files, sorted by name
+   */
+  [[nodiscard]] const std::vector<std::filesystem::path> &
+  existing_files() const {
+    return m_existing;
+  }
+
+  /**
+   * @brief      Wait for files to be completed.
+   *
+   * @param[in]  timeout  How long to wait
+   *
+   * @return     Newly completed files, if any, sorted by name
+   */
+  std::vector<std::filesystem::path> wait(std::chrono::milliseconds timeout);
+
+private:
+  const std::filesystem::path m_dir;
+  std::vector<std::filesystem::path> m_existing;
+  int m_inotify_fd{-1};
+
+  // For polling:  files already reported, and sizes of files in progress.
+  std::set<std::filesystem::path> m_reported;
+  std::map<std::filesystem::path, std::uintmax_t> m_sizes;
+
+  // Sizes of existing files, as reported at startup.
+  std::map<std::filesystem::path, std::uintmax_t> m_existing_sizes;
+
+  [[nodiscard]] std::vector<std::filesystem::path> list_files() const;
+  [[nodiscard]] static std::map<std::filesystem::path, std::uintmax_t>
+  file_sizes(const std::vector<std::filesystem::path> &paths);
+  bool changed_since_startup(const std::filesystem::path &path);
+  std::vector<std::filesystem::path>
+  wait_inotify(std::chrono::milliseconds timeout);
+  std::vector<std::filesystem::path> poll(std::chrono::milliseconds timeout);
+};
+
+} // namespace StackExposures
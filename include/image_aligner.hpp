@@ -1,9 +1,126 @@
 #pragma once
 
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
 #include "image_info.hpp"
 
 namespace StackExposures {
+class AlignmentCache;
+
 struct ImageAligner {
+  /**
+   * @brief      The motion model used to align images.
+   */
+  enum class Motion { translation, euclidean, affine };
+
+  /**
+   * @brief      How images are resampled when the warp that aligns them is
+   * not a whole-pixel shift.
+   */
+  enum class Interpolation { nearest, bilinear, lanczos };
+
+  // How far, in pixels, a warp may move any pixel from a whole-pixel shift
+  // and still be applied as that shift.
+  static constexpr double integer_shift_tolerance = 0.05;
+
+  explicit ImageAligner(Motion motion = Motion::euclidean,
+                        std::shared_ptr<AlignmentCache> cache = nullptr,
+                        Interpolation interpolation = Interpolation::bilinear)
+      : m_motion(motion), m_cache(std::move(cache)),
+        m_interpolation(interpolation) {}
+
+  /**
+   * @brief      Parse an interpolation name:  "nearest", "bilinear" or
+   * "lanczos".
+   *
+   * @param[in]  name  The name
+   *
+   * @return     The interpolation; nullopt if name is not valid
+   */
+  [[nodiscard]] static std::optional<Interpolation>
+  parse_interpolation(std::string_view name);
+
   void align(const cv::Mat &ref, const cv::Mat &to_align, cv::Mat &aligned);
+
+  /**
+   * @brief      Align to_align with ref, reusing the cached warp for this
+   * pair of images if there is one, and caching the warp otherwise.
+   *
+   * @param[in]  ref       The reference image
+   * @param[in]  to_align  The image to be aligned
+   * @param[out] aligned   to_align, aligned; empty on failure
+   * @param[in]  ref_id    Identity of ref; empty to bypass the cache
+   * @param[in]  frame_id  Identity of to_align; empty to bypass the cache
+   */
+  void align(const cv::Mat &ref, const cv::Mat &to_align, cv::Mat &aligned,
+             const std::string &ref_id, const std::string &frame_id);
+
+  /**
+   * @brief      Align to_align with ref, and add the result to sum.  A warp
+   * that amounts to a whole-pixel shift is applied by adding shifted rows of
+   * to_align straight into sum, with no interpolation and no intermediate
+   * image.  Warps are cached as for align().
+   *
+   * @param[in]  ref       The reference image
+   * @param[in]  to_align  The image to be aligned
+   * @param      sum       CV_32FC3 accumulator, the same size as ref
+   * @param[in]  ref_id    Identity of ref; empty to bypass the cache
+   * @param[in]  frame_id  Identity of to_align; empty to bypass the cache
+   *
+   * @return     true if to_align was added; false, leaving sum unchanged, if
+   * the images could not be aligned
+   */
+  bool accumulate(const cv::Mat &ref, const cv::Mat &to_align, cv::Mat &sum,
+                  const std::string &ref_id = {},
+                  const std::string &frame_id = {});
+
+  /**
+   * @brief      Warp an image and add it to sum.
+   *
+   * @param[in]  image  The image
+   * @param[in]  warp   2x3 warp, as from estimate()
+   * @param      sum    CV_32FC3 accumulator, the same size as image
+   */
+  void add_warped(const cv::Mat &image, const cv::Mat &warp,
+                  cv::Mat &sum) const;
+
+  /**
+   * @brief      Find the whole-pixel shift that a warp amounts to, within
+   * integer_shift_tolerance, over an image of the given size.
+   *
+   * @param[in]  warp  2x3 warp, as from estimate()
+   * @param[in]  size  The size of the image to be warped
+   *
+   * @return     The offset from ref coordinates to to_align coordinates;
+   * nullopt if the warp rotates, scales or shifts by a fraction of a pixel
+   */
+  [[nodiscard]] static std::optional<cv::Point>
+  integer_shift(const cv::Mat &warp, cv::Size size);
+
+  /**
+   * @brief      Estimate the warp that aligns to_align with ref.
+   *
+   * @param[in]  ref       The reference image
+   * @param[in]  to_align  The image to be aligned
+   *
+   * @return     A 2x3 CV_32F matrix mapping ref coordinates to to_align
+   * coordinates; empty if the images cannot be aligned
+   */
+  [[nodiscard]] cv::Mat estimate(const cv::Mat &ref,
+                                 const cv::Mat &to_align) const;
+
+  [[nodiscard]] Motion motion() const { return m_motion; }
+
+  [[nodiscard]] Interpolation interpolation() const {
+    return m_interpolation;
+  }
+
+private:
+  Motion m_motion;
+  std::shared_ptr<AlignmentCache> m_cache;
+  Interpolation m_interpolation;
 };
 } // namespace StackExposures
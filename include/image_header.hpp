@@ -0,0 +1,120 @@
+#pragma once
+
+#include <ctime>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "image_loader.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      What an image file's header says about it, read without
+ * decoding any pixels.
+ *
+ * PNG, JPEG and TIFF headers are parsed directly; any other file is opened
+ * with LibRaw, which identifies a raw image without unpacking it.
+ */
+struct ImageHeader {
+  std::filesystem::path path;
+
+  // Width and height of the full-resolution decoded image, after any
+  // rotation that loading applies; empty if the header could not be read.
+  cv::Size size;
+
+  // Raw images:  the sensor's size, including margins; otherwise empty.
+  cv::Size sensor_size;
+
+  double exposure{0.0};     // Seconds; 0 if unknown
+  double iso{0.0};          // 0 if unknown
+  std::time_t timestamp{0}; // When the image was taken; 0 if unknown
+
+  /**
+   * @brief      Read an image file's header.
+   *
+   * @param[in]  path  The image file
+   *
+   * @return     The header; its size is empty if the file could not be read
+   * or is not in a recognized format
+   */
+  [[nodiscard]] static ImageHeader read(const std::filesystem::path &path);
+
+  [[nodiscard]] bool known() const { return !size.empty(); }
+
+  /**
+   * @brief      The width and height of ImageLoader::load_image's result for
+   * this image, after any half-size decoding and region of interest.
+   *
+   * @param[in]  options  How the image will be loaded
+   *
+   * @return     The size; empty if the size is unknown
+   */
+  [[nodiscard]] cv::Size loaded_size(const LoadOptions &options) const;
+
+  /**
+   * @brief      Estimate how many bytes ImageLoader::load_image's result
+   * holds for this image.
+   *
+   * @param[in]  options  How the image will be loaded
+   *
+   * @return     The estimate; 0 if the size is unknown
+   */
+  [[nodiscard]] size_t loaded_bytes(const LoadOptions &options) const;
+
+  /**
+   * @brief      Estimate how many bytes ImageLoader::load_cfa's result holds
+   * for this image.
+   *
+   * @return     The estimate; 0 if this is not known to be a raw image
+   */
+  [[nodiscard]] size_t cfa_bytes() const;
+};
+
+/**
+ * @brief      Read the headers of many image files, in parallel.
+ *
+ * @param[in]  paths  The image files
+ *
+ * @return     Their headers, in the order of paths
+ */
+[[nodiscard]] std::vector<ImageHeader>
+read_headers(const std::vector<std::filesystem::path> &paths);
+
+/**
+ * @brief      Drop the images whose size, as loaded, differs from that of
+ * most images.  Each image dropped is reported to std::cerr.  Images of
+ * unknown size are kept, to be checked once decoded.
+ *
+ * Sizes are compared after options' half-size decoding and region of
+ * interest, as stacking compares decoded images:  images of different full
+ * sizes are kept if the region of interest lies within each of them.
+ * Stacks of raw sensor data, which are cropped only once stacked, should
+ * pass default options, to compare full frames.
+ *
+ * @param[in]  headers  The images' headers
+ * @param[in]  options  How the images will be loaded
+ *
+ * @return     The headers of the images kept, in their original order
+ */
+[[nodiscard]] std::vector<ImageHeader>
+same_size_headers(const std::vector<ImageHeader> &headers,
+                  const LoadOptions &options = {});
+
+/**
+ * @brief      Describe any spread in the images' exposure times or ISO
+ * settings, which usually means that a frame of another kind, e.g., a flat,
+ * has been mixed in.  Also describe any gap between capture times that is
+ * an hour or more, and far longer than the usual interval, which usually
+ * means that exposures from another session have been mixed in.
+ *
+ * @param[in]  headers  The images' headers
+ *
+ * @return     A warning; empty if the known settings agree
+ */
+[[nodiscard]] std::string
+settings_warning(const std::vector<ImageHeader> &headers);
+
+} // namespace StackExposures
@@ -1,15 +1,71 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 
+#include "bad_pixel_map.hpp"
+#include "calibration.hpp"
 #include "image_info.hpp"
 
 #include "libraw.h"
 
 namespace StackExposures {
+
+/**
+ * @brief      Controls how much of each image is decoded.
+ */
+struct LoadOptions {
+  // Decode at half resolution.  Raw images use LibRaw's half_size mode, which
+  // bins each 2x2 Bayer block into one pixel and skips demosaicing.
+  bool half_size{false};
+
+  // Keep only this region of each image, in (possibly half-size) output
+  // coordinates.  Every later stage sees only these pixels.
+  std::optional<cv::Rect> roi{};
+
+  // Calibrate each image as it is loaded.  A sensor_domain() calibration is
+  // applied to raw sensor data before demosaicing.
+  Calibration::ConstPtr calibration{};
+
+  // Repair these pixels of each image, after calibration and before
+  // alignment.  A cfa() map is applied to raw sensor data.
+  BadPixelMap::ConstPtr bad_pixels{};
+
+  // Store calibrated (floating point) images as CV_16F, halving the memory
+  // that loaded images hold while they wait to be stacked.  Their values are
+  // in 0...255, which half precision represents to within 1/8.
+  bool half_float{false};
+};
+
+/**
+ * @brief      Undemosaiced sensor data of a Bayer raw image.
+ */
+struct CfaImage {
+  using SharedPtr = std::shared_ptr<CfaImage>;
+
+  std::filesystem::path path;
+
+  // The LibRaw instance that unpacked the image.  It owns the pixel data, and
+  // can demosaic it later.
+  LibRawSharedPtr processor;
+
+  // CV_16UC1 view of the visible area of processor's raw data.
+  cv::Mat visible;
+
+  /**
+   * @brief      Get the black level that LibRaw will subtract from each pixel
+   * of the visible area.
+   *
+   * @return     CV_32FC1 black levels, the same size as visible
+   */
+  [[nodiscard]] cv::Mat black_levels() const;
+};
+
+using CfaImageFuture = std::shared_future<CfaImage::SharedPtr>;
+
 class ImageLoader {
 public:
-  ImageLoader();
+  ImageLoader(LoadOptions options = {});
 
   /**
    * @brief      Loads an image.
@@ -21,11 +77,66 @@ public:
    */
   ImageInfo::SharedPtr load_image(const std::filesystem::path &image_path);
 
+  /**
+   * @brief      Prepares a frame that has already been decoded, e.g., from a
+   * video, as load_image prepares an image file:  halved, cropped to the ROI
+   * and calibrated.  Throws std::runtime_error if this loader applies sensor
+   * calibration.
+   *
+   * @param[in]  frame   BGR frame, CV_8UC3 or CV_32FC3 with values in
+   * 0...255
+   * @param[in]  source  The file from which the frame was decoded
+   *
+   * @return     The prepared frame
+   */
+  ImageInfo::SharedPtr load_frame(const cv::Mat &frame,
+                                  const std::filesystem::path &source);
+
+  /**
+   * @brief      Unpacks a raw image without demosaicing it.
+   *
+   * @param[in]  image_path  pathname of a Bayer raw image
+   *
+   * @return     The image's sensor data.  Throws std::runtime_error if the
+   * image cannot be unpacked, or is not a Bayer raw image.
+   */
+  CfaImage::SharedPtr load_cfa(const std::filesystem::path &image_path);
+
+  /**
+   * @brief      Demosaics and color-converts sensor data, e.g., after its
+   * visible area has been replaced by a stack of several images.
+   *
+   * @param[in]  image  sensor data loaded with load_cfa
+   *
+   * @return     The processed image, cropped to this loader's ROI.
+   */
+  ImageInfo::SharedPtr process_cfa(const CfaImage &image);
+
 private:
+  LoadOptions m_options;
   LibRawSharedPtr m_processor;
 
   void check(int status, const std::string &msg);
 
+  [[nodiscard]] cv::Mat cropped(const cv::Mat &image,
+                                const cv::Rect &roi) const;
+
+  [[nodiscard]] bool uses_sensor_data() const;
+
+  [[nodiscard]] bool uses_processed_data() const;
+
+  [[nodiscard]] cv::Mat finished(cv::Mat image) const;
+
+  bool request_raw_crop(bool enable);
+
+  [[nodiscard]] cv::Mat visible_sensor_data() const;
+
+  void prepare_sensor_data();
+
+  ImageInfo::SharedPtr processed(LibRawSharedPtr processor,
+                                 const std::filesystem::path &image_path,
+                                 bool raw_cropped);
+
   ImageInfo::SharedPtr load_raw_image(const std::filesystem::path &image_path);
 };
-} // namespace StackExposures
\ No newline at end of file
+} // namespace StackExposures
@@ -2,10 +2,13 @@
 
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "alignment_cache.hpp"
 #include "image_aligner.hpp"
 #include "image_info.hpp"
+#include "memory_budget.hpp"
 
 namespace StackExposures {
 
@@ -16,12 +19,49 @@ struct ImageStacker {
 
   virtual ~ImageStacker() = default;
 
-  static Ptr create();
+  /**
+   * @brief      Create a stacker.
+   *
+   * @param[in]  budget           Optional memory budget, charged for the
+   * stacker's accumulators and intermediate images
+   * @param[in]  alignment_cache  Optional cache of warps from earlier runs
+   * @param[in]  interpolation    How to resample images that are not
+   * aligned by a whole-pixel shift
+   *
+   * @return     The new stacker
+   */
+  static Ptr create(MemoryBudget::SharedPtr budget = nullptr,
+                    AlignmentCache::SharedPtr alignment_cache = nullptr,
+                    ImageAligner::Interpolation interpolation =
+                        ImageAligner::Interpolation::bilinear);
 
+  /**
+   * @brief      Get the order in which stacked_result consumes images.
+   * Loading images in this order lets each be released as early as possible.
+   *
+   * @param[in]  count  The number of images to be stacked
+   *
+   * @return     Indices of the images, in the order they are consumed
+   */
+  [[nodiscard]] static std::vector<size_t> consumption_order(size_t count);
+
+  /**
+   * @brief      Stack images.  Each image is released once it has been
+   * stacked, unless the caller holds other references to it.
+   *
+   * @param[in]  images      The images to stack
+   * @param[in]  dark_image  Optional dark image, subtracted from the mean
+   * @param[in]  align       Whether to align images before stacking
+   * @param[in]  frame_ids   Optional identity of each image (see
+   * AlignmentCache::file_id), with which warps are cached
+   *
+   * @return     The mean of the images; empty on failure.  Images that
+   * cannot be aligned with the rest are left out.
+   */
   [[nodiscard]] virtual cv::Mat
-  stacked_result(const ImageInfoFutureContainer &images,
-                 ImageInfo::SharedPtr dark_image = nullptr,
-                 bool align = true) const = 0;
+  stacked_result(ImageInfoFutureContainer images,
+                 ImageInfo::SharedPtr dark_image = nullptr, bool align = true,
+                 const std::vector<std::string> &frame_ids = {}) const = 0;
 };
 
 } // namespace StackExposures
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+#include "image_aligner.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      Stacks images one at a time, as they arrive.
+ *
+ * Each image is aligned to a fixed reference -- the first image -- and added
+ * to a running sum, so the cost of adding an image does not grow with the
+ * number already stacked.
+ */
+class IncrementalStacker {
+public:
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  align          Whether to align images to the reference
+   * @param[in]  interpolation  How to resample images that are not aligned
+   * by a whole-pixel shift
+   */
+  explicit IncrementalStacker(bool align = true,
+                              ImageAligner::Interpolation interpolation =
+                                  ImageAligner::Interpolation::bilinear);
+
+  /**
+   * @brief      Add an image to the stack.
+   *
+   * @param[in]  image  The image; the first image becomes the reference
+   *
+   * @return     true if the image was added; false if it could not be aligned
+   * or its size differs from the reference
+   */
+  bool add(const cv::Mat &image);
+
+  [[nodiscard]] size_t count() const { return m_count; }
+
+  /**
+   * @brief      Get the mean of the images added so far.
+   *
+   * @return     CV_32FC3 with values in 0...255, like ImageStacker's result;
+   * empty if no images have been added
+   */
+  [[nodiscard]] cv::Mat mean() const;
+
+  /**
+   * @brief      Get a reduced-size copy of the mean, for quick previews.
+   *
+   * @param[in]  max_dimension  Largest width or height of the preview
+   *
+   * @return     CV_32FC3 with values in 0...255; empty if no images have been
+   * added
+   */
+  [[nodiscard]] cv::Mat preview(int max_dimension) const;
+
+private:
+  const bool m_align;
+  ImageAligner m_aligner;
+  cv::Mat m_reference; // CV_32FC3
+  cv::Mat m_sum;       // CV_32FC3
+  size_t m_count{0};
+};
+
+} // namespace StackExposures
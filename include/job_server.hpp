@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "stack_job.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      Serves stack jobs over a local (Unix domain) socket.
+ *
+ * A resident server keeps what one job warms up for the next:  its
+ * StackRunner's memory budget, calibration masters and alignment caches,
+ * OpenCV's thread pool and any buffer pool.
+ *
+ * Clients send jobs as JSON objects, one per line.  A job has the keys of a
+ * read_manifest job, and optionally "id", which is echoed in every reply
+ * about the job, and "directory", to which its relative paths are relative
+ * (by default, the server's working directory).  For each job, the server
+ * replies with one JSON object per line, as the job progresses:
+ *
+ *     {"id":1,"event":"started","images":12}
+ *     {"id":1,"event":"stacked","ms":840}
+ *     {"id":1,"event":"wrote","path":"/data/m31.tiff"}
+ *     {"id":1,"event":"done","ms":910}
+ *
+ * or, once the job fails, {"id":1,"event":"error","message":"..."}.
+ *
+ * Jobs from all clients share one queue, served by a fixed number of
+ * workers, and share one memory budget.  A client may send several jobs
+ * without waiting for replies; replies about different jobs may then
+ * interleave.  While as many of a client's jobs are unfinished as there are
+ * workers, the server reads no more from that client.
+ */
+class JobServer {
+public:
+  /**
+   * @brief      Start listening.  Throws std::runtime_error if the socket
+   * cannot be created, e.g., if socket_path names an existing file that is
+   * not a socket.
+   *
+   * @param[in]  socket_path     Where to create the socket
+   * @param      runner          Runs the jobs
+   * @param[in]  defaults        Settings for jobs that don't specify their
+   * own
+   * @param[in]  max_concurrent  How many jobs to run at once
+   */
+  JobServer(std::filesystem::path socket_path, StackRunner &runner,
+            StackJob defaults, size_t max_concurrent);
+
+  /**
+   * @brief      Stop listening, and remove the socket.
+   */
+  ~JobServer();
+
+  JobServer(const JobServer &src) = delete;
+  JobServer(JobServer &&src) = delete;
+  JobServer &operator=(const JobServer &src) = delete;
+  JobServer &operator=(JobServer &&src) = delete;
+
+  /**
+   * @brief      Serve clients until stop becomes true.  Jobs already
+   * received are finished before this returns.
+   *
+   * @param[in]  stop  Set to stop serving, e.g., from a signal handler
+   */
+  void serve(const std::atomic_bool &stop);
+
+private:
+  struct Connection;
+  using ConnectionPtr = std::shared_ptr<Connection>;
+
+  struct QueuedJob {
+    ConnectionPtr connection; // Kept open until the job has replied
+    std::string message;
+  };
+
+  const std::filesystem::path m_socket_path;
+  StackRunner &m_runner;
+  const StackJob m_defaults;
+  const size_t m_max_concurrent;
+  int m_listen_fd{-1};
+
+  std::mutex m_mutex;
+  std::condition_variable m_job_queued;
+  std::deque<QueuedJob> m_queue;
+  bool m_closing{false}; // Set once no more jobs will be queued
+
+  void handle(const ConnectionPtr &connection, const std::atomic_bool &stop);
+  void work();
+  void run_job(Connection &connection, const std::string &message);
+};
+
+} // namespace StackExposures
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+namespace StackExposures {
+
+/**
+ * @brief      Tracks how many bytes the pipeline's frames, intermediates and
+ * accumulators hold, and makes new work wait until there is room for it.
+ */
+class MemoryBudget : public std::enable_shared_from_this<MemoryBudget> {
+public:
+  using SharedPtr = std::shared_ptr<MemoryBudget>;
+
+  /**
+   * @brief      A claim on part of a budget.  The claim is returned to the
+   * budget when the reservation is destroyed.
+   */
+  class Reservation {
+  public:
+    ~Reservation();
+
+    Reservation(const Reservation &src) = delete;
+    Reservation(Reservation &&src) = delete;
+    Reservation &operator=(const Reservation &src) = delete;
+    Reservation &operator=(Reservation &&src) = delete;
+
+    [[nodiscard]] size_t bytes() const { return m_bytes; }
+
+    /**
+     * @brief      Change the size of this claim, without waiting.
+     *
+     * @param[in]  bytes  The new size
+     */
+    void resize(size_t bytes);
+
+  private:
+    friend class MemoryBudget;
+    Reservation(SharedPtr budget, size_t bytes);
+
+    SharedPtr m_budget;
+    size_t m_bytes;
+  };
+  using ReservationPtr = std::shared_ptr<Reservation>;
+
+  /**
+   * @brief      Create a budget.
+   *
+   * @param[in]  capacity  Maximum bytes to hold at once; 0 for no limit
+   *
+   * @return     A shared pointer to the new instance
+   */
+  static SharedPtr create(size_t capacity);
+
+  /**
+   * @brief      Wait until bytes are available, then claim them.  A request
+   * larger than the whole budget is granted once nothing else is held.
+   *
+   * @param[in]  bytes      How many bytes to claim
+   * @param[in]  cancelled  Optional; stop waiting once this becomes true
+   *
+   * @return     The reservation, or nullptr if cancelled first
+   */
+  ReservationPtr reserve(size_t bytes,
+                         const std::atomic_bool *cancelled = nullptr);
+
+  /**
+   * @brief      Claim bytes if they are available now.
+   *
+   * @param[in]  bytes  How many bytes to claim
+   *
+   * @return     The reservation, or nullptr if the bytes don't fit
+   */
+  ReservationPtr try_reserve(size_t bytes);
+
+  /**
+   * @brief      Claim bytes without waiting, even if that exceeds capacity.
+   * Use this for memory that must be allocated for work to proceed at all,
+   * e.g., accumulators; later reserve() calls wait for it to be returned.
+   *
+   * @param[in]  bytes  How many bytes to claim
+   *
+   * @return     The reservation
+   */
+  ReservationPtr claim(size_t bytes);
+
+  [[nodiscard]] size_t capacity() const { return m_capacity; }
+  [[nodiscard]] size_t in_use() const;
+  [[nodiscard]] size_t peak() const;
+
+  /**
+   * @brief      Get how many tasks, each needing bytes_per_task, fit within
+   * the whole budget.
+   *
+   * @param[in]  bytes_per_task  Memory needed by each task
+   * @param[in]  max_tasks       Upper limit, e.g., the number of cores
+   *
+   * @return     A number in 1...max_tasks
+   */
+  [[nodiscard]] size_t concurrency(size_t bytes_per_task,
+                                   size_t max_tasks) const;
+
+private:
+  explicit MemoryBudget(size_t capacity);
+
+  void release(size_t bytes);
+  void adjust(size_t old_bytes, size_t new_bytes);
+
+  const size_t m_capacity;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_available;
+  size_t m_in_use{0};
+  size_t m_peak{0};
+};
+
+} // namespace StackExposures
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "image_info.hpp"
+#include "image_loader.hpp"
+
+namespace StackExposures {
+
+using CfaImageFutureContainer = std::vector<CfaImageFuture>;
+
+/**
+ * @brief      Stacks the undemosaiced sensor data of Bayer raw images, then
+ * demosaics and color-converts the result once.
+ *
+ * Alignment, if requested, is translation-only:  each image is shifted by a
+ * whole number of CFA blocks so that its Bayer pattern still lines up with the
+ * first image's.
+ */
+class RawStacker {
+public:
+  RawStacker(LoadOptions options = {});
+
+  /**
+   * @brief      Stack raw images.  Calibration, if any, happens as images are
+   * loaded; see LoadOptions.  Each image but the first is released once it
+   * has been stacked, unless the caller holds other references to it.
+   *
+   * @param[in]  images  The images to stack.  The first is the reference to
+   * which the others are aligned.
+   * @param[in]  align   Whether to align images before stacking
+   *
+   * @return     The processed stack, or nullptr if there was nothing to stack.
+   */
+  [[nodiscard]] ImageInfo::SharedPtr
+  stacked_result(CfaImageFutureContainer images, bool align = true) const;
+
+  /**
+   * @brief      Average the sensor data of raw images, without demosaicing.
+   *
+   * @param[in]  images  The images to average
+   * @param[in]  align   Whether to align images before averaging
+   *
+   * @return     CV_32FC1 mean of the visible sensor areas; empty if there was
+   * nothing to average.  Near the borders of aligned images, each pixel is
+   * the mean of the images that cover it.
+   */
+  [[nodiscard]] cv::Mat mean_cfa(CfaImageFutureContainer images,
+                                 bool align = false) const;
+
+private:
+  LoadOptions m_options;
+};
+
+} // namespace StackExposures
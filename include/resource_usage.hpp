@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+namespace StackExposures {
+
+/**
+ * @brief      Start measuring peak resident set size afresh, where the
+ * platform allows it (Linux).  Elsewhere, peak_rss_bytes() reports the peak
+ * over the life of the process.
+ */
+void reset_peak_rss();
+
+/**
+ * @brief      Get this process's peak resident set size.
+ *
+ * @return     The peak, in bytes; 0 if unknown
+ */
+size_t peak_rss_bytes();
+
+} // namespace StackExposures
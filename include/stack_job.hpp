@@ -0,0 +1,250 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "alignment_cache.hpp"
+#include "calibration_builder.hpp"
+#include "image_aligner.hpp"
+#include "image_header.hpp"
+#include "image_loader.hpp"
+#include "memory_budget.hpp"
+#include "tiff_writer.hpp"
+
+namespace StackExposures {
+
+/**
+ * @brief      A file to which a stacked image is saved.
+ */
+struct OutputSpec {
+  std::filesystem::path path{"stacked.tiff"};
+  TiffOptions tiff_options{}; // Ignored unless path is a TIFF
+
+  /**
+   * @brief      Parse "PATH", or "PATH:OPTIONS", where OPTIONS are separated
+   * by '+' and each is "float", "uint16", or a compression as for
+   * TiffCompression::parse:  e.g., "m31.tiff:float+zstd:19".
+   *
+   * @param[in]  text      The text to parse
+   * @param[in]  defaults  TIFF options that OPTIONS do not set
+   *
+   * @return     The output; nullopt if text is not valid
+   */
+  [[nodiscard]] static std::optional<OutputSpec>
+  parse(std::string_view text, const TiffOptions &defaults = {});
+};
+
+/**
+ * @brief      Everything needed to produce one stacked image.
+ */
+struct StackJob {
+  std::vector<std::filesystem::path> images;
+  std::filesystem::path output_path{"stacked.tiff"};
+  LoadOptions load_options{}; // Half size and ROI; calibration is built
+  CalibrationFrames calibration_frames{};
+  std::filesystem::path calibration_cache{};
+  bool calibrate_raw{false};
+  bool fix_bad_pixels{false};
+  double bad_pixel_sigma{6.0};
+  bool align{true};
+  std::filesystem::path alignment_cache{}; // Sidecar of saved warps
+  bool refresh_alignment{false};           // Ignore saved warps
+  ImageAligner::Interpolation interpolation{
+      ImageAligner::Interpolation::bilinear};
+  bool raw_stack{false};
+  double keep_best{100.0}; // Percentage of video frames to stack
+  TiffOptions tiff_options{};
+  std::vector<OutputSpec> more_outputs{}; // Also save the result to these
+
+  /**
+   * @brief      Get every output of the job:  output_path, saved with
+   * tiff_options, followed by more_outputs.
+   *
+   * @return     The outputs
+   */
+  [[nodiscard]] std::vector<OutputSpec> outputs() const;
+
+  /**
+   * @brief      Find out whether stacked images can be saved to a path.
+   *
+   * @param[in]  path  The output path
+   *
+   * @return     true iff the path's extension is a supported output format
+   */
+  [[nodiscard]] static bool supported_output(const std::filesystem::path &path);
+
+  [[nodiscard]] static const std::vector<std::string> &supported_extensions();
+
+  /**
+   * @brief      Find a path that is given as more than one output.  Paths
+   * are compared lexically, after normalization.
+   *
+   * @param[in]  outputs  The outputs
+   *
+   * @return     The first repeated path; nullopt if every path differs
+   */
+  [[nodiscard]] static std::optional<std::filesystem::path>
+  duplicate_output(const std::vector<OutputSpec> &outputs);
+};
+
+/**
+ * @brief      Read one stack job, as described for read_manifest.  Throws
+ * std::runtime_error if the job is invalid.
+ *
+ * @param[in]  node      The job:  a JSON object
+ * @param[in]  base      Directory to which relative paths are relative
+ * @param[in]  defaults  Settings for the job, unless it specifies its own
+ *
+ * @return     The job
+ */
+StackJob read_job(const cv::FileNode &node, const std::filesystem::path &base,
+                  const StackJob &defaults);
+
+/**
+ * @brief      Read stack jobs from a JSON manifest.
+ *
+ * The manifest is an object with a "jobs" array.  Each job is an object with
+ * an "images" array and an "output", and optionally "dark_images",
+ * "bias_images", "flat_images", "calibration_cache", "calibrate_raw",
+ * "fix_bad_pixels", "bad_pixel_sigma", "align", "alignment_cache",
+ * "refresh_alignment", "interpolation" (as for
+ * ImageAligner::parse_interpolation), "raw_stack", "keep_best", "half_size",
+ * "half_float",
+ * "roi" ([x, y, w, h]), "float_tiff" and "compression" (as for
+ * TiffCompression::parse).  "output" is an output spec, as for
+ * OutputSpec::parse, or an array of them; the job's own "float_tiff" and
+ * "compression" apply to outputs that don't say otherwise.  Settings a job
+ * omits are taken from defaults.
+ * Relative paths are relative to the manifest's directory.
+ *
+ * @param[in]  path      The manifest
+ * @param[in]  defaults  Settings for jobs that don't specify their own
+ *
+ * @return     The jobs
+ */
+std::vector<StackJob> read_manifest(const std::filesystem::path &path,
+                                    const StackJob &defaults);
+
+/**
+ * @brief      Runs stack jobs.  Jobs run by the same instance share a memory
+ * budget, and jobs that use the same calibration frames share the masters
+ * and bad pixel maps built from them.
+ */
+class StackRunner {
+public:
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  max_memory      Memory budget for all jobs; 0 for no limit
+   * @param[in]  splits_threads  Whether jobs run one at a time, with no other
+   * thread using OpenCV, so that each stage of a job may resize OpenCV's pool
+   * (see ThreadBudget::split)
+   */
+  explicit StackRunner(size_t max_memory = 0, bool splits_threads = false);
+
+  /**
+   * @brief      Stack a job's images.  If the images are videos (see
+   * VideoSource::is_video), the sharpest keep_best percent of their frames
+   * are stacked.  Otherwise the images' headers are read first, and images
+   * whose size differs from most are skipped without being decoded.  Throws
+   * std::runtime_error if the job mixes videos with still images.
+   *
+   * @param[in]  job   The job
+   *
+   * @return     The stacked image, CV_32FC3 with values in 0...255; empty if
+   * stacking failed
+   */
+  [[nodiscard]] cv::Mat stacked(const StackJob &job);
+
+  /**
+   * @brief      Stack a job's images, and save the result.  Throws
+   * std::runtime_error on failure.
+   *
+   * @param[in]  job   The job
+   */
+  void run(const StackJob &job);
+
+  /**
+   * @brief      Run jobs, several at a time, so that one job's loading can
+   * overlap another's alignment and stacking.
+   *
+   * @param[in]  jobs             The jobs
+   * @param[in]  max_concurrent   How many jobs to run at once
+   *
+   * @return     For each job, an error message; empty if the job succeeded
+   */
+  std::vector<std::string> run_all(const std::vector<StackJob> &jobs,
+                                   size_t max_concurrent);
+
+  /**
+   * @brief      Get the options with which to load a job's images, including
+   * its calibration and bad pixel map.  These are built once, and shared by
+   * all jobs with the same calibration frames and options.
+   *
+   * @param[in]  job   The job
+   *
+   * @return     The load options
+   */
+  [[nodiscard]] LoadOptions load_options(const StackJob &job);
+
+  /**
+   * @brief      Save a stacked image to several outputs at once, each on its
+   * own thread.  Throws std::runtime_error if any output could not be saved,
+   * once all have been attempted.
+   *
+   * @param[in]  stacked  The stacked image, as from stacked()
+   * @param[in]  outputs  Where and how to save it
+   */
+  static void save(const cv::Mat &stacked,
+                   const std::vector<OutputSpec> &outputs);
+
+  /**
+   * @brief      Save a stacked image.  Throws std::runtime_error on failure.
+   *
+   * @param[in]  stacked       The stacked image, as from stacked()
+   * @param[in]  path          Where to save it
+   * @param[in]  tiff_options  How to save it, if path is a TIFF
+   */
+  static void save(const cv::Mat &stacked, const std::filesystem::path &path,
+                   const TiffOptions &tiff_options = {});
+
+private:
+  // Calibrations kept for later jobs.  Masters are held outside the memory
+  // budget, so a resident runner keeps only the most recently used few.
+  static constexpr size_t max_cached_calibrations = 4;
+
+  struct CachedCalibration {
+    std::shared_future<LoadOptions> load_options;
+    uint64_t last_used{0};
+  };
+
+  MemoryBudget::SharedPtr m_budget;
+  const bool m_splits_threads;
+
+  std::mutex m_mutex;
+  std::map<std::string, CachedCalibration> m_load_options;
+  uint64_t m_calibration_uses{0};
+  std::map<std::filesystem::path, AlignmentCache::SharedPtr> m_alignments;
+
+  [[nodiscard]] AlignmentCache::SharedPtr alignment_cache(const StackJob &job);
+
+  [[nodiscard]] cv::Mat image_stacked(const StackJob &job,
+                                      const LoadOptions &options,
+                                      const std::vector<ImageHeader> &headers);
+  [[nodiscard]] cv::Mat
+  raw_stacked(const StackJob &job, const LoadOptions &options,
+              const std::vector<ImageHeader> &headers) const;
+  [[nodiscard]] cv::Mat video_stacked(const StackJob &job,
+                                      const LoadOptions &options) const;
+};
+
+} // namespace StackExposures
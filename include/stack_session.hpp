@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+// The embedding API.  This header depends only on the standard library, so
+// applications can stack frames they already hold in memory without using
+// OpenCV or LibRaw themselves.
+
+namespace StackExposures {
+
+/**
+ * @brief      A non-owning description of a caller-owned pixel buffer.
+ */
+struct FrameView {
+  enum class Depth { u8, u16, f32 };
+
+  enum class Channels { gray, bgr, rgb, bgra, rgba };
+
+  void *data{nullptr};
+  int width{0};
+  int height{0};
+  Depth depth{Depth::u8};
+  Channels channels{Channels::bgr};
+
+  // Bytes from the start of one row to the start of the next; 0 means the
+  // rows are tightly packed.
+  size_t stride{0};
+};
+
+/**
+ * @brief      How a StackSession is doing.
+ */
+struct StackProgress {
+  size_t frames_pushed{0};
+  size_t frames_added{0};
+  size_t frames_rejected{0};
+};
+
+struct StackSessionSettings {
+  // Align each frame to the first one pushed.
+  bool align{true};
+
+  // Called on the pushing thread after each frame has been handled.
+  std::function<void(const StackProgress &)> on_progress{};
+};
+
+/**
+ * @brief      Stacks frames that the caller pushes one at a time.
+ *
+ * Frames are read in place during push(); the session keeps no reference to
+ * the caller's buffer once push() returns.  All frames must have the same
+ * size, depth and channel layout as the first.  Only cancel() may be called
+ * from another thread.
+ */
+class StackSession {
+public:
+  enum class PushResult { added, rejected, cancelled };
+
+  explicit StackSession(StackSessionSettings settings);
+  StackSession();
+  ~StackSession();
+
+  StackSession(const StackSession &src) = delete;
+  StackSession(StackSession &&src) = delete;
+  StackSession &operator=(const StackSession &src) = delete;
+  StackSession &operator=(StackSession &&src) = delete;
+
+  /**
+   * @brief      Add a frame to the stack.
+   *
+   * @param[in]  frame  The frame; the first frame becomes the reference
+   *
+   * @return     added; rejected if the frame could not be aligned or does
+   * not match the first frame; or cancelled if cancel() has been called.
+   */
+  PushResult push(const FrameView &frame);
+
+  /**
+   * @brief      Stop accepting frames.  Safe to call from any thread.
+   */
+  void cancel();
+
+  [[nodiscard]] bool cancelled() const;
+
+  [[nodiscard]] StackProgress progress() const;
+
+  /**
+   * @brief      Write the mean of the frames added so far into a caller-owned
+   * buffer.  Values are rescaled from the depth of the pushed frames to the
+   * depth of dest; f32 values span 0.0 to 1.0.  Throws std::runtime_error if
+   * no frames have been added or dest's size differs from theirs.
+   *
+   * @param[in]  dest  The buffer to fill
+   */
+  void read_result(const FrameView &dest) const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+};
+
+} // namespace StackExposures
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      Where a synthetic frame points, relative to the reference
+ * frame:  a rotation about the image center, followed by a translation.
+ */
+struct FrameWarp {
+  double dx{0.0};
+  double dy{0.0};
+  double rotation_deg{0.0};
+
+  /**
+   * @brief      Get this warp as an affine transform.
+   *
+   * @param[in]  size  Size of the frame, whose center is the rotation center
+   *
+   * @return     A 2x3 CV_32F matrix mapping reference-frame coordinates to
+   * coordinates in the warped frame, as estimated by ImageAligner
+   */
+  [[nodiscard]] cv::Mat matrix(cv::Size size) const;
+
+  /**
+   * @brief      Get random warps; the first is always the identity.
+   *
+   * @param[in]  count         How many warps to make
+   * @param[in]  max_shift     Largest translation, in pixels
+   * @param[in]  max_rotation  Largest rotation, in degrees
+   * @param[in]  seed          Random number seed
+   *
+   * @return     The warps
+   */
+  [[nodiscard]] static std::vector<FrameWarp>
+  random(size_t count, double max_shift, double max_rotation, uint64_t seed);
+};
+
+/**
+ * @brief      Measure how far a warp estimate is from the truth.
+ *
+ * @param[in]  estimated  A 2x3 warp, e.g., from ImageAligner::estimate
+ * @param[in]  truth      The true warp
+ * @param[in]  size       Frame size
+ *
+ * @return     The largest displacement, in pixels, between where the two
+ * warps map the frame's corners and center
+ */
+[[nodiscard]] double warp_error(const cv::Mat &estimated,
+                                const FrameWarp &truth, cv::Size size);
+
+/**
+ * @brief      Renders synthetic star fields, for benchmarks and accuracy
+ * tests.
+ *
+ * Each frame shows the same stars, warped by a known FrameWarp, on a sky
+ * background with read noise.  Frames can also have hot pixels, which stay
+ * put from frame to frame, and a dark signal.
+ */
+class StarField {
+public:
+  struct Params {
+    cv::Size size{1224, 816}; // ~1 MP
+    double stars_per_mp{300.0};
+    double star_sigma{1.5}; // Gaussian PSF width, in pixels
+    double sky{0.05};       // Background level, as a fraction of full scale
+    double noise{0.01};     // Read noise standard deviation
+    size_t num_hot_pixels{0};
+    double dark_level{0.0}; // Mean dark signal; adds a gradient and offset
+    int depth{16};          // Bits per channel:  8 or 16
+    uint64_t seed{1};
+  };
+
+  /**
+   * @brief      Get a frame size with a 3:2 aspect ratio.
+   *
+   * @param[in]  megapixels  Approximate number of pixels, in millions
+   *
+   * @return     The size
+   */
+  [[nodiscard]] static cv::Size size_for_megapixels(double megapixels);
+
+  explicit StarField(Params params);
+
+  [[nodiscard]] const Params &params() const { return m_params; }
+
+  /**
+   * @brief      Get the positions of the hot pixels.
+   */
+  [[nodiscard]] const std::vector<cv::Point> &hot_pixels() const {
+    return m_hot_pixels;
+  }
+
+  /**
+   * @brief      Render a BGR frame.
+   *
+   * @param[in]  warp   Where the frame points
+   * @param[in]  index  Frame number; selects the noise
+   *
+   * @return     A CV_8UC3 or CV_16UC3 image, per params().depth
+   */
+  [[nodiscard]] cv::Mat render(const FrameWarp &warp, size_t index) const;
+
+  /**
+   * @brief      Render a frame as raw Bayer (RGGB) sensor data, for use
+   * without a raw file container.
+   *
+   * @param[in]  warp   Where the frame points
+   * @param[in]  index  Frame number; selects the noise
+   *
+   * @return     A CV_16UC1 mosaic
+   */
+  [[nodiscard]] cv::Mat render_cfa(const FrameWarp &warp, size_t index) const;
+
+  /**
+   * @brief      Render a dark frame:  dark signal, hot pixels and noise, but
+   * no sky or stars.
+   *
+   * @param[in]  index  Frame number; selects the noise
+   *
+   * @return     A CV_8UC3 or CV_16UC3 image, per params().depth
+   */
+  [[nodiscard]] cv::Mat render_dark(size_t index) const;
+
+  /**
+   * @brief      Render frames and save them as TIFF files.
+   *
+   * @param[in]  dir    Where to save the frames
+   * @param[in]  warps  One per frame
+   *
+   * @return     Paths of the saved frames
+   */
+  std::vector<std::filesystem::path>
+  write_tiffs(const std::filesystem::path &dir,
+              const std::vector<FrameWarp> &warps) const;
+
+private:
+  struct Star {
+    cv::Point2f position;
+    float brightness;
+    cv::Vec3f color;
+  };
+
+  const Params m_params;
+  std::vector<Star> m_stars;
+  std::vector<cv::Point> m_hot_pixels;
+  cv::Mat m_dark; // CV_32FC1, including hot pixels
+
+  [[nodiscard]] cv::Mat render_float(const FrameWarp &warp, size_t index,
+                                     bool with_stars) const;
+  [[nodiscard]] cv::Mat converted(const cv::Mat &image) const;
+};
+
+} // namespace StackExposures
@@ -1,7 +1,18 @@
 #pragma once
 
+#include <cstddef>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace StrUtil {
 std::string lowercase(std::string_view s);
+std::vector<std::string> split(std::string_view s, char delimiter);
+
+// Parse a byte count such as "1048576", "512M" or "8G" (binary multiples).
+std::optional<size_t> parse_byte_count(std::string_view s);
+
+// A suffix for temporary files, such as ".1234.5678.tmp", that no other
+// process or thread uses:  it names the process and the calling thread.
+std::string temporary_suffix();
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+namespace StackExposures {
+
+/**
+ * @brief      Divides one budget of threads among the pipeline's parallel
+ * stages.
+ *
+ * Three things start threads of their own:  AsyncImageLoader runs several
+ * decodes at once, LibRaw may give each dcraw_process an OpenMP team, and
+ * OpenCV's parallel_for_ (in cvtColor, warpAffine and our own loops) has a
+ * pool.  Left alone, each sizes itself to the whole machine, and together
+ * they oversubscribe it.
+ *
+ * A ThreadBudget plans decodes within the budget:  small frames get many
+ * single-threaded decodes, large frames fewer decodes with an OpenMP team
+ * each.  Decode threads are claimed from the budget, so that loaders of
+ * concurrent jobs share it.  When decodes and OpenCV's loops run at the same
+ * time, split() divides the budget between them.  Thread-safe.
+ */
+class ThreadBudget {
+public:
+  /**
+   * @brief      How to decode images of one size.
+   */
+  struct DecodePlan {
+    size_t concurrent_decodes{1};
+    size_t threads_per_decode{1};
+  };
+
+  // Decoding takes one thread for each of this many bytes of decode memory,
+  // up to max_threads_per_decode.  LibRaw's OpenMP loops scale poorly beyond
+  // that.
+  static constexpr size_t bytes_per_decode_thread = size_t{256} << 20;
+  static constexpr size_t max_threads_per_decode = 8;
+
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  threads  How many threads to use; 0 for one per core
+   */
+  explicit ThreadBudget(size_t threads = 0);
+
+  /**
+   * @brief      Make a budget the one used by every AsyncImageLoader, and
+   * size OpenCV's thread pool to it.  Calling this again changes the
+   * budget.
+   *
+   * @param[in]  threads  How many threads to use; 0 for one per core
+   *
+   * @return     The budget
+   */
+  static ThreadBudget &install(size_t threads);
+
+  /**
+   * @brief      Get the installed budget; by default, one thread per core.
+   */
+  static ThreadBudget &current();
+
+  [[nodiscard]] size_t threads() const;
+
+  /**
+   * @brief      Whether the budget is one thread per core, rather than a
+   * count that was asked for.
+   */
+  [[nodiscard]] bool per_core() const;
+
+  /**
+   * @brief      How many threads decodes may claim in all; threads() unless
+   * the budget is split.
+   */
+  [[nodiscard]] size_t decode_threads() const;
+
+  /**
+   * @brief      Divide the budget between decodes and OpenCV's pool for the
+   * next stage of work.  OpenCV's pool cannot be resized while any thread is
+   * in one of its loops, so call this only between stages, from the thread
+   * that runs them, while no other thread uses OpenCV.  Only the installed
+   * budget resizes OpenCV's pool.
+   *
+   * @param[in]  decode_threads  How many threads decodes may claim in all;
+   * OpenCV's pool gets the rest, and at least one.  0 to give each the whole
+   * budget, for stages in which they take turns.
+   */
+  void split(size_t decode_threads);
+
+  /**
+   * @brief      Split the budget in half, e.g., while images are stacked as
+   * they load.  See split().
+   */
+  void split_evenly();
+
+  /**
+   * @brief      Plan the decoding of images of one size.
+   *
+   * @param[in]  decode_bytes  Memory needed to decode one image; 0 if
+   * unknown, or if decodes are single-threaded anyway
+   *
+   * @return     The plan; concurrent_decodes * threads_per_decode is at most
+   * decode_threads()
+   */
+  [[nodiscard]] DecodePlan decode_plan(size_t decode_bytes) const;
+
+  /**
+   * @brief      Claim threads for one decode, if they are free now.  When no
+   * decode threads are claimed, any request is granted, so that every
+   * decode can proceed.
+   *
+   * @param[in]  threads  How many threads the decode will use
+   *
+   * @return     true iff the threads were claimed; return them with
+   * release_decode
+   */
+  [[nodiscard]] bool try_claim_decode(size_t threads);
+
+  void release_decode(size_t threads);
+
+  [[nodiscard]] size_t decode_threads_in_use() const;
+
+  /**
+   * @brief      Limit the OpenMP teams started by the calling thread, e.g.,
+   * by LibRaw's dcraw_process.  Has no effect if OpenMP is unavailable.
+   *
+   * @param[in]  threads  Team size
+   */
+  static void limit_openmp_threads(size_t threads);
+
+private:
+  mutable std::mutex m_mutex;
+  size_t m_threads;
+  bool m_per_core;
+  size_t m_decode_threads_in_use{0};
+  size_t m_decode_limit{0};   // Decodes' share of a split budget; 0 if whole
+  bool m_sizes_opencv{false}; // Whether this budget was installed
+
+  void set_threads(size_t threads);
+};
+
+} // namespace StackExposures
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      How TIFF strips are compressed.
+ */
+struct TiffCompression {
+  enum class Codec { none, lzw, deflate, zstd };
+
+  Codec codec{Codec::lzw};
+  int level{-1}; // -1 for the codec's default; ignored by none and lzw
+
+  /**
+   * @brief      Parse a codec name, optionally followed by ':' and a level:
+   * "none", "lzw", "deflate", "deflate:9", "zstd", "zstd:19".
+   *
+   * @param[in]  text  The text to parse
+   *
+   * @return     The compression; nullopt if text is not valid
+   */
+  [[nodiscard]] static std::optional<TiffCompression>
+  parse(std::string_view text);
+
+  /**
+   * @brief      Find out whether this build can compress with a codec.
+   * deflate and zstd need zlib and libzstd, respectively, at build time.
+   *
+   * @param[in]  codec  The codec
+   *
+   * @return     true iff the codec can be used
+   */
+  [[nodiscard]] static bool available(Codec codec);
+};
+
+struct TiffOptions {
+  // Save 32-bit floating point samples, in 0...1, rather than 16-bit
+  // integers.
+  bool float32{false};
+  TiffCompression compression{};
+};
+
+/**
+ * @brief      Save a stacked image as an RGB TIFF.
+ *
+ * The image is converted and compressed a few strips at a time, with strips
+ * compressed in parallel, so no second full-size copy of the image is made.
+ * Compressed strips are first differenced horizontally (TIFF predictor 2,
+ * or 3 for floating point), as libtiff does.  Throws std::runtime_error on
+ * failure.
+ *
+ * @param[in]  stacked  CV_32FC3 BGR image, with values in 0...255
+ * @param[in]  path     Where to save it
+ * @param[in]  options  Sample format and compression
+ */
+void write_tiff(const cv::Mat &stacked, const std::filesystem::path &path,
+                const TiffOptions &options);
+
+} // namespace StackExposures
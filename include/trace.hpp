@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+
+namespace StackExposures::Trace {
+
+/**
+ * @brief      Start or stop recording.  Recording is off by default; while
+ * it is off, a Scope costs one relaxed atomic load.
+ *
+ * @param[in]  enable  Whether to record
+ */
+void enable(bool enable);
+
+namespace detail {
+extern std::atomic_bool g_enabled;
+} // namespace detail
+
+[[nodiscard]] inline bool enabled() {
+  return detail::g_enabled.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief      Times a stage of processing, from construction to destruction.
+ */
+class Scope {
+public:
+  /**
+   * @brief      Start timing.
+   *
+   * @param[in]  name  Name of the stage.  Must outlive the recording, e.g., a
+   * string literal.
+   */
+  explicit Scope(const char *name) {
+    if (enabled()) {
+      begin(name);
+    }
+  }
+
+  ~Scope() {
+    if (m_name != nullptr) {
+      end();
+    }
+  }
+
+  Scope(const Scope &src) = delete;
+  Scope(Scope &&src) = delete;
+  Scope &operator=(const Scope &src) = delete;
+  Scope &operator=(Scope &&src) = delete;
+
+private:
+  const char *m_name{nullptr};
+  std::chrono::steady_clock::time_point m_start;
+  uint64_t m_start_bytes{0};
+
+  void begin(const char *name);
+  void end();
+};
+
+/**
+ * @brief      Save everything recorded so far as a Chrome trace, for viewing
+ * in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * @param[in]  path  Where to save
+ */
+void write_chrome_trace(const std::filesystem::path &path);
+
+/**
+ * @brief      Count image memory as it is allocated and released, for
+ * print_stats.  Called by an allocator that sees every cv::Mat allocation,
+ * i.e., an installed BufferPool; counts are kept only while recording.
+ *
+ * @param[in]  bytes  Size of the allocation
+ */
+void count_allocation(size_t bytes);
+void count_release(size_t bytes);
+
+/**
+ * @brief      Find out whether allocations are being counted, i.e., whether
+ * count_allocation has been called.
+ */
+[[nodiscard]] bool counts_allocations();
+
+/**
+ * @brief      Print, for each stage, how often it ran and how long it took;
+ * then print peak memory use.  If allocations are counted, also print how
+ * much image memory was allocated during each stage, and in all.
+ *
+ * Allocations are counted process-wide, so stages that overlap in time share
+ * each other's counts.
+ *
+ * @param      outs  Where to print
+ */
+void print_stats(std::ostream &outs);
+
+} // namespace StackExposures::Trace
+
+#define STACK_EXP_TRACE_CONCAT_(a, b) a##b
+#define STACK_EXP_TRACE_CONCAT(a, b) STACK_EXP_TRACE_CONCAT_(a, b)
+
+/**
+ * @brief      Time the rest of the enclosing block as stage 'name'.
+ */
+#define STACK_EXP_TRACE_SCOPE(name)                                            \
+  const ::StackExposures::Trace::Scope STACK_EXP_TRACE_CONCAT(                 \
+      stack_exp_trace_scope_, __LINE__)(name)
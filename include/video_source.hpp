@@ -0,0 +1,124 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace StackExposures {
+
+/**
+ * @brief      The frames of a video file, decoded one after another.
+ *
+ * SER files are read natively; other videos, such as AVI, are read through
+ * cv::VideoCapture.
+ */
+class VideoSource {
+public:
+  using Ptr = std::unique_ptr<VideoSource>;
+
+  virtual ~VideoSource() = default;
+
+  /**
+   * @brief      Open a video.  Throws std::runtime_error on failure.
+   *
+   * @param[in]  path  The video
+   *
+   * @return     The new source, positioned at the first frame
+   */
+  [[nodiscard]] static Ptr open(const std::filesystem::path &path);
+
+  /**
+   * @brief      Find out whether a path names a video, by its extension.
+   *
+   * @param[in]  path  The path
+   *
+   * @return     true iff path is a SER or AVI file
+   */
+  [[nodiscard]] static bool is_video(const std::filesystem::path &path);
+
+  /**
+   * @brief      Get the number of frames in the video.  For videos read
+   * through cv::VideoCapture, this is the container's estimate.
+   *
+   * @return     The number of frames
+   */
+  [[nodiscard]] virtual size_t frame_count() const = 0;
+
+  /**
+   * @brief      Decode the next frame.  Throws std::runtime_error if the
+   * video is corrupt.
+   *
+   * @return     The frame, CV_8UC3 or (for deeper SER frames) CV_32FC3 BGR,
+   * with values in 0...255; empty after the last frame
+   */
+  [[nodiscard]] virtual cv::Mat next() = 0;
+
+  /**
+   * @brief      Move past the next frame without decoding it.
+   *
+   * @return     false if there was no next frame
+   */
+  virtual bool skip() = 0;
+};
+
+/**
+ * @brief      Decodes a video's frames on a background thread, at most a
+ * fixed number of frames ahead of the consumer.
+ */
+class FrameReadahead {
+public:
+  struct Frame {
+    size_t index{0}; // Position of the frame in the video
+    cv::Mat image;
+  };
+
+  /**
+   * @brief      Start decoding.
+   *
+   * @param[in]  source  The video
+   * @param[in]  wanted  Which frames to decode, by index; frames past its end,
+   * and frames marked false, are skipped.  Empty to decode every frame.
+   * @param[in]  window  How many decoded frames may wait to be consumed
+   */
+  FrameReadahead(VideoSource::Ptr source, std::vector<bool> wanted,
+                 size_t window);
+  ~FrameReadahead();
+
+  FrameReadahead(const FrameReadahead &src) = delete;
+  FrameReadahead(FrameReadahead &&src) = delete;
+  FrameReadahead &operator=(const FrameReadahead &src) = delete;
+  FrameReadahead &operator=(FrameReadahead &&src) = delete;
+
+  /**
+   * @brief      Get the next decoded frame, waiting for it if need be.
+   * Rethrows any exception thrown while decoding.
+   *
+   * @return     The frame; nullopt after the last wanted frame
+   */
+  [[nodiscard]] std::optional<Frame> next();
+
+private:
+  VideoSource::Ptr m_source;
+  const std::vector<bool> m_wanted;
+  const size_t m_window;
+
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::deque<Frame> m_frames;
+  bool m_done{false};
+  bool m_stopping{false};
+  std::exception_ptr m_error;
+  std::thread m_decoder;
+
+  void decode();
+};
+
+} // namespace StackExposures
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "image_aligner.hpp"
+#include "image_loader.hpp"
+
+namespace StackExposures {
+
+struct VideoStackOptions {
+  // Stack only this percentage of the frames:  the sharpest.
+  double keep_percent{100.0};
+  bool align{true};
+  ImageAligner::Interpolation interpolation{
+      ImageAligner::Interpolation::bilinear};
+
+  // How many decoded frames may wait to be scored or stacked.
+  size_t readahead{8};
+};
+
+/**
+ * @brief      Stacks the sharpest frames of videos, e.g., of a planetary or
+ * lunar session.
+ *
+ * Videos are read twice.  The first pass scores every frame's sharpness,
+ * keeping only the scores and the sharpest frame.  The second pass aligns
+ * each chosen frame to the sharpest one and adds it to a running sum.
+ * Neither pass holds more than a few frames, however long the videos are.
+ */
+class VideoStacker {
+public:
+  /**
+   * @brief      Constructs a new instance.
+   *
+   * @param[in]  load_options  How to prepare each frame; see
+   * ImageLoader::load_frame
+   * @param[in]  options       Which frames to stack, and how
+   */
+  VideoStacker(LoadOptions load_options, VideoStackOptions options);
+
+  /**
+   * @brief      Score a frame's sharpness, as the variance of its Laplacian.
+   *
+   * @param[in]  frame  The frame
+   *
+   * @return     The score; higher is sharper
+   */
+  [[nodiscard]] static double quality(const cv::Mat &frame);
+
+  /**
+   * @brief      Get how many frames to keep.
+   *
+   * @param[in]  count         The number of frames
+   * @param[in]  keep_percent  The percentage to keep
+   *
+   * @return     The number to keep; at least 1 if count is not 0
+   */
+  [[nodiscard]] static size_t keep_count(size_t count, double keep_percent);
+
+  /**
+   * @brief      Stack the sharpest frames of videos.  Throws
+   * std::runtime_error if a video cannot be read.
+   *
+   * @param[in]  videos  The videos; their frames are ranked together
+   *
+   * @return     The mean of the frames stacked, CV_32FC3 with values in
+   * 0...255; empty if the videos have no frames
+   */
+  [[nodiscard]] cv::Mat
+  stacked_result(const std::vector<std::filesystem::path> &videos);
+
+  [[nodiscard]] size_t frames_scored() const { return m_frames_scored; }
+
+  [[nodiscard]] size_t frames_stacked() const { return m_frames_stacked; }
+
+private:
+  LoadOptions m_load_options;
+  VideoStackOptions m_options;
+  size_t m_frames_scored{0};
+  size_t m_frames_stacked{0};
+};
+
+} // namespace StackExposures
@@ -0,0 +1,185 @@
+#include "alignment_cache.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "content_hash.hpp"
+#include "str_util.hpp"
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+constexpr int format_version = 1;
+constexpr size_t read_chunk_bytes = 1 << 20;
+
+std::string key_of(const std::string &reference, const std::string &frame,
+                   ImageAligner::Motion motion) {
+  return reference + "/" + frame + "/" +
+         std::to_string(static_cast<int>(motion));
+}
+} // namespace
+
+AlignmentCache::AlignmentCache(std::filesystem::path path)
+    : m_path(std::move(path)) {}
+
+AlignmentCache::SharedPtr AlignmentCache::open(std::filesystem::path path,
+                                               bool invalidate) {
+  SharedPtr result(new AlignmentCache(std::move(path)));
+  if (invalidate) {
+    // Rewrite the sidecar even if no warps are added.
+    result->m_dirty = true;
+  } else {
+    result->load();
+  }
+  return result;
+}
+
+std::string AlignmentCache::file_id(const std::filesystem::path &path) {
+  STACK_EXP_TRACE_SCOPE("alignment_cache.file_id");
+  std::ifstream inf(path, std::ios::binary);
+  if (!inf) {
+    return {};
+  }
+  ContentHash hash;
+  std::vector<char> buffer(read_chunk_bytes);
+  while (inf) {
+    inf.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    hash.add(buffer.data(), static_cast<size_t>(inf.gcount()));
+  }
+  return hash.hex();
+}
+
+std::string AlignmentCache::combined_id(const std::string &a,
+                                        const std::string &b) {
+  if (a.empty() || b.empty()) {
+    return {};
+  }
+  return ContentHash().add(a).add(b).hex();
+}
+
+std::optional<AlignmentCache::Entry>
+AlignmentCache::find(const std::string &reference, const std::string &frame,
+                     ImageAligner::Motion motion) const {
+  std::scoped_lock lock(m_mutex);
+  const auto found = m_entries.find(key_of(reference, frame, motion));
+  if (found == m_entries.end()) {
+    ++m_misses;
+    return std::nullopt;
+  }
+  ++m_hits;
+  return found->second;
+}
+
+void AlignmentCache::store(Entry entry) {
+  std::scoped_lock lock(m_mutex);
+  auto key = key_of(entry.reference, entry.frame, entry.motion);
+  m_saved_keys.erase(key);
+  m_entries.insert_or_assign(std::move(key), std::move(entry));
+  m_dirty = true;
+}
+
+void AlignmentCache::forget_saved() {
+  std::scoped_lock lock(m_mutex);
+  for (const auto &key : m_saved_keys) {
+    m_entries.erase(key);
+  }
+  m_saved_keys.clear();
+  m_dirty = true;
+}
+
+bool AlignmentCache::save() const {
+  std::scoped_lock lock(m_mutex);
+  if (!m_dirty) {
+    return true;
+  }
+  // Write to a private temporary file, then rename, so that a crash or a
+  // concurrent run never leaves a truncated sidecar.
+  auto tmp_path(m_path);
+  tmp_path += StrUtil::temporary_suffix();
+  std::error_code err;
+  try {
+    cv::FileStorage fs(tmp_path.string(),
+                       cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+    if (!fs.isOpened()) {
+      return false;
+    }
+    fs << "format_version" << format_version;
+    fs << "alignments"
+       << "[";
+    for (const auto &[key, entry] : m_entries) {
+      fs << "{";
+      fs << "reference" << entry.reference;
+      fs << "frame" << entry.frame;
+      fs << "motion" << static_cast<int>(entry.motion);
+      fs << "correlation" << entry.correlation;
+      fs << "warp" << entry.warp;
+      fs << "}";
+    }
+    fs << "]";
+    fs.release();
+  } catch (cv::Exception &e) {
+    std::cerr << "Could not save alignments to " << m_path << ": " << e.what()
+              << std::endl;
+    std::filesystem::remove(tmp_path, err);
+    return false;
+  }
+  std::filesystem::rename(tmp_path, m_path, err);
+  if (err) {
+    std::cerr << "Could not save alignments to " << m_path << ": "
+              << err.message() << std::endl;
+    std::filesystem::remove(tmp_path, err);
+    return false;
+  }
+  m_dirty = false;
+  return true;
+}
+
+size_t AlignmentCache::hits() const {
+  std::scoped_lock lock(m_mutex);
+  return m_hits;
+}
+
+size_t AlignmentCache::misses() const {
+  std::scoped_lock lock(m_mutex);
+  return m_misses;
+}
+
+void AlignmentCache::load() {
+  if (!std::filesystem::exists(m_path)) {
+    return;
+  }
+  try {
+    cv::FileStorage fs(m_path.string(),
+                       cv::FileStorage::READ | cv::FileStorage::FORMAT_JSON);
+    if (!fs.isOpened() ||
+        (static_cast<int>(fs["format_version"]) != format_version)) {
+      std::cerr << "Ignoring alignment sidecar " << m_path << "." << std::endl;
+      return;
+    }
+    const auto alignments = fs["alignments"];
+    for (auto iter = alignments.begin(); iter != alignments.end(); ++iter) {
+      const auto node = *iter;
+      Entry entry;
+      entry.reference = static_cast<std::string>(node["reference"]);
+      entry.frame = static_cast<std::string>(node["frame"]);
+      entry.motion =
+          static_cast<ImageAligner::Motion>(static_cast<int>(node["motion"]));
+      entry.correlation = static_cast<double>(node["correlation"]);
+      node["warp"] >> entry.warp;
+      if ((entry.warp.rows == 2) && (entry.warp.cols == 3) &&
+          (entry.warp.type() == CV_32F)) {
+        auto key = key_of(entry.reference, entry.frame, entry.motion);
+        m_saved_keys.insert(key);
+        m_entries.emplace(std::move(key), std::move(entry));
+      }
+    }
+  } catch (cv::Exception &e) {
+    std::cerr << "Ignoring alignment sidecar " << m_path << ": " << e.what()
+              << std::endl;
+    m_entries.clear();
+    m_saved_keys.clear();
+  }
+}
+
+} // namespace StackExposures
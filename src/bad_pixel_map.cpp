@@ -0,0 +1,314 @@
+#include "bad_pixel_map.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <opencv2/imgproc.hpp>
+
+#include "str_util.hpp"
+
+namespace StackExposures {
+namespace {
+
+constexpr uint32_t map_magic = 0x50424553; // "SEBP"
+constexpr uint32_t map_version = 2;
+
+// Smallest excess over the neighborhood median that marks a pixel as bad,
+// regardless of how little noise an image has.
+constexpr double min_excess = 1.0;
+
+// Enough samples to estimate noise robustly, without sorting a whole frame.
+constexpr size_t max_noise_samples = 1 << 20;
+
+// Get one 2x2 CFA phase of plane, as its own half-size image.
+cv::Mat phase_plane(const cv::Mat &plane, int dy, int dx) {
+  cv::Mat result((plane.rows - dy + 1) / 2, (plane.cols - dx + 1) / 2,
+                 CV_32FC1);
+  for (int row = 0; row < result.rows; ++row) {
+    const auto *src = plane.ptr<float>(2 * row + dy);
+    auto *dest = result.ptr<float>(row);
+    for (int col = 0; col < result.cols; ++col) {
+      dest[col] = src[2 * col + dx];
+    }
+  }
+  return result;
+}
+
+// Get the brightest channel of each pixel, as floating point.
+cv::Mat intensity(const cv::Mat &image) {
+  cv::Mat as_float;
+  image.convertTo(as_float, CV_MAKETYPE(CV_32F, image.channels()));
+  if (as_float.channels() == 1) {
+    return as_float;
+  }
+  std::vector<cv::Mat> channels;
+  cv::split(as_float, channels);
+  cv::Mat result = channels[0];
+  for (size_t i = 1; i < channels.size(); ++i) {
+    result = cv::max(result, channels[i]);
+  }
+  return result;
+}
+
+// Get the excess of each pixel of plane over the median of its same-color
+// neighborhood.
+cv::Mat residual_of(const cv::Mat &plane, bool cfa) {
+  cv::Mat result(plane.size(), CV_32FC1);
+  const int step = cfa ? 2 : 1;
+  for (int dy = 0; dy < step; ++dy) {
+    for (int dx = 0; dx < step; ++dx) {
+      const auto sub = cfa ? phase_plane(plane, dy, dx) : plane;
+      cv::Mat median;
+      cv::medianBlur(sub, median, 3);
+      const cv::Mat excess = sub - median;
+      for (int row = 0; row < excess.rows; ++row) {
+        const auto *src = excess.ptr<float>(row);
+        auto *dest = result.ptr<float>(step * row + dy);
+        for (int col = 0; col < excess.cols; ++col) {
+          dest[step * col + dx] = src[col];
+        }
+      }
+    }
+  }
+  return result;
+}
+
+// Average 2x2 blocks, which washes out single bad pixels (and, for Bayer
+// data, the color pattern) before the sky's motion is measured.
+cv::Mat binned(const cv::Mat &plane) {
+  cv::Mat result;
+  cv::resize(plane, result, cv::Size(plane.cols / 2, plane.rows / 2), 0, 0,
+             cv::INTER_AREA);
+  return result;
+}
+
+// Estimate the standard deviation of residual from its median absolute value.
+double robust_sigma(const cv::Mat &residual) {
+  const size_t total = residual.total();
+  const size_t stride = std::max<size_t>(1, total / max_noise_samples);
+  std::vector<float> samples;
+  samples.reserve(total / stride + 1);
+  for (size_t i = 0; i < total; i += stride) {
+    const int row = static_cast<int>(i / residual.cols);
+    const int col = static_cast<int>(i % residual.cols);
+    samples.push_back(std::abs(residual.at<float>(row, col)));
+  }
+  auto middle = samples.begin() + static_cast<long>(samples.size() / 2);
+  std::nth_element(samples.begin(), middle, samples.end());
+  return 1.4826 * *middle;
+}
+
+} // namespace
+
+BadPixelMap::ConstPtr BadPixelMap::create(cv::Size size,
+                                          std::vector<uint32_t> indices,
+                                          bool cfa) {
+  std::sort(indices.begin(), indices.end());
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+  return std::shared_ptr<const BadPixelMap>(
+      new BadPixelMap(size, std::move(indices), cfa));
+}
+
+BadPixelMap::BadPixelMap(cv::Size size, std::vector<uint32_t> indices,
+                         bool cfa)
+    : m_size(size), m_indices(std::move(indices)), m_cfa(cfa) {}
+
+BadPixelMap::ConstPtr BadPixelMap::detect(const cv::Mat &image, bool cfa,
+                                          double sigmas) {
+  const auto plane = intensity(image);
+  const auto residual = residual_of(plane, cfa);
+  const double threshold =
+      std::max(sigmas * robust_sigma(residual), min_excess);
+  std::vector<uint32_t> indices;
+  for (int row = 0; row < residual.rows; ++row) {
+    const auto *values = residual.ptr<float>(row);
+    for (int col = 0; col < residual.cols; ++col) {
+      if (values[col] > threshold) {
+        indices.push_back(static_cast<uint32_t>(row * residual.cols + col));
+      }
+    }
+  }
+  return create(plane.size(), std::move(indices), cfa);
+}
+
+BadPixelMap::SessionDetector::SessionDetector(bool cfa, double sigmas)
+    : m_cfa(cfa), m_sigmas(sigmas) {}
+
+void BadPixelMap::SessionDetector::add(const cv::Mat &exposure) {
+  const auto plane = intensity(exposure);
+  if ((m_count > 0) && (plane.size() != m_weakest.size())) {
+    return;
+  }
+  const auto residual = residual_of(plane, m_cfa);
+  const double threshold =
+      std::max(m_sigmas * robust_sigma(residual), min_excess);
+  const cv::Mat ratio = residual / threshold;
+
+  const auto thumbnail = binned(plane);
+  if (m_count == 0) {
+    m_weakest = ratio;
+    m_reference = thumbnail;
+    cv::createHanningWindow(m_window, m_reference.size(), CV_32F);
+  } else {
+    m_weakest = cv::min(m_weakest, ratio);
+    const auto shift = cv::phaseCorrelate(m_reference, thumbnail, m_window);
+    m_motion = std::max(m_motion, 2.0 * std::hypot(shift.x, shift.y));
+  }
+  ++m_count;
+}
+
+BadPixelMap::ConstPtr BadPixelMap::SessionDetector::result() const {
+  if ((m_count < 2) || (m_motion < min_motion)) {
+    return nullptr;
+  }
+  std::vector<uint32_t> indices;
+  for (int row = 0; row < m_weakest.rows; ++row) {
+    const auto *values = m_weakest.ptr<float>(row);
+    for (int col = 0; col < m_weakest.cols; ++col) {
+      if (values[col] > 1.0F) {
+        indices.push_back(static_cast<uint32_t>(row * m_weakest.cols + col));
+      }
+    }
+  }
+  return create(m_weakest.size(), std::move(indices), m_cfa);
+}
+
+BadPixelMap::ConstPtr BadPixelMap::load(const std::filesystem::path &path) {
+  std::ifstream ins(path, std::ios::binary);
+  if (!ins) {
+    return nullptr;
+  }
+  uint32_t header[6] = {};
+  ins.read(reinterpret_cast<char *>(header), sizeof(header));
+  constexpr auto max_side = static_cast<uint32_t>(
+      std::numeric_limits<int>::max());
+  if (!ins || (header[0] != map_magic) || (header[1] != map_version) ||
+      (header[2] == 0) || (header[3] == 0) || (header[2] > max_side) ||
+      (header[3] > max_side)) {
+    return nullptr;
+  }
+
+  // repair() writes at every index, so a stale or corrupt map must not be
+  // trusted:  it must hold exactly its stated number of in-bounds indices.
+  const auto num_pixels = uint64_t{header[2]} * header[3];
+  const auto index_bytes = uint64_t{header[5]} * sizeof(uint32_t);
+  std::error_code err;
+  const auto file_bytes = std::filesystem::file_size(path, err);
+  if ((header[5] > num_pixels) || err ||
+      (file_bytes != sizeof(header) + index_bytes)) {
+    return nullptr;
+  }
+  std::vector<uint32_t> indices(header[5]);
+  ins.read(reinterpret_cast<char *>(indices.data()),
+           static_cast<std::streamsize>(index_bytes));
+  if (!ins || std::any_of(indices.begin(), indices.end(),
+                          [num_pixels](uint32_t index) {
+                            return index >= num_pixels;
+                          })) {
+    return nullptr;
+  }
+  const cv::Size size(static_cast<int>(header[3]), static_cast<int>(header[2]));
+  return create(size, std::move(indices), header[4] != 0);
+}
+
+bool BadPixelMap::save(const std::filesystem::path &path) const {
+  // Write to a private temporary file, then rename, so that concurrent runs
+  // never see a partially written map.
+  auto tmp_path(path);
+  tmp_path += StrUtil::temporary_suffix();
+  std::error_code err;
+  {
+    std::ofstream outs(tmp_path, std::ios::binary);
+    const uint32_t header[6] = {map_magic,
+                                map_version,
+                                static_cast<uint32_t>(m_size.height),
+                                static_cast<uint32_t>(m_size.width),
+                                m_cfa ? 1U : 0U,
+                                static_cast<uint32_t>(m_indices.size())};
+    outs.write(reinterpret_cast<const char *>(header), sizeof(header));
+    outs.write(
+        reinterpret_cast<const char *>(m_indices.data()),
+        static_cast<std::streamsize>(m_indices.size() * sizeof(uint32_t)));
+    if (!outs) {
+      std::filesystem::remove(tmp_path, err);
+      return false;
+    }
+  }
+  std::filesystem::rename(tmp_path, path, err);
+  if (err) {
+    std::filesystem::remove(tmp_path, err);
+    return false;
+  }
+  return true;
+}
+
+bool BadPixelMap::is_bad(int row, int col) const {
+  const auto index = static_cast<uint32_t>(row * m_size.width + col);
+  return std::binary_search(m_indices.begin(), m_indices.end(), index);
+}
+
+template <typename T> void BadPixelMap::repair_pixels(cv::Mat &image) const {
+  const int step = m_cfa ? 2 : 1;
+  const int channels = image.channels();
+  const std::array<cv::Point, 4> offsets{
+      cv::Point(-step, 0), cv::Point(step, 0), cv::Point(0, -step),
+      cv::Point(0, step)};
+
+  for (const auto index : m_indices) {
+    const int row = static_cast<int>(index) / m_size.width;
+    const int col = static_cast<int>(index) % m_size.width;
+
+    std::array<double, 4> sums{};
+    int count = 0;
+    for (const auto &offset : offsets) {
+      const int r = row + offset.y;
+      const int c = col + offset.x;
+      if ((r < 0) || (r >= image.rows) || (c < 0) || (c >= image.cols) ||
+          is_bad(r, c)) {
+        continue;
+      }
+      const T *neighbor = image.ptr<T>(r) + c * channels;
+      for (int ch = 0; ch < channels; ++ch) {
+        sums[ch] += neighbor[ch];
+      }
+      ++count;
+    }
+    if (count > 0) {
+      T *pixel = image.ptr<T>(row) + col * channels;
+      for (int ch = 0; ch < channels; ++ch) {
+        pixel[ch] = cv::saturate_cast<T>(sums[ch] / count);
+      }
+    }
+  }
+}
+
+void BadPixelMap::repair(cv::Mat &image) const {
+  if (image.size() != m_size) {
+    throw std::runtime_error(
+        "Bad pixel map dimensions do not match the image.");
+  }
+  if (image.channels() > 4) {
+    throw std::runtime_error("Cannot repair images with over 4 channels.");
+  }
+  switch (image.depth()) {
+  case CV_8U:
+    repair_pixels<uint8_t>(image);
+    break;
+  case CV_16U:
+    repair_pixels<uint16_t>(image);
+    break;
+  case CV_32F:
+    repair_pixels<float>(image);
+    break;
+  default:
+    throw std::runtime_error("Cannot repair images of this pixel depth.");
+  }
+}
+
+} // namespace StackExposures
@@ -0,0 +1,206 @@
+#include "buffer_pool.hpp"
+
+#include <cstdint>
+
+#include "trace.hpp"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace StackExposures {
+namespace {
+
+// Pooled buffers are rounded up to whole pages, so that requests for nearly
+// the same size share a bucket.
+constexpr size_t page_bytes = size_t{4} << 10;
+constexpr size_t huge_page_bytes = size_t{2} << 20;
+
+size_t bucket_size(size_t bytes) {
+  return (bytes + page_bytes - 1) / page_bytes * page_bytes;
+}
+
+// Ask for transparent huge pages for the whole huge pages within a buffer.
+// This is only advice:  failure, or a kernel that ignores it, is harmless.
+void advise_huge_pages(void *buffer, size_t bytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  const auto begin = reinterpret_cast<uintptr_t>(buffer);
+  const auto first = (begin + huge_page_bytes - 1) / huge_page_bytes *
+                     huge_page_bytes;
+  const auto last = (begin + bytes) / huge_page_bytes * huge_page_bytes;
+  if (last > first) {
+    (void)madvise(reinterpret_cast<void *>(first), last - first,
+                  MADV_HUGEPAGE);
+  }
+#else
+  (void)buffer;
+  (void)bytes;
+#endif
+}
+
+} // namespace
+
+BufferPool::BufferPool(size_t max_idle_bytes)
+    : m_max_idle_bytes(max_idle_bytes) {}
+
+BufferPool::~BufferPool() { trim(); }
+
+BufferPool &BufferPool::install(size_t max_idle_bytes) {
+  // Never destroyed, since Mats allocated by the pool may be released during
+  // static destruction.
+  static auto *pool = new BufferPool(max_idle_bytes);
+  pool->set_max_idle_bytes(max_idle_bytes);
+  // The default allocator sees every allocation, so it can count them.
+  pool->m_counts_allocations = true;
+  cv::Mat::setDefaultAllocator(pool);
+  return *pool;
+}
+
+// Modeled on OpenCV's StdMatAllocator.
+cv::UMatData *BufferPool::allocate(int dims, const int *sizes, int type,
+                                   void *data, size_t *step,
+                                   cv::AccessFlag /*flags*/,
+                                   cv::UMatUsageFlags /*usage_flags*/) const {
+  auto total = static_cast<size_t>(CV_ELEM_SIZE(type));
+  for (int i = dims - 1; i >= 0; --i) {
+    if (step != nullptr) {
+      if ((data != nullptr) && (step[i] != CV_AUTOSTEP)) {
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= static_cast<size_t>(sizes[i]);
+  }
+
+  auto *result = new cv::UMatData(this);
+  if (data != nullptr) {
+    result->data = result->origdata = static_cast<uchar *>(data);
+    result->flags |= cv::UMatData::USER_ALLOCATED;
+  } else {
+    result->data = result->origdata = static_cast<uchar *>(take(total));
+  }
+  result->size = total;
+  return result;
+}
+
+bool BufferPool::allocate(cv::UMatData *data, cv::AccessFlag /*access_flags*/,
+                          cv::UMatUsageFlags /*usage_flags*/) const {
+  return data != nullptr;
+}
+
+void BufferPool::deallocate(cv::UMatData *data) const {
+  if (data == nullptr) {
+    return;
+  }
+  CV_Assert(data->urefcount == 0);
+  CV_Assert(data->refcount == 0);
+  if ((data->flags & cv::UMatData::USER_ALLOCATED) == 0) {
+    give_back(data->origdata, data->size);
+    data->origdata = nullptr;
+  }
+  delete data;
+}
+
+BufferPool::Stats BufferPool::stats() const {
+  std::lock_guard lock(m_mutex);
+  return m_stats;
+}
+
+void BufferPool::set_max_idle_bytes(size_t max_idle_bytes) {
+  std::lock_guard lock(m_mutex);
+  m_max_idle_bytes = max_idle_bytes;
+  free_idle_down_to(max_idle_bytes);
+}
+
+void BufferPool::trim() {
+  std::lock_guard lock(m_mutex);
+  free_idle_down_to(0);
+}
+
+void *BufferPool::take(size_t bytes) const {
+  if (m_counts_allocations) {
+    Trace::count_allocation(bytes);
+  }
+  if (bytes < min_pooled_bytes) {
+    return cv::fastMalloc(bytes);
+  }
+  const auto bucket = bucket_size(bytes);
+  {
+    std::lock_guard lock(m_mutex);
+    const auto found = m_idle.find(bucket);
+    if ((found != m_idle.end()) && !found->second.empty()) {
+      // The most recently returned buffer is the likeliest to be cached.
+      void *result = found->second.back().buffer;
+      found->second.pop_back();
+      if (found->second.empty()) {
+        m_idle.erase(found);
+      }
+      m_stats.idle_bytes -= bucket;
+      ++m_stats.hits;
+      return result;
+    }
+    ++m_stats.misses;
+  }
+  void *result = cv::fastMalloc(bucket);
+  if (bucket >= huge_page_bytes) {
+    advise_huge_pages(result, bucket);
+  }
+  return result;
+}
+
+void BufferPool::give_back(void *buffer, size_t bytes) const {
+  if (m_counts_allocations) {
+    Trace::count_release(bytes);
+  }
+  if (bytes < min_pooled_bytes) {
+    cv::fastFree(buffer);
+    return;
+  }
+  const auto bucket = bucket_size(bytes);
+  {
+    std::lock_guard lock(m_mutex);
+    if (bucket <= m_max_idle_bytes) {
+      // Make room by freeing the idle buffers of other sizes that were
+      // returned longest ago.  Freeing one of this size to keep another
+      // would gain nothing.
+      free_idle_down_to(m_max_idle_bytes - bucket, bucket);
+    }
+    if (m_stats.idle_bytes + bucket <= m_max_idle_bytes) {
+      m_idle[bucket].push_back({buffer, m_returns++});
+      m_stats.idle_bytes += bucket;
+      return;
+    }
+    ++m_stats.discarded;
+  }
+  cv::fastFree(buffer);
+}
+
+void BufferPool::free_idle_down_to(size_t max_idle_bytes,
+                                   size_t kept_bucket) const {
+  // Free the least recently returned buffers first.  There are only a few
+  // buckets, so finding the oldest is cheap.
+  while (m_stats.idle_bytes > max_idle_bytes) {
+    auto oldest = m_idle.end();
+    for (auto iter = m_idle.begin(); iter != m_idle.end(); ++iter) {
+      if ((iter->first != kept_bucket) &&
+          ((oldest == m_idle.end()) ||
+           (iter->second.front().returned <
+            oldest->second.front().returned))) {
+        oldest = iter;
+      }
+    }
+    if (oldest == m_idle.end()) {
+      return;
+    }
+    cv::fastFree(oldest->second.front().buffer);
+    oldest->second.pop_front();
+    m_stats.idle_bytes -= oldest->first;
+    ++m_stats.discarded;
+    if (oldest->second.empty()) {
+      m_idle.erase(oldest);
+    }
+  }
+}
+
+} // namespace StackExposures
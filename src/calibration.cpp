@@ -0,0 +1,183 @@
+#include "calibration.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+
+#include <opencv2/core/utility.hpp>
+
+namespace StackExposures {
+namespace {
+
+constexpr float min_flat_signal = 1.0e-6F;
+
+// Each of these loops runs over contiguous floats with no branches in the
+// body, so that the compiler can vectorize it.
+template <typename Src>
+void calibrate_row(const Src *src, const float *offset, const float *gain,
+                   float *dest, int count) {
+  if ((offset != nullptr) && (gain != nullptr)) {
+    for (int i = 0; i < count; ++i) {
+      dest[i] = (static_cast<float>(src[i]) - offset[i]) * gain[i];
+    }
+  } else if (offset != nullptr) {
+    for (int i = 0; i < count; ++i) {
+      dest[i] = static_cast<float>(src[i]) - offset[i];
+    }
+  } else if (gain != nullptr) {
+    for (int i = 0; i < count; ++i) {
+      dest[i] = static_cast<float>(src[i]) * gain[i];
+    }
+  } else {
+    for (int i = 0; i < count; ++i) {
+      dest[i] = static_cast<float>(src[i]);
+    }
+  }
+}
+
+template <typename Src>
+void calibrate(const cv::Mat &src, const cv::Mat &offset, const cv::Mat &gain,
+               cv::Mat &dest) {
+  const int count = src.cols * src.channels();
+  cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &rows) {
+    for (int row = rows.start; row < rows.end; ++row) {
+      calibrate_row(src.ptr<Src>(row),
+                    offset.empty() ? nullptr : offset.ptr<float>(row),
+                    gain.empty() ? nullptr : gain.ptr<float>(row),
+                    dest.ptr<float>(row), count);
+    }
+  });
+}
+
+void calibrate_sensor_row(uint16_t *sensor, const float *black,
+                          const float *offset, const float *gain, int count) {
+  for (int i = 0; i < count; ++i) {
+    const float signal = static_cast<float>(sensor[i]) - offset[i];
+    sensor[i] = cv::saturate_cast<uint16_t>(signal * gain[i] + black[i]);
+  }
+}
+
+} // namespace
+
+Calibration::ConstPtr Calibration::create(const cv::Mat &offset,
+                                          const cv::Mat &gain,
+                                          bool sensor_domain) {
+  if (!offset.empty() && !gain.empty() &&
+      ((offset.size() != gain.size()) ||
+       (offset.channels() != gain.channels()))) {
+    throw std::runtime_error(
+        "Master flat and master dark/bias have different dimensions.");
+  }
+  return std::shared_ptr<const Calibration>(
+      new Calibration(offset, gain, sensor_domain));
+}
+
+Calibration::Calibration(cv::Mat offset, cv::Mat gain, bool sensor_domain)
+    : m_offset(std::move(offset)), m_gain(std::move(gain)),
+      m_sensor_domain(sensor_domain) {}
+
+cv::Mat Calibration::flat_gain(const cv::Mat &flat_signal) {
+  cv::Mat signal;
+  flat_signal.convertTo(signal, CV_MAKETYPE(CV_32F, flat_signal.channels()));
+
+  if (signal.channels() > 1) {
+    // Processed image:  normalize each color channel separately.
+    const auto means = cv::mean(signal);
+    std::vector<cv::Mat> channels;
+    cv::split(signal, channels);
+    for (size_t i = 0; i < channels.size(); ++i) {
+      channels[i] = means[static_cast<int>(i)] /
+                    cv::max(channels[i], min_flat_signal);
+    }
+    cv::Mat result;
+    cv::merge(channels, result);
+    return result;
+  }
+
+  // Bayer mosaic:  normalize each position of the 2x2 CFA block separately, so
+  // that the flat does not shift color balance.
+  std::array<double, 4> sums{};
+  std::array<size_t, 4> counts{};
+  for (int row = 0; row < signal.rows; ++row) {
+    const auto *values = signal.ptr<float>(row);
+    for (int col = 0; col < signal.cols; ++col) {
+      const auto phase = 2 * (row % 2) + (col % 2);
+      sums[phase] += values[col];
+      ++counts[phase];
+    }
+  }
+  cv::Mat result(signal.size(), CV_32FC1);
+  for (int row = 0; row < signal.rows; ++row) {
+    const auto *values = signal.ptr<float>(row);
+    auto *gains = result.ptr<float>(row);
+    for (int col = 0; col < signal.cols; ++col) {
+      const auto phase = 2 * (row % 2) + (col % 2);
+      const auto mean = static_cast<float>(sums[phase] / counts[phase]);
+      gains[col] = mean / std::max(values[col], min_flat_signal);
+    }
+  }
+  return result;
+}
+
+bool Calibration::sensor_domain() const { return m_sensor_domain; }
+
+cv::Size Calibration::size() const {
+  return m_offset.empty() ? m_gain.size() : m_offset.size();
+}
+
+void Calibration::check_size(const cv::Mat &image) const {
+  const auto &master = m_offset.empty() ? m_gain : m_offset;
+  if (master.empty()) {
+    return;
+  }
+  if ((image.size() != master.size()) ||
+      (image.channels() != master.channels())) {
+    std::ostringstream outs;
+    outs << "Cannot calibrate image: width x height (" << image.cols << " x "
+         << image.rows << ") do not match calibration frames (" << master.cols
+         << " x " << master.rows << ")";
+    throw std::runtime_error(outs.str());
+  }
+}
+
+cv::Mat Calibration::applied(const cv::Mat &image) const {
+  check_size(image);
+
+  cv::Mat result(image.size(), CV_MAKETYPE(CV_32F, image.channels()));
+  switch (image.depth()) {
+  case CV_8U:
+    calibrate<uint8_t>(image, m_offset, m_gain, result);
+    break;
+  case CV_16U:
+    calibrate<uint16_t>(image, m_offset, m_gain, result);
+    break;
+  case CV_32F:
+    calibrate<float>(image, m_offset, m_gain, result);
+    break;
+  default:
+    throw std::runtime_error("Cannot calibrate images of this pixel depth.");
+  }
+  return result;
+}
+
+void Calibration::apply_to_sensor(cv::Mat &sensor,
+                                  const cv::Mat &black_levels) const {
+  check_size(sensor);
+
+  // With no master dark or bias, the offset is just the black level.
+  const cv::Mat &offset = m_offset.empty() ? black_levels : m_offset;
+  const cv::Mat gain =
+      m_gain.empty() ? cv::Mat(sensor.size(), CV_32FC1, cv::Scalar(1.0))
+                     : m_gain;
+  cv::parallel_for_(cv::Range(0, sensor.rows), [&](const cv::Range &rows) {
+    for (int row = rows.start; row < rows.end; ++row) {
+      calibrate_sensor_row(sensor.ptr<uint16_t>(row),
+                           black_levels.ptr<float>(row), offset.ptr<float>(row),
+                           gain.ptr<float>(row), sensor.cols);
+    }
+  });
+}
+
+} // namespace StackExposures
@@ -0,0 +1,271 @@
+#include "calibration_builder.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+
+#include "async_image_loader.hpp"
+#include "content_hash.hpp"
+#include "image_stacker.hpp"
+#include "raw_stacker.hpp"
+#include "str_util.hpp"
+
+namespace StackExposures {
+namespace {
+
+// Masters are cached as a small header followed by the pixel data.
+constexpr uint32_t master_magic = 0x464d4553; // "SEMF"
+constexpr uint32_t master_version = 1;
+
+// How many exposures to examine, when looking for bad pixels in a session.
+constexpr size_t session_sample_size = 8;
+
+std::vector<std::filesystem::path>
+evenly_spaced(const std::vector<std::filesystem::path> &paths, size_t count) {
+  if (paths.size() <= count) {
+    return paths;
+  }
+  std::vector<std::filesystem::path> result;
+  for (size_t i = 0; i < count; ++i) {
+    result.push_back(paths[i * paths.size() / count]);
+  }
+  return result;
+}
+
+void write_master(const std::filesystem::path &path, const cv::Mat &image) {
+  std::error_code err;
+  std::filesystem::create_directories(path.parent_path(), err);
+
+  // Write to a private temporary file, then rename, so that concurrent runs
+  // never see a partially written master.
+  auto tmp_path(path);
+  tmp_path += StrUtil::temporary_suffix();
+  {
+    std::ofstream outs(tmp_path, std::ios::binary);
+    const int32_t header[] = {static_cast<int32_t>(master_magic),
+                              static_cast<int32_t>(master_version), image.rows,
+                              image.cols, image.type()};
+    outs.write(reinterpret_cast<const char *>(header), sizeof(header));
+    const auto row_bytes = static_cast<std::streamsize>(image.cols *
+                                                        image.elemSize());
+    for (int row = 0; row < image.rows; ++row) {
+      outs.write(image.ptr<char>(row), row_bytes);
+    }
+    if (!outs) {
+      std::cerr << "Could not cache calibration master " << path << std::endl;
+      std::filesystem::remove(tmp_path, err);
+      return;
+    }
+  }
+  std::filesystem::rename(tmp_path, path, err);
+  if (err) {
+    std::cerr << "Could not cache calibration master " << path << ": "
+              << err.message() << std::endl;
+    std::filesystem::remove(tmp_path, err);
+  }
+}
+
+cv::Mat read_master(const std::filesystem::path &path) {
+  std::ifstream ins(path, std::ios::binary);
+  if (!ins) {
+    return {};
+  }
+  int32_t header[5] = {};
+  ins.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!ins || (header[0] != static_cast<int32_t>(master_magic)) ||
+      (header[1] != static_cast<int32_t>(master_version)) ||
+      (header[2] <= 0) || (header[3] <= 0) ||
+      ((header[4] != CV_32FC1) && (header[4] != CV_32FC3))) {
+    return {};
+  }
+
+  // A truncated, or otherwise foreign, file is rebuilt rather than trusted.
+  const auto pixel_bytes = static_cast<uint64_t>(header[2]) *
+                           static_cast<uint64_t>(header[3]) *
+                           CV_ELEM_SIZE(header[4]);
+  std::error_code err;
+  const auto file_bytes = std::filesystem::file_size(path, err);
+  if (err || (file_bytes != sizeof(header) + pixel_bytes)) {
+    return {};
+  }
+  cv::Mat result(header[2], header[3], header[4]);
+  ins.read(result.ptr<char>(), static_cast<std::streamsize>(pixel_bytes));
+  if (!ins) {
+    return {};
+  }
+  return result;
+}
+
+} // namespace
+
+CalibrationBuilder::CalibrationBuilder(LoadOptions options, bool sensor_domain,
+                                       std::filesystem::path cache_dir)
+    : m_options(std::move(options)), m_sensor_domain(sensor_domain),
+      m_cache_dir(std::move(cache_dir)) {
+  // Calibration images themselves are loaded uncalibrated.
+  m_options.calibration = nullptr;
+}
+
+Calibration::ConstPtr
+CalibrationBuilder::build(const CalibrationFrames &frames) const {
+  if (frames.empty()) {
+    return nullptr;
+  }
+
+  auto build_async = [this](std::string_view kind, const auto &paths) {
+    return std::async(std::launch::async,
+                      [this, kind, &paths]() { return master(kind, paths); });
+  };
+  auto dark_future = build_async("dark", frames.darks);
+  auto bias_future = build_async("bias", frames.biases);
+  auto flat_future = build_async("flat", frames.flats);
+
+  const auto master_dark = dark_future.get();
+  const auto master_bias = bias_future.get();
+  const auto master_flat = flat_future.get();
+
+  // A master dark includes the bias, so subtract one or the other.
+  const auto offset = master_dark.empty() ? master_bias : master_dark;
+
+  cv::Mat gain;
+  if (!master_flat.empty()) {
+    cv::Mat flat_offset = master_bias;
+    if (flat_offset.empty() && m_sensor_domain) {
+      ImageLoader loader(m_options);
+      flat_offset = loader.load_cfa(frames.flats.front())->black_levels();
+    }
+    gain = Calibration::flat_gain(
+        flat_offset.empty() ? master_flat : cv::Mat(master_flat - flat_offset));
+  }
+  return Calibration::create(offset, gain, m_sensor_domain);
+}
+
+cv::Mat CalibrationBuilder::master(
+    std::string_view kind,
+    const std::vector<std::filesystem::path> &paths) const {
+  if (paths.empty()) {
+    return {};
+  }
+  if (m_cache_dir.empty()) {
+    return mean_of(paths);
+  }
+
+  const auto cached_path =
+      cache_path("master_" + std::string(kind), paths, ".semf");
+  auto result = read_master(cached_path);
+  if (result.empty()) {
+    result = mean_of(paths);
+    if (!result.empty()) {
+      write_master(cached_path, result);
+    }
+  }
+  return result;
+}
+
+BadPixelMap::ConstPtr CalibrationBuilder::bad_pixels(
+    const CalibrationFrames &frames,
+    const std::vector<std::filesystem::path> &exposures, double sigmas) const {
+  const bool from_darks = !frames.darks.empty();
+  const std::string kind(from_darks ? "dark" : "session");
+  const auto paths =
+      from_darks ? frames.darks : evenly_spaced(exposures, session_sample_size);
+  if (paths.empty()) {
+    return nullptr;
+  }
+
+  std::filesystem::path cached_path;
+  if (!m_cache_dir.empty()) {
+    const auto map_kind = "bad_pixels_" + kind + "_" + std::to_string(sigmas);
+    cached_path = cache_path(map_kind, paths, ".sebp");
+    if (auto result = BadPixelMap::load(cached_path)) {
+      return result;
+    }
+  }
+
+  BadPixelMap::ConstPtr result;
+  if (from_darks) {
+    const auto source = master(kind, paths);
+    if (source.empty()) {
+      return nullptr;
+    }
+    result = BadPixelMap::detect(source, m_sensor_domain, sigmas);
+  } else {
+    result = session_bad_pixels(paths, sigmas);
+    if (result == nullptr) {
+      std::cerr << "Cannot tell bad pixels from stars:  the exposures are "
+                   "not dithered.  Give dark images to find bad pixels."
+                << std::endl;
+      return nullptr;
+    }
+  }
+  std::cout << "Found " << result->indices().size() << " bad pixels."
+            << std::endl;
+  if (!cached_path.empty() && !result->save(cached_path)) {
+    std::cerr << "Could not cache bad pixel map " << cached_path << std::endl;
+  }
+  return result;
+}
+
+BadPixelMap::ConstPtr CalibrationBuilder::session_bad_pixels(
+    const std::vector<std::filesystem::path> &paths, double sigmas) const {
+  BadPixelMap::SessionDetector detector(m_sensor_domain, sigmas);
+  const auto add_all = [&detector](auto futures, const auto &image_of) {
+    for (auto &future : futures) {
+      try {
+        if (const auto loaded = future.get()) {
+          detector.add(image_of(*loaded));
+        }
+      } catch (std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+      }
+      future = {}; // Release each exposure once it has been examined.
+    }
+  };
+  if (m_sensor_domain) {
+    const auto loader = load_cfa_async(paths, m_options);
+    add_all(loader->take_futures(),
+            [](const CfaImage &image) { return image.visible; });
+  } else {
+    const auto loader = load_images_async(paths, m_options);
+    add_all(loader->take_futures(),
+            [](const ImageInfo &image) { return image.image(); });
+  }
+  return detector.result();
+}
+
+cv::Mat CalibrationBuilder::mean_of(
+    const std::vector<std::filesystem::path> &paths) const {
+  if (m_sensor_domain) {
+    const auto loader = load_cfa_async(paths, m_options);
+    RawStacker stacker(m_options);
+    return stacker.mean_cfa(loader->futures(), false);
+  }
+  const auto loader = load_images_async(paths, m_options);
+  const auto stacker = ImageStacker::create();
+  return stacker->stacked_result(loader->futures(), nullptr, false);
+}
+
+std::filesystem::path CalibrationBuilder::cache_path(
+    std::string_view kind, const std::vector<std::filesystem::path> &paths,
+    std::string_view extension) const {
+  // Key on everything that affects the master's pixels:  its inputs, their
+  // modification times, and how they are loaded.
+  ContentHash hash;
+  hash.add(kind).add(static_cast<uint64_t>(m_sensor_domain));
+  hash.add(static_cast<uint64_t>(m_options.half_size));
+  if (m_options.roi) {
+    const auto &roi = *m_options.roi;
+    for (const int coord : {roi.x, roi.y, roi.width, roi.height}) {
+      hash.add(static_cast<uint64_t>(coord));
+    }
+  }
+  for (const auto &path : paths) {
+    hash.add_file_stamp(path);
+  }
+  return m_cache_dir /
+         (std::string(kind) + "_" + hash.hex() + std::string(extension));
+}
+
+} // namespace StackExposures
@@ -0,0 +1,43 @@
+#include "content_hash.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+namespace StackExposures {
+namespace {
+constexpr uint64_t fnv_prime = 1099511628211ULL;
+} // namespace
+
+ContentHash &ContentHash::add(const void *data, size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    m_value = (m_value ^ bytes[i]) * fnv_prime;
+  }
+  return *this;
+}
+
+ContentHash &ContentHash::add(std::string_view s) {
+  // Include the length, so that ("ab", "c") and ("a", "bc") differ.
+  add(static_cast<uint64_t>(s.size()));
+  return add(s.data(), s.size());
+}
+
+ContentHash &ContentHash::add(uint64_t value) {
+  return add(&value, sizeof(value));
+}
+
+ContentHash &ContentHash::add_file_stamp(const std::filesystem::path &path) {
+  std::error_code err;
+  add(std::filesystem::absolute(path, err).string());
+  add(static_cast<uint64_t>(std::filesystem::file_size(path, err)));
+  const auto mtime = std::filesystem::last_write_time(path, err);
+  return add(static_cast<uint64_t>(mtime.time_since_epoch().count()));
+}
+
+std::string ContentHash::hex() const {
+  std::ostringstream outs;
+  outs << std::hex << std::setw(16) << std::setfill('0') << m_value;
+  return outs.str();
+}
+
+} // namespace StackExposures
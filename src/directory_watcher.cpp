@@ -0,0 +1,194 @@
+#include "directory_watcher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "str_util.hpp"
+
+namespace StackExposures {
+namespace {
+constexpr auto poll_interval = std::chrono::milliseconds(250);
+
+bool is_candidate(const std::filesystem::path &path) {
+  const auto name = path.filename().string();
+  if (name.empty() || (name.front() == '.')) {
+    return false;
+  }
+  static const std::array<std::string, 4> temporary_suffixes{
+      ".tmp", ".part", ".partial", ".crdownload"};
+  const auto ext = StrUtil::lowercase(path.extension().string());
+  return std::find(temporary_suffixes.begin(), temporary_suffixes.end(),
+                   ext) == temporary_suffixes.end();
+}
+} // namespace
+
+DirectoryWatcher::DirectoryWatcher(std::filesystem::path dir)
+    : m_dir(std::move(dir)) {
+  if (!std::filesystem::is_directory(m_dir)) {
+    throw std::runtime_error("Cannot watch '" + m_dir.string() +
+                             "': not a directory.");
+  }
+#ifdef __linux__
+  // Watch before listing, so no file can slip in between.
+  m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_inotify_fd >= 0) {
+    if (inotify_add_watch(m_inotify_fd, m_dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      close(m_inotify_fd);
+      m_inotify_fd = -1;
+    }
+  }
+#endif
+
+  // A file may still be being written when watching begins.  Count as
+  // existing only files whose size holds steady across two scans; report
+  // the rest later, once complete, like new files.
+  const auto first_sizes = file_sizes(list_files());
+  if (!first_sizes.empty()) {
+    std::this_thread::sleep_for(poll_interval);
+  }
+  for (const auto &[path, size] : file_sizes(list_files())) {
+    const auto first = first_sizes.find(path);
+    if ((first != first_sizes.end()) && (first->second == size)) {
+      m_existing.push_back(path);
+      m_reported.insert(path);
+      m_existing_sizes[path] = size;
+    } else {
+      m_sizes[path] = size;
+    }
+  }
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+#ifdef __linux__
+  if (m_inotify_fd >= 0) {
+    close(m_inotify_fd);
+  }
+#endif
+}
+
+std::vector<std::filesystem::path> DirectoryWatcher::list_files() const {
+  std::vector<std::filesystem::path> result;
+  for (const auto &entry : std::filesystem::directory_iterator(m_dir)) {
+    if (entry.is_regular_file() && is_candidate(entry.path())) {
+      result.push_back(entry.path());
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::map<std::filesystem::path, std::uintmax_t> DirectoryWatcher::file_sizes(
+    const std::vector<std::filesystem::path> &paths) {
+  std::map<std::filesystem::path, std::uintmax_t> result;
+  for (const auto &path : paths) {
+    std::error_code error;
+    const auto size = std::filesystem::file_size(path, error);
+    if (!error) {
+      result[path] = size;
+    }
+  }
+  return result;
+}
+
+std::vector<std::filesystem::path>
+DirectoryWatcher::wait(std::chrono::milliseconds timeout) {
+  auto result = (m_inotify_fd >= 0) ? wait_inotify(timeout) : poll(timeout);
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::vector<std::filesystem::path>
+DirectoryWatcher::wait_inotify(std::chrono::milliseconds timeout) {
+  std::vector<std::filesystem::path> result;
+#ifdef __linux__
+  pollfd pfd{m_inotify_fd, POLLIN, 0};
+  if (::poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0) {
+    return result;
+  }
+  alignas(inotify_event) std::array<char, 16384> buffer{};
+  for (;;) {
+    const auto num_read = read(m_inotify_fd, buffer.data(), buffer.size());
+    if (num_read <= 0) {
+      break;
+    }
+    for (ssize_t offset = 0; offset < num_read;) {
+      const auto *event =
+          reinterpret_cast<const inotify_event *>(buffer.data() + offset);
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      if ((event->len == 0) || ((event->mask & IN_ISDIR) != 0)) {
+        continue;
+      }
+      const auto path = m_dir / event->name;
+      if (!is_candidate(path)) {
+        continue;
+      }
+      // A file may be closed after writing more than once; report it once.
+      // But an existing file whose writer had merely paused at startup was
+      // reported incomplete, so report it again once it has grown.
+      if (m_reported.insert(path).second || changed_since_startup(path)) {
+        result.push_back(path);
+      }
+    }
+  }
+#else
+  (void)timeout;
+#endif
+  return result;
+}
+
+bool DirectoryWatcher::changed_since_startup(
+    const std::filesystem::path &path) {
+  const auto found = m_existing_sizes.find(path);
+  if (found == m_existing_sizes.end()) {
+    return false;
+  }
+  std::error_code error;
+  const auto size = std::filesystem::file_size(path, error);
+  if (error || (size == found->second)) {
+    return false;
+  }
+  m_existing_sizes.erase(found);
+  return true;
+}
+
+std::vector<std::filesystem::path>
+DirectoryWatcher::poll(std::chrono::milliseconds timeout) {
+  std::vector<std::filesystem::path> result;
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  for (;;) {
+    for (const auto &path : list_files()) {
+      if (m_reported.count(path) != 0) {
+        continue;
+      }
+      std::error_code error;
+      const auto size = std::filesystem::file_size(path, error);
+      if (error) {
+        continue;
+      }
+      // Report a file once its size is the same on two successive scans.
+      const auto found = m_sizes.find(path);
+      if ((found != m_sizes.end()) && (found->second == size)) {
+        m_sizes.erase(found);
+        m_reported.insert(path);
+        result.push_back(path);
+      } else {
+        m_sizes[path] = size;
+      }
+    }
+    if (!result.empty() || (std::chrono::steady_clock::now() >= deadline)) {
+      return result;
+    }
+    std::this_thread::sleep_for(poll_interval);
+  }
+}
+
+} // namespace StackExposures
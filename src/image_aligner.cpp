@@ -1,5 +1,9 @@
 #include "image_aligner.hpp"
+#include "alignment_cache.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
@@ -18,51 +22,230 @@ using namespace StackExposures;
 namespace StackExposures {
 
 namespace {
-void align_internal(const cv::Mat &ref, const cv::Mat &to_align,
-                    cv::Mat &aligned) {
+int ecc_motion_type(ImageAligner::Motion motion) {
+  switch (motion) {
+  case ImageAligner::Motion::translation:
+    return cv::MOTION_TRANSLATION;
+  case ImageAligner::Motion::affine:
+    return cv::MOTION_AFFINE;
+  default:
+    return cv::MOTION_EUCLIDEAN;
+  }
+}
+
+cv::Mat estimate_internal(const cv::Mat &ref, const cv::Mat &to_align,
+                          ImageAligner::Motion motion,
+                          double *correlation = nullptr) {
   // See
   // https://docs.opencv.org/4.6.0/dd/d93/samples_2cpp_2image_alignment_8cpp-example.html#a39
 
   using namespace cv;
 
   Mat ref_gray;
-  cvtColor(ref, ref_gray, COLOR_BGR2GRAY);
-
   Mat to_align_gray;
-  cvtColor(to_align, to_align_gray, COLOR_BGR2GRAY);
+  {
+    STACK_EXP_TRACE_SCOPE("cvtColor");
+    cvtColor(ref, ref_gray, COLOR_BGR2GRAY);
+    cvtColor(to_align, to_align_gray, COLOR_BGR2GRAY);
+  }
 
-  const auto warp_mode = MOTION_EUCLIDEAN;
   const int num_iterations = 200;
   const double termination_eps = 1.0e-5;
   Mat warp_matrix = Mat::eye(2, 3, CV_32F);
 
-  findTransformECC(ref_gray, to_align_gray, warp_matrix, warp_mode,
-                   TermCriteria(TermCriteria::COUNT + TermCriteria::EPS,
-                                num_iterations, termination_eps));
-  // Do the alignment.
-  aligned = Mat(to_align.rows, to_align.cols, CV_32FC3);
-  warpAffine(to_align, aligned, warp_matrix, aligned.size(),
-             INTER_LINEAR + WARP_INVERSE_MAP);
+  STACK_EXP_TRACE_SCOPE("findTransformECC");
+  const double rho = findTransformECC(
+      ref_gray, to_align_gray, warp_matrix, ecc_motion_type(motion),
+      TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, num_iterations,
+                   termination_eps));
+  if (correlation != nullptr) {
+    *correlation = rho;
+  }
+  return warp_matrix;
+}
+
+// WARP_INVERSE_MAP:  warps map ref coordinates to to_align coordinates.
+// OpenCV vectorizes each of these kernels.  Its Lanczos kernel spans 8 x 8
+// pixels.
+int warp_flags(ImageAligner::Interpolation interpolation) {
+  switch (interpolation) {
+  case ImageAligner::Interpolation::nearest:
+    return cv::INTER_NEAREST + cv::WARP_INVERSE_MAP;
+  case ImageAligner::Interpolation::lanczos:
+    return cv::INTER_LANCZOS4 + cv::WARP_INVERSE_MAP;
+  default:
+    return cv::INTER_LINEAR + cv::WARP_INVERSE_MAP;
+  }
+}
+
+cv::Mat cached_warp(const cv::Mat &ref, const cv::Mat &to_align,
+                    ImageAligner::Motion motion, AlignmentCache *cache,
+                    const std::string &ref_id, const std::string &frame_id) {
+  const bool cacheable =
+      (cache != nullptr) && !ref_id.empty() && !frame_id.empty();
+  cv::Mat warp_matrix;
+  if (cacheable) {
+    if (const auto entry = cache->find(ref_id, frame_id, motion)) {
+      warp_matrix = entry->warp;
+    }
+  }
+  if (warp_matrix.empty()) {
+    double correlation = 0.0;
+    warp_matrix = estimate_internal(ref, to_align, motion, &correlation);
+    if (cacheable) {
+      cache->store({ref_id, frame_id, motion, correlation, warp_matrix});
+    }
+  }
+  return warp_matrix;
+}
+
+// The part of a shifted image's extent that overlaps the image.  Outside it,
+// the shifted image is 0, as warpAffine's constant border would make it.
+cv::Rect shifted_extent(cv::Size size, cv::Point shift) {
+  return cv::Rect(-shift, size) & cv::Rect(cv::Point(), size);
+}
+
+void add_shifted(const cv::Mat &image, cv::Point shift, cv::Mat &sum) {
+  STACK_EXP_TRACE_SCOPE("add_shifted");
+  const auto extent = shifted_extent(image.size(), shift);
+  if (!extent.empty()) {
+    cv::Mat dest = sum(extent);
+    cv::add(dest, image(extent + shift), dest, cv::noArray(), sum.type());
+  }
+}
+
+void report_failure(const cv::Exception &e, const cv::Mat &ref,
+                    const cv::Mat &to_align) {
+  std::cerr << "Could not align images: " << e.what() << std::endl;
+  cv::imwrite("align_failed_ref.tiff", ref);
+  cv::imwrite("align_failed_to_align.tiff", to_align);
+}
+
+bool same_size(const cv::Mat &ref, const cv::Mat &to_align) {
+  if ((ref.cols != to_align.cols) || (ref.rows != to_align.rows)) {
+    std::cerr << "Cannot align images with different sizes." << std::endl;
+    return false;
+  }
+  return true;
 }
 
 } // namespace
 
+std::optional<ImageAligner::Interpolation>
+ImageAligner::parse_interpolation(std::string_view name) {
+  if (name == "nearest") {
+    return Interpolation::nearest;
+  }
+  if (name == "bilinear") {
+    return Interpolation::bilinear;
+  }
+  if (name == "lanczos") {
+    return Interpolation::lanczos;
+  }
+  return std::nullopt;
+}
+
 void ImageAligner::align(const cv::Mat &ref, const cv::Mat &to_align,
                          cv::Mat &aligned) {
+  align(ref, to_align, aligned, {}, {});
+}
 
-  if ((ref.cols != to_align.cols) || (ref.rows != to_align.rows)) {
-    std::cerr << "Cannot align images with different sizes." << std::endl;
+void ImageAligner::align(const cv::Mat &ref, const cv::Mat &to_align,
+                         cv::Mat &aligned, const std::string &ref_id,
+                         const std::string &frame_id) {
+  aligned = cv::Mat();
+  if (!same_size(ref, to_align)) {
+    return;
+  }
+  try {
+    const auto warp = cached_warp(ref, to_align, m_motion, m_cache.get(),
+                                  ref_id, frame_id);
+    if (const auto shift = integer_shift(warp, to_align.size())) {
+      STACK_EXP_TRACE_SCOPE("shift");
+      aligned = cv::Mat::zeros(to_align.size(), to_align.type());
+      const auto extent = shifted_extent(to_align.size(), *shift);
+      if (!extent.empty()) {
+        to_align(extent + *shift).copyTo(aligned(extent));
+      }
+    } else {
+      STACK_EXP_TRACE_SCOPE("warpAffine");
+      cv::warpAffine(to_align, aligned, warp, to_align.size(),
+                     warp_flags(m_interpolation));
+    }
+  } catch (cv::Exception &e) {
+    report_failure(e, ref, to_align);
     aligned = cv::Mat();
-  } else {
-    try {
-      align_internal(ref, to_align, aligned);
-    } catch (cv::Exception &e) {
-      std::cerr << "Could not align images: " << e.what() << std::endl;
-      cv::imwrite("align_failed_ref.tiff", ref);
-      cv::imwrite("align_failed_to_align.tiff", to_align);
-      aligned = cv::Mat();
+  }
+}
+
+bool ImageAligner::accumulate(const cv::Mat &ref, const cv::Mat &to_align,
+                              cv::Mat &sum, const std::string &ref_id,
+                              const std::string &frame_id) {
+  if (!same_size(ref, to_align)) {
+    return false;
+  }
+  try {
+    const auto warp = cached_warp(ref, to_align, m_motion, m_cache.get(),
+                                  ref_id, frame_id);
+    add_warped(to_align, warp, sum);
+    return true;
+  } catch (cv::Exception &e) {
+    report_failure(e, ref, to_align);
+  }
+  return false;
+}
+
+void ImageAligner::add_warped(const cv::Mat &image, const cv::Mat &warp,
+                              cv::Mat &sum) const {
+  if (const auto shift = integer_shift(warp, image.size())) {
+    add_shifted(image, *shift, sum);
+    return;
+  }
+  cv::Mat warped;
+  {
+    STACK_EXP_TRACE_SCOPE("warpAffine");
+    cv::warpAffine(image, warped, warp, image.size(),
+                   warp_flags(m_interpolation));
+  }
+  STACK_EXP_TRACE_SCOPE("accumulate");
+  cv::add(sum, warped, sum, cv::noArray(), sum.type());
+}
+
+std::optional<cv::Point> ImageAligner::integer_shift(const cv::Mat &warp,
+                                                     cv::Size size) {
+  cv::Mat_<double> m;
+  warp.convertTo(m, CV_64F);
+  const cv::Point shift(cvRound(m(0, 2)), cvRound(m(1, 2)));
+
+  // The warp is affine, so the pixels that stray furthest from the shift are
+  // at the corners.
+  const double right = std::max(0, size.width - 1);
+  const double bottom = std::max(0, size.height - 1);
+  for (const auto &corner : {cv::Point2d(0.0, 0.0), cv::Point2d(right, 0.0),
+                             cv::Point2d(0.0, bottom),
+                             cv::Point2d(right, bottom)}) {
+    const double dx = m(0, 0) * corner.x + m(0, 1) * corner.y + m(0, 2) -
+                      (corner.x + shift.x);
+    const double dy = m(1, 0) * corner.x + m(1, 1) * corner.y + m(1, 2) -
+                      (corner.y + shift.y);
+    if (std::hypot(dx, dy) > integer_shift_tolerance) {
+      return std::nullopt;
     }
   }
+  return shift;
+}
+
+cv::Mat ImageAligner::estimate(const cv::Mat &ref,
+                               const cv::Mat &to_align) const {
+  if (!same_size(ref, to_align)) {
+    return {};
+  }
+  try {
+    return estimate_internal(ref, to_align, m_motion);
+  } catch (cv::Exception &e) {
+    std::cerr << "Could not align images: " << e.what() << std::endl;
+  }
+  return {};
 }
 
 } // namespace StackExposures
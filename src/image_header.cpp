@@ -0,0 +1,456 @@
+#include "image_header.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core/utility.hpp>
+
+#include "libraw.h"
+#include "str_util.hpp"
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+
+// Random access to the fields of a header, in the header's byte order.
+class FieldReader {
+public:
+  FieldReader(std::istream &in, std::streamoff base, bool little_endian)
+      : m_in(in), m_base(base), m_little_endian(little_endian) {}
+
+  [[nodiscard]] uint16_t u16(std::streamoff offset) {
+    return static_cast<uint16_t>(unsigned_at(offset, 2));
+  }
+
+  [[nodiscard]] uint32_t u32(std::streamoff offset) {
+    return unsigned_at(offset, 4);
+  }
+
+  [[nodiscard]] std::string text(std::streamoff offset, size_t size) {
+    std::string result(size, '\0');
+    seek(offset);
+    if (!m_in.read(result.data(), static_cast<std::streamsize>(size))) {
+      throw std::runtime_error("Truncated header.");
+    }
+    return result;
+  }
+
+private:
+  std::istream &m_in;
+  const std::streamoff m_base;
+  const bool m_little_endian;
+
+  void seek(std::streamoff offset) {
+    m_in.clear();
+    m_in.seekg(m_base + offset);
+  }
+
+  [[nodiscard]] uint32_t unsigned_at(std::streamoff offset, size_t size) {
+    const auto bytes = text(offset, size);
+    uint32_t result = 0;
+    for (size_t i = 0; i < size; ++i) {
+      const auto byte = static_cast<uint8_t>(
+          bytes[m_little_endian ? (size - 1 - i) : i]);
+      result = (result << 8) | byte;
+    }
+    return result;
+  }
+};
+
+struct Fields {
+  cv::Size size;
+  uint32_t orientation{1};
+  double exposure{0.0};
+  double iso{0.0};
+  std::time_t timestamp{0};
+};
+
+// TIFF and Exif tags are described at
+// https://www.loc.gov/preservation/digital/formats/content/tiff_tags.shtml
+namespace Tiff {
+enum Tag : uint16_t {
+  width = 256,
+  height = 257,
+  orientation = 274,
+  exposure_time = 33434,
+  exif_ifd = 34665,
+  iso = 34855,
+  date_time_original = 36867,
+};
+
+enum Type : uint16_t { ascii = 2, short_int = 3, rational = 5 };
+
+constexpr size_t entry_size = 12;
+constexpr size_t date_time_size = 19; // "YYYY:MM:DD HH:MM:SS"
+} // namespace Tiff
+
+// Exif times have no time zone; like LibRaw, take them as local times.
+std::time_t parse_date_time(const std::string &text) {
+  std::tm when{};
+  std::istringstream ins(text);
+  ins >> std::get_time(&when, "%Y:%m:%d %H:%M:%S");
+  if (ins.fail()) {
+    return 0;
+  }
+  when.tm_isdst = -1;
+  const auto result = std::mktime(&when);
+  return (result < 0) ? 0 : result;
+}
+
+void read_ifd(FieldReader &fields, uint32_t offset, Fields &result,
+              bool is_exif = false) {
+  const auto count = fields.u16(offset);
+  for (uint16_t i = 0; i < count; ++i) {
+    const std::streamoff entry = offset + 2 + (Tiff::entry_size * i);
+    const auto type = fields.u16(entry + 2);
+    const auto value_count = fields.u32(entry + 4);
+    const std::streamoff value = entry + 8;
+    const auto integer = [&]() -> uint32_t {
+      return (type == Tiff::short_int) ? fields.u16(value) : fields.u32(value);
+    };
+
+    switch (fields.u16(entry)) {
+    case Tiff::width:
+      result.size.width = static_cast<int>(integer());
+      break;
+    case Tiff::height:
+      result.size.height = static_cast<int>(integer());
+      break;
+    case Tiff::orientation:
+      result.orientation = integer();
+      break;
+    case Tiff::exif_ifd:
+      if (!is_exif) {
+        read_ifd(fields, integer(), result, true);
+      }
+      break;
+    case Tiff::exposure_time:
+      if (type == Tiff::rational) {
+        const auto at = fields.u32(value);
+        const auto denominator = fields.u32(at + 4);
+        if (denominator != 0) {
+          result.exposure = static_cast<double>(fields.u32(at)) / denominator;
+        }
+      }
+      break;
+    case Tiff::iso:
+      result.iso = integer();
+      break;
+    case Tiff::date_time_original:
+      if ((type == Tiff::ascii) && (value_count > Tiff::date_time_size)) {
+        result.timestamp = parse_date_time(
+            fields.text(fields.u32(value), Tiff::date_time_size));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// A TIFF structure, starting at base:  a TIFF file, or a JPEG's Exif data.
+Fields read_tiff(std::istream &in, std::streamoff base) {
+  FieldReader order(in, base, true);
+  const auto byte_order = order.text(0, 2);
+  if ((byte_order != "II") && (byte_order != "MM")) {
+    throw std::runtime_error("Not a TIFF header.");
+  }
+  FieldReader fields(in, base, byte_order == "II");
+  if (fields.u16(2) != 42) {
+    throw std::runtime_error("Not a TIFF header.");
+  }
+  Fields result;
+  read_ifd(fields, fields.u32(4), result);
+  return result;
+}
+
+Fields read_png(std::istream &in) {
+  FieldReader fields(in, 0, false);
+  if (fields.text(12, 4) != "IHDR") {
+    throw std::runtime_error("Invalid PNG header.");
+  }
+  Fields result;
+  result.size = cv::Size(static_cast<int>(fields.u32(16)),
+                         static_cast<int>(fields.u32(20)));
+  return result;
+}
+
+// JPEG markers are described at https://www.w3.org/Graphics/JPEG/itu-t81.pdf
+Fields read_jpeg(std::istream &in) {
+  constexpr uint8_t app1 = 0xE1;
+  constexpr uint8_t start_of_scan = 0xDA;
+  constexpr uint8_t end_of_image = 0xD9;
+
+  FieldReader fields(in, 0, false);
+  Fields result;
+  std::streamoff offset = 2;
+  while (true) {
+    const auto marker = fields.u16(offset);
+    const auto code = static_cast<uint8_t>(marker & 0xFF);
+    if (((marker >> 8) != 0xFF) || (code == start_of_scan) ||
+        (code == end_of_image)) {
+      break;
+    }
+    if (code == 0xFF) { // Fill byte
+      ++offset;
+      continue;
+    }
+    const auto length = fields.u16(offset + 2);
+    // SOF0...SOF15, other than DHT (C4), JPG (C8) and DAC (CC)
+    const bool start_of_frame = (code >= 0xC0) && (code <= 0xCF) &&
+                                (code != 0xC4) && (code != 0xC8) &&
+                                (code != 0xCC);
+    if (start_of_frame) {
+      result.size = cv::Size(fields.u16(offset + 7), fields.u16(offset + 5));
+      break;
+    }
+    if ((code == app1) &&
+        (fields.text(offset + 4, 6) == std::string("Exif\0\0", 6))) {
+      try {
+        const auto exif = read_tiff(in, offset + 10);
+        result.orientation = exif.orientation;
+        result.exposure = exif.exposure;
+        result.iso = exif.iso;
+        result.timestamp = exif.timestamp;
+      } catch (const std::runtime_error &) {
+        // Use the frame size alone.
+      }
+    }
+    offset += 2 + length;
+  }
+  // cv::imread turns JPEGs upright, per their Exif orientation.
+  if ((result.orientation >= 5) && (result.orientation <= 8)) {
+    result.size = cv::Size(result.size.height, result.size.width);
+  }
+  return result;
+}
+
+// Identify a raw image without unpacking it.
+ImageHeader read_raw(const std::filesystem::path &path) {
+  ImageHeader result{path};
+  const auto processor = std::make_unique<LibRaw>();
+  if (processor->open_file(path.c_str()) != LIBRAW_SUCCESS) {
+    return result;
+  }
+  const auto &sizes = processor->imgdata.sizes;
+  result.size = cv::Size(sizes.width, sizes.height);
+  // Flips 5 and 6 turn the image on its side.
+  if ((sizes.flip & 4) != 0) {
+    result.size = cv::Size(sizes.height, sizes.width);
+  }
+  if (processor->imgdata.idata.filters != 0) {
+    result.sensor_size = cv::Size(sizes.raw_width, sizes.raw_height);
+  }
+  const auto &other = processor->imgdata.other;
+  result.exposure = other.shutter;
+  result.iso = other.iso_speed;
+  result.timestamp = other.timestamp;
+  return result;
+}
+
+bool is_tiff_extension(const std::filesystem::path &path) {
+  const auto ext = StrUtil::lowercase(path.extension().string());
+  return (ext == ".tif") || (ext == ".tiff");
+}
+
+} // namespace
+
+ImageHeader ImageHeader::read(const std::filesystem::path &path) {
+  STACK_EXP_TRACE_SCOPE("header");
+  std::ifstream in(path, std::ios::binary);
+  std::array<char, 8> magic{};
+  if (!in.read(magic.data(), magic.size())) {
+    return {path};
+  }
+  const std::string_view signature(magic.data(), magic.size());
+
+  try {
+    std::optional<Fields> fields;
+    if (signature == std::string_view("\x89PNG\r\n\x1A\n", 8)) {
+      fields = read_png(in);
+    } else if (signature.substr(0, 2) == "\xFF\xD8") {
+      fields = read_jpeg(in);
+    } else if (is_tiff_extension(path)) {
+      // Many raw formats are TIFF-based, so trust the extension to tell
+      // TIFFs, which ImageLoader decodes with OpenCV, from raw images.
+      fields = read_tiff(in, 0);
+    }
+    if (!fields) {
+      return read_raw(path);
+    }
+    ImageHeader result{path};
+    result.size = fields->size;
+    result.exposure = fields->exposure;
+    result.iso = fields->iso;
+    result.timestamp = fields->timestamp;
+    return result;
+  } catch (const std::runtime_error &) {
+    return {path};
+  }
+}
+
+cv::Size ImageHeader::loaded_size(const LoadOptions &options) const {
+  if (!known()) {
+    return {};
+  }
+  auto result = size;
+  if (options.half_size) {
+    result = cv::Size((result.width + 1) / 2, (result.height + 1) / 2);
+  }
+  if (options.roi) {
+    result = (*options.roi & cv::Rect(cv::Point(), result)).size();
+  }
+  return result;
+}
+
+size_t ImageHeader::loaded_bytes(const LoadOptions &options) const {
+  const auto loaded = loaded_size(options);
+  if (loaded.empty()) {
+    return 0;
+  }
+  // Calibrated images are floating point; others keep 8-bit samples.
+  size_t sample_bytes = 1;
+  const auto &calibration = options.calibration;
+  if ((calibration != nullptr) && !calibration->sensor_domain()) {
+    sample_bytes = options.half_float ? 2 : 4;
+  }
+  return static_cast<size_t>(loaded.width) * loaded.height * 3 *
+         sample_bytes;
+}
+
+size_t ImageHeader::cfa_bytes() const {
+  return static_cast<size_t>(sensor_size.width) * sensor_size.height *
+         sizeof(uint16_t);
+}
+
+std::vector<ImageHeader>
+read_headers(const std::vector<std::filesystem::path> &paths) {
+  STACK_EXP_TRACE_SCOPE("read_headers");
+  std::vector<ImageHeader> result(paths.size());
+  cv::parallel_for_(cv::Range(0, static_cast<int>(paths.size())),
+                    [&](const cv::Range &range) {
+                      for (int i = range.start; i < range.end; ++i) {
+                        result[i] = ImageHeader::read(paths[i]);
+                      }
+                    });
+  return result;
+}
+
+std::vector<ImageHeader>
+same_size_headers(const std::vector<ImageHeader> &headers,
+                  const LoadOptions &options) {
+  // The most common size; of equally common sizes, the first seen.
+  std::map<std::pair<int, int>, size_t> counts;
+  for (const auto &header : headers) {
+    if (header.known()) {
+      const auto loaded = header.loaded_size(options);
+      ++counts[{loaded.width, loaded.height}];
+    }
+  }
+  cv::Size common;
+  size_t most = 0;
+  for (const auto &header : headers) {
+    if (!header.known()) {
+      continue;
+    }
+    const auto loaded = header.loaded_size(options);
+    const auto count = counts[{loaded.width, loaded.height}];
+    if (count > most) {
+      most = count;
+      common = loaded;
+    }
+  }
+
+  std::vector<ImageHeader> result;
+  for (const auto &header : headers) {
+    const auto loaded = header.loaded_size(options);
+    if (header.known() && (loaded != common)) {
+      std::cerr << "Skipping " << header.path.string()
+                << ": image width x height (" << loaded.width << " x "
+                << loaded.height << ") do not match most images ("
+                << common.width << " x " << common.height << ")"
+                << std::endl;
+      continue;
+    }
+    result.push_back(header);
+  }
+  return result;
+}
+
+std::string settings_warning(const std::vector<ImageHeader> &headers) {
+  // Allow for rounding, e.g., of 1/3 s.
+  constexpr double tolerance = 1.01;
+  // A gap between exposures that suggests another session:  in seconds, and
+  // as a multiple of the median gap.
+  constexpr double min_session_gap = 60.0 * 60.0;
+  constexpr double session_gap_ratio = 10.0;
+
+  std::ostringstream outs;
+  const auto check = [&](const char *what, const char *unit, auto setting) {
+    double lowest = 0.0;
+    double highest = 0.0;
+    for (const auto &header : headers) {
+      const double value = setting(header);
+      if (value > 0.0) {
+        lowest = (lowest > 0.0) ? std::min(lowest, value) : value;
+        highest = std::max(highest, value);
+      }
+    }
+    if (highest > lowest * tolerance) {
+      if (outs.tellp() > 0) {
+        outs << "  ";
+      }
+      outs << what << " ranges from " << lowest << unit << " to " << highest
+           << unit << ".";
+    }
+  };
+  check("Exposure time", " s", [](const auto &h) { return h.exposure; });
+  check("ISO", "", [](const auto &h) { return h.iso; });
+
+  // The longest gap between capture times, compared with the usual one.
+  std::vector<std::pair<std::time_t, const ImageHeader *>> taken;
+  for (const auto &header : headers) {
+    if (header.timestamp != 0) {
+      taken.emplace_back(header.timestamp, &header);
+    }
+  }
+  if (taken.size() >= 3) {
+    std::sort(taken.begin(), taken.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::vector<double> gaps;
+    for (size_t i = 1; i < taken.size(); ++i) {
+      gaps.push_back(std::difftime(taken[i].first, taken[i - 1].first));
+    }
+    const auto longest = std::max_element(gaps.begin(), gaps.end());
+    const auto longest_gap = *longest;
+    const auto *after =
+        taken[static_cast<size_t>(longest - gaps.begin()) + 1].second;
+    const auto median = gaps.begin() + static_cast<long>(gaps.size() / 2);
+    std::nth_element(gaps.begin(), median, gaps.end());
+    if ((longest_gap >= min_session_gap) &&
+        (longest_gap > session_gap_ratio * *median)) {
+      if (outs.tellp() > 0) {
+        outs << "  ";
+      }
+      outs << "Exposures pause for " << std::lround(longest_gap / 60.0)
+           << " min before " << after->path.string()
+           << "; some may be from another session.";
+    }
+  }
+  return outs.str();
+}
+
+} // namespace StackExposures
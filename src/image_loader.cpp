@@ -1,12 +1,16 @@
 #include "image_loader.hpp"
+#include "trace.hpp"
 
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 
 namespace StackExposures {
 namespace {
-void configure(LibRawSharedPtr processor) {
+void configure(LibRawSharedPtr processor, const LoadOptions &options) {
   // Adjust processing of raw images.
   // NB: don't muck with bit depth.  Load with default 8-bits / color component,
   // to match cv::imread defaults.
@@ -20,16 +24,43 @@ void configure(LibRawSharedPtr processor) {
   processor->imgdata.params.gamm[1] = 1.0;    // 12.92;
   processor->imgdata.params.no_auto_bright = 1;
 
+  // half_size skips demosaicing entirely:  each 2x2 Bayer block becomes one
+  // output pixel.
+  processor->imgdata.params.half_size = options.half_size ? 1 : 0;
+
   // TODO - ARW-specific parameters, e.g., to suppress posterization
   // in shadows of Sony RAW images.
   // See https://www.libraw.org/docs/API-datastruct.html#libraw_output_params_t
   // and search for sony_arw2_posterization_thr
 }
 
+// The black level LibRaw will subtract from each pixel of a visible area of the
+// given size.
+[[nodiscard]] cv::Mat sensor_black_levels(LibRaw &processor,
+                                          const cv::Size &size) {
+  const auto &color = processor.imgdata.color;
+  cv::Mat tile(2, 2, CV_32FC1);
+  for (int row = 0; row < 2; ++row) {
+    for (int col = 0; col < 2; ++col) {
+      const auto channel = processor.COLOR(row, col);
+      tile.at<float>(row, col) =
+          static_cast<float>(color.black + color.cblack[channel]);
+    }
+  }
+  cv::Mat result;
+  cv::repeat(tile, (size.height + 1) / 2, (size.width + 1) / 2, result);
+  return result(cv::Rect(0, 0, size.width, size.height)).clone();
+}
+
 } // namespace
 
-ImageLoader::ImageLoader() : m_processor(std::make_shared<LibRaw>()) {
-  configure(m_processor);
+cv::Mat CfaImage::black_levels() const {
+  return sensor_black_levels(*processor, visible.size());
+}
+
+ImageLoader::ImageLoader(LoadOptions options)
+    : m_options(std::move(options)), m_processor(std::make_shared<LibRaw>()) {
+  configure(m_processor, m_options);
 }
 
 void ImageLoader::check(int status, const std::string &msg) {
@@ -50,32 +81,242 @@ void ImageLoader::check(int status, const std::string &msg) {
   }
 }
 
+cv::Mat ImageLoader::cropped(const cv::Mat &image, const cv::Rect &roi) const {
+  const auto clipped = roi & cv::Rect(0, 0, image.cols, image.rows);
+  if (clipped.empty()) {
+    std::ostringstream outs;
+    outs << "Region of interest " << roi << " lies outside the "
+         << image.cols << " x " << image.rows << " image.";
+    throw std::runtime_error(outs.str());
+  }
+  // Copy, so the full-size decode buffer can be released right away.
+  return image(clipped).clone();
+}
+
 ImageInfo::SharedPtr
 ImageLoader::load_image(const std::filesystem::path &image_path) {
-  cv::Mat image = cv::imread(image_path.c_str());
+  const int flags =
+      m_options.half_size ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_COLOR;
+  cv::Mat image;
+  {
+    STACK_EXP_TRACE_SCOPE("decode");
+    image = cv::imread(image_path.c_str(), flags);
+  }
   if (image.data != nullptr) {
-    return ImageInfo::from_file(image_path, image);
+    if (uses_sensor_data()) {
+      throw std::runtime_error("Cannot apply sensor calibration to " +
+                               image_path.string() + ": not a raw image.");
+    }
+    if (m_options.roi) {
+      image = cropped(image, *m_options.roi);
+    }
+    return ImageInfo::from_file(image_path, finished(image));
   }
   return load_raw_image(image_path);
 }
 
 ImageInfo::SharedPtr
-ImageLoader::load_raw_image(const std::filesystem::path &image_path) {
-  // Consider adjusting m_processor differently when it appears that a Sony ARW
-  // image is being loaded.
-  check(m_processor->open_file(image_path.c_str()), "Could not open file");
-  check(m_processor->unpack(), "Could not unpack");
-  check(m_processor->dcraw_process(),
-        "dcraw_process"); // This is what Rawpy uses.
+ImageLoader::load_frame(const cv::Mat &frame,
+                        const std::filesystem::path &source) {
+  if (uses_sensor_data()) {
+    throw std::runtime_error("Cannot apply sensor calibration to frames of " +
+                             source.string() + ": not a raw image.");
+  }
+  cv::Mat image = frame;
+  if (m_options.half_size) {
+    STACK_EXP_TRACE_SCOPE("half_size");
+    cv::resize(frame, image, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+  }
+  if (m_options.roi) {
+    image = cropped(image, *m_options.roi);
+  }
+  return ImageInfo::from_file(source, finished(image));
+}
+
+bool ImageLoader::uses_sensor_data() const {
+  const auto &calibration = m_options.calibration;
+  const auto &bad_pixels = m_options.bad_pixels;
+  return ((calibration != nullptr) && calibration->sensor_domain()) ||
+         ((bad_pixels != nullptr) && bad_pixels->cfa());
+}
+
+bool ImageLoader::uses_processed_data() const {
+  const auto &calibration = m_options.calibration;
+  const auto &bad_pixels = m_options.bad_pixels;
+  return ((calibration != nullptr) && !calibration->sensor_domain()) ||
+         ((bad_pixels != nullptr) && !bad_pixels->cfa());
+}
+
+cv::Mat ImageLoader::finished(cv::Mat image) const {
+  STACK_EXP_TRACE_SCOPE("calibrate");
+  const auto &calibration = m_options.calibration;
+  if ((calibration != nullptr) && !calibration->sensor_domain()) {
+    image = calibration->applied(image);
+  }
+  const auto &bad_pixels = m_options.bad_pixels;
+  if ((bad_pixels != nullptr) && !bad_pixels->cfa()) {
+    bad_pixels->repair(image);
+  }
+  if (m_options.half_float && (image.depth() == CV_32F)) {
+    STACK_EXP_TRACE_SCOPE("to_half");
+    cv::Mat half;
+    image.convertTo(half, CV_MAKETYPE(CV_16F, image.channels()));
+    return half;
+  }
+  return image;
+}
+
+cv::Mat ImageLoader::visible_sensor_data() const {
+  const auto &sizes = m_processor->imgdata.sizes;
+  auto *raw_image = m_processor->imgdata.rawdata.raw_image;
+  if ((raw_image == nullptr) || (m_processor->imgdata.idata.filters == 0)) {
+    return {};
+  }
+
+  // Reference LibRaw's buffer.
+  const cv::Mat sensor(sizes.raw_height, sizes.raw_width, CV_16UC1,
+                       (void *)raw_image, sizes.raw_pitch);
+  const cv::Rect visible_area(sizes.left_margin, sizes.top_margin, sizes.width,
+                              sizes.height);
+  return sensor(visible_area);
+}
+
+void ImageLoader::prepare_sensor_data() {
+  if (!uses_sensor_data()) {
+    return;
+  }
+  STACK_EXP_TRACE_SCOPE("raw.calibrate");
+  cv::Mat sensor = visible_sensor_data();
+  if (sensor.empty()) {
+    throw std::runtime_error(
+        "Cannot apply sensor calibration: not a Bayer raw image.");
+  }
+  const auto &calibration = m_options.calibration;
+  if ((calibration != nullptr) && calibration->sensor_domain()) {
+    calibration->apply_to_sensor(
+        sensor, sensor_black_levels(*m_processor, sensor.size()));
+  }
+  // Repair after calibration, so that dark subtraction has a chance to fix
+  // the pixels first.
+  const auto &bad_pixels = m_options.bad_pixels;
+  if ((bad_pixels != nullptr) && bad_pixels->cfa()) {
+    bad_pixels->repair(sensor);
+  }
+}
+
+bool ImageLoader::request_raw_crop(bool enable) {
+  auto &params = m_processor->imgdata.params;
+#if LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0, 20)
+  for (auto &coord : params.cropbox) {
+    coord = 0;
+  }
+  // cropbox is expressed in unrotated, full-resolution sensor coordinates.
+  // Rather than translate the ROI through the camera's flip, crop after
+  // processing when the image is rotated.
+  if (!enable || !m_options.roi || (m_processor->imgdata.sizes.flip != 0)) {
+    return false;
+  }
+  const int scale = m_options.half_size ? 2 : 1;
+  const auto &roi = *m_options.roi;
+  params.cropbox[0] = roi.x * scale;
+  params.cropbox[1] = roi.y * scale;
+  params.cropbox[2] = roi.width * scale;
+  params.cropbox[3] = roi.height * scale;
+  return true;
+#else
+  (void)params;
+  (void)enable;
+  return false;
+#endif
+}
+
+ImageInfo::SharedPtr
+ImageLoader::processed(LibRawSharedPtr processor,
+                       const std::filesystem::path &image_path,
+                       bool raw_cropped) {
+  {
+    STACK_EXP_TRACE_SCOPE("raw.dcraw_process");
+    check(processor->dcraw_process(),
+          "dcraw_process"); // This is what Rawpy uses.
+  }
 
   // Can LibRaw do the right thing with raw images having > 10 bits / channel?
   int status = 0;
-  libraw_processed_image_t *img = m_processor->dcraw_make_mem_image(&status);
+  libraw_processed_image_t *img = nullptr;
+  {
+    STACK_EXP_TRACE_SCOPE("raw.make_mem_image");
+    img = processor->dcraw_make_mem_image(&status);
+  }
   check(status, "dcraw_make_mem_image");
   assert(img);
   assert(img->type == LIBRAW_IMAGE_BITMAP);
 
-  return ImageInfo::from_raw_file(m_processor, image_path, img);
+  auto result = ImageInfo::from_raw_file(processor, image_path, img);
+  cv::Mat image = result->image();
+  if (m_options.roi) {
+    // LibRaw may round the crop box to whole CFA blocks.  Trim any excess.
+    const auto &roi = *m_options.roi;
+    const auto wanted =
+        raw_cropped ? cv::Rect(0, 0, roi.width, roi.height) : roi;
+    image = cropped(image, wanted);
+  }
+  image = finished(image);
+  if (image.data == result->image().data) {
+    return result;
+  }
+  // Release LibRaw's copy of the image.
+  return ImageInfo::from_file(image_path, image);
+}
+
+ImageInfo::SharedPtr
+ImageLoader::load_raw_image(const std::filesystem::path &image_path) {
+  // Consider adjusting m_processor differently when it appears that a Sony ARW
+  // image is being loaded.
+  {
+    STACK_EXP_TRACE_SCOPE("raw.open");
+    check(m_processor->open_file(image_path.c_str()), "Could not open file");
+  }
+  // Crop before unpacking, so LibRaw processes only the requested pixels.
+  const bool raw_cropped = request_raw_crop(true);
+  {
+    STACK_EXP_TRACE_SCOPE("raw.unpack");
+    check(m_processor->unpack(), "Could not unpack");
+  }
+  prepare_sensor_data();
+  return processed(m_processor, image_path, raw_cropped);
+}
+
+CfaImage::SharedPtr
+ImageLoader::load_cfa(const std::filesystem::path &image_path) {
+  {
+    STACK_EXP_TRACE_SCOPE("raw.open");
+    check(m_processor->open_file(image_path.c_str()), "Could not open file");
+  }
+  // Frames are shifted before they are summed, so crop only after the final
+  // demosaic.
+  request_raw_crop(false);
+  {
+    STACK_EXP_TRACE_SCOPE("raw.unpack");
+    check(m_processor->unpack(), "Could not unpack");
+  }
+
+  const auto sensor = visible_sensor_data();
+  if (sensor.empty()) {
+    throw std::runtime_error("Cannot stack " + image_path.string() +
+                             " as sensor data: not a Bayer raw image.");
+  }
+  if (uses_processed_data()) {
+    throw std::runtime_error("Stacking sensor data requires sensor-domain "
+                             "calibration frames and bad pixel maps.");
+  }
+  prepare_sensor_data();
+
+  // The result keeps m_processor, which owns the sensor data, alive.
+  return std::make_shared<CfaImage>(CfaImage{image_path, m_processor, sensor});
+}
+
+ImageInfo::SharedPtr ImageLoader::process_cfa(const CfaImage &image) {
+  return processed(image.processor, image.path, false);
 }
 
 } // namespace StackExposures
\ No newline at end of file
@@ -1,14 +1,19 @@
 #include "image_stacker.hpp"
+#include "trace.hpp"
 
 namespace StackExposures {
 namespace {
 
 constexpr auto image_dtype = CV_32FC3;
 
+// Images are widened to image_dtype only when they are used, so that images
+// stored as CV_16F or 8-bit integers stay small while they wait.  OpenCV
+// vectorizes the conversion, using F16C for CV_16F where available.
 [[nodiscard]] cv::Mat stackable(const cv::Mat &image) {
   if (image.type() == image_dtype) {
     return image;
   }
+  STACK_EXP_TRACE_SCOPE("stackable");
 
   cv::Mat result;
   image.convertTo(result, image_dtype);
@@ -18,14 +23,17 @@ constexpr auto image_dtype = CV_32FC3;
 struct StackedImage {
   cv::Mat m_image;
   size_t m_num_used{0}; // number of images used to compute m_image
+  std::string m_id;     // identifies the images in m_image; may be empty
 
   StackedImage() = default;
 
-  StackedImage(const cv::Mat &image, size_t num_used)
-      : m_image(stackable(image)), m_num_used(num_used) {}
+  StackedImage(const cv::Mat &image, size_t num_used, std::string id)
+      : m_image(stackable(image)), m_num_used(num_used), m_id(std::move(id)) {
+  }
 
-  StackedImage(const cv::Mat &single_image)
-      : m_image(stackable(single_image)), m_num_used(1) {}
+  StackedImage(const cv::Mat &single_image, std::string id = {})
+      : m_image(stackable(single_image)), m_num_used(1), m_id(std::move(id)) {
+  }
 
   [[nodiscard]] bool succeeded() const {
     return (m_num_used > 0) && !m_image.empty();
@@ -37,15 +45,58 @@ struct StackedImage {
   }
 };
 
-struct Impl : public ImageStacker {
+// Images held by the stacker at its peak:  two partial stacks, the next image
+// (converted for stacking), and that image aligned.
+constexpr size_t working_images = 4;
+
+// State of one stacked_result call, so that concurrent calls on one stacker
+// don't interfere.
+struct StackCall {
+  // The identities of the images being stacked, indexed like the futures
+  // that start at first_future.
+  std::vector<std::string> frame_ids;
+  const ImageInfoFuture *first_future{nullptr};
+
+  // Charged for the stacker's working images; returned to the budget when
+  // the call ends, however it ends.
+  MemoryBudget::ReservationPtr working_memory{};
+
+  [[nodiscard]] const std::string &id_of(const ImageInfoFuture &future) const {
+    return frame_ids[static_cast<size_t>(&future - first_future)];
+  }
+};
+
+// Take an image from its future, so that the image is released as soon as the
+// caller is done with it.
+[[nodiscard]] ImageInfo::SharedPtr take(ImageInfoFuture &future) {
+  STACK_EXP_TRACE_SCOPE("wait_for_load");
+  auto result = future.get();
+  future = {};
+  return result;
+}
 
-  Impl() = default;
+struct Impl : public ImageStacker {
 
-  [[nodiscard]] cv::Mat stacked_result(const ImageInfoFutureContainer &images,
-                                       ImageInfo::SharedPtr dark_image,
-                                       bool align) const override {
-    auto result = process_all(images, align);
+  Impl(MemoryBudget::SharedPtr budget,
+       AlignmentCache::SharedPtr alignment_cache,
+       ImageAligner::Interpolation interpolation)
+      : m_budget(std::move(budget)),
+        m_alignment_cache(std::move(alignment_cache)),
+        m_interpolation(interpolation) {}
+
+  [[nodiscard]] cv::Mat
+  stacked_result(ImageInfoFutureContainer images,
+                 ImageInfo::SharedPtr dark_image, bool align,
+                 const std::vector<std::string> &frame_ids) const override {
+    StackCall call;
+    call.frame_ids = (frame_ids.size() == images.size())
+                         ? frame_ids
+                         : std::vector<std::string>(images.size());
+    call.first_future = images.data();
+    auto result = process_all(call, images, align);
+    call.working_memory.reset();
     if (result.succeeded()) {
+      STACK_EXP_TRACE_SCOPE("finalize");
       cv::Mat mean = result.m_image / result.m_num_used;
       if (dark_image != nullptr) {
         return darkened(mean, dark_image->image());
@@ -56,6 +107,20 @@ struct Impl : public ImageStacker {
   }
 
 private:
+  MemoryBudget::SharedPtr m_budget;
+  AlignmentCache::SharedPtr m_alignment_cache;
+  ImageAligner::Interpolation m_interpolation;
+
+  void charge_working_memory(StackCall &call, const ImageInfo &image) const {
+    if ((m_budget != nullptr) && (call.working_memory == nullptr)) {
+      // The stacker cannot make progress without this memory, so don't wait
+      // for it.  Loads wait instead.
+      const auto image_bytes =
+          image.rows() * image.cols() * CV_ELEM_SIZE(image_dtype);
+      call.working_memory = m_budget->claim(working_images * image_bytes);
+    }
+  }
+
   void report_size_mismatch(ImageInfo::SharedPtr ref_img,
                             ImageInfo::SharedPtr img_info) const {
     report_size_mismatch(ref_img->image(), img_info->image(),
@@ -84,7 +149,8 @@ private:
     return image;
   }
 
-  [[nodiscard]] StackedImage process_all(const ImageInfoFutureContainer &images,
+  [[nodiscard]] StackedImage process_all(StackCall &call,
+                                         ImageInfoFutureContainer &images,
                                          bool align) const {
     const auto count = images.size();
 
@@ -94,10 +160,12 @@ private:
                   << std::endl;
         return {};
       } else if (count == 1) {
-        return {images[0].get()->image()};
+        return {take(images[0])->image()};
       }
-      StackedImage s1(images[0].get()->image());
-      StackedImage s2(images[1].get()->image());
+      const auto info = take(images[0]);
+      charge_working_memory(call, *info);
+      StackedImage s1(info->image(), call.id_of(images[0]));
+      StackedImage s2(take(images[1])->image(), call.id_of(images[1]));
       return align_and_stack(s1, s2, align);
     }
 
@@ -106,10 +174,10 @@ private:
     const auto left_count = count / 2;
     const auto right_count = count - left_count;
 
-    const auto left_result =
-        process_some(images.begin(), images.begin() + left_count, align);
-    const auto right_result =
-        process_some(images.rbegin(), images.rbegin() + right_count, align);
+    const auto left_result = process_some(call, images.begin(),
+                                          images.begin() + left_count, align);
+    const auto right_result = process_some(
+        call, images.rbegin(), images.rbegin() + right_count, align);
 
     if (left_result.succeeded() && right_result.succeeded()) {
       return align_and_stack(left_result, right_result, align);
@@ -120,21 +188,24 @@ private:
     return {};
   }
 
-  [[nodiscard]] StackedImage process_some(const auto begin, const auto end,
-                                          bool align) const {
+  [[nodiscard]] StackedImage process_some(StackCall &call, const auto begin,
+                                          const auto end, bool align) const {
     auto fut_iter = begin;
-    const auto info = fut_iter->get();
+    const auto &first_id = call.id_of(*fut_iter);
+    const auto info = take(*fut_iter);
     std::cout << info->path() << std::endl;
+    charge_working_memory(call, *info);
 
     // At every step, (align and) stack the pile of images already processed,
     // onto the next image.  This shifts the whole pile of processed images, a
     // little at a time, to align it with the next image in the sequence.
 
-    StackedImage result(info->image());
+    StackedImage result(info->image(), first_id);
 
     for (++fut_iter; fut_iter != end; ++fut_iter) {
-      const auto next_info(fut_iter->get());
-      StackedImage next_image(next_info->image());
+      const auto &next_id = call.id_of(*fut_iter);
+      const auto next_info(take(*fut_iter));
+      StackedImage next_image(next_info->image(), next_id);
       std::cout << next_info->path() << std::endl;
 
       result = align_and_stack(result, next_image, align);
@@ -156,13 +227,25 @@ private:
     }
 
     if (align) {
-      ImageAligner aligner;
-      cv::Mat aligned_image; // Will hold internal_image, aligned to
-                             // internal_target.
-      aligner.align(target.m_image, unaligned.m_image, aligned_image);
-
-      StackedImage aligned(aligned_image, unaligned.m_num_used);
-      return stack_pair(aligned, target);
+      ImageAligner aligner(ImageAligner::Motion::euclidean,
+                           m_alignment_cache, m_interpolation);
+      // Add the unaligned pile, aligned, to a copy of the target.  A pile
+      // that is off by whole pixels is added without being resampled.
+      cv::Mat sum = target.m_image.clone();
+      if (!aligner.accumulate(target.m_image, unaligned.m_image, sum,
+                              target.m_id, unaligned.m_id)) {
+        // Drop the smaller of the two, e.g., one cloudy frame, rather than
+        // the whole pile.
+        const auto &kept = (unaligned.m_num_used >= target.m_num_used)
+                               ? unaligned
+                               : target;
+        const auto &dropped = (&kept == &unaligned) ? target : unaligned;
+        std::cerr << "Skipping " << dropped.m_num_used
+                  << " image(s) that could not be aligned." << std::endl;
+        return kept;
+      }
+      return {sum, unaligned.m_num_used + target.m_num_used,
+              AlignmentCache::combined_id(unaligned.m_id, target.m_id)};
     }
 
     return stack_pair(unaligned, target);
@@ -170,12 +253,34 @@ private:
 
   [[nodiscard]] StackedImage stack_pair(const auto &top_image,
                                         const auto &bottom_image) const {
+    STACK_EXP_TRACE_SCOPE("accumulate");
     return {top_image.m_image + bottom_image.m_image,
-            top_image.m_num_used + bottom_image.m_num_used};
+            top_image.m_num_used + bottom_image.m_num_used,
+            AlignmentCache::combined_id(top_image.m_id, bottom_image.m_id)};
   }
 };
 } // namespace
 
-ImageStacker::Ptr ImageStacker::create() { return std::make_unique<Impl>(); }
+ImageStacker::Ptr
+ImageStacker::create(MemoryBudget::SharedPtr budget,
+                     AlignmentCache::SharedPtr alignment_cache,
+                     ImageAligner::Interpolation interpolation) {
+  return std::make_unique<Impl>(std::move(budget), std::move(alignment_cache),
+                                interpolation);
+}
+
+std::vector<size_t> ImageStacker::consumption_order(size_t count) {
+  // Mirror Impl::process_all:  the left half is consumed first to last, then
+  // the right half last to first.
+  std::vector<size_t> result;
+  const auto left_count = (count < 3) ? count : count / 2;
+  for (size_t i = 0; i < left_count; ++i) {
+    result.push_back(i);
+  }
+  for (size_t i = count; i > left_count; --i) {
+    result.push_back(i - 1);
+  }
+  return result;
+}
 
 } // namespace StackExposures
@@ -0,0 +1,81 @@
+#include "incremental_stacker.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <opencv2/imgproc.hpp>
+
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+constexpr auto image_dtype = CV_32FC3;
+} // namespace
+
+IncrementalStacker::IncrementalStacker(
+    bool align, ImageAligner::Interpolation interpolation)
+    : m_align(align),
+      m_aligner(ImageAligner::Motion::euclidean, nullptr, interpolation) {}
+
+bool IncrementalStacker::add(const cv::Mat &image) {
+  if (image.empty()) {
+    return false;
+  }
+
+  cv::Mat stackable;
+  {
+    STACK_EXP_TRACE_SCOPE("stackable");
+    image.convertTo(stackable, image_dtype);
+  }
+
+  if (m_count == 0) {
+    m_reference = stackable;
+    m_sum = stackable.clone();
+    m_count = 1;
+    return true;
+  }
+
+  if (stackable.size() != m_reference.size()) {
+    std::cerr << "Cannot stack a " << stackable.cols << " x " << stackable.rows
+              << " image onto " << m_reference.cols << " x "
+              << m_reference.rows << " images." << std::endl;
+    return false;
+  }
+
+  if (m_align) {
+    if (!m_aligner.accumulate(m_reference, stackable, m_sum)) {
+      return false;
+    }
+  } else {
+    STACK_EXP_TRACE_SCOPE("accumulate");
+    cv::accumulate(stackable, m_sum);
+  }
+  ++m_count;
+  return true;
+}
+
+cv::Mat IncrementalStacker::mean() const {
+  if (m_count == 0) {
+    return {};
+  }
+  return m_sum / static_cast<double>(m_count);
+}
+
+cv::Mat IncrementalStacker::preview(int max_dimension) const {
+  if (m_count == 0) {
+    return {};
+  }
+  const auto longest = std::max(m_sum.cols, m_sum.rows);
+  if (longest <= max_dimension) {
+    return mean();
+  }
+  // Reduce first, so the cost of a preview is mostly the cost of resizing.
+  const double scale = static_cast<double>(max_dimension) / longest;
+  const cv::Size size(std::max(1, cvRound(m_sum.cols * scale)),
+                      std::max(1, cvRound(m_sum.rows * scale)));
+  cv::Mat result;
+  cv::resize(m_sum, result, size, 0, 0, cv::INTER_AREA);
+  return result / static_cast<double>(m_count);
+}
+
+} // namespace StackExposures
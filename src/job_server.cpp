@@ -0,0 +1,409 @@
+#include "job_server.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+// How often blocked reads and accepts check whether to stop.
+constexpr int poll_interval_ms = 200;
+
+// Longest job message accepted.
+constexpr size_t max_message_bytes = size_t{1} << 20;
+
+constexpr int listen_backlog = 16;
+
+#ifdef MSG_NOSIGNAL
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0; // See SO_NOSIGPIPE, below
+#endif
+
+std::string json_string(std::string_view text) {
+  std::ostringstream outs;
+  outs << '"';
+  for (const char c : text) {
+    switch (c) {
+    case '"':
+      outs << "\\\"";
+      break;
+    case '\\':
+      outs << "\\\\";
+      break;
+    case '\n':
+      outs << "\\n";
+      break;
+    case '\t':
+      outs << "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        outs << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << static_cast<int>(c) << std::dec;
+      } else {
+        outs << c;
+      }
+      break;
+    }
+  }
+  outs << '"';
+  return outs.str();
+}
+
+// A reply about a job.  id is JSON, or empty if the job has no id; fields
+// are further JSON members, if any.
+std::string reply(const std::string &id, std::string_view event,
+                  const std::string &fields = {}) {
+  std::string result("{");
+  if (!id.empty()) {
+    result += "\"id\":" + id + ",";
+  }
+  result += "\"event\":\"" + std::string(event) + "\"";
+  if (!fields.empty()) {
+    result += "," + fields;
+  }
+  return result + "}";
+}
+
+std::string error_reply(const std::string &id, std::string_view message) {
+  return reply(id, "error", "\"message\":" + json_string(message));
+}
+
+// A job's "id", as JSON; empty if it has none.
+std::string id_of(const cv::FileNode &job) {
+  const auto id = job["id"];
+  if (id.isString()) {
+    return json_string(static_cast<std::string>(id));
+  }
+  if (id.isInt()) {
+    return std::to_string(static_cast<int>(id));
+  }
+  return {};
+}
+
+std::string elapsed_ms(std::chrono::steady_clock::time_point start) {
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return "\"ms\":" +
+         std::to_string(
+             std::chrono::duration_cast<std::chrono::milliseconds>(elapsed)
+                 .count());
+}
+
+std::string errno_message(const std::string &what) {
+  return what + ": " + std::strerror(errno) + ".";
+}
+
+sockaddr_un socket_address(const std::filesystem::path &path) {
+  sockaddr_un result{};
+  result.sun_family = AF_UNIX;
+  const auto text = path.string();
+  if (text.size() >= sizeof(result.sun_path)) {
+    throw std::runtime_error("Socket path '" + text + "' is too long.");
+  }
+  std::copy(text.begin(), text.end(), result.sun_path);
+  return result;
+}
+
+bool connect_to(int fd, const sockaddr_un &address) {
+  return ::connect(fd, reinterpret_cast<const sockaddr *>(&address),
+                   sizeof(address)) == 0;
+}
+} // namespace
+
+struct JobServer::Connection {
+  explicit Connection(int socket_fd) : fd(socket_fd) {}
+  ~Connection() { ::close(fd); }
+
+  Connection(const Connection &src) = delete;
+  Connection(Connection &&src) = delete;
+  Connection &operator=(const Connection &src) = delete;
+  Connection &operator=(Connection &&src) = delete;
+
+  const int fd;
+  std::thread reader;
+  std::atomic_bool finished{false};
+
+  void job_queued() {
+    std::lock_guard lock(m_jobs_mutex);
+    ++m_num_jobs;
+  }
+
+  void job_finished() {
+    {
+      std::lock_guard lock(m_jobs_mutex);
+      --m_num_jobs;
+    }
+    m_job_finished.notify_all();
+  }
+
+  // Wait until fewer than max_jobs of this client's jobs are unfinished.
+  // Returns false if stop is set first.
+  bool wait_for_room(size_t max_jobs, const std::atomic_bool &stop) {
+    std::unique_lock lock(m_jobs_mutex);
+    while (m_num_jobs >= max_jobs) {
+      if (stop) {
+        return false;
+      }
+      m_job_finished.wait_for(lock,
+                              std::chrono::milliseconds(poll_interval_ms));
+    }
+    return true;
+  }
+
+  // Send a reply.  A client that has gone away misses it.
+  void send_line(const std::string &line) {
+    const auto text = line + "\n";
+    std::lock_guard lock(m_write_mutex);
+    size_t sent = 0;
+    while (sent < text.size()) {
+      const auto count =
+          ::send(fd, text.data() + sent, text.size() - sent, send_flags);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      sent += static_cast<size_t>(count);
+    }
+  }
+
+private:
+  std::mutex m_write_mutex;
+  std::mutex m_jobs_mutex;
+  std::condition_variable m_job_finished;
+  size_t m_num_jobs{0}; // Queued or running
+};
+
+JobServer::JobServer(std::filesystem::path socket_path, StackRunner &runner,
+                     StackJob defaults, size_t max_concurrent)
+    : m_socket_path(std::move(socket_path)), m_runner(runner),
+      m_defaults(std::move(defaults)),
+      m_max_concurrent(std::max<size_t>(max_concurrent, 1)) {
+  const auto address = socket_address(m_socket_path);
+  const auto where = "'" + m_socket_path.string() + "'";
+
+  std::error_code error;
+  if (std::filesystem::exists(m_socket_path, error)) {
+    if (!std::filesystem::is_socket(m_socket_path, error)) {
+      throw std::runtime_error("Cannot serve on " + where +
+                               ": not a socket.");
+    }
+    // Replace a socket left behind by a server that did not shut down
+    // cleanly, but not one that is still in use.
+    const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    const bool in_use = (probe >= 0) && connect_to(probe, address);
+    if (probe >= 0) {
+      ::close(probe);
+    }
+    if (in_use) {
+      throw std::runtime_error("Cannot serve on " + where +
+                               ": another server is using it.");
+    }
+    std::filesystem::remove(m_socket_path, error);
+  }
+
+  m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_listen_fd < 0) {
+    throw std::runtime_error(errno_message("Could not create a socket"));
+  }
+  if ((::bind(m_listen_fd, reinterpret_cast<const sockaddr *>(&address),
+              sizeof(address)) != 0) ||
+      (::listen(m_listen_fd, listen_backlog) != 0)) {
+    const auto message = errno_message("Could not listen on " + where);
+    ::close(m_listen_fd);
+    throw std::runtime_error(message);
+  }
+}
+
+JobServer::~JobServer() {
+  ::close(m_listen_fd);
+  std::error_code error;
+  std::filesystem::remove(m_socket_path, error);
+}
+
+void JobServer::serve(const std::atomic_bool &stop) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_closing = false;
+  }
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < m_max_concurrent; ++i) {
+    workers.emplace_back([this]() { work(); });
+  }
+
+  std::list<ConnectionPtr> connections;
+  const auto forget_finished = [&]() {
+    for (auto iter = connections.begin(); iter != connections.end();) {
+      if ((*iter)->finished) {
+        (*iter)->reader.join();
+        iter = connections.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  };
+
+  while (!stop) {
+    pollfd listening{m_listen_fd, POLLIN, 0};
+    const auto ready = ::poll(&listening, 1, poll_interval_ms);
+    forget_finished();
+    if (ready <= 0) {
+      continue;
+    }
+    const int fd = ::accept(m_listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    (void)::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    auto &connection =
+        connections.emplace_back(std::make_shared<Connection>(fd));
+    connection->reader = std::thread(
+        [this, connection, &stop]() { handle(connection, stop); });
+  }
+
+  // Finish the jobs already received, even when stopping.
+  for (auto &connection : connections) {
+    connection->reader.join();
+  }
+  {
+    std::lock_guard lock(m_mutex);
+    m_closing = true;
+  }
+  m_job_queued.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+void JobServer::work() {
+  for (;;) {
+    QueuedJob job;
+    {
+      std::unique_lock lock(m_mutex);
+      m_job_queued.wait(lock,
+                        [this]() { return m_closing || !m_queue.empty(); });
+      if (m_queue.empty()) {
+        return;
+      }
+      job = std::move(m_queue.front());
+      m_queue.pop_front();
+    }
+    run_job(*job.connection, job.message);
+    job.connection->job_finished();
+  }
+}
+
+void JobServer::handle(const ConnectionPtr &connection,
+                       const std::atomic_bool &stop) {
+  std::string pending;
+  std::array<char, 4096> buffer{};
+  while (!stop) {
+    pollfd readable{connection->fd, POLLIN, 0};
+    if (::poll(&readable, 1, poll_interval_ms) <= 0) {
+      continue;
+    }
+    const auto count = ::recv(connection->fd, buffer.data(), buffer.size(), 0);
+    if ((count < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (count <= 0) {
+      break;
+    }
+    pending.append(buffer.data(), static_cast<size_t>(count));
+
+    for (auto end = pending.find('\n'); end != std::string::npos;
+         end = pending.find('\n')) {
+      auto message = pending.substr(0, end);
+      pending.erase(0, end + 1);
+      if (message.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+      // Read no further while this client has a job for every worker.
+      if (!connection->wait_for_room(m_max_concurrent, stop)) {
+        break;
+      }
+      connection->job_queued();
+      {
+        std::lock_guard lock(m_mutex);
+        m_queue.push_back({connection, std::move(message)});
+      }
+      m_job_queued.notify_one();
+    }
+    if (pending.size() > max_message_bytes) {
+      connection->send_line(error_reply({}, "Job message is too long."));
+      break;
+    }
+  }
+  // Queued jobs keep the connection open until they have replied.
+  connection->finished = true;
+}
+
+void JobServer::run_job(Connection &connection, const std::string &message) {
+  const auto start = std::chrono::steady_clock::now();
+  std::string id;
+  StackJob job;
+  try {
+    const cv::FileStorage storage(message, cv::FileStorage::READ |
+                                               cv::FileStorage::MEMORY |
+                                               cv::FileStorage::FORMAT_JSON);
+    const auto root = storage.root();
+    id = id_of(root);
+    const auto directory = root["directory"];
+    const auto base =
+        directory.isString()
+            ? std::filesystem::path(static_cast<std::string>(directory))
+            : std::filesystem::current_path();
+    job = read_job(root, base, m_defaults);
+  } catch (const cv::Exception &e) {
+    connection.send_line(
+        error_reply(id, std::string("Could not parse job: ") + e.what()));
+    return;
+  } catch (const std::exception &e) {
+    connection.send_line(error_reply(id, e.what()));
+    return;
+  }
+
+  connection.send_line(reply(
+      id, "started", "\"images\":" + std::to_string(job.images.size())));
+  try {
+    STACK_EXP_TRACE_SCOPE("serve.job");
+    const auto stacked = m_runner.stacked(job);
+    if (stacked.empty()) {
+      throw std::runtime_error("Stacking failed.");
+    }
+    connection.send_line(reply(id, "stacked", elapsed_ms(start)));
+    const auto outputs = job.outputs();
+    StackRunner::save(stacked, outputs);
+    for (const auto &output : outputs) {
+      connection.send_line(
+          reply(id, "wrote", "\"path\":" + json_string(output.path.string())));
+    }
+    connection.send_line(reply(id, "done", elapsed_ms(start)));
+  } catch (const std::exception &e) {
+    connection.send_line(error_reply(id, e.what()));
+  }
+}
+
+} // namespace StackExposures
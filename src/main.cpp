@@ -1,43 +1,117 @@
 #include <iostream>
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
-#include <future>
-#include <semaphore>
-
-#include <opencv2/imgcodecs.hpp>
+#include <chrono>
+#include <csignal>
+#include <optional>
+#include <stdexcept>
 
 #include "arg_parse.hpp"
-#include "image_info.hpp"
-#include "image_loader.hpp"
-#include "image_stacker.hpp"
+#include "buffer_pool.hpp"
+#include "directory_watcher.hpp"
+#include "incremental_stacker.hpp"
+#include "job_server.hpp"
+#include "stack_job.hpp"
 #include "str_util.hpp"
+#include "thread_budget.hpp"
+#include "trace.hpp"
 
 using namespace StackExposures;
 
 namespace {
 
 const std::string default_out_pathname("stacked.tiff");
-const std::vector<std::string> supported_extensions{".tif", ".tiff", ".png",
-                                                    ".jpg", ".jpeg"};
 
-auto lowercase_extension(std::string_view filename) {
-  std::filesystem::path pathname(filename);
+// Batch jobs run concurrently, so that one job's loading overlaps another's
+// alignment and stacking.
+constexpr int default_concurrent_jobs = 2;
+
+// Freed image buffers kept for reuse, unless --buffer-pool says otherwise.
+// Pooled memory is not charged to --max-memory, so pooling is opt-in.
+const std::string default_buffer_pool("0");
+
+// Set when a --watch or --serve session is asked to stop.
+std::atomic_bool g_stop_requested{false};
+
+extern "C" void on_stop_signal(int /*signal*/) { g_stop_requested = true; }
 
-  return StrUtil::lowercase(pathname.extension().string());
+std::optional<cv::Rect> parse_roi(std::string_view spec) {
+  const auto fields = StrUtil::split(spec, ',');
+  if (fields.size() != 4) {
+    return std::nullopt;
+  }
+  std::vector<int> values;
+  for (const auto &field : fields) {
+    try {
+      size_t num_parsed = 0;
+      values.push_back(std::stoi(field, &num_parsed));
+      if (num_parsed != field.size()) {
+        return std::nullopt;
+      }
+    } catch (std::logic_error &) {
+      return std::nullopt;
+    }
+  }
+  const cv::Rect result(values[0], values[1], values[2], values[3]);
+  if ((result.x < 0) || (result.y < 0) || result.empty()) {
+    return std::nullopt;
+  }
+  return result;
 }
 
-bool supported_format(std::string_view image_filename) {
-  const auto ext = lowercase_extension(image_filename);
-  return (std::find(supported_extensions.begin(), supported_extensions.end(),
-                    ext) != supported_extensions.end());
+std::vector<std::filesystem::path> paths(std::string_view comma_separated) {
+  std::vector<std::filesystem::path> result;
+  if (!comma_separated.empty()) {
+    for (const auto &path : StrUtil::split(comma_separated, ',')) {
+      result.emplace_back(path);
+    }
+  }
+  return result;
 }
 
 class CmdOption {
   ArgParse::ArgumentParser::Ptr m_parser;
   ArgParse::Flag::Ptr m_no_align;
-  ArgParse::Option<std::filesystem::path>::Ptr m_output_path;
-  ArgParse::Option<std::filesystem::path>::Ptr m_dark_image;
+  ArgParse::Option<std::filesystem::path>::Ptr m_alignment_cache;
+  ArgParse::Flag::Ptr m_refresh_alignment;
+  ArgParse::Option<std::string>::Ptr m_interpolation;
+  ArgParse::Flag::Ptr m_half_size;
+  ArgParse::Flag::Ptr m_half_float;
+  ArgParse::Flag::Ptr m_raw_stack;
+  ArgParse::Option<double>::Ptr m_keep_best;
+  ArgParse::Option<std::string>::Ptr m_roi;
+  ArgParse::Option<std::string>::Ptr m_output_path;
+  ArgParse::Option<std::string>::Ptr m_dark_images;
+  ArgParse::Option<std::string>::Ptr m_bias_images;
+  ArgParse::Option<std::string>::Ptr m_flat_images;
+  ArgParse::Option<std::filesystem::path>::Ptr m_calibration_cache;
+  ArgParse::Flag::Ptr m_calibrate_raw;
+  ArgParse::Flag::Ptr m_fix_bad_pixels;
+  ArgParse::Option<double>::Ptr m_bad_pixel_sigma;
+  ArgParse::Option<std::string>::Ptr m_max_memory;
+  ArgParse::Option<std::string>::Ptr m_buffer_pool;
+  ArgParse::Option<int>::Ptr m_threads;
+  ArgParse::Option<std::filesystem::path>::Ptr m_trace_path;
+  ArgParse::Flag::Ptr m_stats;
+  ArgParse::Option<std::filesystem::path>::Ptr m_manifest;
+  ArgParse::Option<int>::Ptr m_jobs;
+  ArgParse::Option<std::filesystem::path>::Ptr m_watch_dir;
+  ArgParse::Option<std::filesystem::path>::Ptr m_serve_socket;
+  ArgParse::Option<double>::Ptr m_preview_interval;
+  ArgParse::Option<int>::Ptr m_preview_size;
+  ArgParse::Option<double>::Ptr m_idle_exit;
+  ArgParse::Flag::Ptr m_float_tiff;
+  ArgParse::Option<std::string>::Ptr m_compression;
   ArgParse::Argument<std::filesystem::path>::Ptr m_input_images;
+  LoadOptions m_load_options;
+  TiffOptions m_tiff_options;
+  std::vector<OutputSpec> m_outputs;
+  ImageAligner::Interpolation m_interpolation_kind{
+      ImageAligner::Interpolation::bilinear};
+  size_t m_max_memory_bytes{0};
+  size_t m_buffer_pool_bytes{0};
 
 public:
   CmdOption(int argc, char **argv) {
@@ -47,31 +121,296 @@ public:
     m_no_align = ArgParse::flag(m_parser, "--no-align", "--no-align",
                                 "Skip aligning images before stacking.");
 
-    m_dark_image = ArgParse::option<std::filesystem::path>(
+    m_alignment_cache = ArgParse::option<std::filesystem::path>(
+        m_parser, "--alignment-cache", "--alignment-cache",
+        "Save each image's alignment to this sidecar file, and reuse "
+        "alignments saved there by earlier runs over the same images.");
+
+    m_refresh_alignment = ArgParse::flag(
+        m_parser, "--refresh-alignment", "--refresh-alignment",
+        "Ignore alignments already saved in the --alignment-cache sidecar, "
+        "and replace them.");
+
+    m_interpolation = ArgParse::option<std::string>(
+        m_parser, "--interpolation", "--interpolation",
+        "How to resample images whose alignment is not a whole-pixel shift:  "
+        "nearest, bilinear or lanczos; default bilinear.",
+        "bilinear");
+
+    m_half_size = ArgParse::flag(
+        m_parser, "--half-size", "--half-size",
+        "Load images at half resolution.  Raw images skip demosaicing.");
+
+    m_half_float = ArgParse::flag(
+        m_parser, "--half-float", "--half-float",
+        "Hold calibrated images in half-precision floating point while they "
+        "wait to be stacked, halving their memory use.");
+
+    m_raw_stack = ArgParse::flag(
+        m_parser, "--raw-stack", "--raw-stack",
+        "Stack raw sensor data, and demosaic only the result.  Requires Bayer "
+        "raw images.  Alignment is translation-only.");
+
+    m_keep_best = ArgParse::option<double>(
+        m_parser, "--keep-best", "--keep-best",
+        "When stacking SER or AVI videos, stack only this percentage of "
+        "their frames:  the sharpest.  Default 100.",
+        100.0);
+
+    m_roi = ArgParse::option<std::string>(
+        m_parser, "--roi", "--roi",
+        "Process only this region of each image, given as 'x,y,w,h'.");
+
+    m_dark_images = ArgParse::option<std::string>(
         m_parser, "-d", "--dark-image",
-        "Dark image to be subtracted from the exposure.");
+        "Dark image(s) to be subtracted from the exposures.  Separate "
+        "multiple images with commas; they are averaged into a master dark.");
+
+    m_bias_images = ArgParse::option<std::string>(
+        m_parser, "--bias-images", "--bias-images",
+        "Comma-separated bias images, averaged into a master bias.  Used in "
+        "place of a master dark when there is none, and to calibrate flats.");
+
+    m_flat_images = ArgParse::option<std::string>(
+        m_parser, "--flat-images", "--flat-images",
+        "Comma-separated flat-field images, averaged into a master flat.");
+
+    m_calibration_cache = ArgParse::option<std::filesystem::path>(
+        m_parser, "--calibration-cache", "--calibration-cache",
+        "Directory in which to cache master calibration frames.");
+
+    m_calibrate_raw = ArgParse::flag(
+        m_parser, "--calibrate-raw", "--calibrate-raw",
+        "Calibrate raw sensor data, before demosaicing.  Implied by "
+        "--raw-stack.");
+
+    m_fix_bad_pixels = ArgParse::flag(
+        m_parser, "--fix-bad-pixels", "--fix-bad-pixels",
+        "Replace hot pixels with the mean of their neighbors.  Hot pixels are "
+        "found in the master dark, or else in a sample of the exposures, "
+        "if they are dithered.");
+
+    m_bad_pixel_sigma = ArgParse::option<double>(
+        m_parser, "--bad-pixel-sigma", "--bad-pixel-sigma",
+        "How many standard deviations above its neighbors a pixel must be to "
+        "count as hot; default 6.",
+        6.0);
+
+    m_max_memory = ArgParse::option<std::string>(
+        m_parser, "--max-memory", "--max-memory",
+        "Limit memory used for decoded images, e.g. '512M' or '8G'.  Fewer "
+        "images are loaded at once to stay within the limit.");
+
+    m_buffer_pool = ArgParse::option<std::string>(
+        m_parser, "--buffer-pool", "--buffer-pool",
+        "Keep up to this much memory of freed image buffers, e.g. '512M', "
+        "for reuse by later images of the same size; '0' to free buffers "
+        "at once.  This memory is in addition to --max-memory.  Default " +
+            default_buffer_pool + ".",
+        default_buffer_pool);
+
+    m_threads = ArgParse::option<int>(
+        m_parser, "--threads", "--threads",
+        "How many threads to use in all, shared by image decoding (including "
+        "LibRaw's OpenMP teams) and OpenCV; default 0, one per core.",
+        0);
+
+    m_trace_path = ArgParse::option<std::filesystem::path>(
+        m_parser, "--trace", "--trace",
+        "Save a timeline of processing stages to this file, as a Chrome "
+        "trace (view with chrome://tracing or ui.perfetto.dev).");
+
+    m_stats = ArgParse::flag(
+        m_parser, "--stats", "--stats",
+        "Print time and memory used by each processing stage.");
+
+    m_manifest = ArgParse::option<std::filesystem::path>(
+        m_parser, "--manifest", "--manifest",
+        "Run the stack jobs listed in this JSON file, instead of stacking the "
+        "images given on the command line.  Other options serve as defaults "
+        "for every job.");
+
+    m_jobs = ArgParse::option<int>(
+        m_parser, "--jobs", "--jobs",
+        "How many --manifest or --serve jobs to run at once; default " +
+            std::to_string(default_concurrent_jobs) + ".",
+        default_concurrent_jobs);
+
+    m_watch_dir = ArgParse::option<std::filesystem::path>(
+        m_parser, "--watch", "--watch",
+        "Stack images as they arrive in this directory, aligning each to the "
+        "first.  Stop with Ctrl-C.");
+
+    m_serve_socket = ArgParse::option<std::filesystem::path>(
+        m_parser, "--serve", "--serve",
+        "Run stack jobs sent as JSON lines to a Unix socket created at this "
+        "path, reporting progress on the same connection.  Other options "
+        "serve as defaults for every job.  Stop with Ctrl-C.");
+
+    m_preview_interval = ArgParse::option<double>(
+        m_parser, "--preview-interval", "--preview-interval",
+        "With --watch, how often to save the result and a preview, in "
+        "seconds; default 30.",
+        30.0);
+
+    m_preview_size = ArgParse::option<int>(
+        m_parser, "--preview-size", "--preview-size",
+        "With --watch, the largest width or height of the preview, which is "
+        "saved as '<output>_preview.jpg'; default 1024.",
+        1024);
+
+    m_idle_exit = ArgParse::option<double>(
+        m_parser, "--idle-exit", "--idle-exit",
+        "With --watch, stop after this many seconds without a new image; "
+        "default 0, meaning never.",
+        0.0);
+
+    m_float_tiff = ArgParse::flag(
+        m_parser, "--float-tiff", "--float-tiff",
+        "Save TIFF output as 32-bit floating point, with values in 0...1, "
+        "rather than as 16-bit integers.");
+
+    m_compression = ArgParse::option<std::string>(
+        m_parser, "--compression", "--compression",
+        "TIFF compression:  none, lzw, deflate[:LEVEL] or zstd[:LEVEL]; "
+        "default lzw.",
+        "lzw");
 
-    const std::filesystem::path default_out_path(default_out_pathname);
     const auto outpath_help =
-        "Where to save the result; default '" + default_out_pathname + "'.";
-    m_output_path = ArgParse::option<std::filesystem::path>(
-        m_parser, "-o", "--output-path", outpath_help, default_out_path);
+        "Where to save the result; default '" + default_out_pathname +
+        "'.  Separate multiple outputs with commas; the images are stacked "
+        "once for all of them.  An output may end with ':' and TIFF options "
+        "separated by '+' -- float, uint16, or a compression -- e.g., "
+        "'m31.tiff:float+zstd,m31.jpg'.";
+    m_output_path = ArgParse::option<std::string>(
+        m_parser, "-o", "--output-path", outpath_help, default_out_pathname);
 
     m_input_images = ArgParse::argument<std::filesystem::path>(
-        m_parser, "image", ArgParse::Nargs::one_or_more, "Stack these images.");
+        m_parser, "image", ArgParse::Nargs::zero_or_more,
+        "Stack these images, or the frames of these SER or AVI videos.");
 
     m_parser->parse_args(argc, argv);
+    if (should_exit()) {
+      return;
+    }
 
-    const auto path_str(m_output_path->value().string());
-    if (!supported_format(path_str)) {
-      std::ostringstream outs;
-      outs << "Output format '" << lowercase_extension(path_str)
-           << "' is not supported." << std::endl
-           << "Please use one of these extensions when specifying output-path:";
-      for (const auto &ext : supported_extensions) {
-        outs << " '" << ext << "'";
+    const int num_modes = static_cast<int>(!images().empty()) +
+                          static_cast<int>(!manifest().empty()) +
+                          static_cast<int>(!watch_dir().empty()) +
+                          static_cast<int>(!serve_socket().empty());
+    if (num_modes != 1) {
+      m_parser->show_error(
+          "Usage:  stack_exposures [options] image [image ...]\n"
+          "        stack_exposures [options] --manifest jobs.json\n"
+          "        stack_exposures [options] --watch DIR\n"
+          "        stack_exposures [options] --serve SOCKET",
+          1);
+    }
+
+    if (m_threads->value() < 0) {
+      m_parser->show_error("--threads must be at least 0.", 1);
+    }
+    if (m_jobs->value() < 1) {
+      m_parser->show_error("--jobs must be at least 1.", 1);
+    }
+    if (!(m_keep_best->value() > 0.0) || (m_keep_best->value() > 100.0)) {
+      m_parser->show_error("--keep-best must be more than 0 and at most 100.",
+                           1);
+    }
+    if (m_preview_size->value() < 1) {
+      m_parser->show_error("--preview-size must be at least 1.", 1);
+    }
+
+    if (!m_roi->value().empty()) {
+      m_load_options.roi = parse_roi(m_roi->value());
+      if (!m_load_options.roi) {
+        m_parser->show_error("Invalid --roi '" + m_roi->value() +
+                                 "'; expected 'x,y,w,h' with w, h > 0.",
+                             1);
       }
-      m_parser->show_error(outs.str(), 1);
+    }
+    m_load_options.half_size = m_half_size->is_set();
+    m_load_options.half_float = m_half_float->is_set();
+
+    const auto interpolation =
+        ImageAligner::parse_interpolation(m_interpolation->value());
+    if (!interpolation) {
+      m_parser->show_error("Invalid --interpolation '" +
+                               m_interpolation->value() +
+                               "'; expected nearest, bilinear or lanczos.",
+                           1);
+    } else {
+      m_interpolation_kind = *interpolation;
+    }
+
+    const auto compression = TiffCompression::parse(m_compression->value());
+    if (!compression) {
+      m_parser->show_error("Invalid --compression '" + m_compression->value() +
+                               "'; expected none, lzw, deflate[:0-9] or "
+                               "zstd[:0-22].",
+                           1);
+    } else if (!TiffCompression::available(compression->codec)) {
+      m_parser->show_error("This build of stack_exposures does not support "
+                           "--compression '" +
+                               m_compression->value() + "'.",
+                           1);
+    } else {
+      m_tiff_options.compression = *compression;
+    }
+    m_tiff_options.float32 = m_float_tiff->is_set();
+
+    for (const auto &text : StrUtil::split(m_output_path->value(), ',')) {
+      const auto output = OutputSpec::parse(text, m_tiff_options);
+      if (!output) {
+        m_parser->show_error("Invalid --output-path '" + text + "'.", 1);
+      } else if (!StackJob::supported_output(output->path)) {
+        std::ostringstream outs;
+        outs << "Output format '"
+             << StrUtil::lowercase(output->path.extension().string())
+             << "' is not supported." << std::endl
+             << "Please use one of these extensions when specifying "
+                "output-path:";
+        for (const auto &ext : StackJob::supported_extensions()) {
+          outs << " '" << ext << "'";
+        }
+        m_parser->show_error(outs.str(), 1);
+      } else if (!TiffCompression::available(
+                     output->tiff_options.compression.codec)) {
+        m_parser->show_error("This build of stack_exposures does not "
+                             "support the compression of '" +
+                                 text + "'.",
+                             1);
+      } else {
+        m_outputs.push_back(*output);
+      }
+    }
+    if (m_outputs.empty() && !should_exit()) {
+      m_parser->show_error("No --output-path given.", 1);
+    }
+    if (const auto duplicate = StackJob::duplicate_output(m_outputs)) {
+      m_parser->show_error("'" + duplicate->string() +
+                               "' is given as more than one --output-path.",
+                           1);
+    }
+
+    if (!m_max_memory->value().empty()) {
+      const auto bytes = StrUtil::parse_byte_count(m_max_memory->value());
+      if (!bytes || (*bytes == 0)) {
+        m_parser->show_error("Invalid --max-memory '" + m_max_memory->value() +
+                                 "'; expected a size such as '512M' or '8G'.",
+                             1);
+      } else {
+        m_max_memory_bytes = *bytes;
+      }
+    }
+
+    const auto pool_bytes = StrUtil::parse_byte_count(m_buffer_pool->value());
+    if (!pool_bytes) {
+      m_parser->show_error("Invalid --buffer-pool '" + m_buffer_pool->value() +
+                               "'; expected a size such as '512M' or '0'.",
+                           1);
+    } else {
+      m_buffer_pool_bytes = *pool_bytes;
     }
   }
 
@@ -79,61 +418,245 @@ public:
 
   [[nodiscard]] int exit_code() const { return m_parser->exit_code(); }
 
-  [[nodiscard]] auto dark_image() const { return m_dark_image->value(); }
+  [[nodiscard]] CalibrationFrames calibration_frames() const {
+    return {paths(m_dark_images->value()), paths(m_bias_images->value()),
+            paths(m_flat_images->value())};
+  }
+
+  [[nodiscard]] std::filesystem::path calibration_cache() const {
+    return m_calibration_cache->value();
+  }
+
+  [[nodiscard]] bool fix_bad_pixels() const {
+    return m_fix_bad_pixels->is_set();
+  }
+
+  [[nodiscard]] double bad_pixel_sigma() const {
+    return m_bad_pixel_sigma->value();
+  }
+
+  [[nodiscard]] bool calibrate_raw() const {
+    return raw_stack() || m_calibrate_raw->is_set();
+  }
 
   [[nodiscard]] auto images() const { return m_input_images->values(); }
 
   [[nodiscard]] bool align() const { return !m_no_align->is_set(); }
 
-  [[nodiscard]] std::filesystem::path output_pathname() const {
-    return m_output_path->value();
+  [[nodiscard]] std::filesystem::path alignment_cache() const {
+    return m_alignment_cache->value();
   }
-};
 
-struct AsyncImageLoader {
-  AsyncImageLoader(std::vector<std::filesystem::path> image_paths)
-      : m_gate(max_concurrent_loads) {
-    for (const auto image_path : image_paths) {
-      auto load_async = [this, image_path]() {
-        m_gate.acquire();
-        ImageLoader loader;
-        auto result = loader.load_image(image_path);
-        m_gate.release();
-        return result;
-      };
+  [[nodiscard]] bool refresh_alignment() const {
+    return m_refresh_alignment->is_set();
+  }
 
-      m_futures.emplace_back(std::async(std::launch::async, load_async));
-    }
+  [[nodiscard]] ImageAligner::Interpolation interpolation() const {
+    return m_interpolation_kind;
   }
 
-  auto futures() const { return m_futures; }
+  [[nodiscard]] bool raw_stack() const { return m_raw_stack->is_set(); }
 
-private:
-  constexpr static size_t max_concurrent_loads = 4;
-  std::counting_semaphore<max_concurrent_loads> m_gate;
-  ImageInfoFutureContainer m_futures;
-};
+  [[nodiscard]] double keep_best() const { return m_keep_best->value(); }
+
+  [[nodiscard]] std::filesystem::path trace_path() const {
+    return m_trace_path->value();
+  }
+
+  [[nodiscard]] bool stats() const { return m_stats->is_set(); }
+
+  [[nodiscard]] std::filesystem::path manifest() const {
+    return m_manifest->value();
+  }
+
+  [[nodiscard]] size_t concurrent_jobs() const {
+    return static_cast<size_t>(m_jobs->value());
+  }
 
-auto formatted_for_output(const cv::Mat &stacking_image,
-                          std::string_view filename) {
-  // stacking_image should be in MainStacker's format, which will use
-  // values in 0...255.
+  [[nodiscard]] std::filesystem::path watch_dir() const {
+    return m_watch_dir->value();
+  }
+
+  [[nodiscard]] std::filesystem::path serve_socket() const {
+    return m_serve_socket->value();
+  }
+
+  [[nodiscard]] std::chrono::duration<double> preview_interval() const {
+    return std::chrono::duration<double>(m_preview_interval->value());
+  }
+
+  [[nodiscard]] int preview_size() const { return m_preview_size->value(); }
+
+  // 0 means never.
+  [[nodiscard]] std::chrono::duration<double> idle_exit() const {
+    return std::chrono::duration<double>(m_idle_exit->value());
+  }
+
+  // 0 means no limit.
+  [[nodiscard]] size_t max_memory() const { return m_max_memory_bytes; }
 
-  cv::Mat scaled(stacking_image);
-  auto output_type{CV_8UC3};
+  // 0 means no pool.
+  [[nodiscard]] size_t buffer_pool() const { return m_buffer_pool_bytes; }
 
-  std::filesystem::path pathname(filename);
+  // 0 means one per core.
+  [[nodiscard]] size_t threads() const {
+    return static_cast<size_t>(m_threads->value());
+  }
 
-  auto suffix = StrUtil::lowercase(pathname.extension().string());
-  if ((suffix == ".tiff") || (suffix == ".tif") || (suffix == ".png")) {
-    scaled = stacking_image * 0xFF;
-    output_type = CV_16UC3;
+  [[nodiscard]] const LoadOptions &load_options() const {
+    return m_load_options;
   }
 
-  cv::Mat result;
-  scaled.convertTo(result, output_type);
+  // Never empty once the command line has been parsed successfully.
+  [[nodiscard]] const std::vector<OutputSpec> &outputs() const {
+    return m_outputs;
+  }
+};
+
+// The job described by the command line.  Also the defaults for manifest
+// jobs.
+StackJob job(const CmdOption &opt) {
+  StackJob result;
+  result.images = opt.images();
+  result.load_options = opt.load_options();
+  result.calibration_frames = opt.calibration_frames();
+  result.calibration_cache = opt.calibration_cache();
+  result.calibrate_raw = opt.calibrate_raw();
+  result.fix_bad_pixels = opt.fix_bad_pixels();
+  result.bad_pixel_sigma = opt.bad_pixel_sigma();
+  result.align = opt.align();
+  result.alignment_cache = opt.alignment_cache();
+  result.refresh_alignment = opt.refresh_alignment();
+  result.interpolation = opt.interpolation();
+  result.raw_stack = opt.raw_stack();
+  result.keep_best = opt.keep_best();
+  const auto &outputs = opt.outputs();
+  if (!outputs.empty()) {
+    result.output_path = outputs.front().path;
+    result.tiff_options = outputs.front().tiff_options;
+    result.more_outputs.assign(outputs.begin() + 1, outputs.end());
+  }
   return result;
 }
+
+int run_manifest(const CmdOption &opt, StackRunner &runner) {
+  const auto jobs = read_manifest(opt.manifest(), job(opt));
+  const auto errors = runner.run_all(jobs, opt.concurrent_jobs());
+  int result = 0;
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (!errors[i].empty()) {
+      std::cerr << "Job " << i << " (" << jobs[i].output_path.string()
+                << ") failed: " << errors[i] << std::endl;
+      result = 2;
+    }
+  }
+  return result;
+}
+std::filesystem::path preview_path(const std::filesystem::path &output) {
+  auto result = output;
+  result.replace_filename(output.stem().string() + "_preview.jpg");
+  return result;
+}
+
+bool same_file(const std::filesystem::path &a, const std::filesystem::path &b) {
+  std::error_code error;
+  return std::filesystem::weakly_canonical(a, error) ==
+         std::filesystem::weakly_canonical(b, error);
+}
+
+int run_watch(const CmdOption &opt, StackRunner &runner) {
+  const auto watch_job = job(opt);
+  if (watch_job.raw_stack) {
+    throw std::runtime_error("--watch does not support --raw-stack.");
+  }
+  if (watch_job.fix_bad_pixels && watch_job.calibration_frames.darks.empty()) {
+    throw std::runtime_error("With --watch, --fix-bad-pixels requires dark "
+                             "images:  the exposures have yet to arrive.");
+  }
+  const auto options = runner.load_options(watch_job);
+  const auto output = watch_job.output_path;
+  const auto preview = preview_path(output);
+  const auto outputs = watch_job.outputs();
+  const auto is_output = [&](const std::filesystem::path &path) {
+    return same_file(path, preview) ||
+           std::any_of(outputs.begin(), outputs.end(),
+                       [&](const auto &o) { return same_file(path, o.path); });
+  };
+
+  DirectoryWatcher watcher(opt.watch_dir());
+  IncrementalStacker stacker(watch_job.align, watch_job.interpolation);
+
+  std::signal(SIGINT, on_stop_signal);
+  std::signal(SIGTERM, on_stop_signal);
+
+  const auto save = [&]() {
+    StackRunner::save(stacker.mean(), outputs);
+    StackRunner::save(stacker.preview(opt.preview_size()), preview);
+    std::cout << "Saved " << stacker.count() << " frames to "
+              << output.string() << std::endl;
+  };
+
+  using Clock = std::chrono::steady_clock;
+  auto last_arrival = Clock::now();
+  auto last_save = Clock::now();
+  bool unsaved = false;
+  auto arrived = watcher.existing_files();
+  while (!g_stop_requested) {
+    for (const auto &path : arrived) {
+      if (is_output(path)) {
+        continue;
+      }
+      try {
+        ImageLoader loader(options);
+        if (stacker.add(loader.load_image(path)->image())) {
+          std::cout << "Added " << path.string() << " (" << stacker.count()
+                    << " frames)" << std::endl;
+          unsaved = true;
+        } else {
+          std::cerr << "Skipped " << path.string() << "." << std::endl;
+        }
+      } catch (std::runtime_error &e) {
+        std::cerr << "Skipped " << path.string() << ": " << e.what()
+                  << std::endl;
+      }
+      last_arrival = Clock::now();
+    }
+
+    const auto now = Clock::now();
+    if (unsaved && (now - last_save >= opt.preview_interval())) {
+      save();
+      last_save = now;
+      unsaved = false;
+    }
+    if ((opt.idle_exit().count() > 0) &&
+        (now - last_arrival >= opt.idle_exit())) {
+      break;
+    }
+    arrived = watcher.wait(std::chrono::milliseconds(500));
+  }
+
+  if (stacker.count() == 0) {
+    std::cerr << "No images were stacked." << std::endl;
+    return 2;
+  }
+  if (unsaved) {
+    save();
+  }
+  std::cout << "Stacked " << stacker.count() << " frames into "
+            << output.string() << std::endl;
+  return 0;
+}
+
+int run_serve(const CmdOption &opt, StackRunner &runner) {
+  JobServer server(opt.serve_socket(), runner, job(opt),
+                   opt.concurrent_jobs());
+  std::signal(SIGINT, on_stop_signal);
+  std::signal(SIGTERM, on_stop_signal);
+  std::cout << "Serving stack jobs on " << opt.serve_socket().string()
+            << std::endl;
+  server.serve(g_stop_requested);
+  return 0;
+}
 } // namespace
 
 int main(int argc, char *argv[]) {
@@ -142,26 +665,55 @@ int main(int argc, char *argv[]) {
     return opt.exit_code();
   }
 
-  AsyncImageLoader loader(opt.images());
-  auto futures = loader.futures();
-
-  ImageInfo::SharedPtr dark_image{};
-  if (!opt.dark_image().empty()) {
-    ImageLoader loader;
-    dark_image = loader.load_image(opt.dark_image());
+  Trace::enable(!opt.trace_path().empty() || opt.stats());
+  ThreadBudget::install(opt.threads());
+  // When tracing, a pool with no room for idle buffers still counts
+  // allocations.
+  const auto *pool = ((opt.buffer_pool() > 0) || Trace::enabled())
+                         ? &BufferPool::install(opt.buffer_pool())
+                         : nullptr;
+
+  int result = 0;
+  try {
+    // Concurrent jobs share one split of the thread budget, made before any
+    // of them starts; a lone job splits it anew for each stage.
+    const bool concurrent_jobs =
+        !opt.serve_socket().empty() ||
+        (!opt.manifest().empty() && (opt.concurrent_jobs() > 1));
+    if (concurrent_jobs) {
+      ThreadBudget::current().split_evenly();
+    }
+    StackRunner runner(opt.max_memory(), !concurrent_jobs);
+    if (!opt.manifest().empty()) {
+      result = run_manifest(opt, runner);
+    } else if (!opt.watch_dir().empty()) {
+      result = run_watch(opt, runner);
+    } else if (!opt.serve_socket().empty()) {
+      result = run_serve(opt, runner);
+    } else {
+      runner.run(job(opt));
+    }
+  } catch (std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 2;
   }
 
-  auto stacker = ImageStacker::create();
-  const auto processed_image =
-      stacker->stacked_result(futures, dark_image, opt.align());
-
-  const auto output_pathname(opt.output_pathname().string());
-  const auto final_image =
-      formatted_for_output(processed_image, output_pathname);
-  if (final_image.empty()) {
-    std::cerr << "Final stack image is empty." << std::endl;
-    return 2;
+  if (!opt.trace_path().empty()) {
+    try {
+      Trace::write_chrome_trace(opt.trace_path());
+    } catch (std::runtime_error &e) {
+      std::cerr << e.what() << std::endl;
+      return 2;
+    }
   }
-  cv::imwrite(output_pathname, final_image);
-  return 0;
+  if (opt.stats()) {
+    Trace::print_stats(std::cout);
+    if ((pool != nullptr) && (opt.buffer_pool() > 0)) {
+      const auto stats = pool->stats();
+      std::cout << "Buffer pool:  " << stats.hits << " hits, " << stats.misses
+                << " misses, " << stats.discarded << " discarded"
+                << std::endl;
+    }
+  }
+  return result;
 }
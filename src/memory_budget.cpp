@@ -0,0 +1,108 @@
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace StackExposures {
+namespace {
+constexpr auto cancel_poll_interval = std::chrono::milliseconds(50);
+} // namespace
+
+MemoryBudget::Reservation::Reservation(SharedPtr budget, size_t bytes)
+    : m_budget(std::move(budget)), m_bytes(bytes) {}
+
+MemoryBudget::Reservation::~Reservation() { m_budget->release(m_bytes); }
+
+void MemoryBudget::Reservation::resize(size_t bytes) {
+  m_budget->adjust(m_bytes, bytes);
+  m_bytes = bytes;
+}
+
+MemoryBudget::SharedPtr MemoryBudget::create(size_t capacity) {
+  return std::shared_ptr<MemoryBudget>(new MemoryBudget(capacity));
+}
+
+MemoryBudget::MemoryBudget(size_t capacity) : m_capacity(capacity) {}
+
+MemoryBudget::ReservationPtr
+MemoryBudget::reserve(size_t bytes, const std::atomic_bool *cancelled) {
+  const auto fits = [this, bytes]() {
+    return (m_capacity == 0) || (m_in_use == 0) ||
+           (m_in_use + bytes <= m_capacity);
+  };
+  std::unique_lock lock(m_mutex);
+  while (!fits()) {
+    if ((cancelled != nullptr) && *cancelled) {
+      return nullptr;
+    }
+    // Wake periodically to check for cancellation.
+    m_available.wait_for(lock, cancel_poll_interval);
+  }
+  m_in_use += bytes;
+  m_peak = std::max(m_peak, m_in_use);
+  lock.unlock();
+  return std::shared_ptr<Reservation>(
+      new Reservation(shared_from_this(), bytes));
+}
+
+MemoryBudget::ReservationPtr MemoryBudget::try_reserve(size_t bytes) {
+  {
+    std::lock_guard lock(m_mutex);
+    if ((m_capacity != 0) && (m_in_use + bytes > m_capacity)) {
+      return nullptr;
+    }
+    m_in_use += bytes;
+    m_peak = std::max(m_peak, m_in_use);
+  }
+  return std::shared_ptr<Reservation>(
+      new Reservation(shared_from_this(), bytes));
+}
+
+MemoryBudget::ReservationPtr MemoryBudget::claim(size_t bytes) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_in_use += bytes;
+    m_peak = std::max(m_peak, m_in_use);
+  }
+  return std::shared_ptr<Reservation>(
+      new Reservation(shared_from_this(), bytes));
+}
+
+size_t MemoryBudget::in_use() const {
+  std::lock_guard lock(m_mutex);
+  return m_in_use;
+}
+
+size_t MemoryBudget::peak() const {
+  std::lock_guard lock(m_mutex);
+  return m_peak;
+}
+
+size_t MemoryBudget::concurrency(size_t bytes_per_task,
+                                 size_t max_tasks) const {
+  if ((m_capacity == 0) || (bytes_per_task == 0)) {
+    return std::max<size_t>(1, max_tasks);
+  }
+  return std::clamp<size_t>(m_capacity / bytes_per_task, 1,
+                            std::max<size_t>(1, max_tasks));
+}
+
+void MemoryBudget::release(size_t bytes) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_in_use -= std::min(bytes, m_in_use);
+  }
+  m_available.notify_all();
+}
+
+void MemoryBudget::adjust(size_t old_bytes, size_t new_bytes) {
+  {
+    std::lock_guard lock(m_mutex);
+    m_in_use -= std::min(old_bytes, m_in_use);
+    m_in_use += new_bytes;
+    m_peak = std::max(m_peak, m_in_use);
+  }
+  m_available.notify_all();
+}
+
+} // namespace StackExposures
@@ -0,0 +1,149 @@
+#include "raw_stacker.hpp"
+#include "trace.hpp"
+
+#include <cmath>
+#include <iostream>
+
+#include <opencv2/imgproc.hpp>
+
+namespace StackExposures {
+namespace {
+
+constexpr auto accum_dtype = CV_32FC1;
+
+// Average each 2x2 CFA block into one pixel, yielding an image suitable for
+// estimating translations regardless of the Bayer pattern.
+[[nodiscard]] cv::Mat binned(const cv::Mat &cfa) {
+  cv::Mat as_float;
+  cfa.convertTo(as_float, accum_dtype);
+  cv::Mat result;
+  cv::resize(as_float, result, cv::Size(cfa.cols / 2, cfa.rows / 2), 0, 0,
+             cv::INTER_AREA);
+  return result;
+}
+
+// Add frame to accum, with frame(y + dy, x + dx) landing on accum(y, x).
+// Accumulator pixels with no counterpart in frame are left unchanged.
+// Returns the area of accum that frame covers.
+cv::Rect accumulate_shifted(cv::Mat &accum, const cv::Mat &frame, int dx,
+                            int dy) {
+  const cv::Rect accum_rect = cv::Rect(-dx, -dy, frame.cols, frame.rows) &
+                              cv::Rect(0, 0, accum.cols, accum.rows);
+  if (accum_rect.empty()) {
+    return accum_rect;
+  }
+  const cv::Rect frame_rect = accum_rect + cv::Point(dx, dy);
+  cv::Mat dest(accum(accum_rect));
+  cv::accumulate(frame(frame_rect), dest);
+  return accum_rect;
+}
+
+struct TranslationEstimator {
+  explicit TranslationEstimator(const cv::Mat &ref_cfa)
+      : m_ref(binned(ref_cfa)) {
+    cv::createHanningWindow(m_window, m_ref.size(), accum_dtype);
+  }
+
+  // Get the shift, in whole CFA blocks, that takes cfa onto the reference.
+  [[nodiscard]] cv::Point shift(const cv::Mat &cfa) const {
+    STACK_EXP_TRACE_SCOPE("raw.estimate_shift");
+    const auto offset = cv::phaseCorrelate(m_ref, binned(cfa), m_window);
+    return {2 * static_cast<int>(std::lround(offset.x)),
+            2 * static_cast<int>(std::lround(offset.y))};
+  }
+
+private:
+  cv::Mat m_ref;
+  cv::Mat m_window;
+};
+
+} // namespace
+
+RawStacker::RawStacker(LoadOptions options) : m_options(std::move(options)) {}
+
+cv::Mat RawStacker::mean_cfa(CfaImageFutureContainer images,
+                             bool align) const {
+  if (images.empty()) {
+    std::cerr << "Can't stack -- need at least one image." << std::endl;
+    return {};
+  }
+
+  const auto ref = images.front().get();
+  std::cout << ref->path << std::endl;
+
+  cv::Mat accum;
+  ref->visible.convertTo(accum, accum_dtype);
+  size_t num_used = 1;
+  cv::Mat coverage; // Frames covering each pixel; empty while all do
+
+  std::unique_ptr<TranslationEstimator> estimator;
+  if (align) {
+    estimator = std::make_unique<TranslationEstimator>(ref->visible);
+  }
+
+  for (auto fut_iter = images.begin() + 1; fut_iter != images.end();
+       ++fut_iter) {
+    CfaImage::SharedPtr next;
+    {
+      STACK_EXP_TRACE_SCOPE("wait_for_load");
+      next = fut_iter->get();
+    }
+    *fut_iter = {}; // Release next once it has been stacked.
+    std::cout << next->path << std::endl;
+    if (next->visible.size() != ref->visible.size()) {
+      std::cerr << "Cannot process " << next->path.string()
+                << ": sensor width x height (" << next->visible.cols << " x "
+                << next->visible.rows << ") do not match first image ("
+                << ref->visible.cols << " x " << ref->visible.rows << ")"
+                << std::endl;
+      continue;
+    }
+    const cv::Point offset =
+        estimator ? estimator->shift(next->visible) : cv::Point();
+    {
+      STACK_EXP_TRACE_SCOPE("raw.accumulate");
+      const auto covered =
+          accumulate_shifted(accum, next->visible, offset.x, offset.y);
+      // Once a frame leaves part of the stack uncovered, count the frames
+      // that cover each pixel, so that borders are not darkened.
+      if ((covered.size() != accum.size()) && coverage.empty()) {
+        coverage = cv::Mat(accum.size(), accum_dtype,
+                           cv::Scalar(static_cast<double>(num_used)));
+      }
+      if (!coverage.empty() && !covered.empty()) {
+        cv::Mat covered_count(coverage(covered));
+        covered_count += 1.0;
+      }
+    }
+    ++num_used;
+  }
+
+  if (coverage.empty()) {
+    return accum / static_cast<double>(num_used);
+  }
+  cv::Mat result;
+  cv::divide(accum, coverage, result);
+  return result;
+}
+
+ImageInfo::SharedPtr RawStacker::stacked_result(CfaImageFutureContainer images,
+                                                bool align) const {
+  if (images.empty()) {
+    return nullptr;
+  }
+  const auto ref = images.front().get();
+  const auto mean = mean_cfa(std::move(images), align);
+  if (mean.empty()) {
+    return nullptr;
+  }
+
+  // Replace the reference image's sensor data with the stack, and process it.
+  STACK_EXP_TRACE_SCOPE("raw.finalize");
+  cv::Mat sensor_data(ref->visible);
+  mean.convertTo(sensor_data, CV_16UC1);
+
+  ImageLoader loader(m_options);
+  return loader.process_cfa(*ref);
+}
+
+} // namespace StackExposures
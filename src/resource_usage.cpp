@@ -0,0 +1,43 @@
+#include "resource_usage.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <sys/resource.h>
+
+namespace StackExposures {
+
+void reset_peak_rss() {
+#ifdef __linux__
+  // See proc(5):  writing 5 to clear_refs resets the peak RSS (VmHWM).
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+#endif
+}
+
+size_t peak_rss_bytes() {
+#ifdef __linux__
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      std::istringstream ins(line.substr(6));
+      size_t kib = 0;
+      ins >> kib;
+      return kib * 1024;
+    }
+  }
+#endif
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss); // bytes
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024; // KiB
+#endif
+}
+
+} // namespace StackExposures
@@ -0,0 +1,659 @@
+#include "stack_job.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "async_image_loader.hpp"
+#include "content_hash.hpp"
+#include "image_header.hpp"
+#include "image_stacker.hpp"
+#include "raw_stacker.hpp"
+#include "str_util.hpp"
+#include "thread_budget.hpp"
+#include "trace.hpp"
+#include "video_source.hpp"
+#include "video_stacker.hpp"
+
+namespace StackExposures {
+namespace {
+std::filesystem::path resolved(const std::filesystem::path &base,
+                               const std::string &path) {
+  const std::filesystem::path result(path);
+  return result.is_relative() ? base / result : result;
+}
+
+// A path, or an array of paths.
+std::vector<std::filesystem::path> paths_of(const cv::FileNode &node,
+                                            const std::filesystem::path &base) {
+  std::vector<std::filesystem::path> result;
+  if (node.isString()) {
+    result.push_back(resolved(base, static_cast<std::string>(node)));
+  } else if (node.isSeq()) {
+    for (auto iter = node.begin(); iter != node.end(); ++iter) {
+      result.push_back(resolved(base, static_cast<std::string>(*iter)));
+    }
+  }
+  return result;
+}
+
+void read_flag(const cv::FileNode &node, bool &value) {
+  if (!node.empty()) {
+    value = (static_cast<int>(node) != 0);
+  }
+}
+
+void read_paths(const cv::FileNode &node, const std::filesystem::path &base,
+                std::vector<std::filesystem::path> &value) {
+  if (!node.empty()) {
+    value = paths_of(node, base);
+  }
+}
+
+// An output spec, or an array of them.  The first sets the job's output_path
+// and tiff_options; the rest are its more_outputs.
+void read_outputs(const cv::FileNode &node, const std::filesystem::path &base,
+                  StackJob &job) {
+  if (node.empty()) {
+    return;
+  }
+  std::vector<std::string> texts;
+  if (node.isString()) {
+    texts.push_back(static_cast<std::string>(node));
+  } else if (node.isSeq()) {
+    for (auto iter = node.begin(); iter != node.end(); ++iter) {
+      texts.push_back(static_cast<std::string>(*iter));
+    }
+  }
+  if (texts.empty()) {
+    throw std::runtime_error("'output' must be an output or an array of "
+                             "outputs.");
+  }
+
+  std::vector<OutputSpec> outputs;
+  for (const auto &text : texts) {
+    auto output = OutputSpec::parse(text, job.tiff_options);
+    if (!output) {
+      throw std::runtime_error("Invalid 'output' '" + text + "'.");
+    }
+    output->path = resolved(base, output->path.string());
+    outputs.push_back(*output);
+  }
+  job.output_path = outputs.front().path;
+  job.tiff_options = outputs.front().tiff_options;
+  job.more_outputs.assign(outputs.begin() + 1, outputs.end());
+}
+
+} // namespace
+
+StackJob read_job(const cv::FileNode &node, const std::filesystem::path &base,
+                  const StackJob &defaults) {
+  auto result = defaults;
+  read_paths(node["images"], base, result.images);
+  read_paths(node["dark_images"], base, result.calibration_frames.darks);
+  read_paths(node["bias_images"], base, result.calibration_frames.biases);
+  read_paths(node["flat_images"], base, result.calibration_frames.flats);
+  if (!node["calibration_cache"].empty()) {
+    result.calibration_cache =
+        resolved(base, static_cast<std::string>(node["calibration_cache"]));
+  }
+  read_flag(node["calibrate_raw"], result.calibrate_raw);
+  read_flag(node["fix_bad_pixels"], result.fix_bad_pixels);
+  if (!node["bad_pixel_sigma"].empty()) {
+    result.bad_pixel_sigma = static_cast<double>(node["bad_pixel_sigma"]);
+  }
+  read_flag(node["align"], result.align);
+  if (!node["alignment_cache"].empty()) {
+    result.alignment_cache =
+        resolved(base, static_cast<std::string>(node["alignment_cache"]));
+  }
+  read_flag(node["refresh_alignment"], result.refresh_alignment);
+  if (!node["interpolation"].empty()) {
+    const auto text = static_cast<std::string>(node["interpolation"]);
+    const auto interpolation = ImageAligner::parse_interpolation(text);
+    if (!interpolation) {
+      throw std::runtime_error("Unknown 'interpolation' '" + text + "'.");
+    }
+    result.interpolation = *interpolation;
+  }
+  read_flag(node["raw_stack"], result.raw_stack);
+  if (!node["keep_best"].empty()) {
+    result.keep_best = static_cast<double>(node["keep_best"]);
+    if (!(result.keep_best > 0.0) || (result.keep_best > 100.0)) {
+      throw std::runtime_error("'keep_best' must be in (0, 100].");
+    }
+  }
+  read_flag(node["half_size"], result.load_options.half_size);
+  read_flag(node["half_float"], result.load_options.half_float);
+  read_flag(node["float_tiff"], result.tiff_options.float32);
+  if (!node["compression"].empty()) {
+    const auto text = static_cast<std::string>(node["compression"]);
+    const auto compression = TiffCompression::parse(text);
+    if (!compression) {
+      throw std::runtime_error("Unknown 'compression' '" + text + "'.");
+    }
+    result.tiff_options.compression = *compression;
+  }
+  read_outputs(node["output"], base, result);
+
+  const auto roi = node["roi"];
+  if (!roi.empty()) {
+    if (!roi.isSeq() || (roi.size() != 4)) {
+      throw std::runtime_error("'roi' must be [x, y, w, h].");
+    }
+    const cv::Rect rect(static_cast<int>(roi[0]), static_cast<int>(roi[1]),
+                        static_cast<int>(roi[2]), static_cast<int>(roi[3]));
+    if ((rect.x < 0) || (rect.y < 0) || rect.empty()) {
+      throw std::runtime_error("'roi' must have x, y >= 0 and w, h > 0.");
+    }
+    result.load_options.roi = rect;
+  }
+
+  if (result.images.empty()) {
+    throw std::runtime_error("No 'images' given.");
+  }
+  for (const auto &output : result.outputs()) {
+    if (!StackJob::supported_output(output.path)) {
+      throw std::runtime_error("Output format of '" + output.path.string() +
+                               "' is not supported.");
+    }
+  }
+  // Catch this before the job is stacked, rather than when it is saved.
+  if (const auto duplicate = StackJob::duplicate_output(result.outputs())) {
+    throw std::runtime_error("'" + duplicate->string() +
+                             "' is given as more than one output.");
+  }
+  return result;
+}
+
+namespace {
+void add_paths(ContentHash &hash,
+               const std::vector<std::filesystem::path> &paths) {
+  hash.add(static_cast<uint64_t>(paths.size()));
+  for (const auto &path : paths) {
+    hash.add_file_stamp(path);
+  }
+}
+
+// Identifies the calibration, and bad pixel map, that a job needs.  Like
+// CalibrationBuilder's cache, this keys on the files' sizes and modification
+// times, so that replacing a calibration frame yields a new calibration.
+std::string calibration_key(const StackJob &job) {
+  ContentHash hash;
+  const auto &frames = job.calibration_frames;
+  add_paths(hash, frames.darks);
+  add_paths(hash, frames.biases);
+  add_paths(hash, frames.flats);
+  hash.add(job.calibration_cache.string());
+  hash.add(static_cast<uint64_t>(job.calibrate_raw || job.raw_stack));
+  hash.add(static_cast<uint64_t>(job.load_options.half_size));
+  hash.add(static_cast<uint64_t>(job.load_options.half_float));
+  const auto roi = job.load_options.roi.value_or(cv::Rect());
+  for (const auto value : {roi.x, roi.y, roi.width, roi.height}) {
+    hash.add(static_cast<uint64_t>(value));
+  }
+  hash.add(static_cast<uint64_t>(job.fix_bad_pixels));
+  if (job.fix_bad_pixels) {
+    hash.add(&job.bad_pixel_sigma, sizeof(job.bad_pixel_sigma));
+    // Without a dark, bad pixels are found in the exposures themselves.
+    if (frames.darks.empty()) {
+      add_paths(hash, job.images);
+    }
+  }
+  return hash.hex();
+}
+
+// Identities of a job's images, for its alignment cache.  Loading at a
+// different size or region changes every warp, so that is part of each
+// identity.
+std::vector<std::string> frame_ids(const StackJob &job) {
+  std::vector<std::string> result(job.images.size());
+  cv::parallel_for_(
+      cv::Range(0, static_cast<int>(job.images.size())),
+      [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; ++i) {
+          const auto file_id = AlignmentCache::file_id(job.images[i]);
+          if (file_id.empty()) {
+            continue;
+          }
+          ContentHash hash;
+          hash.add(file_id);
+          hash.add(static_cast<uint64_t>(job.load_options.half_size));
+          const auto roi = job.load_options.roi.value_or(cv::Rect());
+          for (const auto value : {roi.x, roi.y, roi.width, roi.height}) {
+            hash.add(static_cast<uint64_t>(value));
+          }
+          result[i] = hash.hex();
+        }
+      });
+  return result;
+}
+
+cv::Mat formatted_for_output(const cv::Mat &stacking_image,
+                             const std::filesystem::path &path) {
+  // stacking_image should be in MainStacker's format, which will use
+  // values in 0...255.
+
+  cv::Mat scaled(stacking_image);
+  auto output_type{CV_8UC3};
+
+  const auto suffix = StrUtil::lowercase(path.extension().string());
+  if (suffix == ".png") {
+    scaled = stacking_image * 0xFF;
+    output_type = CV_16UC3;
+  } else if (suffix == ".exr") {
+    scaled = stacking_image / 0xFF;
+    output_type = CV_32FC3;
+  }
+
+  cv::Mat result;
+  scaled.convertTo(result, output_type);
+  return result;
+}
+
+bool is_tiff(const std::filesystem::path &path) {
+  const auto suffix = StrUtil::lowercase(path.extension().string());
+  return (suffix == ".tiff") || (suffix == ".tif");
+}
+} // namespace
+
+std::optional<OutputSpec> OutputSpec::parse(std::string_view text,
+                                            const TiffOptions &defaults) {
+  // Compressions have colons of their own, so split at the first.
+  const auto colon = text.find(':');
+  OutputSpec result{std::string(text.substr(0, colon)), defaults};
+  if (result.path.empty()) {
+    return std::nullopt;
+  }
+  if (colon == std::string_view::npos) {
+    return result;
+  }
+  for (const auto &option : StrUtil::split(text.substr(colon + 1), '+')) {
+    if (option == "float") {
+      result.tiff_options.float32 = true;
+    } else if (option == "uint16") {
+      result.tiff_options.float32 = false;
+    } else if (const auto compression = TiffCompression::parse(option)) {
+      result.tiff_options.compression = *compression;
+    } else {
+      return std::nullopt;
+    }
+  }
+  return result;
+}
+
+std::vector<OutputSpec> StackJob::outputs() const {
+  std::vector<OutputSpec> result{{output_path, tiff_options}};
+  result.insert(result.end(), more_outputs.begin(), more_outputs.end());
+  return result;
+}
+
+const std::vector<std::string> &StackJob::supported_extensions() {
+  static const std::vector<std::string> result{".tif", ".tiff", ".png",
+                                               ".jpg", ".jpeg", ".exr"};
+  return result;
+}
+
+bool StackJob::supported_output(const std::filesystem::path &path) {
+  const auto ext = StrUtil::lowercase(path.extension().string());
+  const auto &extensions = supported_extensions();
+  return std::find(extensions.begin(), extensions.end(), ext) !=
+         extensions.end();
+}
+
+std::optional<std::filesystem::path>
+StackJob::duplicate_output(const std::vector<OutputSpec> &outputs) {
+  for (auto iter = outputs.begin(); iter != outputs.end(); ++iter) {
+    const auto path = iter->path.lexically_normal();
+    for (auto other = iter + 1; other != outputs.end(); ++other) {
+      if (other->path.lexically_normal() == path) {
+        return path;
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+std::vector<StackJob> read_manifest(const std::filesystem::path &path,
+                                    const StackJob &defaults) {
+  std::vector<StackJob> result;
+  try {
+    cv::FileStorage fs(path.string(),
+                       cv::FileStorage::READ | cv::FileStorage::FORMAT_JSON);
+    if (!fs.isOpened()) {
+      throw std::runtime_error("Could not read manifest '" + path.string() +
+                               "'.");
+    }
+    const auto jobs = fs["jobs"];
+    if (!jobs.isSeq() || (jobs.size() == 0)) {
+      throw std::runtime_error("Manifest '" + path.string() +
+                               "' has no 'jobs'.");
+    }
+    const auto base = path.parent_path();
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      try {
+        result.push_back(read_job(jobs[static_cast<int>(i)], base, defaults));
+      } catch (std::runtime_error &e) {
+        throw std::runtime_error("Manifest '" + path.string() + "', job " +
+                                 std::to_string(i) + ": " + e.what());
+      }
+    }
+  } catch (cv::Exception &e) {
+    throw std::runtime_error("Could not parse manifest '" + path.string() +
+                             "': " + e.what());
+  }
+  return result;
+}
+
+StackRunner::StackRunner(size_t max_memory, bool splits_threads)
+    : m_budget(MemoryBudget::create(max_memory)),
+      m_splits_threads(splits_threads) {}
+
+LoadOptions StackRunner::load_options(const StackJob &job) {
+  if (job.calibration_frames.empty() && !job.fix_bad_pixels) {
+    return job.load_options;
+  }
+
+  // Jobs that share calibration frames wait for the first such job to build
+  // the calibration, rather than building their own.
+  const auto key = calibration_key(job);
+  std::promise<LoadOptions> promise;
+  std::shared_future<LoadOptions> future;
+  bool must_build = false;
+  {
+    std::lock_guard lock(m_mutex);
+    const auto found = m_load_options.find(key);
+    if (found != m_load_options.end()) {
+      future = found->second.load_options;
+      found->second.last_used = ++m_calibration_uses;
+    } else {
+      future = promise.get_future().share();
+      m_load_options[key] = {future, ++m_calibration_uses};
+      must_build = true;
+
+      // Forget the least recently used calibration.  Jobs using it keep
+      // their own reference until they finish.
+      if (m_load_options.size() > max_cached_calibrations) {
+        m_load_options.erase(std::min_element(
+            m_load_options.begin(), m_load_options.end(),
+            [](const auto &a, const auto &b) {
+              return a.second.last_used < b.second.last_used;
+            }));
+      }
+    }
+  }
+
+  if (must_build) {
+    try {
+      // Calibration frames are loaded concurrently, before any exposure, so
+      // that each exposure can be calibrated as it is loaded.
+      auto result = job.load_options;
+      const bool sensor_domain = job.calibrate_raw || job.raw_stack;
+      CalibrationBuilder builder(result, sensor_domain, job.calibration_cache);
+      result.calibration = builder.build(job.calibration_frames);
+      if (job.fix_bad_pixels) {
+        result.bad_pixels = builder.bad_pixels(
+            job.calibration_frames, job.images, job.bad_pixel_sigma);
+      }
+      promise.set_value(result);
+    } catch (...) {
+      // Jobs already waiting share the failure, but later jobs try again,
+      // e.g., once missing calibration frames are in place.
+      {
+        std::lock_guard lock(m_mutex);
+        m_load_options.erase(key);
+      }
+      promise.set_exception(std::current_exception());
+    }
+  }
+  return future.get();
+}
+
+cv::Mat StackRunner::image_stacked(const StackJob &job,
+                                   const LoadOptions &options,
+                                   const std::vector<ImageHeader> &headers) {
+  size_t image_bytes = 0;
+  for (const auto &header : headers) {
+    image_bytes = std::max(image_bytes, header.loaded_bytes(options));
+  }
+  // Identify the images while they load.  Hashing reads every file in full,
+  // alongside the loader's reads; stacking waits until it is done.
+  const auto alignments = alignment_cache(job);
+  std::future<std::vector<std::string>> pending_ids;
+  if (alignments != nullptr) {
+    pending_ids =
+        std::async(std::launch::async, [&job]() { return frame_ids(job); });
+  }
+
+  // Images are stacked as they load.
+  if (m_splits_threads) {
+    ThreadBudget::current().split_evenly();
+  }
+  // Images are loaded in the order in which the stacker consumes them, so
+  // that a memory budget never holds back the image the stacker needs next.
+  const auto loader = load_images_async(
+      job.images, options, m_budget,
+      ImageStacker::consumption_order(job.images.size()), image_bytes);
+
+  if (alignments == nullptr) {
+    auto stacker =
+        ImageStacker::create(m_budget, nullptr, job.interpolation);
+    return stacker->stacked_result(loader->take_futures(), nullptr, job.align);
+  }
+
+  const auto ids = pending_ids.get();
+  const auto hits_before = alignments->hits();
+  const auto misses_before = alignments->misses();
+  auto stacker =
+      ImageStacker::create(m_budget, alignments, job.interpolation);
+  auto result =
+      stacker->stacked_result(loader->take_futures(), nullptr, true, ids);
+  std::cout << "Reused " << (alignments->hits() - hits_before) << " of "
+            << (alignments->hits() - hits_before) +
+                   (alignments->misses() - misses_before)
+            << " alignments from " << job.alignment_cache << std::endl;
+  if (!alignments->save()) {
+    std::cerr << "Could not save alignments to " << job.alignment_cache
+              << std::endl;
+  }
+  return result;
+}
+
+AlignmentCache::SharedPtr
+StackRunner::alignment_cache(const StackJob &job) {
+  if (!job.align || job.alignment_cache.empty()) {
+    return nullptr;
+  }
+  // Jobs that name the same sidecar share one cache, so that their warps are
+  // all saved.
+  std::lock_guard lock(m_mutex);
+  auto &result = m_alignments[job.alignment_cache];
+  if (result == nullptr) {
+    result = AlignmentCache::open(job.alignment_cache, job.refresh_alignment);
+  } else if (job.refresh_alignment) {
+    // Warps stored by earlier jobs in this process are fresh; only those
+    // read from the sidecar are stale.
+    result->forget_saved();
+  }
+  return result;
+}
+
+cv::Mat
+StackRunner::raw_stacked(const StackJob &job, const LoadOptions &options,
+                         const std::vector<ImageHeader> &headers) const {
+  size_t image_bytes = 0;
+  for (const auto &header : headers) {
+    image_bytes = std::max(image_bytes, header.cfa_bytes());
+  }
+  if (m_splits_threads) {
+    ThreadBudget::current().split_evenly();
+  }
+  const auto loader =
+      load_cfa_async(job.images, options, m_budget, image_bytes);
+
+  RawStacker stacker(options);
+  const auto result =
+      stacker.stacked_result(loader->take_futures(), job.align);
+  if (result == nullptr) {
+    return {};
+  }
+  // Match ImageStacker's output:  floating point, with values in 0...255.
+  cv::Mat as_float;
+  result->image().convertTo(as_float, CV_32FC3);
+  return as_float;
+}
+
+cv::Mat StackRunner::video_stacked(const StackJob &job,
+                                   const LoadOptions &options) const {
+  VideoStackOptions video_options;
+  video_options.keep_percent = job.keep_best;
+  video_options.align = job.align;
+  video_options.interpolation = job.interpolation;
+
+  VideoStacker stacker(options, video_options);
+  auto result = stacker.stacked_result(job.images);
+  std::cout << "Stacked " << stacker.frames_stacked() << " of "
+            << stacker.frames_scored() << " video frames" << std::endl;
+  return result;
+}
+
+cv::Mat StackRunner::stacked(const StackJob &job) {
+  // Until images are stacked, decodes and OpenCV's loops take turns:
+  // calibration frames are loaded, then combined.
+  if (m_splits_threads) {
+    ThreadBudget::current().split(0);
+  }
+  const auto num_videos = static_cast<size_t>(std::count_if(
+      job.images.begin(), job.images.end(), VideoSource::is_video));
+  if (num_videos == 0) {
+    // Read just the images' headers first, so that images that cannot be
+    // stacked with the rest are dropped before they are decoded.  Raw
+    // sensor data is stacked whole, and cropped only afterwards.
+    const auto headers =
+        same_size_headers(read_headers(job.images),
+                          job.raw_stack ? LoadOptions{} : job.load_options);
+    const auto warning = settings_warning(headers);
+    if (!warning.empty()) {
+      std::cerr << "Warning: " << warning << std::endl;
+    }
+    StackJob checked(job);
+    checked.images.clear();
+    for (const auto &header : headers) {
+      checked.images.push_back(header.path);
+    }
+    const auto options = load_options(checked);
+    return checked.raw_stack ? raw_stacked(checked, options, headers)
+                             : image_stacked(checked, options, headers);
+  }
+
+  if (num_videos != job.images.size()) {
+    throw std::runtime_error("Cannot stack videos together with images.");
+  }
+  if (job.raw_stack) {
+    throw std::runtime_error("Cannot raw-stack videos.");
+  }
+  if (job.fix_bad_pixels && job.calibration_frames.darks.empty()) {
+    throw std::runtime_error("To fix bad pixels in videos, give dark images.");
+  }
+  return video_stacked(job, load_options(job));
+}
+
+void StackRunner::save(const cv::Mat &stacked,
+                       const std::filesystem::path &path,
+                       const TiffOptions &tiff_options) {
+  // TIFFs are converted strip by strip as they are written.
+  if (is_tiff(path)) {
+    if (stacked.empty()) {
+      throw std::runtime_error("Final stack image is empty.");
+    }
+    write_tiff(stacked, path, tiff_options);
+    return;
+  }
+
+  const auto final_image = formatted_for_output(stacked, path);
+  if (final_image.empty()) {
+    throw std::runtime_error("Final stack image is empty.");
+  }
+  STACK_EXP_TRACE_SCOPE("imwrite");
+  std::vector<int> params;
+  if (final_image.depth() == CV_32F) {
+    params = {cv::IMWRITE_EXR_TYPE, cv::IMWRITE_EXR_TYPE_FLOAT};
+  }
+  if (!cv::imwrite(path.string(), final_image, params)) {
+    throw std::runtime_error("Could not write '" + path.string() + "'.");
+  }
+}
+
+void StackRunner::save(const cv::Mat &stacked,
+                       const std::vector<OutputSpec> &outputs) {
+  // Jobs are checked when they are read; this guards other callers.
+  if (const auto duplicate = StackJob::duplicate_output(outputs)) {
+    throw std::runtime_error("'" + duplicate->string() +
+                             "' is given as more than one output.");
+  }
+
+  // Every write reads the one stacked image; none modifies it.
+  std::vector<std::future<void>> writes;
+  for (const auto &output : outputs) {
+    writes.push_back(std::async(std::launch::async, [&stacked, &output]() {
+      save(stacked, output.path, output.tiff_options);
+    }));
+  }
+  std::optional<std::string> error;
+  for (auto &write : writes) {
+    try {
+      write.get();
+    } catch (std::exception &e) {
+      if (!error) {
+        error = e.what();
+      }
+    }
+  }
+  if (error) {
+    throw std::runtime_error(*error);
+  }
+}
+
+void StackRunner::run(const StackJob &job) {
+  save(stacked(job), job.outputs());
+}
+
+std::vector<std::string> StackRunner::run_all(const std::vector<StackJob> &jobs,
+                                              size_t max_concurrent) {
+  std::vector<std::string> result(jobs.size());
+  if (jobs.empty()) {
+    return result;
+  }
+  std::atomic<size_t> next_job{0};
+  const auto worker = [&]() {
+    for (auto i = next_job++; i < jobs.size(); i = next_job++) {
+      try {
+        run(jobs[i]);
+        for (const auto &output : jobs[i].outputs()) {
+          std::cout << "Wrote " << output.path.string() << std::endl;
+        }
+      } catch (std::exception &e) {
+        result[i] = e.what();
+      }
+    }
+  };
+
+  const auto num_workers = std::clamp<size_t>(max_concurrent, 1, jobs.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers.emplace_back(worker);
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  return result;
+}
+
+} // namespace StackExposures
@@ -0,0 +1,205 @@
+#include "stack_session.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "incremental_stacker.hpp"
+
+namespace StackExposures {
+namespace {
+
+int cv_depth(FrameView::Depth depth) {
+  switch (depth) {
+  case FrameView::Depth::u8:
+    return CV_8U;
+  case FrameView::Depth::u16:
+    return CV_16U;
+  case FrameView::Depth::f32:
+    return CV_32F;
+  }
+  throw std::runtime_error("Unsupported frame depth.");
+}
+
+int num_channels(FrameView::Channels channels) {
+  switch (channels) {
+  case FrameView::Channels::gray:
+    return 1;
+  case FrameView::Channels::bgr:
+  case FrameView::Channels::rgb:
+    return 3;
+  case FrameView::Channels::bgra:
+  case FrameView::Channels::rgba:
+    return 4;
+  }
+  throw std::runtime_error("Unsupported frame channel layout.");
+}
+
+double full_scale(FrameView::Depth depth) {
+  switch (depth) {
+  case FrameView::Depth::u8:
+    return 255.0;
+  case FrameView::Depth::u16:
+    return 65535.0;
+  case FrameView::Depth::f32:
+    return 1.0;
+  }
+  throw std::runtime_error("Unsupported frame depth.");
+}
+
+// The conversion from a frame's layout to BGR, if any.
+std::optional<int> to_bgr(FrameView::Channels channels) {
+  switch (channels) {
+  case FrameView::Channels::gray:
+    return cv::COLOR_GRAY2BGR;
+  case FrameView::Channels::rgb:
+    return cv::COLOR_RGB2BGR;
+  case FrameView::Channels::bgra:
+    return cv::COLOR_BGRA2BGR;
+  case FrameView::Channels::rgba:
+    return cv::COLOR_RGBA2BGR;
+  case FrameView::Channels::bgr:
+    break;
+  }
+  return std::nullopt;
+}
+
+// The conversion from BGR to a frame's layout, if any.
+std::optional<int> from_bgr(FrameView::Channels channels) {
+  switch (channels) {
+  case FrameView::Channels::gray:
+    return cv::COLOR_BGR2GRAY;
+  case FrameView::Channels::rgb:
+    return cv::COLOR_BGR2RGB;
+  case FrameView::Channels::bgra:
+    return cv::COLOR_BGR2BGRA;
+  case FrameView::Channels::rgba:
+    return cv::COLOR_BGR2RGBA;
+  case FrameView::Channels::bgr:
+    break;
+  }
+  return std::nullopt;
+}
+
+// Wrap a caller's buffer without copying it.
+cv::Mat wrap(const FrameView &view) {
+  if ((view.data == nullptr) || (view.width <= 0) || (view.height <= 0)) {
+    throw std::runtime_error("Frame has no pixels.");
+  }
+  const auto type = CV_MAKETYPE(cv_depth(view.depth),
+                                num_channels(view.channels));
+  const auto stride = (view.stride == 0) ? cv::Mat::AUTO_STEP : view.stride;
+  return cv::Mat(view.height, view.width, type, view.data, stride);
+}
+
+bool same_layout(const FrameView &a, const FrameView &b) {
+  return (a.width == b.width) && (a.height == b.height) &&
+         (a.depth == b.depth) && (a.channels == b.channels);
+}
+} // namespace
+
+struct StackSession::Impl {
+  explicit Impl(StackSessionSettings settings_in)
+      : settings(std::move(settings_in)), stacker(settings.align) {}
+
+  const StackSessionSettings settings;
+  IncrementalStacker stacker;
+  std::atomic_bool cancelled{false};
+
+  // Layout of the first frame; every later frame must match it.
+  std::optional<FrameView> layout;
+
+  // Reused for frames that are not already BGR.
+  cv::Mat bgr;
+
+  mutable std::mutex mutex;
+  StackProgress progress;
+};
+
+StackSession::StackSession(StackSessionSettings settings)
+    : m_impl(std::make_unique<Impl>(std::move(settings))) {}
+
+StackSession::StackSession() : StackSession(StackSessionSettings{}) {}
+
+StackSession::~StackSession() = default;
+
+StackSession::PushResult StackSession::push(const FrameView &frame) {
+  if (m_impl->cancelled) {
+    return PushResult::cancelled;
+  }
+
+  const auto view = wrap(frame);
+  bool added = false;
+  if (!m_impl->layout || same_layout(*m_impl->layout, frame)) {
+    // BGR frames go straight to the stacker, which converts them to its
+    // working format as its first step.
+    const auto conversion = to_bgr(frame.channels);
+    if (conversion) {
+      cv::cvtColor(view, m_impl->bgr, *conversion);
+    }
+    added = m_impl->stacker.add(conversion ? m_impl->bgr : view);
+    if (added && !m_impl->layout) {
+      m_impl->layout = frame;
+    }
+  }
+
+  StackProgress progress;
+  {
+    std::scoped_lock lock(m_impl->mutex);
+    ++m_impl->progress.frames_pushed;
+    if (added) {
+      ++m_impl->progress.frames_added;
+    } else {
+      ++m_impl->progress.frames_rejected;
+    }
+    progress = m_impl->progress;
+  }
+  if (m_impl->settings.on_progress) {
+    m_impl->settings.on_progress(progress);
+  }
+  return added ? PushResult::added : PushResult::rejected;
+}
+
+void StackSession::cancel() { m_impl->cancelled = true; }
+
+bool StackSession::cancelled() const { return m_impl->cancelled; }
+
+StackProgress StackSession::progress() const {
+  std::scoped_lock lock(m_impl->mutex);
+  return m_impl->progress;
+}
+
+void StackSession::read_result(const FrameView &dest) const {
+  if (!m_impl->layout) {
+    throw std::runtime_error("No frames have been stacked.");
+  }
+  if ((dest.width != m_impl->layout->width) ||
+      (dest.height != m_impl->layout->height)) {
+    throw std::runtime_error("Result buffer size does not match the frames.");
+  }
+
+  // OpenCV writes into dest in place, because its size and type already
+  // match the requested output.
+  auto out = wrap(dest);
+  const auto *const out_data = out.data;
+  const auto mean = m_impl->stacker.mean();
+  const double scale =
+      full_scale(dest.depth) / full_scale(m_impl->layout->depth);
+  const auto conversion = from_bgr(dest.channels);
+  if (conversion) {
+    cv::Mat scaled;
+    mean.convertTo(scaled, CV_MAKETYPE(out.depth(), 3), scale);
+    cv::cvtColor(scaled, out, *conversion);
+  } else {
+    mean.convertTo(out, out.type(), scale);
+  }
+  if (out.data != out_data) {
+    throw std::runtime_error("Could not write the result in place.");
+  }
+}
+
+} // namespace StackExposures
@@ -0,0 +1,244 @@
+#include "star_field.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace StackExposures {
+namespace {
+// Noise is generated a band of rows at a time, to bound the size of the
+// scratch buffer for very large frames.
+constexpr int noise_band_rows = 256;
+
+constexpr float hot_pixel_level = 0.8f;
+
+uint64_t frame_seed(uint64_t seed, size_t index) {
+  // Any fixed mixing will do, so long as frames get different noise.
+  return seed * 0x9E3779B97F4A7C15ULL + index + 1;
+}
+
+void draw_star(cv::Mat &image, cv::Point2f center, float brightness,
+               const cv::Vec3f &color, double sigma) {
+  const int radius = static_cast<int>(std::ceil(4.0 * sigma));
+  const auto denom = static_cast<float>(2.0 * sigma * sigma);
+  const int y0 = std::max(0, static_cast<int>(center.y) - radius);
+  const int y1 = std::min(image.rows - 1, static_cast<int>(center.y) + radius);
+  const int x0 = std::max(0, static_cast<int>(center.x) - radius);
+  const int x1 = std::min(image.cols - 1, static_cast<int>(center.x) + radius);
+  for (int y = y0; y <= y1; ++y) {
+    auto *row = image.ptr<cv::Vec3f>(y);
+    const float dy = static_cast<float>(y) - center.y;
+    for (int x = x0; x <= x1; ++x) {
+      const float dx = static_cast<float>(x) - center.x;
+      const float value = brightness * std::exp(-(dx * dx + dy * dy) / denom);
+      row[x] += color * value;
+    }
+  }
+}
+} // namespace
+
+cv::Mat FrameWarp::matrix(cv::Size size) const {
+  const cv::Point2f center(static_cast<float>(size.width) / 2.0f,
+                           static_cast<float>(size.height) / 2.0f);
+  cv::Mat result = cv::getRotationMatrix2D(center, rotation_deg, 1.0);
+  result.at<double>(0, 2) += dx;
+  result.at<double>(1, 2) += dy;
+  result.convertTo(result, CV_32F);
+  return result;
+}
+
+std::vector<FrameWarp> FrameWarp::random(size_t count, double max_shift,
+                                         double max_rotation, uint64_t seed) {
+  cv::RNG rng(seed);
+  std::vector<FrameWarp> result;
+  for (size_t i = 0; i < count; ++i) {
+    if (i == 0) {
+      result.push_back({});
+    } else {
+      result.push_back({rng.uniform(-max_shift, max_shift),
+                        rng.uniform(-max_shift, max_shift),
+                        rng.uniform(-max_rotation, max_rotation)});
+    }
+  }
+  return result;
+}
+
+double warp_error(const cv::Mat &estimated, const FrameWarp &truth,
+                  cv::Size size) {
+  const auto w = static_cast<float>(size.width - 1);
+  const auto h = static_cast<float>(size.height - 1);
+  const std::vector<cv::Point2f> points{
+      {0, 0}, {w, 0}, {0, h}, {w, h}, {w / 2.0f, h / 2.0f}};
+
+  std::vector<cv::Point2f> from_estimate;
+  std::vector<cv::Point2f> from_truth;
+  cv::transform(points, from_estimate, estimated);
+  cv::transform(points, from_truth, truth.matrix(size));
+
+  double result = 0.0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    result = std::max(result, cv::norm(from_estimate[i] - from_truth[i]));
+  }
+  return result;
+}
+
+cv::Size StarField::size_for_megapixels(double megapixels) {
+  const auto width = std::sqrt(megapixels * 1.0e6 * 1.5);
+  // Keep dimensions even, so that CFA renderings have whole 2x2 tiles.
+  const auto even = [](double v) {
+    return std::max(2, 2 * static_cast<int>(std::lround(v / 2.0)));
+  };
+  return {even(width), even(width / 1.5)};
+}
+
+StarField::StarField(Params params) : m_params(std::move(params)) {
+  if ((m_params.depth != 8) && (m_params.depth != 16)) {
+    throw std::runtime_error("Star field depth must be 8 or 16 bits.");
+  }
+  if (m_params.size.empty()) {
+    throw std::runtime_error("Star field size must not be empty.");
+  }
+
+  cv::RNG rng(m_params.seed);
+  const auto &size = m_params.size;
+
+  // Scatter stars beyond the frame edges, so that warped frames are filled.
+  const float margin_x = 0.1f * static_cast<float>(size.width);
+  const float margin_y = 0.1f * static_cast<float>(size.height);
+  const auto num_stars = static_cast<size_t>(
+      m_params.stars_per_mp * size.area() * 1.44 / 1.0e6);
+  for (size_t i = 0; i < num_stars; ++i) {
+    const cv::Point2f position(
+        rng.uniform(-margin_x, static_cast<float>(size.width) + margin_x),
+        rng.uniform(-margin_y, static_cast<float>(size.height) + margin_y));
+    // Many faint stars, few bright ones.
+    const auto brightness =
+        static_cast<float>(0.05 + 0.85 * std::pow(rng.uniform(0.0, 1.0), 4.0));
+    const cv::Vec3f color(rng.uniform(0.85f, 1.0f), 1.0f,
+                          rng.uniform(0.85f, 1.0f));
+    m_stars.push_back({position, brightness, color});
+  }
+
+  m_dark = cv::Mat::zeros(size, CV_32FC1);
+  if (m_params.dark_level > 0.0) {
+    // A gradient, as from amplifier glow at one edge.
+    for (int y = 0; y < size.height; ++y) {
+      auto *row = m_dark.ptr<float>(y);
+      for (int x = 0; x < size.width; ++x) {
+        row[x] = static_cast<float>(
+            m_params.dark_level *
+            (0.5 + static_cast<double>(x) / static_cast<double>(size.width)));
+      }
+    }
+  }
+  for (size_t i = 0; i < m_params.num_hot_pixels; ++i) {
+    const cv::Point p(rng.uniform(0, size.width), rng.uniform(0, size.height));
+    m_hot_pixels.push_back(p);
+    m_dark.at<float>(p) = hot_pixel_level;
+  }
+}
+
+cv::Mat StarField::render_float(const FrameWarp &warp, size_t index,
+                                bool with_stars) const {
+  const auto &size = m_params.size;
+  cv::Mat result(size, CV_32FC3,
+                 cv::Scalar::all(with_stars ? m_params.sky : 0.0));
+
+  if (with_stars) {
+    const auto m = warp.matrix(size);
+    const auto *w = m.ptr<float>(0);
+    const auto *w1 = m.ptr<float>(1);
+    for (const auto &star : m_stars) {
+      const auto &p = star.position;
+      const cv::Point2f center(w[0] * p.x + w[1] * p.y + w[2],
+                               w1[0] * p.x + w1[1] * p.y + w1[2]);
+      draw_star(result, center, star.brightness, star.color,
+                m_params.star_sigma);
+    }
+  }
+
+  cv::Mat dark_bgr;
+  cv::cvtColor(m_dark, dark_bgr, cv::COLOR_GRAY2BGR);
+  result += dark_bgr;
+
+  if (m_params.noise > 0.0) {
+    cv::RNG rng(frame_seed(m_params.seed, index));
+    cv::Mat noise;
+    for (int y = 0; y < size.height; y += noise_band_rows) {
+      auto band =
+          result.rowRange(y, std::min(size.height, y + noise_band_rows));
+      noise.create(band.size(), CV_32FC3);
+      rng.fill(noise, cv::RNG::NORMAL, 0.0, m_params.noise);
+      band += noise;
+    }
+  }
+
+  // Hot pixels stay hot, whatever the noise.
+  for (const auto &p : m_hot_pixels) {
+    result.at<cv::Vec3f>(p) = cv::Vec3f::all(hot_pixel_level);
+  }
+  return result;
+}
+
+cv::Mat StarField::converted(const cv::Mat &image) const {
+  cv::Mat result;
+  if (m_params.depth == 8) {
+    image.convertTo(result, CV_MAKETYPE(CV_8U, image.channels()), 255.0);
+  } else {
+    image.convertTo(result, CV_MAKETYPE(CV_16U, image.channels()), 65535.0);
+  }
+  return result;
+}
+
+cv::Mat StarField::render(const FrameWarp &warp, size_t index) const {
+  return converted(render_float(warp, index, true));
+}
+
+cv::Mat StarField::render_dark(size_t index) const {
+  return converted(render_float({}, index, false));
+}
+
+cv::Mat StarField::render_cfa(const FrameWarp &warp, size_t index) const {
+  const auto bgr = render_float(warp, index, true);
+  cv::Mat mosaic(bgr.size(), CV_32FC1);
+  for (int y = 0; y < bgr.rows; ++y) {
+    const auto *src = bgr.ptr<cv::Vec3f>(y);
+    auto *dest = mosaic.ptr<float>(y);
+    for (int x = 0; x < bgr.cols; ++x) {
+      // RGGB:  red at even rows and columns, blue at odd rows and columns.
+      const bool odd_row = (y % 2) == 1;
+      const bool odd_col = (x % 2) == 1;
+      const int channel = (!odd_row && !odd_col) ? 2
+                          : (odd_row && odd_col) ? 0
+                                                 : 1;
+      dest[x] = src[x][channel];
+    }
+  }
+  cv::Mat result;
+  mosaic.convertTo(result, CV_16UC1, 65535.0);
+  return result;
+}
+
+std::vector<std::filesystem::path>
+StarField::write_tiffs(const std::filesystem::path &dir,
+                       const std::vector<FrameWarp> &warps) const {
+  std::filesystem::create_directories(dir);
+  std::vector<std::filesystem::path> result;
+  for (size_t i = 0; i < warps.size(); ++i) {
+    std::ostringstream name;
+    name << "frame_" << std::setw(4) << std::setfill('0') << i << ".tif";
+    const auto path = dir / name.str();
+    if (!cv::imwrite(path.string(), render(warps[i], i))) {
+      throw std::runtime_error("Could not write '" + path.string() + "'.");
+    }
+    result.push_back(path);
+  }
+  return result;
+}
+
+} // namespace StackExposures
@@ -1,5 +1,11 @@
 #include "str_util.hpp"
 #include <algorithm>
+#include <cctype>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+
+#include <unistd.h>
 
 namespace StrUtil {
 
@@ -9,4 +15,59 @@ std::string lowercase(std::string_view s) {
                  [](unsigned char c) { return std::tolower(c); });
   return result;
 }
+
+std::vector<std::string> split(std::string_view s, char delimiter) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  for (;;) {
+    const auto end = s.find(delimiter, start);
+    if (end == std::string_view::npos) {
+      result.emplace_back(s.substr(start));
+      return result;
+    }
+    result.emplace_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+std::optional<size_t> parse_byte_count(std::string_view s) {
+  if (s.empty()) {
+    return std::nullopt;
+  }
+  size_t multiplier = 1;
+  switch (std::toupper(static_cast<unsigned char>(s.back()))) {
+  case 'K':
+    multiplier = size_t{1} << 10;
+    break;
+  case 'M':
+    multiplier = size_t{1} << 20;
+    break;
+  case 'G':
+    multiplier = size_t{1} << 30;
+    break;
+  case 'T':
+    multiplier = size_t{1} << 40;
+    break;
+  default:
+    break;
+  }
+  const std::string digits(multiplier == 1 ? s : s.substr(0, s.size() - 1));
+  try {
+    size_t num_parsed = 0;
+    const auto value = std::stoull(digits, &num_parsed);
+    if ((num_parsed != digits.size()) || (digits.front() == '-')) {
+      return std::nullopt;
+    }
+    return static_cast<size_t>(value) * multiplier;
+  } catch (std::logic_error &) {
+    return std::nullopt;
+  }
+}
+
+std::string temporary_suffix() {
+  return "." + std::to_string(getpid()) + "." +
+         std::to_string(
+             std::hash<std::thread::id>{}(std::this_thread::get_id())) +
+         ".tmp";
+}
 } // namespace StrUtil
\ No newline at end of file
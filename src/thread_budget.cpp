@@ -0,0 +1,121 @@
+#include "thread_budget.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#include <opencv2/core.hpp>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace StackExposures {
+namespace {
+
+size_t resolved(size_t threads) {
+  if (threads > 0) {
+    return threads;
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+} // namespace
+
+ThreadBudget::ThreadBudget(size_t threads)
+    : m_threads(resolved(threads)), m_per_core(threads == 0) {}
+
+ThreadBudget &ThreadBudget::install(size_t threads) {
+  auto &result = current();
+  result.set_threads(threads);
+  cv::setNumThreads(static_cast<int>(result.threads()));
+  limit_openmp_threads(result.threads());
+  return result;
+}
+
+ThreadBudget &ThreadBudget::current() {
+  static ThreadBudget budget;
+  return budget;
+}
+
+size_t ThreadBudget::threads() const {
+  std::lock_guard lock(m_mutex);
+  return m_threads;
+}
+
+bool ThreadBudget::per_core() const {
+  std::lock_guard lock(m_mutex);
+  return m_per_core;
+}
+
+size_t ThreadBudget::decode_threads() const {
+  std::lock_guard lock(m_mutex);
+  return (m_decode_limit > 0) ? m_decode_limit : m_threads;
+}
+
+void ThreadBudget::split(size_t decode_threads) {
+  size_t opencv_threads = 0;
+  {
+    std::lock_guard lock(m_mutex);
+    m_decode_limit = std::min(decode_threads, m_threads);
+    opencv_threads = (m_decode_limit > 0)
+                         ? std::max<size_t>(1, m_threads - m_decode_limit)
+                         : m_threads;
+    if (!m_sizes_opencv) {
+      return;
+    }
+  }
+  cv::setNumThreads(static_cast<int>(opencv_threads));
+}
+
+void ThreadBudget::split_evenly() { split((threads() + 1) / 2); }
+
+ThreadBudget::DecodePlan ThreadBudget::decode_plan(size_t decode_bytes) const {
+  const auto total = decode_threads();
+  DecodePlan result;
+  result.threads_per_decode =
+      std::clamp<size_t>(decode_bytes / bytes_per_decode_thread, 1,
+                         std::min(max_threads_per_decode, total));
+  result.concurrent_decodes = total / result.threads_per_decode;
+  return result;
+}
+
+bool ThreadBudget::try_claim_decode(size_t threads) {
+  std::lock_guard lock(m_mutex);
+  const auto available = (m_decode_limit > 0) ? m_decode_limit : m_threads;
+  if ((m_decode_threads_in_use > 0) &&
+      (m_decode_threads_in_use + threads > available)) {
+    return false;
+  }
+  m_decode_threads_in_use += threads;
+  return true;
+}
+
+void ThreadBudget::release_decode(size_t threads) {
+  std::lock_guard lock(m_mutex);
+  m_decode_threads_in_use -= std::min(threads, m_decode_threads_in_use);
+}
+
+size_t ThreadBudget::decode_threads_in_use() const {
+  std::lock_guard lock(m_mutex);
+  return m_decode_threads_in_use;
+}
+
+void ThreadBudget::limit_openmp_threads(size_t threads) {
+#ifdef _OPENMP
+  // This sets the calling thread's own nthreads-var; other threads keep
+  // theirs.
+  omp_set_num_threads(static_cast<int>(std::max<size_t>(threads, 1)));
+#else
+  (void)threads;
+#endif
+}
+
+void ThreadBudget::set_threads(size_t threads) {
+  std::lock_guard lock(m_mutex);
+  m_threads = resolved(threads);
+  m_per_core = (threads == 0);
+  m_decode_limit = 0;
+  m_sizes_opencv = true;
+}
+
+} // namespace StackExposures
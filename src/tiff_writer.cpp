@@ -0,0 +1,558 @@
+#include "tiff_writer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef STACK_EXP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef STACK_EXP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "str_util.hpp"
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+using Bytes = std::vector<uint8_t>;
+
+// Uncompressed size of each strip.  Strips are compressed in parallel, a
+// few per thread at a time, so this also bounds the writer's memory use.
+constexpr size_t strip_target_bytes = 1 << 20;
+constexpr int strips_per_thread = 2;
+
+constexpr int num_channels = 3;
+
+// TIFF tags, field types and values.
+constexpr uint16_t tag_image_width = 256;
+constexpr uint16_t tag_image_length = 257;
+constexpr uint16_t tag_bits_per_sample = 258;
+constexpr uint16_t tag_compression = 259;
+constexpr uint16_t tag_photometric = 262;
+constexpr uint16_t tag_strip_offsets = 273;
+constexpr uint16_t tag_samples_per_pixel = 277;
+constexpr uint16_t tag_rows_per_strip = 278;
+constexpr uint16_t tag_strip_byte_counts = 279;
+constexpr uint16_t tag_planar_config = 284;
+constexpr uint16_t tag_predictor = 317;
+constexpr uint16_t tag_sample_format = 339;
+
+constexpr uint16_t type_short = 3;
+constexpr uint16_t type_long = 4;
+
+constexpr uint16_t photometric_rgb = 2;
+constexpr uint16_t planar_contiguous = 1;
+constexpr uint16_t sample_format_uint = 1;
+constexpr uint16_t sample_format_float = 3;
+constexpr uint16_t predictor_horizontal = 2;
+constexpr uint16_t predictor_float = 3;
+
+uint16_t compression_tag_value(TiffCompression::Codec codec) {
+  switch (codec) {
+  case TiffCompression::Codec::lzw:
+    return 5;
+  case TiffCompression::Codec::deflate:
+    return 8;
+  case TiffCompression::Codec::zstd:
+    return 50000;
+  case TiffCompression::Codec::none:
+    break;
+  }
+  return 1;
+}
+
+// Packs variable-width codes, most significant bit first, as TIFF's LZW
+// requires.
+class BitWriter {
+public:
+  explicit BitWriter(Bytes &out) : m_out(out) {}
+
+  void put(uint32_t code, int num_bits) {
+    m_bits = (m_bits << num_bits) | code;
+    m_num_bits += num_bits;
+    while (m_num_bits >= 8) {
+      m_num_bits -= 8;
+      m_out.push_back(static_cast<uint8_t>(m_bits >> m_num_bits));
+    }
+    m_bits &= (1U << m_num_bits) - 1;
+  }
+
+  void flush() {
+    if (m_num_bits > 0) {
+      m_out.push_back(static_cast<uint8_t>(m_bits << (8 - m_num_bits)));
+      m_bits = 0;
+      m_num_bits = 0;
+    }
+  }
+
+private:
+  Bytes &m_out;
+  uint32_t m_bits{0};
+  int m_num_bits{0};
+};
+
+// Maps (prefix code, next byte) to the code for the extended string.
+class LzwTable {
+public:
+  // Returns the slot holding key, or the empty slot where it belongs.
+  [[nodiscard]] size_t find(uint32_t key) const {
+    size_t slot = (key * 2654435761U) >> (32 - table_bits);
+    while ((m_keys[slot] != 0) && (m_keys[slot] != key + 1)) {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    return slot;
+  }
+
+  [[nodiscard]] bool occupied(size_t slot) const { return m_keys[slot] != 0; }
+
+  [[nodiscard]] uint32_t code(size_t slot) const { return m_codes[slot]; }
+
+  void insert(size_t slot, uint32_t key, uint32_t code) {
+    m_keys[slot] = key + 1;
+    m_codes[slot] = static_cast<uint16_t>(code);
+  }
+
+  void clear() { std::fill(m_keys.begin(), m_keys.end(), 0); }
+
+private:
+  // At least twice the 4096 possible codes, to keep probes short.
+  static constexpr int table_bits = 13;
+  static constexpr size_t table_size = size_t(1) << table_bits;
+
+  // Keys are stored plus one, so that 0 marks an empty slot.
+  std::vector<uint32_t> m_keys = std::vector<uint32_t>(table_size, 0);
+  std::vector<uint16_t> m_codes = std::vector<uint16_t>(table_size, 0);
+};
+
+// TIFF 6.0 LZW, with the same code-width changes and table resets as
+// libtiff's encoder.
+Bytes lzw_compressed(const Bytes &data) {
+  constexpr uint32_t code_clear = 256;
+  constexpr uint32_t code_eoi = 257;
+  constexpr uint32_t code_first = 258;
+  constexpr uint32_t code_max = 4095;
+  constexpr int min_bits = 9;
+
+  Bytes result;
+  result.reserve(data.size() / 2 + 16);
+  BitWriter bits(result);
+  LzwTable table;
+
+  int num_bits = min_bits;
+  uint32_t max_code = (1U << num_bits) - 1;
+  uint32_t free_code = code_first;
+  const auto after_add = [&]() {
+    if (free_code == code_max - 1) {
+      bits.put(code_clear, num_bits);
+      table.clear();
+      free_code = code_first;
+      num_bits = min_bits;
+      max_code = (1U << num_bits) - 1;
+    } else if (free_code > max_code) {
+      ++num_bits;
+      max_code = (1U << num_bits) - 1;
+    }
+  };
+
+  bits.put(code_clear, num_bits);
+  if (!data.empty()) {
+    uint32_t prefix = data[0];
+    for (size_t i = 1; i < data.size(); ++i) {
+      const uint32_t key = (prefix << 8) | data[i];
+      const auto slot = table.find(key);
+      if (table.occupied(slot)) {
+        prefix = table.code(slot);
+        continue;
+      }
+      bits.put(prefix, num_bits);
+      prefix = data[i];
+      table.insert(slot, key, free_code++);
+      after_add();
+    }
+    bits.put(prefix, num_bits);
+    ++free_code;
+    after_add();
+  }
+  bits.put(code_eoi, num_bits);
+  bits.flush();
+  return result;
+}
+
+#ifdef STACK_EXP_HAVE_ZLIB
+Bytes deflated(const Bytes &data, int level) {
+  auto size = compressBound(static_cast<uLong>(data.size()));
+  Bytes result(size);
+  const auto status =
+      compress2(result.data(), &size, data.data(),
+                static_cast<uLong>(data.size()),
+                (level < 0) ? Z_DEFAULT_COMPRESSION : level);
+  if (status != Z_OK) {
+    throw std::runtime_error("Could not deflate TIFF strip.");
+  }
+  result.resize(size);
+  return result;
+}
+#endif
+
+#ifdef STACK_EXP_HAVE_ZSTD
+Bytes zstd_compressed(const Bytes &data, int level) {
+  Bytes result(ZSTD_compressBound(data.size()));
+  const auto size =
+      ZSTD_compress(result.data(), result.size(), data.data(), data.size(),
+                    (level < 0) ? ZSTD_CLEVEL_DEFAULT : level);
+  if (ZSTD_isError(size) != 0) {
+    throw std::runtime_error(std::string("Could not compress TIFF strip: ") +
+                             ZSTD_getErrorName(size));
+  }
+  result.resize(size);
+  return result;
+}
+#endif
+
+Bytes compressed(Bytes samples, const TiffCompression &compression) {
+  switch (compression.codec) {
+  case TiffCompression::Codec::lzw:
+    return lzw_compressed(samples);
+#ifdef STACK_EXP_HAVE_ZLIB
+  case TiffCompression::Codec::deflate:
+    return deflated(samples, compression.level);
+#endif
+#ifdef STACK_EXP_HAVE_ZSTD
+  case TiffCompression::Codec::zstd:
+    return zstd_compressed(samples, compression.level);
+#endif
+  default:
+    break;
+  }
+  return samples;
+}
+
+// Rows [y_begin, y_end) of stacked, as interleaved RGB samples.
+Bytes strip_samples(const cv::Mat &stacked, int y_begin, int y_end,
+                    bool float32) {
+  const size_t row_samples = static_cast<size_t>(stacked.cols) * num_channels;
+  const size_t sample_bytes = float32 ? sizeof(float) : sizeof(uint16_t);
+  const size_t row_bytes = row_samples * sample_bytes;
+  Bytes result(row_bytes * (y_end - y_begin));
+
+  std::vector<float> float_row(float32 ? row_samples : 0);
+  std::vector<uint16_t> int_row(float32 ? 0 : row_samples);
+  for (int y = y_begin; y < y_end; ++y) {
+    const auto *src = stacked.ptr<float>(y);
+    auto *dest = result.data() + (y - y_begin) * row_bytes;
+    if (float32) {
+      for (size_t i = 0; i < row_samples; i += num_channels) {
+        float_row[i] = src[i + 2] / 255.0F;
+        float_row[i + 1] = src[i + 1] / 255.0F;
+        float_row[i + 2] = src[i] / 255.0F;
+      }
+      std::memcpy(dest, float_row.data(), row_bytes);
+    } else {
+      // The same scaling as the 16-bit PNG output.
+      for (size_t i = 0; i < row_samples; i += num_channels) {
+        int_row[i] = cv::saturate_cast<uint16_t>(src[i + 2] * 255.0F);
+        int_row[i + 1] = cv::saturate_cast<uint16_t>(src[i + 1] * 255.0F);
+        int_row[i + 2] = cv::saturate_cast<uint16_t>(src[i] * 255.0F);
+      }
+      std::memcpy(dest, int_row.data(), row_bytes);
+    }
+  }
+  return result;
+}
+
+// Replace each sample of one row with its difference from the same channel
+// of the previous pixel (TIFF predictor 2), so that smooth data compresses
+// well.
+void difference_uint16(uint8_t *row, size_t row_bytes) {
+  std::vector<uint16_t> samples(row_bytes / sizeof(uint16_t));
+  std::memcpy(samples.data(), row, row_bytes);
+  constexpr size_t stride = num_channels;
+  for (size_t i = samples.size() - 1; i >= stride; --i) {
+    samples[i] = static_cast<uint16_t>(samples[i] - samples[i - stride]);
+  }
+  std::memcpy(row, samples.data(), row_bytes);
+}
+
+// TIFF predictor 3, as libtiff implements it:  split one row of floats into
+// planes of bytes, most significant first, then difference each byte from
+// the one a pixel before it.
+void difference_float(uint8_t *row, size_t row_bytes) {
+  const size_t num_samples = row_bytes / sizeof(float);
+  Bytes planes(row_bytes);
+  for (size_t i = 0; i < num_samples; ++i) {
+    uint32_t bits = 0;
+    std::memcpy(&bits, row + i * sizeof(float), sizeof(float));
+    for (size_t byte = 0; byte < sizeof(float); ++byte) {
+      const auto shift = 8 * (sizeof(float) - 1 - byte);
+      planes[byte * num_samples + i] = static_cast<uint8_t>(bits >> shift);
+    }
+  }
+  constexpr size_t stride = num_channels;
+  for (size_t i = row_bytes - 1; i >= stride; --i) {
+    planes[i] = static_cast<uint8_t>(planes[i] - planes[i - stride]);
+  }
+  std::memcpy(row, planes.data(), row_bytes);
+}
+
+void apply_predictor(Bytes &samples, size_t row_bytes, bool float32) {
+  for (size_t offset = 0; offset < samples.size(); offset += row_bytes) {
+    if (float32) {
+      difference_float(samples.data() + offset, row_bytes);
+    } else {
+      difference_uint16(samples.data() + offset, row_bytes);
+    }
+  }
+}
+
+// Writes TIFF fields in the host's byte order, which the header declares.
+class TiffFile {
+public:
+  explicit TiffFile(const std::filesystem::path &path)
+      : m_path(path), m_outf(path, std::ios::binary | std::ios::trunc) {
+    if (!m_outf) {
+      fail();
+    }
+  }
+
+  template <typename T> void put(T value) {
+    m_outf.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  void put(const Bytes &bytes) {
+    m_outf.write(reinterpret_cast<const char *>(bytes.data()),
+                 static_cast<std::streamsize>(bytes.size()));
+  }
+
+  // The current offset, which must be addressable by a classic TIFF.
+  [[nodiscard]] uint32_t offset() {
+    const auto result = static_cast<uint64_t>(m_outf.tellp());
+    if (result > std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("'" + m_path.string() +
+                               "' would exceed the 4 GiB TIFF size limit.");
+    }
+    return static_cast<uint32_t>(result);
+  }
+
+  void put_short_entry(uint16_t tag, uint16_t value) {
+    put(tag);
+    put(type_short);
+    put(uint32_t(1));
+    put(value);
+    put(uint16_t(0));
+  }
+
+  void put_entry(uint16_t tag, uint16_t type, uint32_t count,
+                 uint32_t value) {
+    put(tag);
+    put(type);
+    put(count);
+    put(value);
+  }
+
+  void seek(uint32_t offset) { m_outf.seekp(offset); }
+
+  void finish() {
+    m_outf.close();
+    if (!m_outf) {
+      fail();
+    }
+  }
+
+private:
+  const std::filesystem::path m_path;
+  std::ofstream m_outf;
+
+  [[noreturn]] void fail() const {
+    throw std::runtime_error("Could not write '" + m_path.string() + "'.");
+  }
+};
+} // namespace
+
+std::optional<TiffCompression> TiffCompression::parse(std::string_view text) {
+  const auto parts = StrUtil::split(std::string(text), ':');
+  if (parts.empty() || (parts.size() > 2)) {
+    return std::nullopt;
+  }
+
+  TiffCompression result;
+  const auto name = StrUtil::lowercase(parts[0]);
+  if (name == "none") {
+    result.codec = Codec::none;
+  } else if (name == "lzw") {
+    result.codec = Codec::lzw;
+  } else if (name == "deflate") {
+    result.codec = Codec::deflate;
+  } else if (name == "zstd") {
+    result.codec = Codec::zstd;
+  } else {
+    return std::nullopt;
+  }
+
+  if (parts.size() == 2) {
+    const bool has_levels =
+        (result.codec == Codec::deflate) || (result.codec == Codec::zstd);
+    const int max_level = (result.codec == Codec::deflate) ? 9 : 22;
+    try {
+      size_t used = 0;
+      result.level = std::stoi(parts[1], &used);
+      if (!has_levels || (used != parts[1].size()) || (result.level < 0) ||
+          (result.level > max_level)) {
+        return std::nullopt;
+      }
+    } catch (std::exception &) {
+      return std::nullopt;
+    }
+  }
+  return result;
+}
+
+bool TiffCompression::available(Codec codec) {
+  switch (codec) {
+  case Codec::deflate:
+#ifdef STACK_EXP_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+  case Codec::zstd:
+#ifdef STACK_EXP_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  default:
+    return true;
+  }
+}
+
+void write_tiff(const cv::Mat &stacked, const std::filesystem::path &path,
+                const TiffOptions &options) {
+  STACK_EXP_TRACE_SCOPE("write_tiff");
+  if (stacked.type() != CV_32FC3) {
+    throw std::runtime_error("TIFF output needs a CV_32FC3 image.");
+  }
+  if (!TiffCompression::available(options.compression.codec)) {
+    throw std::runtime_error(
+        "This build cannot write TIFFs with the requested compression.");
+  }
+
+  const int width = stacked.cols;
+  const int height = stacked.rows;
+  const uint16_t bits = options.float32 ? 32 : 16;
+  const size_t row_bytes =
+      static_cast<size_t>(width) * num_channels * (bits / 8);
+  const int rows_per_strip = static_cast<int>(
+      std::clamp<size_t>(strip_target_bytes / row_bytes, 1, height));
+  const int num_strips = (height + rows_per_strip - 1) / rows_per_strip;
+  // Like libtiff, predict only data that is compressed.
+  const bool predicted =
+      (options.compression.codec != TiffCompression::Codec::none);
+
+  TiffFile tiff(path);
+  const bool little_endian = (std::endian::native == std::endian::little);
+  tiff.put(little_endian ? uint16_t(0x4949) : uint16_t(0x4D4D));
+  tiff.put(uint16_t(42));
+  tiff.put(uint32_t(0)); // Offset of the IFD, which is written last.
+
+  // Compress a batch of strips in parallel, then append them in order.
+  std::vector<uint32_t> strip_offsets;
+  std::vector<uint32_t> strip_byte_counts;
+  const int batch_size = std::max(1, cv::getNumThreads()) * strips_per_thread;
+  std::vector<Bytes> batch;
+  for (int first = 0; first < num_strips; first += batch_size) {
+    batch.assign(std::min(batch_size, num_strips - first), Bytes());
+    {
+      STACK_EXP_TRACE_SCOPE("tiff.compress");
+      cv::parallel_for_(
+          cv::Range(0, static_cast<int>(batch.size())),
+          [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; ++i) {
+              const int y_begin = (first + i) * rows_per_strip;
+              const int y_end = std::min(height, y_begin + rows_per_strip);
+              auto samples =
+                  strip_samples(stacked, y_begin, y_end, options.float32);
+              if (predicted) {
+                apply_predictor(samples, row_bytes, options.float32);
+              }
+              batch[i] = compressed(std::move(samples), options.compression);
+            }
+          });
+    }
+    STACK_EXP_TRACE_SCOPE("tiff.write");
+    for (const auto &strip : batch) {
+      strip_offsets.push_back(tiff.offset());
+      strip_byte_counts.push_back(static_cast<uint32_t>(strip.size()));
+      tiff.put(strip);
+    }
+  }
+
+  // Values too big to fit in their IFD entries, and then the IFD, must start
+  // on word boundaries.
+  if (tiff.offset() % 2 != 0) {
+    tiff.put(uint8_t(0));
+  }
+  const auto bits_offset = tiff.offset();
+  for (int i = 0; i < num_channels; ++i) {
+    tiff.put(bits);
+  }
+  const auto format_offset = tiff.offset();
+  const uint16_t format =
+      options.float32 ? sample_format_float : sample_format_uint;
+  for (int i = 0; i < num_channels; ++i) {
+    tiff.put(format);
+  }
+  const auto offsets_offset = tiff.offset();
+  for (const auto value : strip_offsets) {
+    tiff.put(value);
+  }
+  const auto counts_offset = tiff.offset();
+  for (const auto value : strip_byte_counts) {
+    tiff.put(value);
+  }
+
+  // One-entry arrays are stored in the entry itself.
+  const auto strips = static_cast<uint32_t>(num_strips);
+  const auto offsets_value =
+      (num_strips == 1) ? strip_offsets.front() : offsets_offset;
+  const auto counts_value =
+      (num_strips == 1) ? strip_byte_counts.front() : counts_offset;
+
+  // Entries must be sorted by tag.
+  const uint16_t num_entries = predicted ? 12 : 11;
+  const auto ifd_offset = tiff.offset();
+  tiff.put(num_entries);
+  tiff.put_entry(tag_image_width, type_long, 1, static_cast<uint32_t>(width));
+  tiff.put_entry(tag_image_length, type_long, 1,
+                 static_cast<uint32_t>(height));
+  tiff.put_entry(tag_bits_per_sample, type_short, num_channels, bits_offset);
+  tiff.put_short_entry(tag_compression,
+                       compression_tag_value(options.compression.codec));
+  tiff.put_short_entry(tag_photometric, photometric_rgb);
+  tiff.put_entry(tag_strip_offsets, type_long, strips, offsets_value);
+  tiff.put_short_entry(tag_samples_per_pixel, uint16_t(num_channels));
+  tiff.put_entry(tag_rows_per_strip, type_long, 1,
+                 static_cast<uint32_t>(rows_per_strip));
+  tiff.put_entry(tag_strip_byte_counts, type_long, strips, counts_value);
+  tiff.put_short_entry(tag_planar_config, planar_contiguous);
+  if (predicted) {
+    tiff.put_short_entry(tag_predictor, options.float32 ? predictor_float
+                                                        : predictor_horizontal);
+  }
+  tiff.put_entry(tag_sample_format, type_short, num_channels, format_offset);
+  tiff.put(uint32_t(0)); // No further IFDs.
+
+  tiff.seek(4);
+  tiff.put(ifd_offset);
+  tiff.finish();
+}
+
+} // namespace StackExposures
@@ -0,0 +1,213 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "resource_usage.hpp"
+
+namespace StackExposures::Trace {
+namespace detail {
+std::atomic_bool g_enabled{false};
+} // namespace detail
+
+namespace {
+// Image memory, as counted by count_allocation and count_release.
+std::atomic_bool g_counting{false};
+std::atomic<uint64_t> g_total_allocated{0};
+std::atomic<int64_t> g_in_use{0};
+std::atomic<int64_t> g_peak_in_use{0};
+
+struct Event {
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::duration duration;
+  uint64_t bytes_allocated;
+  size_t thread_index;
+};
+
+class Recorder {
+public:
+  static Recorder &instance() {
+    static Recorder recorder;
+    return recorder;
+  }
+
+  void add(Event event) {
+    std::lock_guard lock(m_mutex);
+    event.thread_index = thread_index();
+    m_events.push_back(event);
+  }
+
+  [[nodiscard]] std::vector<Event> events() const {
+    std::lock_guard lock(m_mutex);
+    return m_events;
+  }
+
+  [[nodiscard]] std::chrono::steady_clock::time_point epoch() const {
+    return m_epoch;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  const std::chrono::steady_clock::time_point m_epoch{
+      std::chrono::steady_clock::now()};
+  std::vector<Event> m_events;
+  std::map<std::thread::id, size_t> m_thread_indices;
+
+  // Small, stable thread numbers read better in trace viewers than hashes.
+  size_t thread_index() {
+    const auto id = std::this_thread::get_id();
+    const auto found = m_thread_indices.find(id);
+    if (found != m_thread_indices.end()) {
+      return found->second;
+    }
+    const auto result = m_thread_indices.size() + 1;
+    m_thread_indices[id] = result;
+    return result;
+  }
+};
+
+uint64_t total_bytes_allocated() {
+  return g_total_allocated.load(std::memory_order_relaxed);
+}
+
+double to_us(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+double to_mb(double bytes) { return bytes / (1024.0 * 1024.0); }
+} // namespace
+
+void enable(bool enable) {
+  if (enable) {
+    // Set the trace epoch before the first event.
+    (void)Recorder::instance();
+  }
+  detail::g_enabled = enable;
+}
+
+void count_allocation(size_t bytes) {
+  if (!enabled()) {
+    return;
+  }
+  g_counting.store(true, std::memory_order_relaxed);
+  g_total_allocated.fetch_add(bytes, std::memory_order_relaxed);
+  const auto in_use =
+      g_in_use.fetch_add(static_cast<int64_t>(bytes),
+                         std::memory_order_relaxed) +
+      static_cast<int64_t>(bytes);
+  auto peak = g_peak_in_use.load(std::memory_order_relaxed);
+  while ((in_use > peak) && !g_peak_in_use.compare_exchange_weak(
+                                peak, in_use, std::memory_order_relaxed)) {
+  }
+}
+
+void count_release(size_t bytes) {
+  // Buffers allocated before recording started may be released during it,
+  // so the count of bytes in use can dip below zero.  Only the peak matters.
+  if (enabled()) {
+    g_in_use.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+  }
+}
+
+bool counts_allocations() {
+  return g_counting.load(std::memory_order_relaxed);
+}
+
+void Scope::begin(const char *name) {
+  m_name = name;
+  m_start_bytes = total_bytes_allocated();
+  m_start = std::chrono::steady_clock::now();
+}
+
+void Scope::end() {
+  const auto duration = std::chrono::steady_clock::now() - m_start;
+  const auto bytes = total_bytes_allocated() - m_start_bytes;
+  Recorder::instance().add({m_name, m_start, duration, bytes, 0});
+}
+
+void write_chrome_trace(const std::filesystem::path &path) {
+  std::ofstream outs(path);
+  if (!outs) {
+    throw std::runtime_error("Could not write trace to '" + path.string() +
+                             "'.");
+  }
+  // See the Trace Event Format; "X" events are complete, with a duration.
+  const auto &recorder = Recorder::instance();
+  outs << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+  bool first = true;
+  for (const auto &event : recorder.events()) {
+    outs << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name
+         << "\",\"cat\":\"stack_exposures\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+         << event.thread_index
+         << ",\"ts\":" << to_us(event.start - recorder.epoch())
+         << ",\"dur\":" << to_us(event.duration);
+    if (counts_allocations()) {
+      outs << ",\"args\":{\"bytes_allocated\":" << event.bytes_allocated
+           << "}";
+    }
+    outs << "}";
+    first = false;
+  }
+  outs << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void print_stats(std::ostream &outs) {
+  struct Stats {
+    size_t count{0};
+    std::chrono::steady_clock::duration total{};
+    std::chrono::steady_clock::duration longest{};
+    uint64_t bytes{0};
+  };
+  std::map<std::string, Stats> by_stage;
+  for (const auto &event : Recorder::instance().events()) {
+    auto &stats = by_stage[event.name];
+    ++stats.count;
+    stats.total += event.duration;
+    stats.longest = std::max(stats.longest, event.duration);
+    stats.bytes += event.bytes_allocated;
+  }
+
+  // Without an allocator to count them, allocations are unknown, not zero.
+  const bool with_bytes = counts_allocations();
+  outs << std::left << std::setw(24) << "stage" << std::right << std::setw(8)
+       << "count" << std::setw(12) << "total ms" << std::setw(12) << "mean ms"
+       << std::setw(12) << "max ms";
+  if (with_bytes) {
+    outs << std::setw(14) << "alloc MB";
+  }
+  outs << std::endl;
+  outs << std::fixed << std::setprecision(2);
+  for (const auto &[name, stats] : by_stage) {
+    const auto total_ms = to_us(stats.total) / 1000.0;
+    outs << std::left << std::setw(24) << name << std::right << std::setw(8)
+         << stats.count << std::setw(12) << total_ms << std::setw(12)
+         << total_ms / static_cast<double>(stats.count) << std::setw(12)
+         << to_us(stats.longest) / 1000.0;
+    if (with_bytes) {
+      outs << std::setw(14) << to_mb(static_cast<double>(stats.bytes));
+    }
+    outs << std::endl;
+  }
+  outs << "Peak RSS:  " << to_mb(static_cast<double>(peak_rss_bytes()))
+       << " MB" << std::endl;
+  if (with_bytes) {
+    outs << "Peak image allocation:  "
+         << to_mb(static_cast<double>(
+                g_peak_in_use.load(std::memory_order_relaxed)))
+         << " MB" << std::endl
+         << "Total image allocation:  "
+         << to_mb(static_cast<double>(total_bytes_allocated())) << " MB"
+         << std::endl;
+  }
+}
+
+} // namespace StackExposures::Trace
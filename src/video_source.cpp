@@ -0,0 +1,301 @@
+#include "video_source.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "str_util.hpp"
+#include "trace.hpp"
+
+namespace StackExposures {
+namespace {
+
+// SER files are described at https://free-astro.org/index.php/SER
+namespace Ser {
+constexpr size_t header_size = 178;
+constexpr std::string_view file_id("LUCAM-RECORDER");
+
+enum ColorId : int32_t {
+  mono = 0,
+  bayer_rggb = 8,
+  bayer_grbg = 9,
+  bayer_gbrg = 10,
+  bayer_bggr = 11,
+  rgb = 100,
+  bgr = 101,
+};
+
+int32_t int32_at(const std::array<char, header_size> &header, size_t offset) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < 4; ++i) {
+    result |= static_cast<uint32_t>(static_cast<uint8_t>(header[offset + i]))
+              << (8 * i);
+  }
+  return static_cast<int32_t>(result);
+}
+} // namespace Ser
+
+class SerSource : public VideoSource {
+public:
+  explicit SerSource(const std::filesystem::path &path)
+      : m_path(path), m_in(path, std::ios::binary) {
+    std::array<char, Ser::header_size> header{};
+    if (!m_in.read(header.data(), header.size())) {
+      fail("could not read its header");
+    }
+    if (std::string_view(header.data(), Ser::file_id.size()) !=
+        Ser::file_id) {
+      fail("not a SER file");
+    }
+    m_color_id = Ser::int32_at(header, 18);
+    m_width = Ser::int32_at(header, 26);
+    m_height = Ser::int32_at(header, 30);
+    m_bit_depth = Ser::int32_at(header, 34);
+    const auto count = Ser::int32_at(header, 38);
+    if ((m_width <= 0) || (m_height <= 0) || (m_bit_depth < 1) ||
+        (m_bit_depth > 16) || (count < 0)) {
+      fail("invalid header");
+    }
+    if (conversion() < 0) {
+      fail("unsupported color format " + std::to_string(m_color_id));
+    }
+
+    // Trust the file's size over its header, which may claim frames that
+    // were never written.
+    const auto payload =
+        std::filesystem::file_size(path) - Ser::header_size;
+    m_frame_count =
+        std::min(static_cast<size_t>(count), payload / frame_bytes());
+  }
+
+  [[nodiscard]] size_t frame_count() const override { return m_frame_count; }
+
+  [[nodiscard]] cv::Mat next() override {
+    if (m_next >= m_frame_count) {
+      return {};
+    }
+    STACK_EXP_TRACE_SCOPE("ser.decode");
+    cv::Mat raw(m_height, m_width, raw_type());
+    if (!m_in.read(reinterpret_cast<char *>(raw.data),
+                   static_cast<std::streamsize>(frame_bytes()))) {
+      fail("truncated frame " + std::to_string(m_next));
+    }
+    ++m_next;
+
+    // Nearly all capture software writes 16-bit samples little-endian,
+    // whatever the header's endianness flag says.
+    if constexpr (std::endian::native == std::endian::big) {
+      if (raw.depth() == CV_16U) {
+        auto *bytes = raw.data;
+        for (size_t i = 0; i + 1 < frame_bytes(); i += 2) {
+          std::swap(bytes[i], bytes[i + 1]);
+        }
+      }
+    }
+
+    cv::Mat bgr;
+    const auto code = conversion();
+    if (code == 0) {
+      bgr = raw;
+    } else {
+      cv::cvtColor(raw, bgr, code);
+    }
+    if (bgr.depth() == CV_8U) {
+      return bgr;
+    }
+    cv::Mat result;
+    bgr.convertTo(result, CV_32FC3, 255.0 / ((1 << m_bit_depth) - 1));
+    return result;
+  }
+
+  bool skip() override {
+    if (m_next >= m_frame_count) {
+      return false;
+    }
+    m_in.seekg(static_cast<std::streamoff>(frame_bytes()), std::ios::cur);
+    ++m_next;
+    return true;
+  }
+
+private:
+  const std::filesystem::path m_path;
+  std::ifstream m_in;
+  int32_t m_color_id{Ser::mono};
+  int m_width{0};
+  int m_height{0};
+  int m_bit_depth{8};
+  size_t m_frame_count{0};
+  size_t m_next{0};
+
+  [[noreturn]] void fail(const std::string &why) const {
+    throw std::runtime_error("Cannot read '" + m_path.string() + "': " + why +
+                             ".");
+  }
+
+  [[nodiscard]] int planes() const {
+    return ((m_color_id == Ser::rgb) || (m_color_id == Ser::bgr)) ? 3 : 1;
+  }
+
+  [[nodiscard]] int raw_type() const {
+    return CV_MAKETYPE((m_bit_depth > 8) ? CV_16U : CV_8U, planes());
+  }
+
+  [[nodiscard]] size_t frame_bytes() const {
+    return static_cast<size_t>(m_width) * m_height *
+           CV_ELEM_SIZE(raw_type());
+  }
+
+  // The cvtColor code that converts a raw frame to BGR; 0 if the frame is
+  // already BGR, or -1 if the color format is not supported.  OpenCV names
+  // Bayer patterns by their second row, so RGGB is its BayerBG.
+  [[nodiscard]] int conversion() const {
+    switch (m_color_id) {
+    case Ser::mono:
+      return cv::COLOR_GRAY2BGR;
+    case Ser::bayer_rggb:
+      return cv::COLOR_BayerBG2BGR;
+    case Ser::bayer_grbg:
+      return cv::COLOR_BayerGB2BGR;
+    case Ser::bayer_gbrg:
+      return cv::COLOR_BayerGR2BGR;
+    case Ser::bayer_bggr:
+      return cv::COLOR_BayerRG2BGR;
+    case Ser::rgb:
+      return cv::COLOR_RGB2BGR;
+    case Ser::bgr:
+      return 0;
+    default:
+      return -1;
+    }
+  }
+};
+
+class CaptureSource : public VideoSource {
+public:
+  explicit CaptureSource(const std::filesystem::path &path) {
+    if (!m_capture.open(path.string())) {
+      throw std::runtime_error("Cannot read '" + path.string() +
+                               "': could not open the video.");
+    }
+  }
+
+  [[nodiscard]] size_t frame_count() const override {
+    const auto count = m_capture.get(cv::CAP_PROP_FRAME_COUNT);
+    return (count > 0) ? static_cast<size_t>(count) : 0;
+  }
+
+  [[nodiscard]] cv::Mat next() override {
+    STACK_EXP_TRACE_SCOPE("video.decode");
+    cv::Mat frame;
+    if (!m_capture.read(frame)) {
+      return {};
+    }
+    if (frame.channels() == 1) {
+      cv::Mat bgr;
+      cv::cvtColor(frame, bgr, cv::COLOR_GRAY2BGR);
+      return bgr;
+    }
+    return frame;
+  }
+
+  bool skip() override { return m_capture.grab(); }
+
+private:
+  cv::VideoCapture m_capture;
+};
+
+} // namespace
+
+VideoSource::Ptr VideoSource::open(const std::filesystem::path &path) {
+  if (StrUtil::lowercase(path.extension().string()) == ".ser") {
+    return std::make_unique<SerSource>(path);
+  }
+  return std::make_unique<CaptureSource>(path);
+}
+
+bool VideoSource::is_video(const std::filesystem::path &path) {
+  const auto ext = StrUtil::lowercase(path.extension().string());
+  return (ext == ".ser") || (ext == ".avi");
+}
+
+FrameReadahead::FrameReadahead(VideoSource::Ptr source,
+                               std::vector<bool> wanted, size_t window)
+    : m_source(std::move(source)), m_wanted(std::move(wanted)),
+      m_window(std::max<size_t>(window, 1)),
+      m_decoder([this]() { decode(); }) {}
+
+FrameReadahead::~FrameReadahead() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stopping = true;
+  }
+  m_changed.notify_all();
+  m_decoder.join();
+}
+
+std::optional<FrameReadahead::Frame> FrameReadahead::next() {
+  std::unique_lock lock(m_mutex);
+  m_changed.wait(lock, [this]() { return !m_frames.empty() || m_done; });
+  if (m_frames.empty()) {
+    if (m_error) {
+      std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+    return std::nullopt;
+  }
+  auto result = std::move(m_frames.front());
+  m_frames.pop_front();
+  lock.unlock();
+  m_changed.notify_all();
+  return result;
+}
+
+void FrameReadahead::decode() {
+  try {
+    const bool all = m_wanted.empty();
+    for (size_t index = 0; all || (index < m_wanted.size()); ++index) {
+      if (!all && !m_wanted[index]) {
+        if (!m_source->skip()) {
+          break;
+        }
+        continue;
+      }
+      {
+        std::unique_lock lock(m_mutex);
+        m_changed.wait(lock, [this]() {
+          return (m_frames.size() < m_window) || m_stopping;
+        });
+        if (m_stopping) {
+          break;
+        }
+      }
+      auto image = m_source->next();
+      if (image.empty()) {
+        break;
+      }
+      {
+        std::lock_guard lock(m_mutex);
+        m_frames.push_back({index, std::move(image)});
+      }
+      m_changed.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard lock(m_mutex);
+    m_error = std::current_exception();
+  }
+  {
+    std::lock_guard lock(m_mutex);
+    m_done = true;
+  }
+  m_changed.notify_all();
+}
+
+} // namespace StackExposures
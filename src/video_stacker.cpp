@@ -0,0 +1,126 @@
+#include "video_stacker.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <tuple>
+
+#include <opencv2/imgproc.hpp>
+
+#include "incremental_stacker.hpp"
+#include "trace.hpp"
+#include "video_source.hpp"
+
+namespace StackExposures {
+namespace {
+struct Score {
+  size_t video{0};
+  size_t frame{0};
+  double quality{0.0};
+};
+
+struct SharpestFrame {
+  Score score{0, 0, -std::numeric_limits<double>::infinity()};
+  cv::Mat image;
+};
+} // namespace
+
+VideoStacker::VideoStacker(LoadOptions load_options, VideoStackOptions options)
+    : m_load_options(std::move(load_options)), m_options(options) {}
+
+double VideoStacker::quality(const cv::Mat &frame) {
+  STACK_EXP_TRACE_SCOPE("score");
+  cv::Mat as_float;
+  frame.convertTo(as_float, CV_MAKETYPE(CV_32F, frame.channels()));
+  cv::Mat gray = as_float;
+  if (as_float.channels() == 3) {
+    cv::cvtColor(as_float, gray, cv::COLOR_BGR2GRAY);
+  }
+  cv::Mat laplacian;
+  cv::Laplacian(gray, laplacian, CV_32F);
+  cv::Scalar mean;
+  cv::Scalar stddev;
+  cv::meanStdDev(laplacian, mean, stddev);
+  return stddev[0] * stddev[0];
+}
+
+size_t VideoStacker::keep_count(size_t count, double keep_percent) {
+  const auto result = static_cast<size_t>(
+      std::llround(static_cast<double>(count) * keep_percent / 100.0));
+  return std::clamp<size_t>(result, std::min<size_t>(count, 1), count);
+}
+
+cv::Mat
+VideoStacker::stacked_result(const std::vector<std::filesystem::path> &videos) {
+  ImageLoader loader(m_load_options);
+
+  // First pass:  score every frame, keeping only the sharpest.
+  std::vector<Score> scores;
+  SharpestFrame sharpest;
+  for (size_t video = 0; video < videos.size(); ++video) {
+    FrameReadahead frames(VideoSource::open(videos[video]), {},
+                          m_options.readahead);
+    while (const auto frame = frames.next()) {
+      const auto image =
+          loader.load_frame(frame->image, videos[video])->image();
+      const Score score{video, frame->index, quality(image)};
+      scores.push_back(score);
+      if (score.quality > sharpest.score.quality) {
+        sharpest = {score, image};
+      }
+    }
+  }
+  m_frames_scored = scores.size();
+  m_frames_stacked = 0;
+  if (scores.empty()) {
+    return {};
+  }
+
+  const auto keep = keep_count(scores.size(), m_options.keep_percent);
+  // Among equally sharp frames, prefer earlier ones, so that the sharpest
+  // frame -- the first of the sharpest -- is always kept.
+  std::partial_sort(scores.begin(),
+                    scores.begin() + static_cast<std::ptrdiff_t>(keep),
+                    scores.end(),
+                    [](const Score &a, const Score &b) {
+                      if (a.quality != b.quality) {
+                        return a.quality > b.quality;
+                      }
+                      return std::tie(a.video, a.frame) <
+                             std::tie(b.video, b.frame);
+                    });
+  std::vector<std::vector<bool>> wanted(videos.size());
+  for (size_t i = 0; i < keep; ++i) {
+    auto &video_wanted = wanted[scores[i].video];
+    video_wanted.resize(std::max(video_wanted.size(), scores[i].frame + 1));
+    video_wanted[scores[i].frame] = true;
+  }
+  scores.clear();
+
+  // Second pass:  stack the chosen frames, aligned to the sharpest, which
+  // has already been decoded.
+  IncrementalStacker stacker(m_options.align, m_options.interpolation);
+  stacker.add(sharpest.image);
+  sharpest.image.release();
+  wanted[sharpest.score.video][sharpest.score.frame] = false;
+  for (size_t video = 0; video < videos.size(); ++video) {
+    if (std::find(wanted[video].begin(), wanted[video].end(), true) ==
+        wanted[video].end()) {
+      continue;
+    }
+    FrameReadahead frames(VideoSource::open(videos[video]), wanted[video],
+                          m_options.readahead);
+    while (const auto frame = frames.next()) {
+      const auto image = loader.load_frame(frame->image, videos[video]);
+      if (!stacker.add(image->image())) {
+        std::cerr << "Skipped frame " << frame->index << " of "
+                  << videos[video].string() << "." << std::endl;
+      }
+    }
+  }
+  m_frames_stacked = stacker.count();
+  return stacker.mean();
+}
+
+} // namespace StackExposures
@@ -0,0 +1,147 @@
+#include "alignment_cache.hpp"
+#include "image_stacker.hpp"
+#include "star_field.hpp"
+#include "str_util.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <opencv2/core.hpp>
+#include <string>
+#include <unistd.h>
+
+namespace {
+using namespace StackExposures;
+namespace fs = std::filesystem;
+
+ImageInfoFutureContainer futures_of(const std::vector<cv::Mat> &frames) {
+  ImageInfoFutureContainer result;
+  for (const auto &frame : frames) {
+    std::promise<ImageInfo::SharedPtr> promise;
+    promise.set_value(ImageInfo::from_file({}, frame));
+    result.push_back(promise.get_future().share());
+  }
+  return result;
+}
+
+AlignmentCache::Entry entry(const std::string &reference,
+                            const std::string &frame) {
+  cv::Mat warp = cv::Mat::eye(2, 3, CV_32F);
+  warp.at<float>(0, 2) = 1.5F;
+  return {reference, frame, ImageAligner::Motion::euclidean, 0.98, warp};
+}
+} // namespace
+
+TEST_CASE("Alignment Cache") {
+  const auto dir = fs::temp_directory_path() / "test_alignment_cache";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const auto sidecar = dir / "alignments.json";
+
+  SECTION("Identities") {
+    const auto a = dir / "a.bin";
+    const auto b = dir / "b.bin";
+    std::ofstream(a) << "first";
+    std::ofstream(b) << "second";
+    CHECK(AlignmentCache::file_id(a).size() == 16);
+    CHECK(AlignmentCache::file_id(a) == AlignmentCache::file_id(a));
+    CHECK(AlignmentCache::file_id(a) != AlignmentCache::file_id(b));
+    CHECK(AlignmentCache::file_id(dir / "missing.bin").empty());
+
+    CHECK(AlignmentCache::combined_id("a", "b") !=
+          AlignmentCache::combined_id("b", "a"));
+    CHECK(AlignmentCache::combined_id("a", "").empty());
+  }
+
+  SECTION("Save and reload") {
+    {
+      const auto cache = AlignmentCache::open(sidecar);
+      CHECK_FALSE(cache->find("r", "f", ImageAligner::Motion::euclidean));
+      cache->store(entry("r", "f"));
+      REQUIRE(cache->save());
+    }
+
+    const auto cache = AlignmentCache::open(sidecar);
+    const auto found = cache->find("r", "f", ImageAligner::Motion::euclidean);
+    REQUIRE(found);
+    CHECK(found->correlation == 0.98);
+    CHECK(found->warp.at<float>(0, 2) == 1.5F);
+    CHECK_FALSE(cache->find("r", "f", ImageAligner::Motion::affine));
+    CHECK(cache->hits() == 1);
+    CHECK(cache->misses() == 1);
+
+    const auto refreshed = AlignmentCache::open(sidecar, true);
+    CHECK_FALSE(refreshed->find("r", "f", ImageAligner::Motion::euclidean));
+  }
+
+  SECTION("Saving replaces the sidecar whole") {
+    const auto cache = AlignmentCache::open(sidecar);
+    cache->store(entry("r", "f"));
+    REQUIRE(cache->save());
+    size_t num_files = 0;
+    for (const auto &file : fs::directory_iterator(dir)) {
+      CHECK(file.path() == sidecar);
+      ++num_files;
+    }
+    CHECK(num_files == 1);
+  }
+
+  SECTION("Temporary names are private to a process and thread") {
+    const auto suffix = StrUtil::temporary_suffix();
+    CHECK(suffix.find("." + std::to_string(getpid()) + ".") == 0);
+    CHECK(suffix == StrUtil::temporary_suffix());
+    CHECK(suffix !=
+          std::async(std::launch::async, StrUtil::temporary_suffix).get());
+  }
+
+  SECTION("An open cache can forget saved warps") {
+    {
+      const auto cache = AlignmentCache::open(sidecar);
+      cache->store(entry("r", "stale"));
+      REQUIRE(cache->save());
+    }
+
+    const auto cache = AlignmentCache::open(sidecar);
+    cache->store(entry("r", "fresh"));
+    cache->forget_saved();
+    CHECK_FALSE(cache->find("r", "stale", ImageAligner::Motion::euclidean));
+    CHECK(cache->find("r", "fresh", ImageAligner::Motion::euclidean));
+
+    REQUIRE(cache->save());
+    const auto reloaded = AlignmentCache::open(sidecar);
+    CHECK_FALSE(reloaded->find("r", "stale", ImageAligner::Motion::euclidean));
+    CHECK(reloaded->find("r", "fresh", ImageAligner::Motion::euclidean));
+  }
+
+  SECTION("Stacking reuses saved warps") {
+    StarField::Params params;
+    params.size = cv::Size(320, 240);
+    params.stars_per_mp = 3000.0;
+    const StarField field(params);
+    std::vector<cv::Mat> frames;
+    const auto warps = FrameWarp::random(4, 5.0, 0.0, 3);
+    for (size_t i = 0; i < warps.size(); ++i) {
+      frames.push_back(field.render(warps[i], i));
+    }
+    const std::vector<std::string> ids{"f0", "f1", "f2", "f3"};
+
+    const auto first_cache = AlignmentCache::open(sidecar);
+    const auto first = ImageStacker::create(nullptr, first_cache)
+                           ->stacked_result(futures_of(frames), nullptr,
+                                            true, ids);
+    REQUIRE_FALSE(first.empty());
+    CHECK(first_cache->hits() == 0);
+    CHECK(first_cache->misses() == 3);
+    REQUIRE(first_cache->save());
+
+    const auto second_cache = AlignmentCache::open(sidecar);
+    const auto second = ImageStacker::create(nullptr, second_cache)
+                            ->stacked_result(futures_of(frames), nullptr,
+                                             true, ids);
+    CHECK(second_cache->hits() == 3);
+    CHECK(second_cache->misses() == 0);
+    CHECK(cv::norm(first, second, cv::NORM_INF) < 1.0e-3);
+  }
+
+  fs::remove_all(dir);
+}
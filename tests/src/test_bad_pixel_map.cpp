@@ -0,0 +1,152 @@
+#include "bad_pixel_map.hpp"
+#include "image_loader.hpp"
+#include "star_field.hpp"
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core.hpp>
+
+namespace {
+using namespace StackExposures;
+
+auto noisy_dark(int rows, int cols, int type) {
+  cv::Mat result(rows, cols, type);
+  cv::RNG rng(1234);
+  rng.fill(result, cv::RNG::UNIFORM, 10, 14);
+  return result;
+}
+} // namespace
+
+TEST_CASE("Bad Pixel Map") {
+  SECTION("Detect hot pixels") {
+    auto dark = noisy_dark(32, 32, CV_8UC3);
+    dark.at<cv::Vec3b>(5, 7) = cv::Vec3b(200, 200, 200);
+    dark.at<cv::Vec3b>(20, 0) = cv::Vec3b(0, 180, 0);
+
+    const auto map = BadPixelMap::detect(dark, false, 6.0);
+    REQUIRE(map->indices().size() == 2);
+    CHECK(map->indices()[0] == 5 * 32 + 7);
+    CHECK(map->indices()[1] == 20 * 32 + 0);
+  }
+
+  SECTION("Detect hot pixels in sensor data") {
+    auto dark = noisy_dark(32, 32, CV_16UC1);
+    dark.at<uint16_t>(9, 9) = 4000;
+    const auto map = BadPixelMap::detect(dark, true, 6.0);
+    REQUIRE(map->indices().size() == 1);
+    CHECK(map->indices()[0] == 9 * 32 + 9);
+  }
+
+  SECTION("Repair") {
+    cv::Mat image(8, 8, CV_32FC3, cv::Scalar(1, 2, 3));
+    image.at<cv::Vec3f>(3, 3) = cv::Vec3f(99, 99, 99);
+    image.at<cv::Vec3f>(3, 4) = cv::Vec3f(99, 99, 99);
+
+    const auto map = BadPixelMap::create(image.size(), {3 * 8 + 4, 3 * 8 + 3},
+                                         false);
+    map->repair(image);
+    CHECK(image.at<cv::Vec3f>(3, 3) == cv::Vec3f(1, 2, 3));
+    CHECK(image.at<cv::Vec3f>(3, 4) == cv::Vec3f(1, 2, 3));
+  }
+
+  SECTION("Repair sensor data uses same-color neighbors") {
+    // Alternate columns have different values, like a Bayer row.
+    cv::Mat sensor(4, 4, CV_16UC1);
+    for (int row = 0; row < 4; ++row) {
+      for (int col = 0; col < 4; ++col) {
+        sensor.at<uint16_t>(row, col) = (col % 2 == 0) ? 100 : 500;
+      }
+    }
+    sensor.at<uint16_t>(2, 2) = 4000;
+    const auto map = BadPixelMap::create(sensor.size(), {2 * 4 + 2}, true);
+    map->repair(sensor);
+    CHECK(sensor.at<uint16_t>(2, 2) == 100);
+  }
+
+  SECTION("Save and load") {
+    const auto path =
+        std::filesystem::temp_directory_path() / "test_bad_pixel_map.sebp";
+    const auto map = BadPixelMap::create({16, 8}, {3, 1, 2}, true);
+    REQUIRE(map->save(path));
+
+    const auto loaded = BadPixelMap::load(path);
+    REQUIRE(loaded != nullptr);
+    CHECK(loaded->size() == cv::Size(16, 8));
+    CHECK(loaded->cfa());
+    CHECK(loaded->indices() == std::vector<uint32_t>{1, 2, 3});
+    std::filesystem::remove(path);
+  }
+
+  SECTION("Find hot pixels in dithered exposures") {
+    StarField::Params params;
+    params.size = cv::Size(240, 160);
+    params.stars_per_mp = 2000.0;
+    params.star_sigma = 0.6; // Undersampled, so star cores stand out
+    params.num_hot_pixels = 6;
+    const StarField field(params);
+
+    // Without dithering, stars stay put, like hot pixels.
+    BadPixelMap::SessionDetector undithered(false, 6.0);
+    for (size_t i = 0; i < 4; ++i) {
+      undithered.add(field.render(FrameWarp{}, i));
+    }
+    CHECK(undithered.result() == nullptr);
+
+    BadPixelMap::SessionDetector dithered(false, 6.0);
+    const std::vector<FrameWarp> warps{
+        {0.0, 0.0, 0.0}, {5.0, 3.0, 0.0}, {-4.0, 6.0, 0.0}, {7.0, -5.0, 0.0}};
+    for (size_t i = 0; i < warps.size(); ++i) {
+      dithered.add(field.render(warps[i], i));
+    }
+    const auto map = dithered.result();
+    REQUIRE(map != nullptr);
+    for (const auto &p : field.hot_pixels()) {
+      const auto index = static_cast<uint32_t>(p.y * params.size.width + p.x);
+      CHECK(std::binary_search(map->indices().begin(), map->indices().end(),
+                               index));
+    }
+    CHECK(map->indices().size() <= field.hot_pixels().size() + 2);
+  }
+
+  SECTION("Corrupt maps are not loaded") {
+    const auto path =
+        std::filesystem::temp_directory_path() / "test_bad_pixel_corrupt.sebp";
+    const auto map = BadPixelMap::create({16, 8}, {3, 1, 2}, true);
+    const auto patched = [&path](size_t offset, uint32_t value) {
+      std::fstream outs(path, std::ios::binary | std::ios::in | std::ios::out);
+      outs.seekp(static_cast<std::streamoff>(offset));
+      outs.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+    constexpr size_t header_bytes = 6 * sizeof(uint32_t);
+
+    // Missing data
+    REQUIRE(map->save(path));
+    std::filesystem::resize_file(path, header_bytes + sizeof(uint32_t));
+    CHECK(BadPixelMap::load(path) == nullptr);
+
+    // Trailing data
+    REQUIRE(map->save(path));
+    std::ofstream(path, std::ios::binary | std::ios::app) << "junk";
+    CHECK(BadPixelMap::load(path) == nullptr);
+
+    // An index outside the image
+    REQUIRE(map->save(path));
+    patched(header_bytes, 16 * 8);
+    CHECK(BadPixelMap::load(path) == nullptr);
+
+    // More indices than pixels
+    REQUIRE(map->save(path));
+    patched(5 * sizeof(uint32_t), 0xffffffffU);
+    CHECK(BadPixelMap::load(path) == nullptr);
+
+    std::filesystem::remove(path);
+  }
+
+  SECTION("Size mismatch") {
+    cv::Mat image(8, 8, CV_8UC3);
+    const auto map = BadPixelMap::create({4, 4}, {1}, false);
+    REQUIRE_THROWS_AS(map->repair(image), std::runtime_error);
+  }
+}
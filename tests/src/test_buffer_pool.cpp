@@ -0,0 +1,126 @@
+#include "buffer_pool.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+namespace {
+using namespace StackExposures;
+
+cv::Mat pooled(BufferPool &pool, cv::Size size, int type) {
+  cv::Mat result;
+  result.allocator = &pool;
+  result.create(size, type);
+  return result;
+}
+
+const cv::Size frame_size(640, 480);
+const size_t frame_bytes = 640 * 480 * 3;
+} // namespace
+
+TEST_CASE("Buffer Pool") {
+  SECTION("Freed frames are reused") {
+    BufferPool pool(16 * frame_bytes);
+    auto frame = pooled(pool, frame_size, CV_8UC3);
+    frame.setTo(cv::Scalar::all(7));
+    const auto *data = frame.data;
+    frame.release();
+    CHECK(pool.stats().idle_bytes >= frame_bytes);
+
+    frame = pooled(pool, frame_size, CV_8UC3);
+    CHECK(frame.data == data);
+    const auto stats = pool.stats();
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 1);
+    CHECK(stats.idle_bytes == 0);
+  }
+
+  SECTION("Buffers are shared while referenced") {
+    BufferPool pool(16 * frame_bytes);
+    auto frame = pooled(pool, frame_size, CV_8UC3);
+    const auto copy = frame;
+    frame.release();
+    CHECK(pool.stats().idle_bytes == 0);
+    CHECK(copy.size() == frame_size);
+  }
+
+  SECTION("Small buffers are not pooled") {
+    BufferPool pool(16 * frame_bytes);
+    pooled(pool, cv::Size(8, 8), CV_8UC3).release();
+    const auto stats = pool.stats();
+    CHECK(stats.hits == 0);
+    CHECK(stats.misses == 0);
+    CHECK(stats.idle_bytes == 0);
+  }
+
+  SECTION("Without room, freed buffers are discarded") {
+    BufferPool pool(0);
+    pooled(pool, frame_size, CV_8UC3).release();
+    const auto stats = pool.stats();
+    CHECK(stats.discarded == 1);
+    CHECK(stats.idle_bytes == 0);
+  }
+
+  SECTION("Old sizes make room for new") {
+    BufferPool pool(frame_bytes + (64 << 10));
+    pooled(pool, frame_size, CV_8UC3).release();
+    pooled(pool, cv::Size(600, 480), CV_8UC3).release();
+    auto stats = pool.stats();
+    CHECK(stats.discarded == 1);
+    CHECK(stats.idle_bytes < frame_bytes);
+
+    pooled(pool, cv::Size(600, 480), CV_8UC3).release();
+    stats = pool.stats();
+    CHECK(stats.hits == 1);
+  }
+
+  SECTION("Buffers returned longest ago are freed first") {
+    BufferPool pool(2 * frame_bytes);
+    pooled(pool, cv::Size(600, 480), CV_8UC3).release();
+    pooled(pool, cv::Size(620, 480), CV_8UC3).release();
+    pooled(pool, frame_size, CV_8UC3).release();
+    auto stats = pool.stats();
+    CHECK(stats.discarded == 1);
+
+    pooled(pool, cv::Size(620, 480), CV_8UC3).release();
+    stats = pool.stats();
+    CHECK(stats.hits == 1);
+  }
+
+  SECTION("Other sizes make room before the size returned") {
+    BufferPool pool(2 * frame_bytes);
+    pooled(pool, frame_size, CV_8UC3).release();
+    pooled(pool, cv::Size(600, 480), CV_8UC3).release();
+    {
+      auto first = pooled(pool, frame_size, CV_8UC3);
+      auto second = pooled(pool, frame_size, CV_8UC3);
+    }
+    auto stats = pool.stats();
+    CHECK(stats.discarded == 1);
+    CHECK(stats.idle_bytes == 2 * frame_bytes);
+
+    const auto hits = stats.hits;
+    auto first = pooled(pool, frame_size, CV_8UC3);
+    auto second = pooled(pool, frame_size, CV_8UC3);
+    CHECK(pool.stats().hits == hits + 2);
+  }
+
+  SECTION("Trimming frees idle buffers") {
+    BufferPool pool(16 * frame_bytes);
+    pooled(pool, frame_size, CV_8UC3).release();
+    pooled(pool, frame_size, CV_32FC3).release();
+    pool.trim();
+    CHECK(pool.stats().idle_bytes == 0);
+
+    pooled(pool, frame_size, CV_8UC3).release();
+    CHECK(pool.stats().idle_bytes > 0);
+  }
+
+  SECTION("OpenCV operations allocate from the pool") {
+    BufferPool pool(16 * frame_bytes);
+    const cv::Mat source(frame_size, CV_8UC3, cv::Scalar::all(3));
+    cv::Mat converted;
+    converted.allocator = &pool;
+    source.convertTo(converted, CV_32FC3);
+    CHECK(pool.stats().misses == 1);
+    CHECK(converted.at<cv::Vec3f>(0, 0)[0] == 3.0F);
+  }
+}
@@ -0,0 +1,149 @@
+#include "calibration.hpp"
+#include "calibration_builder.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core.hpp>
+#include <string>
+
+namespace {
+using namespace StackExposures;
+
+cv::Mat solid(int rows, int cols, int type, double value) {
+  return cv::Mat(rows, cols, type, cv::Scalar::all(value));
+}
+
+double max_abs_diff(const cv::Mat &a, const cv::Mat &b) {
+  return cv::norm(a, b, cv::NORM_INF);
+}
+} // namespace
+
+TEST_CASE("Calibration") {
+  SECTION("Offset only") {
+    const auto calibration =
+        Calibration::create(solid(4, 4, CV_32FC3, 10.0), {}, false);
+    const auto result = calibration->applied(solid(4, 4, CV_8UC3, 50.0));
+    REQUIRE(result.type() == CV_32FC3);
+    CHECK(max_abs_diff(result, solid(4, 4, CV_32FC3, 40.0)) < 1.0e-6);
+  }
+
+  SECTION("Offset and gain") {
+    cv::Mat flat = solid(4, 4, CV_32FC3, 100.0);
+    flat.at<cv::Vec3f>(0, 0) = cv::Vec3f(50.0, 50.0, 50.0);
+    const auto gain = Calibration::flat_gain(flat);
+    // Vignetted pixels get more gain than the rest.
+    CHECK(gain.at<cv::Vec3f>(0, 0)[0] > gain.at<cv::Vec3f>(1, 1)[0]);
+
+    const auto calibration =
+        Calibration::create(solid(4, 4, CV_32FC3, 10.0), gain, false);
+    cv::Mat light = solid(4, 4, CV_16UC3, 110.0);
+    light.at<cv::Vec3w>(0, 0) = cv::Vec3w(60, 60, 60);
+    const auto result = calibration->applied(light);
+    // Once calibrated, the vignetted pixel matches its neighbors.
+    CHECK(std::abs(result.at<cv::Vec3f>(0, 0)[1] -
+                   result.at<cv::Vec3f>(1, 1)[1]) < 1.0e-3);
+  }
+
+  SECTION("Bayer flat keeps color balance") {
+    // Red pixels are twice as bright as the rest.
+    cv::Mat flat = solid(4, 4, CV_32FC1, 100.0);
+    for (int row = 0; row < 4; row += 2) {
+      for (int col = 0; col < 4; col += 2) {
+        flat.at<float>(row, col) = 200.0;
+      }
+    }
+    const auto gain = Calibration::flat_gain(flat);
+    CHECK(max_abs_diff(gain, solid(4, 4, CV_32FC1, 1.0)) < 1.0e-6);
+  }
+
+  SECTION("Sensor data") {
+    const auto black = solid(4, 4, CV_32FC1, 64.0);
+    const auto calibration =
+        Calibration::create(solid(4, 4, CV_32FC1, 100.0), {}, true);
+    CHECK(calibration->sensor_domain());
+
+    cv::Mat sensor = solid(4, 4, CV_16UC1, 1100.0);
+    calibration->apply_to_sensor(sensor, black);
+    CHECK(max_abs_diff(sensor, solid(4, 4, CV_16UC1, 1064.0)) == 0.0);
+  }
+
+  SECTION("Size mismatch") {
+    const auto calibration =
+        Calibration::create(solid(4, 4, CV_32FC3, 10.0), {}, false);
+    REQUIRE_THROWS_AS(calibration->applied(solid(8, 8, CV_8UC3, 50.0)),
+                      std::runtime_error);
+  }
+}
+
+TEST_CASE("Calibration Builder") {
+  // See CMakeLists.txt for TEST_DATA_DIR
+  const std::string data_dir(TEST_DATA_DIR);
+  const std::filesystem::path image_path(data_dir + "orientation1.jpg");
+
+  SECTION("No frames") {
+    CalibrationBuilder builder({}, false);
+    CHECK(builder.build({}) == nullptr);
+  }
+
+  SECTION("Cached master matches computed master") {
+    const auto cache_dir =
+        std::filesystem::temp_directory_path() / "test_calibration_cache";
+    std::filesystem::remove_all(cache_dir);
+
+    CalibrationBuilder builder({}, false, cache_dir);
+    const auto computed = builder.master("dark", {image_path, image_path});
+    REQUIRE(!computed.empty());
+    CHECK(!std::filesystem::is_empty(cache_dir));
+
+    const auto cached = builder.master("dark", {image_path, image_path});
+    REQUIRE(cached.type() == computed.type());
+    CHECK(max_abs_diff(cached, computed) == 0.0);
+
+    std::filesystem::remove_all(cache_dir);
+  }
+
+  SECTION("Corrupt cached masters are rebuilt") {
+    const auto cache_dir =
+        std::filesystem::temp_directory_path() / "test_calibration_corrupt";
+    std::filesystem::remove_all(cache_dir);
+
+    CalibrationBuilder builder({}, false, cache_dir);
+    const auto computed = builder.master("dark", {image_path, image_path});
+    REQUIRE(!computed.empty());
+    const auto cached_path =
+        std::filesystem::directory_iterator(cache_dir)->path();
+    const auto size = std::filesystem::file_size(cached_path);
+
+    // Truncated
+    std::filesystem::resize_file(cached_path, size / 2);
+    auto rebuilt = builder.master("dark", {image_path, image_path});
+    REQUIRE(rebuilt.type() == computed.type());
+    CHECK(max_abs_diff(rebuilt, computed) == 0.0);
+
+    // Foreign Mat type
+    {
+      std::fstream outs(cached_path,
+                        std::ios::binary | std::ios::in | std::ios::out);
+      const int32_t type = CV_64FC4;
+      outs.seekp(4 * sizeof(int32_t));
+      outs.write(reinterpret_cast<const char *>(&type), sizeof(type));
+    }
+    rebuilt = builder.master("dark", {image_path, image_path});
+    REQUIRE(rebuilt.type() == computed.type());
+    CHECK(max_abs_diff(rebuilt, computed) == 0.0);
+
+    std::filesystem::remove_all(cache_dir);
+  }
+
+  SECTION("Dark calibration") {
+    CalibrationBuilder builder({}, false);
+    const auto calibration = builder.build({.darks = {image_path}});
+    REQUIRE(calibration != nullptr);
+
+    ImageLoader loader({.calibration = calibration});
+    const auto info = loader.load_image(image_path);
+    REQUIRE(info->image().type() == CV_32FC3);
+    CHECK(cv::norm(info->image(), cv::NORM_INF) == 0.0);
+  }
+}
@@ -0,0 +1,90 @@
+#include "directory_watcher.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+using namespace StackExposures;
+namespace fs = std::filesystem;
+
+void write_file(const fs::path &path) {
+  std::ofstream outf(path, std::ios::binary);
+  outf << "not really an image";
+}
+
+// Collect completed files until name appears or a few seconds pass.
+bool wait_for(DirectoryWatcher &watcher, const fs::path &name) {
+  for (int i = 0; i < 20; ++i) {
+    for (const auto &path : watcher.wait(std::chrono::milliseconds(250))) {
+      if (path.filename() == name) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+} // namespace
+
+TEST_CASE("Directory Watcher") {
+  const auto dir = fs::temp_directory_path() / "test_directory_watcher";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+
+  SECTION("Not a directory") {
+    CHECK_THROWS_AS(DirectoryWatcher(dir / "no_such_dir"), std::runtime_error);
+  }
+
+  SECTION("Existing files") {
+    write_file(dir / "b.tif");
+    write_file(dir / "a.tif");
+    write_file(dir / ".hidden.tif");
+    write_file(dir / "c.tif.part");
+
+    DirectoryWatcher watcher(dir);
+    const auto &existing = watcher.existing_files();
+    REQUIRE(existing.size() == 2);
+    CHECK(existing[0].filename() == "a.tif");
+    CHECK(existing[1].filename() == "b.tif");
+  }
+
+  SECTION("Existing files still being written") {
+    write_file(dir / "done.tif");
+    std::ofstream growing(dir / "growing.tif", std::ios::binary);
+    std::atomic_bool writing{true};
+    std::thread writer([&]() {
+      while (writing) {
+        growing << "more data" << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      }
+      growing.close();
+    });
+
+    DirectoryWatcher watcher(dir);
+    writing = false;
+    writer.join();
+    const auto &existing = watcher.existing_files();
+    REQUIRE(existing.size() == 1);
+    CHECK(existing[0].filename() == "done.tif");
+    CHECK(wait_for(watcher, "growing.tif"));
+  }
+
+  SECTION("New files") {
+    DirectoryWatcher watcher(dir);
+    CHECK(watcher.existing_files().empty());
+    CHECK(watcher.wait(std::chrono::milliseconds(10)).empty());
+
+    write_file(dir / "new.tif");
+    CHECK(wait_for(watcher, "new.tif"));
+
+    // Files renamed into place are reported under their final name.
+    write_file(dir / "moved.tif.tmp");
+    fs::rename(dir / "moved.tif.tmp", dir / "moved.tif");
+    CHECK(wait_for(watcher, "moved.tif"));
+  }
+
+  fs::remove_all(dir);
+}
@@ -1,8 +1,10 @@
 #include "image_aligner.hpp"
 #include "image_loader.hpp"
 #include <catch2/catch_test_macros.hpp>
+#include <opencv2/imgproc.hpp>
 #include <iostream>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace {
@@ -71,3 +73,100 @@ TEST_CASE("Image Aligner") {
     // TODO capture and verify stderr messages.
   }
 }
+
+TEST_CASE("Image Aligner warping") {
+  using StackExposures::ImageAligner;
+
+  const auto warp = [](double tx, double ty, double angle = 0.0) {
+    cv::Mat result = cv::getRotationMatrix2D({0.0F, 0.0F}, angle, 1.0);
+    result.at<double>(0, 2) = tx;
+    result.at<double>(1, 2) = ty;
+    result.convertTo(result, CV_32F);
+    return result;
+  };
+
+  cv::Mat frame;
+  image(32, 48, 3, 5).convertTo(frame, CV_32FC3);
+  frame += cv::Scalar(10.0, 20.0, 30.0);
+
+  SECTION("Parse interpolation") {
+    CHECK(ImageAligner::parse_interpolation("nearest") ==
+          ImageAligner::Interpolation::nearest);
+    CHECK(ImageAligner::parse_interpolation("bilinear") ==
+          ImageAligner::Interpolation::bilinear);
+    CHECK(ImageAligner::parse_interpolation("lanczos") ==
+          ImageAligner::Interpolation::lanczos);
+    CHECK(!ImageAligner::parse_interpolation("cubic"));
+    CHECK(!ImageAligner::parse_interpolation(""));
+  }
+
+  SECTION("Integer shifts") {
+    const cv::Size size(48, 32);
+    CHECK(ImageAligner::integer_shift(warp(0.0, 0.0), size) == cv::Point());
+    CHECK(ImageAligner::integer_shift(warp(3.0, -2.0), size) ==
+          cv::Point(3, -2));
+    CHECK(ImageAligner::integer_shift(warp(2.98, 1.01), size) ==
+          cv::Point(3, 1));
+    CHECK(!ImageAligner::integer_shift(warp(0.5, 0.0), size));
+    // A rotation too small to notice near the origin moves far corners.
+    CHECK(!ImageAligner::integer_shift(warp(0.0, 0.0, 0.5), size));
+    CHECK(ImageAligner::integer_shift(warp(0.0, 0.0, 0.01), size) ==
+          cv::Point());
+  }
+
+  SECTION("Whole-pixel shifts match warpAffine") {
+    for (const auto &shift :
+         {cv::Point(0, 0), cv::Point(3, -2), cv::Point(-5, 7),
+          cv::Point(60, 0)}) {
+      const auto m = warp(shift.x, shift.y);
+      cv::Mat expected;
+      cv::warpAffine(frame, expected, m, frame.size(),
+                     cv::INTER_LINEAR + cv::WARP_INVERSE_MAP);
+      expected += 1.0;
+
+      cv::Mat sum(frame.size(), CV_32FC3, cv::Scalar::all(1.0));
+      ImageAligner().add_warped(frame, m, sum);
+      CHECK(cv::norm(sum, expected, cv::NORM_INF) == 0.0);
+    }
+
+    // align() copies, rather than resamples, too.
+    cv::Mat aligned;
+    ImageAligner().align(frame, frame, aligned);
+    CHECK(cv::norm(aligned, frame, cv::NORM_INF) == 0.0);
+  }
+
+  SECTION("Sub-pixel warps use the chosen kernel") {
+    const auto m = warp(1.5, -0.25, 2.0);
+    REQUIRE(!ImageAligner::integer_shift(m, frame.size()));
+    for (const auto &[kind, flags] :
+         {std::pair{ImageAligner::Interpolation::nearest, cv::INTER_NEAREST},
+          std::pair{ImageAligner::Interpolation::bilinear, cv::INTER_LINEAR},
+          std::pair{ImageAligner::Interpolation::lanczos,
+                    cv::INTER_LANCZOS4}}) {
+      cv::Mat expected;
+      cv::warpAffine(frame, expected, m, frame.size(),
+                     flags + cv::WARP_INVERSE_MAP);
+
+      cv::Mat sum = cv::Mat::zeros(frame.size(), CV_32FC3);
+      ImageAligner(ImageAligner::Motion::euclidean, nullptr, kind)
+          .add_warped(frame, m, sum);
+      CHECK(cv::norm(sum, expected, cv::NORM_INF) == 0.0);
+    }
+  }
+
+  SECTION("Accumulate") {
+    cv::Mat shifted;
+    cv::warpAffine(frame, shifted, warp(-2.0, -1.0), frame.size(),
+                   cv::INTER_NEAREST + cv::WARP_INVERSE_MAP);
+    cv::Mat sum = frame.clone();
+    ImageAligner aligner(ImageAligner::Motion::translation);
+    REQUIRE(aligner.accumulate(frame, shifted, sum));
+    CHECK(sum.size() == frame.size());
+
+    cv::Mat unchanged = sum.clone();
+    cv::Mat small;
+    image(8, 8).convertTo(small, CV_32FC3);
+    CHECK(!aligner.accumulate(frame, small, sum));
+    CHECK(cv::norm(sum, unchanged, cv::NORM_INF) == 0.0);
+  }
+}
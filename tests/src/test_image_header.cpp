@@ -0,0 +1,148 @@
+#include "image_header.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+using namespace StackExposures;
+
+std::filesystem::path scratch_dir() {
+  const auto result =
+      std::filesystem::temp_directory_path() / "stack_exp_test_image_header";
+  std::filesystem::create_directories(result);
+  return result;
+}
+
+ImageHeader header_of_size(const std::string &name, cv::Size size) {
+  ImageHeader result{name};
+  result.size = size;
+  return result;
+}
+
+std::vector<std::string> names(const std::vector<ImageHeader> &headers) {
+  std::vector<std::string> result;
+  for (const auto &header : headers) {
+    result.push_back(header.path.string());
+  }
+  return result;
+}
+} // namespace
+
+TEST_CASE("Image Header") {
+  const std::string data_dir(TEST_DATA_DIR);
+
+  SECTION("JPEG size matches the decoded image") {
+    for (const auto *name : {"exif_extractor_missing_icc.jpg",
+                             "exif_extractor_missing_icc_2.jpg"}) {
+      const auto path = data_dir + name;
+      const auto header = ImageHeader::read(path);
+      REQUIRE(header.known());
+      CHECK(header.size == cv::imread(path).size());
+      CHECK(header.sensor_size.empty());
+    }
+  }
+
+  SECTION("PNG and TIFF sizes") {
+    const cv::Mat image(30, 40, CV_16UC3, cv::Scalar::all(1000));
+    for (const auto *ext : {".png", ".tif"}) {
+      const auto path = scratch_dir() / (std::string("image") + ext);
+      REQUIRE(cv::imwrite(path.string(), image));
+      CHECK(ImageHeader::read(path).size == cv::Size(40, 30));
+    }
+  }
+
+  SECTION("Unreadable files have unknown size") {
+    const auto path = scratch_dir() / "bogus.jpg";
+    std::ofstream(path) << "not an image";
+    CHECK_FALSE(ImageHeader::read(path).known());
+    CHECK_FALSE(ImageHeader::read("/no/such/image.jpg").known());
+  }
+
+  SECTION("Headers are read in order") {
+    const auto headers = read_headers({data_dir + "orientation1.jpg",
+                                       "/no/such/image.jpg",
+                                       data_dir + "orientation2.jpg"});
+    REQUIRE(headers.size() == 3);
+    CHECK(headers[0].known());
+    CHECK_FALSE(headers[1].known());
+    CHECK(headers[2].path == data_dir + "orientation2.jpg");
+  }
+
+  SECTION("Loaded size") {
+    const auto header = header_of_size("a", cv::Size(100, 50));
+    CHECK(header.loaded_bytes({}) == 100 * 50 * 3);
+    CHECK(header.loaded_bytes({.half_size = true}) == 50 * 25 * 3);
+    CHECK(header.loaded_bytes({.roi = cv::Rect(90, 0, 20, 10)}) ==
+          10 * 10 * 3);
+    CHECK(ImageHeader{"b"}.loaded_bytes({}) == 0);
+    CHECK(header.cfa_bytes() == 0);
+  }
+
+  SECTION("Mismatched sizes are dropped") {
+    const std::vector<ImageHeader> headers{
+        header_of_size("small", cv::Size(10, 10)),
+        header_of_size("big1", cv::Size(20, 10)), ImageHeader{"unknown"},
+        header_of_size("big2", cv::Size(20, 10))};
+    CHECK(names(same_size_headers(headers)) ==
+          std::vector<std::string>{"big1", "unknown", "big2"});
+  }
+
+  SECTION("Of equally common sizes, the first is kept") {
+    const std::vector<ImageHeader> headers{
+        header_of_size("first", cv::Size(10, 10)),
+        header_of_size("second", cv::Size(20, 10))};
+    CHECK(names(same_size_headers(headers)) ==
+          std::vector<std::string>{"first"});
+  }
+
+  SECTION("Sizes are compared within the region of interest") {
+    const std::vector<ImageHeader> headers{
+        header_of_size("small", cv::Size(10, 10)),
+        header_of_size("big1", cv::Size(20, 10)),
+        header_of_size("big2", cv::Size(20, 10))};
+    CHECK(names(same_size_headers(headers, {.roi = cv::Rect(0, 0, 8, 8)})) ==
+          std::vector<std::string>{"small", "big1", "big2"});
+    CHECK(names(same_size_headers(headers, {.roi = cv::Rect(5, 0, 8, 8)})) ==
+          std::vector<std::string>{"big1", "big2"});
+  }
+
+  SECTION("Mixed settings") {
+    std::vector<ImageHeader> headers(3);
+    headers[0].exposure = 30.0;
+    headers[1].exposure = 30.0;
+    CHECK(settings_warning(headers).empty());
+
+    headers[2].exposure = 1.0 / 100;
+    CHECK(settings_warning(headers).find("Exposure time") !=
+          std::string::npos);
+
+    headers[2].exposure = 0.0;
+    headers[0].iso = 800.0;
+    headers[1].iso = 1600.0;
+    const auto warning = settings_warning(headers);
+    CHECK(warning.find("ISO") != std::string::npos);
+    CHECK(warning.find("Exposure time") == std::string::npos);
+  }
+
+  SECTION("Gaps between exposures") {
+    constexpr std::time_t start = 1700000000;
+    std::vector<ImageHeader> headers(4);
+    for (size_t i = 0; i < headers.size(); ++i) {
+      headers[i].path = "frame" + std::to_string(i);
+      headers[i].timestamp = start + static_cast<std::time_t>(60 * i);
+    }
+    CHECK(settings_warning(headers).empty());
+
+    // Another night's frame, listed first.
+    headers[0].timestamp = start + (24 * 60 * 60);
+    const auto warning = settings_warning(headers);
+    CHECK(warning.find("1437 min before frame0") != std::string::npos);
+
+    // Unknown times are ignored.
+    headers[0].timestamp = 0;
+    CHECK(settings_warning(headers).empty());
+  }
+}
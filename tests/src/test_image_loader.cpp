@@ -28,6 +28,67 @@ TEST_CASE("Image Loader") {
     CHECK(image_info->path() == std::filesystem::path(image_path));
   }
 
+  SECTION("Load half size") {
+    const std::string data_dir(TEST_DATA_DIR);
+    const std::string image_path(data_dir + "exif_extractor_missing_icc.jpg");
+
+    StackExposures::ImageLoader half_loader({.half_size = true});
+    auto full = loader.load_image(image_path);
+    auto half = half_loader.load_image(image_path);
+    CHECK(half->cols() == (full->cols() + 1) / 2);
+    CHECK(half->rows() == (full->rows() + 1) / 2);
+  }
+
+  SECTION("Load region of interest") {
+    const std::string data_dir(TEST_DATA_DIR);
+    const std::string image_path(data_dir + "exif_extractor_missing_icc.jpg");
+
+    StackExposures::ImageLoader roi_loader({.roi = cv::Rect(10, 20, 30, 40)});
+    auto full = loader.load_image(image_path);
+    auto roi = roi_loader.load_image(image_path);
+    REQUIRE(roi->cols() == 30);
+    REQUIRE(roi->rows() == 40);
+
+    cv::Mat diff;
+    cv::absdiff(full->image()(cv::Rect(10, 20, 30, 40)), roi->image(), diff);
+    CHECK(cv::countNonZero(diff.reshape(1)) == 0);
+  }
+
+  SECTION("Load region of interest outside image") {
+    const std::string data_dir(TEST_DATA_DIR);
+    const std::string image_path(data_dir + "exif_extractor_missing_icc.jpg");
+
+    StackExposures::ImageLoader roi_loader(
+        {.roi = cv::Rect(100000, 100000, 10, 10)});
+    REQUIRE_THROWS_AS(roi_loader.load_image(image_path), std::runtime_error);
+  }
+
+  SECTION("Calibrated images stored as half precision") {
+    const std::string data_dir(TEST_DATA_DIR);
+    const std::string image_path(data_dir + "exif_extractor_missing_icc.jpg");
+
+    const auto full = loader.load_image(image_path);
+    const cv::Mat offset(full->image().size(), CV_32FC3, cv::Scalar::all(1.0));
+    const auto calibration =
+        StackExposures::Calibration::create(offset, {}, false);
+
+    StackExposures::ImageLoader float_loader({.calibration = calibration});
+    StackExposures::ImageLoader half_loader(
+        {.calibration = calibration, .half_float = true});
+    const auto as_float = float_loader.load_image(image_path);
+    const auto as_half = half_loader.load_image(image_path);
+    REQUIRE(as_float->image().type() == CV_32FC3);
+    REQUIRE(as_half->image().type() == CV_16FC3);
+
+    cv::Mat widened;
+    as_half->image().convertTo(widened, CV_32FC3);
+    cv::Mat diff;
+    cv::absdiff(as_float->image(), widened, diff);
+    double max_diff = 0.0;
+    cv::minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+    CHECK(max_diff <= 0.125);
+  }
+
   // TO BE WRITTEN -- so far, I can trigger only fatal libraw errors.
   // SECTION("Load with libraw non-fatal error") {
   // }
@@ -1,8 +1,12 @@
 #include "image_stacker.hpp"
+#include "star_field.hpp"
 #include <catch2/catch_test_macros.hpp>
+#include <cmath>
 #include <iostream>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
+#include <thread>
+#include <vector>
 
 // TODO: DRY
 namespace {
@@ -93,6 +97,66 @@ TEST_CASE("Image Stacker") {
     CHECK(stacked.empty());
   }
 
+  SECTION("Half-precision images") {
+    auto color = rgb(150, 75, 10);
+    cv::Mat half;
+    solid_color(4, 4, color)->image().convertTo(half, CV_16FC3);
+
+    for (size_t i = 0; i < 3; ++i) {
+      images.emplace_back(future_image(ImageInfo::from_file({}, half)));
+    }
+    const auto stacked = stacker->stacked_result(images, nullptr, false);
+    REQUIRE(stacked.type() == CV_32FC3);
+    check_solid_color(to_8bit(stacked), color, "Half-precision images");
+  }
+
+  SECTION("Concurrent calls on one stacker") {
+    const auto budget = MemoryBudget::create(size_t{1} << 30);
+    const auto shared_stacker = ImageStacker::create(budget);
+    const std::vector<cv::Vec3b> colors{rgb(10, 20, 30), rgb(200, 100, 50)};
+    std::vector<cv::Mat> results(colors.size());
+    std::vector<std::thread> callers;
+    for (size_t i = 0; i < colors.size(); ++i) {
+      callers.emplace_back([&, i]() {
+        ImageInfoFutureContainer own_images;
+        for (size_t j = 0; j < 7; ++j) {
+          own_images.emplace_back(future_image(solid_color(8, 8, colors[i])));
+        }
+        results[i] = shared_stacker->stacked_result(own_images, nullptr, false,
+                                                    {"a", "b", "c", "d", "e",
+                                                     "f", "g"});
+      });
+    }
+    for (auto &caller : callers) {
+      caller.join();
+    }
+    for (size_t i = 0; i < colors.size(); ++i) {
+      check_solid_color(to_8bit(results[i]), colors[i], "Concurrent calls");
+    }
+    // Working memory is returned once each call ends.
+    CHECK(budget->in_use() == 0);
+  }
+
+  SECTION("An unalignable frame is skipped") {
+    StarField::Params params;
+    params.size = cv::Size(320, 240);
+    params.depth = 8;
+    const StarField field(params);
+    const auto good_mean = cv::mean(field.render(FrameWarp{}, 0))[0];
+
+    // A blank frame, in the middle, cannot be aligned with the others.
+    for (size_t i = 0; i < 5; ++i) {
+      const auto frame = (i == 2)
+                             ? cv::Mat(params.size, CV_8UC3, cv::Scalar(0))
+                             : field.render(FrameWarp{}, i);
+      images.emplace_back(future_image(ImageInfo::from_file({}, frame)));
+    }
+    const auto stacked = stacker->stacked_result(images, nullptr, true);
+    REQUIRE_FALSE(stacked.empty());
+    // Averaging in the blank frame would darken the result by a fifth.
+    CHECK(std::abs(cv::mean(stacked)[0] - good_mean) < 0.05 * good_mean);
+  }
+
   SECTION("With dark image") {
     auto color = rgb(150, 150, 150);
     auto image = solid_color(4, 4, color);
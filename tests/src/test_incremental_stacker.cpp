@@ -0,0 +1,74 @@
+#include "incremental_stacker.hpp"
+#include "star_field.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+namespace {
+using namespace StackExposures;
+
+auto small_field() {
+  StarField::Params params;
+  params.size = cv::Size(320, 240);
+  params.stars_per_mp = 3000.0;
+  params.noise = 0.002;
+  return StarField(params);
+}
+} // namespace
+
+TEST_CASE("Incremental Stacker") {
+  const auto field = small_field();
+
+  SECTION("Empty") {
+    IncrementalStacker stacker;
+    CHECK(stacker.count() == 0);
+    CHECK(stacker.mean().empty());
+    CHECK(stacker.preview(64).empty());
+    CHECK_FALSE(stacker.add(cv::Mat()));
+    CHECK(stacker.count() == 0);
+  }
+
+  SECTION("Unaligned frames are averaged") {
+    IncrementalStacker stacker(false);
+    for (size_t i = 0; i < 3; ++i) {
+      REQUIRE(stacker.add(field.render(FrameWarp{}, i)));
+    }
+    CHECK(stacker.count() == 3);
+
+    const auto mean = stacker.mean();
+    CHECK(mean.size() == field.params().size);
+    CHECK(mean.type() == CV_32FC3);
+  }
+
+  SECTION("Shifted frames are aligned to the first") {
+    IncrementalStacker stacker;
+    const auto reference = field.render(FrameWarp{}, 0);
+    REQUIRE(stacker.add(reference));
+    REQUIRE(stacker.add(field.render(FrameWarp{3.0, -2.0, 0.0}, 1)));
+    CHECK(stacker.count() == 2);
+
+    cv::Mat expected;
+    reference.convertTo(expected, CV_32FC3);
+    const cv::Rect interior(10, 10, expected.cols - 20, expected.rows - 20);
+    cv::Mat diff;
+    cv::absdiff(stacker.mean()(interior), expected(interior), diff);
+    const auto scale = (reference.depth() == CV_16U) ? 65535.0 : 255.0;
+    CHECK(cv::mean(diff)[0] < 0.02 * scale);
+  }
+
+  SECTION("Mismatched sizes are rejected") {
+    IncrementalStacker stacker(false);
+    REQUIRE(stacker.add(field.render(FrameWarp{}, 0)));
+    CHECK_FALSE(stacker.add(cv::Mat(10, 10, CV_8UC3, cv::Scalar::all(0))));
+    CHECK(stacker.count() == 1);
+  }
+
+  SECTION("Previews are reduced") {
+    IncrementalStacker stacker(false);
+    REQUIRE(stacker.add(field.render(FrameWarp{}, 0)));
+
+    const auto preview = stacker.preview(160);
+    CHECK(preview.cols == 160);
+    CHECK(preview.rows == 120);
+    CHECK(stacker.preview(1000).size() == field.params().size);
+  }
+}
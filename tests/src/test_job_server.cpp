@@ -0,0 +1,248 @@
+#include "job_server.hpp"
+#include "star_field.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+using namespace StackExposures;
+
+std::filesystem::path scratch_dir() {
+  const auto result =
+      std::filesystem::temp_directory_path() / "stack_exp_test_job_server";
+  std::filesystem::create_directories(result);
+  return result;
+}
+
+// A client connection that sends lines and reads the replies.
+class Client {
+public:
+  explicit Client(const std::filesystem::path &socket_path)
+      : m_fd(::socket(AF_UNIX, SOCK_STREAM, 0)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const auto text = socket_path.string();
+    std::copy(text.begin(), text.end(), address.sun_path);
+    m_connected =
+        (m_fd >= 0) &&
+        (::connect(m_fd, reinterpret_cast<const sockaddr *>(&address),
+                   sizeof(address)) == 0);
+  }
+  ~Client() { ::close(m_fd); }
+
+  Client(const Client &src) = delete;
+  Client(Client &&src) = delete;
+  Client &operator=(const Client &src) = delete;
+  Client &operator=(Client &&src) = delete;
+
+  [[nodiscard]] bool connected() const { return m_connected; }
+
+  void send(const std::string &line) const {
+    const auto text = line + "\n";
+    (void)::send(m_fd, text.data(), text.size(), 0);
+  }
+
+  // The next reply line; empty if none arrives within 30 seconds.
+  std::string next_line() {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (m_pending.find('\n') == std::string::npos) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        return {};
+      }
+      pollfd readable{m_fd, POLLIN, 0};
+      if (::poll(&readable, 1, 100) <= 0) {
+        continue;
+      }
+      char buffer[1024];
+      const auto count = ::recv(m_fd, buffer, sizeof(buffer), 0);
+      if (count <= 0) {
+        return {};
+      }
+      m_pending.append(buffer, static_cast<size_t>(count));
+    }
+    const auto end = m_pending.find('\n');
+    auto result = m_pending.substr(0, end);
+    m_pending.erase(0, end + 1);
+    return result;
+  }
+
+  // Reply lines up to and including the first "done" or "error" event.
+  std::vector<std::string> replies_until_finished() {
+    std::vector<std::string> result;
+    for (auto line = next_line(); !line.empty(); line = next_line()) {
+      result.push_back(line);
+      if (contains(line, "\"event\":\"done\"") ||
+          contains(line, "\"event\":\"error\"")) {
+        break;
+      }
+    }
+    return result;
+  }
+
+  static bool contains(const std::string &text, const std::string &part) {
+    return text.find(part) != std::string::npos;
+  }
+
+private:
+  int m_fd;
+  bool m_connected{false};
+  std::string m_pending;
+};
+
+// Runs a server on its own thread for the life of the instance.
+class RunningServer {
+public:
+  RunningServer(const std::filesystem::path &socket_path, StackRunner &runner)
+      : m_server(socket_path, runner, StackJob{}, 2),
+        m_thread([this]() { m_server.serve(m_stop); }) {}
+  ~RunningServer() {
+    m_stop = true;
+    m_thread.join();
+  }
+
+  RunningServer(const RunningServer &src) = delete;
+  RunningServer(RunningServer &&src) = delete;
+  RunningServer &operator=(const RunningServer &src) = delete;
+  RunningServer &operator=(RunningServer &&src) = delete;
+
+private:
+  std::atomic_bool m_stop{false};
+  JobServer m_server;
+  std::thread m_thread;
+};
+
+std::vector<std::string> write_frames(const std::filesystem::path &dir) {
+  StarField::Params params;
+  params.size = cv::Size(160, 120);
+  params.stars_per_mp = 3000.0;
+  const StarField field(params);
+  std::vector<std::string> result;
+  for (size_t i = 0; i < 3; ++i) {
+    const auto name = "frame_" + std::to_string(i) + ".tif";
+    REQUIRE(cv::imwrite((dir / name).string(), field.render(FrameWarp{}, i)));
+    result.push_back(name);
+  }
+  return result;
+}
+} // namespace
+
+TEST_CASE("Job Server") {
+  const auto dir = scratch_dir();
+  const auto socket_path = dir / "server.sock";
+  StackRunner runner;
+
+  SECTION("Malformed jobs are reported") {
+    const RunningServer server(socket_path, runner);
+    Client client(socket_path);
+    REQUIRE(client.connected());
+
+    client.send("{not json");
+    const auto parse_error = client.next_line();
+    CHECK(Client::contains(parse_error, "\"event\":\"error\""));
+
+    client.send(R"({"id": "a", "images": []})");
+    const auto no_images = client.next_line();
+    CHECK(Client::contains(no_images, "\"id\":\"a\""));
+    CHECK(Client::contains(no_images, "\"event\":\"error\""));
+  }
+
+  SECTION("Jobs are stacked and saved") {
+    const auto names = write_frames(dir);
+    const auto output = dir / "served.tiff";
+    std::filesystem::remove(output);
+    const RunningServer server(socket_path, runner);
+    Client client(socket_path);
+    REQUIRE(client.connected());
+
+    client.send(R"({"id": 7, "directory": ")" + dir.string() +
+                R"(", "images": [")" + names[0] + R"(", ")" + names[1] +
+                R"(", ")" + names[2] +
+                R"("], "output": "served.tiff", "align": false})");
+    const auto replies = client.replies_until_finished();
+    REQUIRE(replies.size() == 4);
+    CHECK(Client::contains(replies[0], R"({"id":7,"event":"started")"));
+    CHECK(Client::contains(replies[0], "\"images\":3"));
+    CHECK(Client::contains(replies[1], "\"event\":\"stacked\""));
+    CHECK(Client::contains(replies[2], "\"event\":\"wrote\""));
+    CHECK(Client::contains(replies[2], "served.tiff"));
+    CHECK(Client::contains(replies[3], "\"event\":\"done\""));
+    CHECK(std::filesystem::exists(output));
+  }
+
+  SECTION("Jobs may be sent without waiting for replies") {
+    const auto names = write_frames(dir);
+    const RunningServer server(socket_path, runner);
+    Client client(socket_path);
+    REQUIRE(client.connected());
+
+    for (const auto *id : {"x", "y"}) {
+      client.send(R"({"id": ")" + std::string(id) + R"(", "directory": ")" +
+                  dir.string() + R"(", "images": [")" + names[0] +
+                  R"(", ")" + names[1] + R"("], "output": ")" +
+                  std::string(id) + R"(.tiff", "align": false})");
+    }
+    size_t num_done = 0;
+    while (num_done < 2) {
+      const auto line = client.next_line();
+      if (line.empty()) {
+        break;
+      }
+      CHECK_FALSE(Client::contains(line, "\"event\":\"error\""));
+      if (Client::contains(line, "\"event\":\"done\"")) {
+        ++num_done;
+      }
+    }
+    CHECK(num_done == 2);
+  }
+
+  SECTION("Many pipelined jobs are all answered") {
+    const RunningServer server(socket_path, runner);
+    Client client(socket_path);
+    REQUIRE(client.connected());
+
+    constexpr size_t num_jobs = 200;
+    std::thread sender([&client]() {
+      for (size_t i = 0; i < num_jobs; ++i) {
+        client.send(R"({"id": )" + std::to_string(i) + R"(, "images": []})");
+      }
+    });
+    size_t num_errors = 0;
+    while (num_errors < num_jobs) {
+      const auto line = client.next_line();
+      if (line.empty()) {
+        break;
+      }
+      if (Client::contains(line, "\"event\":\"error\"")) {
+        ++num_errors;
+      }
+    }
+    sender.join();
+    CHECK(num_errors == num_jobs);
+  }
+
+  SECTION("The socket is removed on shutdown") {
+    {
+      const RunningServer server(socket_path, runner);
+      CHECK(std::filesystem::is_socket(socket_path));
+    }
+    CHECK_FALSE(std::filesystem::exists(socket_path));
+  }
+
+  SECTION("Other files are not replaced") {
+    const auto path = dir / "not_a_socket";
+    std::ofstream(path) << "data";
+    CHECK_THROWS(JobServer(path, runner, StackJob{}, 1));
+    CHECK(std::filesystem::exists(path));
+  }
+}
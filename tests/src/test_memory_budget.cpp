@@ -0,0 +1,141 @@
+#include "async_image_loader.hpp"
+#include "image_stacker.hpp"
+#include "memory_budget.hpp"
+#include "str_util.hpp"
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <thread>
+
+namespace {
+using namespace StackExposures;
+} // namespace
+
+TEST_CASE("Memory Budget") {
+  SECTION("Reserve and release") {
+    const auto budget = MemoryBudget::create(100);
+    {
+      const auto r1 = budget->reserve(60);
+      REQUIRE(r1 != nullptr);
+      CHECK(budget->in_use() == 60);
+      r1->resize(30);
+      CHECK(budget->in_use() == 30);
+      const auto r2 = budget->claim(200);
+      CHECK(budget->in_use() == 230);
+    }
+    CHECK(budget->in_use() == 0);
+    CHECK(budget->peak() == 260);
+  }
+
+  SECTION("Oversized request is granted when nothing is held") {
+    const auto budget = MemoryBudget::create(10);
+    const auto r = budget->reserve(50);
+    REQUIRE(r != nullptr);
+    CHECK(budget->in_use() == 50);
+  }
+
+  SECTION("Try to reserve") {
+    const auto budget = MemoryBudget::create(100);
+    const auto r1 = budget->try_reserve(70);
+    REQUIRE(r1 != nullptr);
+    CHECK(budget->try_reserve(40) == nullptr);
+    CHECK(budget->try_reserve(30) != nullptr);
+  }
+
+  SECTION("Reserve waits for room") {
+    const auto budget = MemoryBudget::create(100);
+    auto held = budget->reserve(80);
+    auto waiter = std::async(std::launch::async,
+                             [budget]() { return budget->reserve(50); });
+    CHECK(waiter.wait_for(std::chrono::milliseconds(100)) ==
+          std::future_status::timeout);
+    held.reset();
+    const auto granted = waiter.get();
+    REQUIRE(granted != nullptr);
+    CHECK(budget->in_use() == 50);
+  }
+
+  SECTION("Cancel a waiting reservation") {
+    const auto budget = MemoryBudget::create(100);
+    const auto held = budget->reserve(100);
+    std::atomic_bool cancelled{true};
+    CHECK(budget->reserve(1, &cancelled) == nullptr);
+    CHECK(budget->in_use() == 100);
+  }
+
+  SECTION("Concurrency") {
+    CHECK(MemoryBudget::create(0)->concurrency(1000, 8) == 8);
+    CHECK(MemoryBudget::create(1000)->concurrency(300, 8) == 3);
+    CHECK(MemoryBudget::create(1000)->concurrency(5000, 8) == 1);
+    CHECK(MemoryBudget::create(1000)->concurrency(0, 8) == 8);
+  }
+
+  SECTION("Parse byte counts") {
+    CHECK(StrUtil::parse_byte_count("1024") == 1024);
+    CHECK(StrUtil::parse_byte_count("2k") == 2048);
+    CHECK(StrUtil::parse_byte_count("512M") == size_t{512} << 20);
+    CHECK(StrUtil::parse_byte_count("8G") == size_t{8} << 30);
+    CHECK_FALSE(StrUtil::parse_byte_count(""));
+    CHECK_FALSE(StrUtil::parse_byte_count("M"));
+    CHECK_FALSE(StrUtil::parse_byte_count("12X"));
+    CHECK_FALSE(StrUtil::parse_byte_count("-5M"));
+  }
+}
+
+TEST_CASE("Budgeted Loading") {
+  SECTION("Consumption order") {
+    using Order = std::vector<size_t>;
+    CHECK(ImageStacker::consumption_order(0).empty());
+    CHECK(ImageStacker::consumption_order(2) == Order{0, 1});
+    CHECK(ImageStacker::consumption_order(5) == Order{0, 1, 4, 3, 2});
+    CHECK(ImageStacker::consumption_order(6) == Order{0, 1, 2, 5, 4, 3});
+  }
+
+  SECTION("Unlimited budgets keep the default limit on decodes") {
+    using Loader = AsyncImageLoader<ImageInfo>;
+    const std::vector<std::filesystem::path> paths(
+        4 * Loader::max_concurrent_loads, "unused.jpg");
+    std::atomic<size_t> running{0};
+    std::atomic<size_t> peak{0};
+    {
+      Loader loader(
+          paths, {},
+          [&](ImageLoader &, const std::filesystem::path &) {
+            const auto now = ++running;
+            auto seen = peak.load();
+            while ((now > seen) && !peak.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            --running;
+            return Loader::Result{};
+          },
+          MemoryBudget::create(0), {}, size_t{1} << 20);
+      for (const auto &future : loader.futures()) {
+        future.wait();
+      }
+    }
+    CHECK(peak > 0);
+    CHECK(peak <= Loader::max_concurrent_loads);
+  }
+
+  SECTION("Images release their reservations") {
+    const std::filesystem::path data_dir(TEST_DATA_DIR);
+    const auto path = data_dir / "exif_extractor_missing_icc.jpg";
+    const std::vector<std::filesystem::path> paths(5, path);
+
+    // Room for little more than one decode at a time.
+    const auto budget = MemoryBudget::create(1);
+    {
+      const auto loader = load_images_async(
+          paths, {}, budget, ImageStacker::consumption_order(paths.size()));
+      const auto stacker = ImageStacker::create(budget);
+      const auto result =
+          stacker->stacked_result(loader->take_futures(), nullptr, false);
+      CHECK_FALSE(result.empty());
+    }
+    CHECK(budget->in_use() == 0);
+    CHECK(budget->peak() > 0);
+  }
+}
@@ -0,0 +1,76 @@
+#include "raw_stacker.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace {
+using namespace StackExposures;
+
+auto future_cfa(const std::filesystem::path &path) {
+  auto load_async = [path]() {
+    ImageLoader loader;
+    return loader.load_cfa(path);
+  };
+  return std::async(std::launch::async, load_async);
+}
+
+CfaImageFuture ready_cfa(const cv::Mat &visible) {
+  auto image = std::make_shared<CfaImage>();
+  image->visible = visible;
+  std::promise<CfaImage::SharedPtr> promise;
+  promise.set_value(image);
+  return promise.get_future().share();
+}
+} // namespace
+
+TEST_CASE("Raw Stacker") {
+  RawStacker stacker;
+  CfaImageFutureContainer images;
+
+  SECTION("No images") {
+    CHECK(stacker.stacked_result(images) == nullptr);
+  }
+
+  SECTION("Non-raw image") {
+    // See CMakeLists.txt for TEST_DATA_DIR
+    const std::string data_dir(TEST_DATA_DIR);
+    ImageLoader loader;
+    REQUIRE_THROWS_AS(loader.load_cfa(data_dir + "orientation1.jpg"),
+                      std::runtime_error);
+  }
+
+  SECTION("Stack raw images") {
+    const std::string data_dir(TEST_DATA_DIR);
+    const std::string image_path(data_dir + "from_filesamples_com/sample1.orf");
+
+    ImageLoader loader;
+    const auto single = loader.load_image(image_path);
+
+    for (size_t i = 0; i < 3; ++i) {
+      images.emplace_back(future_cfa(image_path));
+    }
+    const auto result = stacker.stacked_result(images);
+    REQUIRE(result != nullptr);
+    CHECK(result->same_extents(single));
+  }
+
+  SECTION("Borders of shifted frames are not darkened") {
+    cv::Mat reference(128, 128, CV_16UC1);
+    cv::randu(reference, 1000, 3000);
+    // The same scene, moved right 4 and down 2 pixels (whole CFA blocks).
+    cv::Mat shifted(reference.size(), CV_16UC1);
+    cv::randu(shifted, 1000, 3000);
+    const cv::Rect overlap(0, 0, reference.cols - 4, reference.rows - 2);
+    reference(overlap).copyTo(shifted(overlap + cv::Point(4, 2)));
+
+    images.push_back(ready_cfa(reference));
+    images.push_back(ready_cfa(shifted));
+    const auto mean = stacker.mean_cfa(images, true);
+    REQUIRE(mean.size() == reference.size());
+    cv::Mat expected;
+    reference.convertTo(expected, CV_32FC1);
+    CHECK(cv::norm(mean, expected, cv::NORM_INF) < 0.5);
+  }
+}
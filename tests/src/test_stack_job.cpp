@@ -0,0 +1,211 @@
+#include "stack_job.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+
+namespace {
+using namespace StackExposures;
+
+const std::filesystem::path data_dir(TEST_DATA_DIR);
+
+std::filesystem::path scratch_dir() {
+  const auto result =
+      std::filesystem::temp_directory_path() / "stack_exp_test_stack_job";
+  std::filesystem::create_directories(result);
+  return result;
+}
+
+std::filesystem::path write_manifest(const std::string &contents) {
+  const auto result = scratch_dir() / "manifest.json";
+  std::ofstream outs(result);
+  outs << contents;
+  return result;
+}
+} // namespace
+
+TEST_CASE("Stack Job") {
+  SECTION("Supported output formats") {
+    CHECK(StackJob::supported_output("a.TIFF"));
+    CHECK(StackJob::supported_output("a.jpg"));
+    CHECK_FALSE(StackJob::supported_output("a.bogus"));
+  }
+
+  SECTION("Parse output specs") {
+    TiffOptions defaults;
+    defaults.compression = *TiffCompression::parse("deflate");
+
+    const auto plain = OutputSpec::parse("out/m31.tiff", defaults);
+    REQUIRE(plain);
+    CHECK(plain->path == std::filesystem::path("out/m31.tiff"));
+    CHECK_FALSE(plain->tiff_options.float32);
+    CHECK(plain->tiff_options.compression.codec ==
+          TiffCompression::Codec::deflate);
+
+    const auto with_options = OutputSpec::parse("m31.tif:float+zstd:19");
+    REQUIRE(with_options);
+    CHECK(with_options->path == std::filesystem::path("m31.tif"));
+    CHECK(with_options->tiff_options.float32);
+    CHECK(with_options->tiff_options.compression.codec ==
+          TiffCompression::Codec::zstd);
+    CHECK(with_options->tiff_options.compression.level == 19);
+
+    defaults.float32 = true;
+    const auto uint16 = OutputSpec::parse("m31.tif:uint16", defaults);
+    REQUIRE(uint16);
+    CHECK_FALSE(uint16->tiff_options.float32);
+
+    CHECK_FALSE(OutputSpec::parse(""));
+    CHECK_FALSE(OutputSpec::parse(":float"));
+    CHECK_FALSE(OutputSpec::parse("m31.tif:"));
+    CHECK_FALSE(OutputSpec::parse("m31.tif:double"));
+  }
+
+  SECTION("Read manifest") {
+    StackJob defaults;
+    defaults.align = false;
+    defaults.bad_pixel_sigma = 4.0;
+
+    const auto path = write_manifest(R"({
+      "jobs": [
+        {"images": ["a.tif", "/abs/b.tif"], "output": "out1.png",
+         "dark_images": "dark.tif", "align": true, "roi": [1, 2, 30, 40]},
+        {"images": ["c.tif"], "output": "out2.jpg", "half_size": true,
+         "raw_stack": true},
+        {"images": ["d.tif"], "output": ["out3.tif:float", "out3.jpg"],
+         "compression": "none"}
+      ]
+    })");
+    const auto jobs = read_manifest(path, defaults);
+    REQUIRE(jobs.size() == 3);
+
+    const auto base = path.parent_path();
+    CHECK(jobs[0].images.size() == 2);
+    CHECK(jobs[0].images[0] == base / "a.tif");
+    CHECK(jobs[0].images[1] == std::filesystem::path("/abs/b.tif"));
+    CHECK(jobs[0].output_path == base / "out1.png");
+    REQUIRE(jobs[0].calibration_frames.darks.size() == 1);
+    CHECK(jobs[0].calibration_frames.darks[0] == base / "dark.tif");
+    CHECK(jobs[0].align);
+    CHECK(jobs[0].load_options.roi == cv::Rect(1, 2, 30, 40));
+    CHECK(jobs[0].bad_pixel_sigma == 4.0);
+
+    CHECK_FALSE(jobs[1].align);
+    CHECK(jobs[1].load_options.half_size);
+    CHECK(jobs[1].raw_stack);
+    CHECK_FALSE(jobs[1].load_options.roi);
+    CHECK(jobs[1].more_outputs.empty());
+
+    const auto outputs = jobs[2].outputs();
+    REQUIRE(outputs.size() == 2);
+    CHECK(outputs[0].path == base / "out3.tif");
+    CHECK(outputs[0].tiff_options.float32);
+    CHECK(outputs[0].tiff_options.compression.codec ==
+          TiffCompression::Codec::none);
+    CHECK(outputs[1].path == base / "out3.jpg");
+    CHECK(jobs[2].tiff_options.float32);
+  }
+
+  SECTION("Invalid manifests") {
+    const StackJob defaults;
+    CHECK_THROWS_AS(read_manifest(scratch_dir() / "missing.json", defaults),
+                    std::runtime_error);
+    CHECK_THROWS_AS(read_manifest(write_manifest(R"({"jobs": []})"), defaults),
+                    std::runtime_error);
+    CHECK_THROWS_AS(
+        read_manifest(write_manifest(R"({"jobs": [{"output": "a.png"}]})"),
+                      defaults),
+        std::runtime_error);
+    CHECK_THROWS_AS(
+        read_manifest(
+            write_manifest(R"({"jobs": [{"images": ["a"], "output": "a.x"}]})"),
+            defaults),
+        std::runtime_error);
+    CHECK_THROWS_AS(
+        read_manifest(write_manifest(
+                          R"({"jobs": [{"images": ["a"],
+                                        "output": ["a.png", "b.x"]}]})"),
+                      defaults),
+        std::runtime_error);
+  }
+
+  SECTION("Run several jobs") {
+    const auto image = data_dir / "exif_extractor_missing_icc.jpg";
+    std::vector<StackJob> jobs(3);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      jobs[i].images = {image, image};
+      jobs[i].align = false;
+      jobs[i].output_path =
+          scratch_dir() / ("stacked_" + std::to_string(i) + ".jpg");
+      std::filesystem::remove(jobs[i].output_path);
+    }
+    jobs[1].more_outputs = {{scratch_dir() / "stacked_1.png"},
+                            {scratch_dir() / "stacked_1.tif"}};
+    for (const auto &output : jobs[1].more_outputs) {
+      std::filesystem::remove(output.path);
+    }
+    jobs[2].images = {data_dir / "no_such_image.jpg"};
+
+    StackRunner runner;
+    const auto errors = runner.run_all(jobs, 2);
+    REQUIRE(errors.size() == 3);
+    CHECK(errors[0].empty());
+    CHECK(errors[1].empty());
+    CHECK_FALSE(errors[2].empty());
+    CHECK(std::filesystem::exists(jobs[0].output_path));
+    for (const auto &output : jobs[1].outputs()) {
+      CHECK(std::filesystem::exists(output.path));
+    }
+  }
+
+  SECTION("Replaced calibration frames are used") {
+    const auto light = scratch_dir() / "calib_light.png";
+    const auto dark = scratch_dir() / "calib_dark.png";
+    const cv::Size size(32, 32);
+    REQUIRE(cv::imwrite(light.string(),
+                        cv::Mat(size, CV_8UC3, cv::Scalar::all(100))));
+    REQUIRE(cv::imwrite(dark.string(),
+                        cv::Mat(size, CV_8UC3, cv::Scalar::all(10))));
+
+    StackJob job;
+    job.images = {light, light};
+    job.calibration_frames.darks = {dark};
+    job.align = false;
+    StackRunner runner;
+    const auto first = runner.stacked(job);
+    REQUIRE_FALSE(first.empty());
+    CHECK(std::abs(cv::mean(first)[0] - 90.0) < 1.0);
+
+    REQUIRE(cv::imwrite(dark.string(),
+                        cv::Mat(size, CV_8UC3, cv::Scalar::all(40))));
+    // Don't depend on the file system's timestamp resolution.
+    std::filesystem::last_write_time(
+        dark, std::filesystem::last_write_time(dark) + std::chrono::seconds(2));
+    const auto second = runner.stacked(job);
+    REQUIRE_FALSE(second.empty());
+    CHECK(std::abs(cv::mean(second)[0] - 60.0) < 1.0);
+  }
+
+  SECTION("Duplicate outputs") {
+    const cv::Mat stacked(4, 4, CV_32FC3, cv::Scalar::all(128.0));
+    const auto path = scratch_dir() / "duplicate.png";
+    const std::vector<OutputSpec> outputs{{path}, {path}};
+    CHECK_THROWS_AS(StackRunner::save(stacked, outputs), std::runtime_error);
+
+    CHECK(StackJob::duplicate_output({{"a/./x.png"}, {"b.png"}, {"a/x.png"}}) ==
+          std::filesystem::path("a/x.png"));
+    CHECK_FALSE(StackJob::duplicate_output({{"a.png"}, {"a.tif"}}));
+
+    // Manifests are checked when read, before anything is stacked.
+    StackJob defaults;
+    CHECK_THROWS_AS(
+        read_manifest(write_manifest(
+                          R"({"jobs": [{"images": ["a"],
+                                        "output": ["a.png", "./a.png"]}]})"),
+                      defaults),
+        std::runtime_error);
+  }
+}
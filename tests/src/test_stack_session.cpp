@@ -0,0 +1,113 @@
+#include "stack_session.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+using namespace StackExposures;
+
+constexpr int width = 64;
+constexpr int height = 48;
+
+FrameView view_of(std::vector<uint8_t> &pixels,
+                  FrameView::Channels channels = FrameView::Channels::bgr) {
+  return FrameView{pixels.data(), width, height, FrameView::Depth::u8,
+                   channels};
+}
+
+FrameView view_of(std::vector<uint16_t> &pixels,
+                  FrameView::Channels channels = FrameView::Channels::bgr) {
+  return FrameView{pixels.data(), width, height, FrameView::Depth::u16,
+                   channels};
+}
+
+std::vector<uint8_t> solid_bgr(uint8_t b, uint8_t g, uint8_t r) {
+  std::vector<uint8_t> result;
+  result.reserve(width * height * 3);
+  for (int i = 0; i < width * height; ++i) {
+    result.insert(result.end(), {b, g, r});
+  }
+  return result;
+}
+} // namespace
+
+TEST_CASE("Stack Session") {
+  StackSessionSettings settings;
+  settings.align = false;
+
+  SECTION("Frames are averaged into the caller's buffer") {
+    std::vector<StackProgress> reports;
+    settings.on_progress = [&reports](const StackProgress &progress) {
+      reports.push_back(progress);
+    };
+    StackSession session(settings);
+
+    auto dark = solid_bgr(10, 20, 30);
+    auto light = solid_bgr(30, 40, 50);
+    CHECK(session.push(view_of(dark)) == StackSession::PushResult::added);
+    CHECK(session.push(view_of(light)) == StackSession::PushResult::added);
+    REQUIRE(reports.size() == 2);
+    CHECK(reports.back().frames_added == 2);
+
+    std::vector<uint8_t> result(width * height * 3);
+    session.read_result(view_of(result));
+    CHECK(result[0] == 20);
+    CHECK(result[1] == 30);
+    CHECK(result[2] == 40);
+
+    // Channel order and depth are converted on the way out.
+    std::vector<uint16_t> rgb16(width * height * 3);
+    session.read_result(view_of(rgb16, FrameView::Channels::rgb));
+    CHECK(rgb16[0] == 40 * 257);
+    CHECK(rgb16[2] == 20 * 257);
+  }
+
+  SECTION("Padded rows and other layouts are read in place") {
+    StackSession session(settings);
+    constexpr size_t stride = width * 4 + 16;
+    std::vector<uint8_t> rgba(stride * height, 0);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        auto *pixel = &rgba[y * stride + x * 4];
+        pixel[0] = 100; // R
+        pixel[1] = 50;  // G
+        pixel[2] = 25;  // B
+        pixel[3] = 255; // A
+      }
+    }
+    auto frame = view_of(rgba, FrameView::Channels::rgba);
+    frame.stride = stride;
+    CHECK(session.push(frame) == StackSession::PushResult::added);
+
+    std::vector<uint8_t> result(width * height * 3);
+    session.read_result(view_of(result));
+    CHECK(result[0] == 25);
+    CHECK(result[2] == 100);
+  }
+
+  SECTION("Mismatched frames are rejected") {
+    StackSession session(settings);
+    auto first = solid_bgr(1, 2, 3);
+    std::vector<uint16_t> deeper(width * height * 3, 0);
+    CHECK(session.push(view_of(first)) == StackSession::PushResult::added);
+    CHECK(session.push(view_of(deeper)) == StackSession::PushResult::rejected);
+    CHECK(session.progress().frames_rejected == 1);
+
+    std::vector<uint8_t> small(3);
+    FrameView wrong_size{small.data(), 1, 1};
+    CHECK_THROWS_AS(session.read_result(wrong_size), std::runtime_error);
+  }
+
+  SECTION("Cancelled sessions accept no frames") {
+    StackSession session(settings);
+    std::vector<uint8_t> result(width * height * 3);
+    CHECK_THROWS_AS(session.read_result(view_of(result)), std::runtime_error);
+
+    session.cancel();
+    CHECK(session.cancelled());
+    auto frame = solid_bgr(1, 2, 3);
+    CHECK(session.push(view_of(frame)) == StackSession::PushResult::cancelled);
+    CHECK(session.progress().frames_pushed == 0);
+  }
+}
@@ -0,0 +1,93 @@
+#include "bad_pixel_map.hpp"
+#include "image_aligner.hpp"
+#include "star_field.hpp"
+#include <algorithm>
+#include <cmath>
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+namespace {
+using namespace StackExposures;
+
+auto small_field(size_t num_hot_pixels = 0) {
+  StarField::Params params;
+  params.size = cv::Size(320, 240);
+  params.stars_per_mp = 3000.0;
+  params.noise = 0.002;
+  params.num_hot_pixels = num_hot_pixels;
+  return StarField(params);
+}
+
+cv::Mat as_float(const cv::Mat &image) {
+  cv::Mat result;
+  image.convertTo(result, CV_32FC3);
+  return result;
+}
+} // namespace
+
+TEST_CASE("Star Field") {
+  SECTION("Sizes") {
+    const auto size = StarField::size_for_megapixels(24);
+    CHECK(size.width == 6000);
+    CHECK(size.height == 4000);
+    CHECK(StarField::size_for_megapixels(1).area() > 990000);
+  }
+
+  SECTION("Warps") {
+    const cv::Size size(100, 50);
+    CHECK(warp_error(FrameWarp{}.matrix(size), {}, size) == 0.0);
+
+    const FrameWarp shifted{2.0, -1.0, 0.0};
+    const auto error = warp_error(FrameWarp{}.matrix(size), shifted, size);
+    CHECK(std::abs(error - std::sqrt(5.0)) < 1.0e-5);
+
+    const auto warps = FrameWarp::random(4, 10.0, 1.0, 7);
+    REQUIRE(warps.size() == 4);
+    CHECK(warps[0].dx == 0.0);
+    CHECK(warps[0].rotation_deg == 0.0);
+    for (const auto &w : warps) {
+      CHECK(std::abs(w.dx) <= 10.0);
+      CHECK(std::abs(w.rotation_deg) <= 1.0);
+    }
+  }
+
+  SECTION("Render") {
+    const auto field = small_field();
+    const auto frame = field.render({}, 0);
+    CHECK(frame.type() == CV_16UC3);
+    CHECK(frame.size() == field.params().size);
+
+    const auto cfa = field.render_cfa({}, 0);
+    CHECK(cfa.type() == CV_16UC1);
+    CHECK(cfa.size() == field.params().size);
+
+    // Different frames get different noise.
+    const auto other = field.render({}, 1);
+    CHECK(cv::norm(frame, other, cv::NORM_INF) > 0);
+  }
+
+  SECTION("Alignment recovers the true warp") {
+    const auto field = small_field();
+    const FrameWarp truth{3.25, -2.5, 0.4};
+    const auto ref = as_float(field.render({}, 0));
+    const auto moved = as_float(field.render(truth, 1));
+
+    const ImageAligner aligner;
+    const auto estimate = aligner.estimate(ref, moved);
+    REQUIRE_FALSE(estimate.empty());
+    CHECK(warp_error(estimate, truth, ref.size()) < 0.25);
+  }
+
+  SECTION("Hot pixels can be found in dark frames") {
+    const auto field = small_field(5);
+    const auto dark = field.render_dark(0);
+    const auto map = BadPixelMap::detect(dark, false, 6.0);
+
+    const auto width = static_cast<uint32_t>(dark.cols);
+    for (const auto &p : field.hot_pixels()) {
+      const auto index = static_cast<uint32_t>(p.y) * width + p.x;
+      const auto &found = map->indices();
+      CHECK(std::find(found.begin(), found.end(), index) != found.end());
+    }
+  }
+}
@@ -0,0 +1,101 @@
+#include "thread_budget.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+
+namespace {
+using namespace StackExposures;
+
+constexpr size_t mib = size_t{1} << 20;
+} // namespace
+
+TEST_CASE("Thread Budget") {
+  SECTION("Default is one thread per core") {
+    const ThreadBudget budget;
+    CHECK(budget.threads() >= 1);
+  }
+
+  SECTION("Small frames get many single-threaded decodes") {
+    const ThreadBudget budget(32);
+    for (const size_t bytes : {size_t{0}, 40 * mib, 255 * mib}) {
+      const auto plan = budget.decode_plan(bytes);
+      CHECK(plan.threads_per_decode == 1);
+      CHECK(plan.concurrent_decodes == 32);
+    }
+  }
+
+  SECTION("Large frames get fewer multi-threaded decodes") {
+    const ThreadBudget budget(32);
+    const auto plan = budget.decode_plan(1200 * mib);
+    CHECK(plan.threads_per_decode == 4);
+    CHECK(plan.concurrent_decodes == 8);
+
+    const auto huge = budget.decode_plan(100000 * mib);
+    CHECK(huge.threads_per_decode == ThreadBudget::max_threads_per_decode);
+    CHECK(huge.concurrent_decodes == 4);
+  }
+
+  SECTION("Plans fit small budgets") {
+    const ThreadBudget budget(3);
+    const auto plan = budget.decode_plan(100000 * mib);
+    CHECK(plan.threads_per_decode == 3);
+    CHECK(plan.concurrent_decodes == 1);
+
+    const ThreadBudget single(1);
+    CHECK(single.decode_plan(100000 * mib).threads_per_decode == 1);
+    CHECK(single.decode_plan(100000 * mib).concurrent_decodes == 1);
+  }
+
+  SECTION("Decode threads are claimed from the budget") {
+    ThreadBudget budget(4);
+    REQUIRE(budget.try_claim_decode(3));
+    CHECK_FALSE(budget.try_claim_decode(2));
+    REQUIRE(budget.try_claim_decode(1));
+    CHECK(budget.decode_threads_in_use() == 4);
+
+    budget.release_decode(3);
+    CHECK(budget.try_claim_decode(2));
+    budget.release_decode(3);
+    CHECK(budget.decode_threads_in_use() == 0);
+
+    // With nothing claimed, even an oversized claim is granted.
+    CHECK(budget.try_claim_decode(9));
+    budget.release_decode(9);
+  }
+
+  SECTION("A chosen thread count is not per core") {
+    CHECK(ThreadBudget().per_core());
+    CHECK_FALSE(ThreadBudget(4).per_core());
+    CHECK(ThreadBudget(4).decode_threads() == 4);
+  }
+
+  SECTION("Splitting limits decodes") {
+    ThreadBudget budget(4);
+    budget.split(2);
+    CHECK(budget.decode_threads() == 2);
+    CHECK(budget.decode_plan(0).concurrent_decodes == 2);
+    REQUIRE(budget.try_claim_decode(2));
+    CHECK_FALSE(budget.try_claim_decode(1));
+    budget.release_decode(2);
+
+    budget.split(0);
+    CHECK(budget.decode_threads() == 4);
+  }
+
+  SECTION("Installing sizes OpenCV's pool") {
+    const auto original = cv::getNumThreads();
+    auto &budget = ThreadBudget::install(4);
+    CHECK(&budget == &ThreadBudget::current());
+    CHECK(budget.threads() == 4);
+    CHECK_FALSE(budget.per_core());
+    CHECK(cv::getNumThreads() == 4);
+
+    // Decodes and OpenCV's pool share a split budget.
+    budget.split(3);
+    CHECK(cv::getNumThreads() == 1);
+    budget.split(0);
+    CHECK(cv::getNumThreads() == 4);
+
+    ThreadBudget::install(0);
+    cv::setNumThreads(original);
+  }
+}
@@ -0,0 +1,123 @@
+#include "tiff_writer.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <opencv2/imgcodecs.hpp>
+#include <stdexcept>
+
+namespace {
+using namespace StackExposures;
+using Codec = TiffCompression::Codec;
+
+// A stacked-looking image:  noise, plus smooth gradients that compress well.
+cv::Mat stacked_image(cv::Size size) {
+  cv::Mat result(size, CV_32FC3);
+  cv::randu(result, 0.0, 255.0);
+  for (int y = 0; y < size.height / 2; ++y) {
+    result.row(y).setTo(cv::Scalar(y % 256, 128.0, 255.0 - y % 256));
+  }
+  return result;
+}
+
+double max_error(const cv::Mat &a, const cv::Mat &b) {
+  cv::Mat diff;
+  cv::absdiff(a, b, diff);
+  double result = 0.0;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &result);
+  return result;
+}
+} // namespace
+
+TEST_CASE("TIFF Writer") {
+  SECTION("Parse compression") {
+    CHECK(TiffCompression::parse("none")->codec == Codec::none);
+    CHECK(TiffCompression::parse("LZW")->codec == Codec::lzw);
+    const auto deflate = TiffCompression::parse("deflate:9");
+    REQUIRE(deflate);
+    CHECK(deflate->codec == Codec::deflate);
+    CHECK(deflate->level == 9);
+    CHECK(TiffCompression::parse("zstd")->level == -1);
+    CHECK(TiffCompression::parse("zstd:19")->level == 19);
+
+    CHECK_FALSE(TiffCompression::parse("jpeg"));
+    CHECK_FALSE(TiffCompression::parse("lzw:3"));
+    CHECK_FALSE(TiffCompression::parse("deflate:10"));
+    CHECK_FALSE(TiffCompression::parse("deflate:x"));
+    CHECK_FALSE(TiffCompression::parse("deflate:1:2"));
+  }
+
+  SECTION("Round trips") {
+    // Tall enough for several strips, and odd-sized.
+    const auto stacked = stacked_image(cv::Size(301, 1203));
+    const auto path = std::filesystem::temp_directory_path() /
+                      "test_tiff_writer.tiff";
+
+    for (const auto codec :
+         {Codec::none, Codec::lzw, Codec::deflate, Codec::zstd}) {
+      if (!TiffCompression::available(codec)) {
+        continue;
+      }
+      TiffOptions options;
+      options.compression.codec = codec;
+
+      write_tiff(stacked, path, options);
+      const auto as_uint16 = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+      if ((codec == Codec::zstd) && as_uint16.empty()) {
+        WARN("OpenCV's libtiff cannot read zstd; skipping.");
+        continue;
+      }
+      REQUIRE(as_uint16.type() == CV_16UC3);
+      cv::Mat expected_uint16;
+      stacked.convertTo(expected_uint16, CV_16UC3, 255.0);
+      // Allow for rounding differences.
+      CHECK(max_error(as_uint16, expected_uint16) <= 1.0);
+
+      options.float32 = true;
+      write_tiff(stacked, path, options);
+      const auto as_float = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+      REQUIRE(as_float.type() == CV_32FC3);
+      CHECK(max_error(as_float, stacked / 255.0) < 1.0e-6);
+    }
+    std::filesystem::remove(path);
+  }
+
+  SECTION("Smooth data is predicted") {
+    // A smooth ramp, which compresses poorly unless differenced.
+    cv::Mat smooth(256, 512, CV_32FC3);
+    for (int y = 0; y < smooth.rows; ++y) {
+      for (int x = 0; x < smooth.cols; ++x) {
+        const auto value = static_cast<float>(0.37 * x + 0.11 * y);
+        smooth.at<cv::Vec3f>(y, x) = cv::Vec3f(value, value / 2, value / 3);
+      }
+    }
+    const auto path = std::filesystem::temp_directory_path() /
+                      "test_tiff_writer_predicted.tiff";
+    TiffOptions options;
+    options.compression.codec = Codec::lzw;
+    write_tiff(smooth, path, options);
+    const auto raw_bytes = smooth.total() * 3 * sizeof(uint16_t);
+    CHECK(std::filesystem::file_size(path) < raw_bytes / 4);
+
+    const auto as_uint16 = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+    REQUIRE(as_uint16.type() == CV_16UC3);
+    cv::Mat expected_uint16;
+    smooth.convertTo(expected_uint16, CV_16UC3, 255.0);
+    CHECK(max_error(as_uint16, expected_uint16) <= 1.0);
+
+    options.float32 = true;
+    write_tiff(smooth, path, options);
+    const auto as_float = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+    REQUIRE(as_float.type() == CV_32FC3);
+    CHECK(max_error(as_float, smooth / 255.0) < 1.0e-6);
+    std::filesystem::remove(path);
+  }
+
+  SECTION("Invalid input") {
+    const auto path = std::filesystem::temp_directory_path() /
+                      "test_tiff_writer_invalid.tiff";
+    CHECK_THROWS_AS(write_tiff(cv::Mat(4, 4, CV_8UC3), path, {}),
+                    std::runtime_error);
+    CHECK_THROWS_AS(write_tiff(stacked_image(cv::Size(4, 4)),
+                               "no_such_dir/stacked.tiff", {}),
+                    std::runtime_error);
+  }
+}
@@ -0,0 +1,63 @@
+#include "trace.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+using namespace StackExposures;
+
+std::string stats_text() {
+  std::ostringstream outs;
+  Trace::print_stats(outs);
+  return outs.str();
+}
+} // namespace
+
+TEST_CASE("Trace") {
+  SECTION("Disabled scopes record nothing") {
+    Trace::enable(false);
+    { STACK_EXP_TRACE_SCOPE("test.disabled"); }
+    CHECK(stats_text().find("test.disabled") == std::string::npos);
+  }
+
+  SECTION("Enabled scopes are recorded") {
+    Trace::enable(true);
+    {
+      STACK_EXP_TRACE_SCOPE("test.enabled");
+      cv::Mat scratch(100, 100, CV_8UC3);
+    }
+    Trace::enable(false);
+    CHECK(stats_text().find("test.enabled") != std::string::npos);
+    // Nothing has counted allocations, so none are reported.
+    CHECK(stats_text().find("alloc MB") == std::string::npos);
+
+    const auto path =
+        std::filesystem::temp_directory_path() / "stack_exp_test_trace.json";
+    Trace::write_chrome_trace(path);
+    std::ifstream ins(path);
+    std::stringstream contents;
+    contents << ins.rdbuf();
+    CHECK(contents.str().find("\"traceEvents\"") != std::string::npos);
+    CHECK(contents.str().find("\"name\":\"test.enabled\"") !=
+          std::string::npos);
+    std::filesystem::remove(path);
+  }
+
+  SECTION("Counted allocations are reported") {
+    Trace::enable(true);
+    {
+      STACK_EXP_TRACE_SCOPE("test.allocating");
+      Trace::count_allocation(size_t{3} << 20);
+      Trace::count_release(size_t{3} << 20);
+    }
+    Trace::enable(false);
+    CHECK(Trace::counts_allocations());
+    const auto text = stats_text();
+    CHECK(text.find("alloc MB") != std::string::npos);
+    CHECK(text.find("Peak image allocation") != std::string::npos);
+    CHECK(text.find("3.00") != std::string::npos);
+  }
+}
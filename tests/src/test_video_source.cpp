@@ -0,0 +1,144 @@
+#include "video_source.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+using namespace StackExposures;
+
+std::filesystem::path scratch_dir() {
+  const auto result =
+      std::filesystem::temp_directory_path() / "stack_exp_test_video_source";
+  std::filesystem::create_directories(result);
+  return result;
+}
+
+void put_int32(std::ofstream &outs, int32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    outs.put(static_cast<char>((static_cast<uint32_t>(value) >> (8 * i)) &
+                               0xFF));
+  }
+}
+
+// A SER file of single-plane frames, little-endian.  count_claimed is the
+// frame count written in the header.
+std::filesystem::path write_ser(const std::string &name,
+                                const std::vector<cv::Mat> &frames,
+                                int32_t color_id, int32_t bit_depth,
+                                int32_t count_claimed = -1) {
+  const auto result = scratch_dir() / name;
+  std::ofstream outs(result, std::ios::binary);
+  outs.write("LUCAM-RECORDER", 14);
+  put_int32(outs, 0); // LuID
+  put_int32(outs, color_id);
+  put_int32(outs, 0); // Endianness flag, as most capture software writes it
+  put_int32(outs, frames.front().cols);
+  put_int32(outs, frames.front().rows);
+  put_int32(outs, bit_depth);
+  put_int32(outs, (count_claimed < 0) ? static_cast<int32_t>(frames.size())
+                                      : count_claimed);
+  outs << std::string(3 * 40 + 2 * 8, '\0');
+  for (const auto &frame : frames) {
+    for (int row = 0; row < frame.rows; ++row) {
+      for (int col = 0; col < frame.cols; ++col) {
+        if (frame.depth() == CV_16U) {
+          const auto value = frame.at<uint16_t>(row, col);
+          outs.put(static_cast<char>(value & 0xFF));
+          outs.put(static_cast<char>(value >> 8));
+        } else {
+          outs.put(static_cast<char>(frame.at<uint8_t>(row, col)));
+        }
+      }
+    }
+  }
+  return result;
+}
+
+std::vector<cv::Mat> mono_frames(int count) {
+  std::vector<cv::Mat> result;
+  for (int i = 0; i < count; ++i) {
+    result.emplace_back(6, 8, CV_8UC1, cv::Scalar(10 * (i + 1)));
+  }
+  return result;
+}
+} // namespace
+
+TEST_CASE("Video Source") {
+  SECTION("Recognizes videos") {
+    CHECK(VideoSource::is_video("moon.ser"));
+    CHECK(VideoSource::is_video("JUPITER.AVI"));
+    CHECK_FALSE(VideoSource::is_video("moon.tif"));
+  }
+
+  SECTION("Mono 8-bit SER") {
+    const auto source =
+        VideoSource::open(write_ser("mono8.ser", mono_frames(3), 0, 8));
+    CHECK(source->frame_count() == 3);
+    for (int i = 0; i < 3; ++i) {
+      const auto frame = source->next();
+      REQUIRE(frame.type() == CV_8UC3);
+      CHECK(frame.size() == cv::Size(8, 6));
+      CHECK(frame.at<cv::Vec3b>(5, 7) ==
+            cv::Vec3b::all(static_cast<uint8_t>(10 * (i + 1))));
+    }
+    CHECK(source->next().empty());
+    CHECK_FALSE(source->skip());
+  }
+
+  SECTION("16-bit SER is scaled to 0...255") {
+    const std::vector<cv::Mat> frames{
+        cv::Mat(4, 4, CV_16UC1, cv::Scalar(4095))};
+    const auto source =
+        VideoSource::open(write_ser("mono12.ser", frames, 0, 12));
+    const auto frame = source->next();
+    REQUIRE(frame.type() == CV_32FC3);
+    CHECK(frame.at<cv::Vec3f>(0, 0)[1] == 255.0F);
+  }
+
+  SECTION("Truncated SER") {
+    const auto path = write_ser("truncated.ser", mono_frames(2), 0, 8, 5);
+    CHECK(VideoSource::open(path)->frame_count() == 2);
+  }
+
+  SECTION("Invalid SER") {
+    const auto path = scratch_dir() / "bogus.ser";
+    std::ofstream(path) << "not a video";
+    CHECK_THROWS_AS(VideoSource::open(path), std::runtime_error);
+    CHECK_THROWS_AS(
+        VideoSource::open(write_ser("cmyk.ser", mono_frames(1), 16, 8)),
+        std::runtime_error);
+  }
+
+  SECTION("Readahead decodes wanted frames in order") {
+    const auto path = write_ser("readahead.ser", mono_frames(6), 0, 8);
+    FrameReadahead frames(VideoSource::open(path),
+                          {false, true, true, false, true}, 2);
+    std::vector<size_t> indices;
+    while (const auto frame = frames.next()) {
+      indices.push_back(frame->index);
+      CHECK(static_cast<size_t>(frame->image.at<cv::Vec3b>(0, 0)[0]) ==
+            10 * (frame->index + 1));
+    }
+    CHECK(indices == std::vector<size_t>{1, 2, 4});
+  }
+
+  SECTION("Readahead of every frame") {
+    const auto path = write_ser("all.ser", mono_frames(20), 0, 8);
+    FrameReadahead frames(VideoSource::open(path), {}, 3);
+    size_t count = 0;
+    while (frames.next()) {
+      ++count;
+    }
+    CHECK(count == 20);
+  }
+
+  SECTION("Readahead stops early") {
+    const auto path = write_ser("early.ser", mono_frames(20), 0, 8);
+    FrameReadahead frames(VideoSource::open(path), {}, 2);
+    CHECK(frames.next().has_value());
+    // Destroying frames must not wait for the rest to be decoded.
+  }
+}
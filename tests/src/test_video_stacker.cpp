@@ -0,0 +1,121 @@
+#include "star_field.hpp"
+#include "video_stacker.hpp"
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+using namespace StackExposures;
+
+auto small_field() {
+  StarField::Params params;
+  params.size = cv::Size(160, 120);
+  params.stars_per_mp = 3000.0;
+  params.noise = 0.002;
+  params.depth = 8;
+  return StarField(params);
+}
+
+cv::Mat blurred(const cv::Mat &image) {
+  cv::Mat result;
+  cv::GaussianBlur(image, result, cv::Size(), 3.0);
+  return result;
+}
+
+void put_int32(std::ofstream &outs, int32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    outs.put(static_cast<char>((static_cast<uint32_t>(value) >> (8 * i)) &
+                               0xFF));
+  }
+}
+
+// A SER file of 8-bit BGR frames.
+std::filesystem::path write_ser(const std::string &name,
+                                const std::vector<cv::Mat> &frames) {
+  const auto dir =
+      std::filesystem::temp_directory_path() / "stack_exp_test_video_stacker";
+  std::filesystem::create_directories(dir);
+  const auto result = dir / name;
+  std::ofstream outs(result, std::ios::binary);
+  outs.write("LUCAM-RECORDER", 14);
+  put_int32(outs, 0);   // LuID
+  put_int32(outs, 101); // BGR
+  put_int32(outs, 0);
+  put_int32(outs, frames.front().cols);
+  put_int32(outs, frames.front().rows);
+  put_int32(outs, 8);
+  put_int32(outs, static_cast<int32_t>(frames.size()));
+  outs << std::string(3 * 40 + 2 * 8, '\0');
+  for (const auto &frame : frames) {
+    const cv::Mat continuous = frame.clone();
+    outs.write(reinterpret_cast<const char *>(continuous.data),
+               static_cast<std::streamsize>(continuous.total() *
+                                            continuous.elemSize()));
+  }
+  return result;
+}
+} // namespace
+
+TEST_CASE("Video Stacker") {
+  const auto field = small_field();
+
+  SECTION("Sharper frames score higher") {
+    const auto sharp = field.render(FrameWarp{}, 0);
+    CHECK(VideoStacker::quality(sharp) >
+          2.0 * VideoStacker::quality(blurred(sharp)));
+  }
+
+  SECTION("Keep count") {
+    CHECK(VideoStacker::keep_count(10, 50.0) == 5);
+    CHECK(VideoStacker::keep_count(10, 100.0) == 10);
+    CHECK(VideoStacker::keep_count(10, 1.0) == 1);
+    CHECK(VideoStacker::keep_count(0, 50.0) == 0);
+  }
+
+  SECTION("Stacks only the sharpest frames") {
+    std::vector<cv::Mat> frames;
+    for (size_t i = 0; i < 6; ++i) {
+      const auto frame = field.render(FrameWarp{}, i);
+      frames.push_back((i % 2 == 0) ? frame : blurred(frame));
+    }
+    const auto path = write_ser("half_blurred.ser", frames);
+
+    VideoStackOptions options;
+    options.keep_percent = 50.0;
+    options.align = false;
+    VideoStacker stacker({}, options);
+    const auto result = stacker.stacked_result({path});
+    CHECK(stacker.frames_scored() == 6);
+    CHECK(stacker.frames_stacked() == 3);
+    REQUIRE(result.type() == CV_32FC3);
+    CHECK(result.size() == field.params().size);
+    CHECK(VideoStacker::quality(result) >
+          2.0 * VideoStacker::quality(frames[1]));
+  }
+
+  SECTION("Frames are ranked across videos") {
+    const auto sharp = field.render(FrameWarp{}, 0);
+    const auto first = write_ser("first.ser", {blurred(sharp), sharp});
+    const auto second = write_ser("second.ser", {sharp, blurred(sharp)});
+
+    VideoStackOptions options;
+    options.keep_percent = 50.0;
+    options.align = false;
+    VideoStacker stacker({}, options);
+    const auto result = stacker.stacked_result({first, second});
+    CHECK(stacker.frames_scored() == 4);
+    CHECK(stacker.frames_stacked() == 2);
+    CHECK(VideoStacker::quality(result) >
+          2.0 * VideoStacker::quality(blurred(sharp)));
+  }
+
+  SECTION("Missing video") {
+    VideoStacker stacker({}, {});
+    CHECK_THROWS_AS(stacker.stacked_result({"no_such_video.ser"}),
+                    std::runtime_error);
+  }
+}